@@ -0,0 +1,132 @@
+#include "admission.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+#if defined(__linux__)
+#include <netinet/tcp.h>
+#endif
+
+AdmissionLimits admission_limits;
+
+static std::atomic<size_t> g_total{0};
+
+// Per-address counts, striped so accepts on different loops rarely meet
+static const size_t ADDRESS_STRIPES = 16;
+struct AddressStripe
+{
+    std::mutex mutex;
+    std::unordered_map<uint32_t, size_t> open;
+};
+static AddressStripe g_addresses[ADDRESS_STRIPES];
+
+static AddressStripe &stripe_of(uint32_t ip)
+{
+    return g_addresses[(ip * 2654435761u) >> 28 & (ADDRESS_STRIPES - 1)];
+}
+
+AdmissionSlot::AdmissionSlot(AdmissionSlot &&other) noexcept
+    : ip_(other.ip_), total_(other.total_), per_ip_(other.per_ip_)
+{
+    other.total_ = other.per_ip_ = false;
+}
+
+AdmissionSlot &AdmissionSlot::operator=(AdmissionSlot &&other) noexcept
+{
+    if (this != &other)
+    {
+        release();
+        ip_ = other.ip_;
+        total_ = other.total_;
+        per_ip_ = other.per_ip_;
+        other.total_ = other.per_ip_ = false;
+    }
+    return *this;
+}
+
+void AdmissionSlot::release()
+{
+    if (total_)
+        g_total.fetch_sub(1, std::memory_order_relaxed);
+    if (per_ip_)
+    {
+        AddressStripe &st = stripe_of(ip_);
+        std::lock_guard<std::mutex> lk(st.mutex);
+        auto it = st.open.find(ip_);
+        if (it != st.open.end() && --it->second == 0)
+            st.open.erase(it);
+    }
+    total_ = per_ip_ = false;
+}
+
+bool admit_connection(socket_t s, const sockaddr_in *peer, AdmissionSlot &slot, bool force)
+{
+    const AdmissionLimits &lim = admission_limits;
+    slot.release();
+    if (lim.max_connections)
+    {
+        if (g_total.fetch_add(1, std::memory_order_relaxed) >= lim.max_connections && !force)
+        {
+            g_total.fetch_sub(1, std::memory_order_relaxed);
+            metric_add(Counter::RejectedTotal);
+            LOG_WARN("connection limit of " << lim.max_connections << " reached; refusing a connection");
+            return false;
+        }
+        slot.total_ = true;
+    }
+    if (lim.max_per_ip == 0)
+        return true;
+
+    sockaddr_in addr{};
+    if (!peer)
+    {
+        socklen_t len = sizeof(addr);
+        if (getpeername(s, reinterpret_cast<sockaddr *>(&addr), &len) != 0)
+            return true; // already gone; the first read reports it
+        peer = &addr;
+    }
+    uint32_t ip = ntohl(peer->sin_addr.s_addr);
+    AddressStripe &st = stripe_of(ip);
+    {
+        std::lock_guard<std::mutex> lk(st.mutex);
+        size_t &open = st.open[ip];
+        if (open >= lim.max_per_ip && !force)
+        {
+            if (open == 0)
+                st.open.erase(ip);
+            slot.release();
+            metric_add(Counter::RejectedPerIp);
+            LOG_WARN("client " << (ip >> 24) << '.' << (ip >> 16 & 0xff) << '.' << (ip >> 8 & 0xff) << '.'
+                               << (ip & 0xff) << " has " << lim.max_per_ip << " connections open; refusing another");
+            return false;
+        }
+        ++open;
+    }
+    slot.ip_ = ip;
+    slot.per_ip_ = true;
+    return true;
+}
+
+void set_defer_accept(socket_t listener, unsigned seconds)
+{
+    if (seconds == 0)
+        return;
+#if defined(__linux__) && defined(TCP_DEFER_ACCEPT)
+    int v = static_cast<int>(seconds);
+    if (setsockopt(listener, IPPROTO_TCP, TCP_DEFER_ACCEPT, &v, sizeof(v)) != 0)
+        LOG_WARN("TCP_DEFER_ACCEPT failed, errno=" << errno);
+#elif defined(SO_ACCEPTFILTER)
+    accept_filter_arg arg{};
+    std::strcpy(arg.af_name, "dataready");
+    if (setsockopt(listener, SOL_SOCKET, SO_ACCEPTFILTER, &arg, sizeof(arg)) != 0)
+        LOG_WARN("accept filter 'dataready' unavailable (kldload accf_data), errno=" << errno);
+#else
+    (void)listener;
+    LOG_WARN("deferred accept is not supported on this platform; ignored");
+#endif
+}
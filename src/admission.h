@@ -0,0 +1,51 @@
+// Admission control on the accept path: connection caps and deferred accept
+#pragma once
+
+#include "platform.h"
+
+#include <cstddef>
+#include <cstdint>
+
+struct AdmissionLimits
+{
+    size_t max_connections = 0; // open connections in total; 0 = unlimited
+    size_t max_per_ip = 0;      // open connections per client address; 0 = unlimited
+    unsigned defer_accept_sec = 0; // see set_defer_accept; 0 = off
+};
+extern AdmissionLimits admission_limits; // set once at startup
+
+// A connection's share of the limits, given back by release() or when the
+// slot is destroyed. Move-only; empty when no limit is configured.
+class AdmissionSlot
+{
+public:
+    AdmissionSlot() = default;
+    AdmissionSlot(AdmissionSlot &&other) noexcept;
+    AdmissionSlot &operator=(AdmissionSlot &&other) noexcept;
+    AdmissionSlot(const AdmissionSlot &) = delete;
+    AdmissionSlot &operator=(const AdmissionSlot &) = delete;
+    ~AdmissionSlot() { release(); }
+
+    void release();
+
+private:
+    friend bool admit_connection(socket_t, const sockaddr_in *, AdmissionSlot &, bool);
+
+    uint32_t ip_ = 0;
+    bool total_ = false;  // counted against max_connections
+    bool per_ip_ = false; // counted against max_per_ip for ip_
+};
+
+// Right after accept, before anything else is spent on the connection.
+// False, after counting the refusal in the metrics, when it would go over
+// a limit; the caller then closes it. `peer` may be null, the address is
+// then looked up (only when a per-address limit is set). With `force` the
+// connection is counted but never refused (sessions carried over on restart).
+bool admit_connection(socket_t s, const sockaddr_in *peer, AdmissionSlot &slot, bool force = false);
+
+// Chat listeners only hand out connections that have sent data (Linux
+// TCP_DEFER_ACCEPT, the BSD "dataready" accept filter), so a flood of
+// idle connects never reaches accept(). The kernel completes a connection
+// that stays silent for `seconds` anyway, and the handshake timeout takes
+// it from there. No-op elsewhere.
+void set_defer_accept(socket_t listener, unsigned seconds);
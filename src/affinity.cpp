@@ -0,0 +1,298 @@
+#include "affinity.h"
+#include "log.h"
+#include "pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+
+#if defined(__linux__)
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+PlacementConfig placement;
+
+#if defined(__linux__)
+
+static bool read_line(const std::string &path, std::string &out)
+{
+    std::ifstream in(path);
+    return static_cast<bool>(std::getline(in, out));
+}
+
+// "0-3,8,10-11" as used throughout sysfs and procfs
+static bool parse_cpulist(const std::string &text, std::vector<int> &out)
+{
+    std::stringstream in(text);
+    std::string item;
+    while (std::getline(in, item, ','))
+    {
+        item.erase(std::remove_if(item.begin(), item.end(), ::isspace), item.end());
+        if (item.empty())
+            continue;
+        char *end = nullptr;
+        long first = std::strtol(item.c_str(), &end, 10);
+        long last = first;
+        if (*end == '-')
+            last = std::strtol(end + 1, &end, 10);
+        if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+            return false;
+        for (long cpu = first; cpu <= last; ++cpu)
+            out.push_back(static_cast<int>(cpu));
+    }
+    return true;
+}
+
+static std::vector<int> read_cpulist(const std::string &path)
+{
+    std::string line;
+    std::vector<int> cpus;
+    if (!read_line(path, line) || !parse_cpulist(line, cpus))
+        cpus.clear();
+    return cpus;
+}
+
+// Node -> its CPUs; a single node 0 where the kernel has no NUMA support
+static std::map<int, std::vector<int>> numa_nodes()
+{
+    std::map<int, std::vector<int>> nodes;
+    for (int node : read_cpulist("/sys/devices/system/node/online"))
+        nodes[node] = read_cpulist("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+    return nodes;
+}
+
+static int node_of(int cpu)
+{
+    for (auto &kv : numa_nodes())
+    {
+        if (std::find(kv.second.begin(), kv.second.end(), cpu) != kv.second.end())
+            return kv.first;
+    }
+    return 0;
+}
+
+// CPUs the process may run on (its cgroup cpuset or taskset), in order
+static std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+    {
+        if (CPU_ISSET(cpu, &set))
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+static void keep_allowed(std::vector<int> &cpus, const std::vector<int> &allowed)
+{
+    std::vector<int> kept;
+    for (int cpu : cpus)
+    {
+        if (std::find(allowed.begin(), allowed.end(), cpu) != allowed.end() &&
+            std::find(kept.begin(), kept.end(), cpu) == kept.end())
+            kept.push_back(cpu);
+    }
+    cpus.swap(kept);
+}
+
+// The first CPU each of the device's interrupts is routed to: MSI vectors
+// from sysfs where the driver exposes them, otherwise every line of
+// /proc/interrupts that names the interface
+static std::vector<int> irq_cpus(const std::string &nic)
+{
+    std::vector<int> irqs;
+    if (DIR *d = opendir(("/sys/class/net/" + nic + "/device/msi_irqs").c_str()))
+    {
+        while (dirent *e = readdir(d))
+        {
+            if (e->d_name[0] != '.')
+                irqs.push_back(std::atoi(e->d_name));
+        }
+        closedir(d);
+        std::sort(irqs.begin(), irqs.end());
+    }
+    if (irqs.empty())
+    {
+        std::ifstream in("/proc/interrupts");
+        std::string line;
+        while (std::getline(in, line))
+        {
+            std::istringstream fields(line);
+            std::string irq, word;
+            fields >> irq;
+            bool named = false;
+            while (fields >> word)
+                named = named || word == nic || word.compare(0, nic.size() + 1, nic + "-") == 0;
+            if (named && !irq.empty() && irq.back() == ':')
+                irqs.push_back(std::atoi(irq.c_str()));
+        }
+    }
+
+    std::vector<int> cpus;
+    for (int irq : irqs)
+    {
+        std::string base = "/proc/irq/" + std::to_string(irq) + "/";
+        std::vector<int> to = read_cpulist(base + "effective_affinity_list");
+        if (to.empty())
+            to = read_cpulist(base + "smp_affinity_list");
+        if (!to.empty())
+            cpus.push_back(to.front());
+    }
+    return cpus;
+}
+
+static bool nic_cpus(const std::string &nic, std::vector<int> &cpus)
+{
+    std::string dev = "/sys/class/net/" + nic;
+    std::string line;
+    if (!read_line(dev + "/operstate", line))
+    {
+        LOG_ERROR("cpu affinity: no network interface '" << nic << "'");
+        return false;
+    }
+    cpus = irq_cpus(nic);
+    if (cpus.empty())
+        cpus = read_cpulist(dev + "/device/local_cpulist");
+    if (cpus.empty() && read_line(dev + "/device/numa_node", line) && std::atoi(line.c_str()) >= 0)
+        cpus = numa_nodes()[std::atoi(line.c_str())];
+    if (cpus.empty())
+    {
+        LOG_WARN("cpu affinity: cannot tell which CPUs serve " << nic << "; using all of them");
+        cpus = allowed_cpus();
+    }
+    return true;
+}
+
+bool plan_cpus(unsigned loops, std::vector<int> &out)
+{
+    out.clear();
+    const std::string &spec = placement.cpus;
+    if (spec.empty())
+        return true;
+    std::vector<int> allowed = allowed_cpus();
+    std::vector<int> cpus;
+    if (spec == "auto")
+    {
+        for (auto &kv : numa_nodes())
+            cpus.insert(cpus.end(), kv.second.begin(), kv.second.end());
+        if (cpus.empty())
+            cpus = allowed;
+    }
+    else if (spec.compare(0, 4, "nic:") == 0)
+    {
+        if (!nic_cpus(spec.substr(4), cpus))
+            return false;
+    }
+    else if (!parse_cpulist(spec, cpus) || cpus.empty())
+    {
+        LOG_ERROR("cpu affinity: bad CPU list '" << spec << "'");
+        return false;
+    }
+    size_t wanted = cpus.size();
+    keep_allowed(cpus, allowed);
+    if (cpus.empty())
+    {
+        LOG_ERROR("cpu affinity: none of the CPUs of '" << spec << "' is available to this process");
+        return false;
+    }
+    if (cpus.size() < wanted)
+        LOG_WARN("cpu affinity: " << wanted - cpus.size() << " CPU(s) of '" << spec << "' are not available, skipped");
+    if (cpus.size() < loops)
+        LOG_WARN("cpu affinity: " << loops << " event loops share " << cpus.size() << " CPU(s)");
+    for (unsigned i = 0; i < loops; ++i)
+        out.push_back(cpus[i % cpus.size()]);
+    return true;
+}
+
+bool pin_thread(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0)
+    {
+        LOG_WARN("cpu affinity: cannot pin to CPU " << cpu << ", error=" << err);
+        return false;
+    }
+    if (numa_nodes().size() < 2)
+        return true;
+    int node = node_of(cpu);
+    // preferred, not bound: a full node still falls back to the others
+    unsigned long mask[4] = {};
+    if (node < static_cast<int>(sizeof(mask) * 8))
+    {
+        mask[node / (sizeof(unsigned long) * 8)] |= 1ul << (node % (sizeof(unsigned long) * 8));
+        if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, sizeof(mask) * 8) != 0)
+            LOG_WARN("cpu affinity: cannot prefer memory of node " << node << ", errno=" << errno);
+    }
+    pool_bind_node(static_cast<unsigned>(node));
+    return true;
+}
+
+bool set_incoming_cpu(socket_t s, int cpu)
+{
+#if defined(SO_INCOMING_CPU)
+    if (setsockopt(s, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == 0)
+        return true;
+    LOG_WARN("SO_INCOMING_CPU failed, errno=" << errno);
+#else
+    (void)s;
+    (void)cpu;
+#endif
+    return false;
+}
+
+void set_busy_poll(socket_t s, unsigned us)
+{
+#if defined(SO_BUSY_POLL)
+    int v = static_cast<int>(us);
+    // one warning, not one per connection
+    static std::atomic<bool> warned{false};
+    if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &v, sizeof(v)) != 0 && !warned.exchange(true))
+        LOG_WARN("SO_BUSY_POLL failed, errno=" << errno << " (needs CAP_NET_ADMIN above net.core.busy_read)");
+#else
+    (void)s;
+    (void)us;
+#endif
+}
+
+#else
+
+bool plan_cpus(unsigned, std::vector<int> &out)
+{
+    out.clear();
+    if (!placement.cpus.empty())
+        LOG_WARN("cpu affinity is only supported on Linux; threads are not pinned");
+    return true;
+}
+
+bool pin_thread(int)
+{
+    return false;
+}
+
+bool set_incoming_cpu(socket_t, int)
+{
+    return false;
+}
+
+void set_busy_poll(socket_t, unsigned)
+{
+}
+
+#endif
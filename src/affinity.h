@@ -0,0 +1,42 @@
+// Placement of the reactor's event-loop threads: CPU pinning, NUMA-local
+// memory and busy polling. Linux only; elsewhere the options are accepted
+// and ignored with a warning.
+#pragma once
+
+#include "platform.h"
+
+#include <string>
+#include <vector>
+
+struct PlacementConfig
+{
+    std::string cpus;          // --cpu-affinity; empty = threads are not pinned (see plan_cpus)
+    unsigned busy_poll_us = 0; // SO_BUSY_POLL on client sockets; 0 = off
+    bool incoming_cpu = false; // SO_INCOMING_CPU on each pinned shard's listener
+};
+extern PlacementConfig placement; // set once at startup
+
+// One CPU per event loop (repeating when there are fewer CPUs than loops),
+// from placement.cpus:
+//   "auto"    every CPU the process may use, node by node
+//   "nic:IF"  the CPUs the interrupts of interface IF are routed to, in
+//             queue order; failing that the CPUs local to the device
+//   a list    such as "0-3,8,10-11"
+// `out` stays empty when pinning is off. False, after logging why, if the
+// spec cannot be satisfied; the loops then run unpinned.
+bool plan_cpus(unsigned loops, std::vector<int> &out);
+
+// Pins the calling thread to `cpu`. On machines with several NUMA nodes
+// its page allocations then prefer that CPU's node, and its pool caches
+// trade with that node's depot (pool.h), so the buffers a loop recycles
+// stay local to it.
+bool pin_thread(int cpu);
+
+// With SO_REUSEPORT, a listener tied to a CPU gets the connections whose
+// packets that CPU received, so each connection is served on the core its
+// receive queue interrupts
+bool set_incoming_cpu(socket_t s, int cpu);
+// Lets the kernel poll the device queue for up to `us` microseconds on a
+// read that would block, instead of waiting for an interrupt (needs
+// CAP_NET_ADMIN above net.core.busy_read)
+void set_busy_poll(socket_t s, unsigned us);
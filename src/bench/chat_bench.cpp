@@ -0,0 +1,372 @@
+// Load generator and fan-out latency benchmark for chat_server
+//
+// Opens N clients that speak the normal protocol (username first, then
+// messages). The first S of them send messages at a fixed rate; each payload
+// carries the send time, so every receiver can measure end-to-end fan-out
+// latency. Sender and receivers share the host clock, so run it on the same
+// machine as the server (or across machines with the same time base).
+
+#include "platform.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+struct BenchConfig
+{
+    std::string host = "127.0.0.1";
+    std::string port = "5555";
+    unsigned clients = 50;
+    unsigned senders = 0;     // 0 = every client sends
+    unsigned rate = 100;      // messages per second per sender, 0 = unthrottled
+    size_t size = 128;        // payload bytes
+    double duration = 10.0;   // measured seconds
+    double warmup = 1.0;      // seconds excluded from the results
+};
+
+// Log-linear latency histogram in nanoseconds: 2^SUB_BITS buckets per power of
+// two, so every recorded value is within 1/128 of its true value.
+class LatencyHistogram
+{
+public:
+    static const int SUB_BITS = 7;
+    static const int SUB = 1 << SUB_BITS;
+    static const int MAGNITUDES = 64 - SUB_BITS;
+
+    LatencyHistogram() : counts_(static_cast<size_t>(MAGNITUDES + 1) * SUB, 0) {}
+
+    void record(uint64_t ns)
+    {
+        counts_[index(ns)]++;
+        total_++;
+        max_ = std::max(max_, ns);
+    }
+
+    void merge(const LatencyHistogram &other)
+    {
+        for (size_t i = 0; i < counts_.size(); ++i)
+            counts_[i] += other.counts_[i];
+        total_ += other.total_;
+        max_ = std::max(max_, other.max_);
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t max() const { return max_; }
+
+    // Upper edge of the bucket holding the q-th quantile
+    uint64_t quantile(double q) const
+    {
+        if (total_ == 0)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * static_cast<double>(total_)));
+        rank = std::max<uint64_t>(rank, 1);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i)
+        {
+            seen += counts_[i];
+            if (seen >= rank)
+                return std::min(upper(i), max_);
+        }
+        return max_;
+    }
+
+private:
+    static size_t index(uint64_t v)
+    {
+        if (v < static_cast<uint64_t>(SUB))
+            return static_cast<size_t>(v);
+        int msb = 0;
+        while (v >> (msb + 1))
+            ++msb;
+        int shift = msb - SUB_BITS;
+        return static_cast<size_t>(shift + 1) * SUB + static_cast<size_t>((v >> shift) - SUB);
+    }
+
+    static uint64_t upper(size_t i)
+    {
+        if (i < static_cast<size_t>(SUB))
+            return i;
+        int shift = static_cast<int>(i / SUB) - 1;
+        uint64_t base = (static_cast<uint64_t>(SUB) + i % SUB) << shift;
+        return base + ((uint64_t(1) << shift) - 1);
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_ = 0;
+    uint64_t max_ = 0;
+};
+
+struct BenchClient
+{
+    socket_t sock = INVALID_SOCKET;
+    std::thread reader;
+    std::thread sender;
+    LatencyHistogram latency;
+    uint64_t received = 0;     // timestamped messages inside the window
+    uint64_t received_bytes = 0;
+    uint64_t sent = 0;         // messages sent inside the window
+};
+
+static std::atomic<bool> g_stop_senders{false};
+static std::atomic<bool> g_stop_readers{false};
+static bench_clock::time_point g_window_start;
+static bench_clock::time_point g_window_end;
+
+// Payloads are "bench:<send time ns>:" followed by padding
+static const char BENCH_TAG[] = "bench:";
+
+static uint64_t now_ns()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     bench_clock::now().time_since_epoch())
+                                     .count());
+}
+
+static uint64_t to_ns(bench_clock::time_point t)
+{
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(t.time_since_epoch()).count());
+}
+
+static socket_t connect_to(const std::string &host, const std::string &port)
+{
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *res = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0)
+        return INVALID_SOCKET;
+    socket_t s = INVALID_SOCKET;
+    for (addrinfo *ai = res; ai; ai = ai->ai_next)
+    {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == INVALID_SOCKET)
+            continue;
+        if (connect(s, ai->ai_addr, static_cast<int>(ai->ai_addrlen)) == 0)
+            break;
+        close_socket(s);
+        s = INVALID_SOCKET;
+    }
+    freeaddrinfo(res);
+    if (s != INVALID_SOCKET)
+    {
+        set_nodelay(s);
+        set_nosigpipe(s);
+    }
+    return s;
+}
+
+static void read_loop(BenchClient *c)
+{
+    std::string msg;
+    uint64_t start = to_ns(g_window_start);
+    uint64_t end = to_ns(g_window_end);
+    while (!g_stop_readers && recv_message(c->sock, msg))
+    {
+        size_t pos = msg.find(BENCH_TAG);
+        if (pos == std::string::npos)
+            continue; // user list, join notices, ...
+        uint64_t sent_at = std::strtoull(msg.c_str() + pos + sizeof(BENCH_TAG) - 1, nullptr, 10);
+        if (sent_at < start || sent_at >= end)
+            continue;
+        uint64_t now = now_ns();
+        c->latency.record(now > sent_at ? now - sent_at : 0);
+        c->received++;
+        c->received_bytes += msg.size();
+    }
+}
+
+static void send_loop(BenchClient *c, const BenchConfig &cfg)
+{
+    std::string msg;
+    std::chrono::nanoseconds interval(cfg.rate ? 1000000000ll / cfg.rate : 0);
+    bench_clock::time_point next = bench_clock::now();
+    while (!g_stop_senders)
+    {
+        if (cfg.rate)
+        {
+            std::this_thread::sleep_until(next);
+            next += interval;
+        }
+        uint64_t ts = now_ns();
+        msg = BENCH_TAG + std::to_string(ts) + ":";
+        if (msg.size() < cfg.size)
+            msg.append(cfg.size - msg.size(), 'x');
+        if (!send_message(c->sock, msg))
+            break;
+        if (ts >= to_ns(g_window_start) && ts < to_ns(g_window_end))
+            c->sent++;
+    }
+}
+
+static void print_usage(const char *prog)
+{
+    std::cerr << "usage: " << prog << " [host] [port] [options]\n"
+              << "  --clients=N    concurrent connections (default 50)\n"
+              << "  --senders=N    connections that send (default: all)\n"
+              << "  --rate=N       messages per second per sender, 0 = unthrottled (default 100)\n"
+              << "  --size=N       payload bytes (default 128)\n"
+              << "  --duration=S   measured seconds (default 10)\n"
+              << "  --warmup=S     seconds before measuring starts (default 1)\n";
+}
+
+static bool parse_args(int argc, char *argv[], BenchConfig &cfg)
+{
+    int positional = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            if (positional == 0)
+                cfg.host = arg;
+            else if (positional == 1)
+                cfg.port = arg;
+            else
+                return false;
+            ++positional;
+            continue;
+        }
+        size_t eq = arg.find('=');
+        if (eq == std::string::npos)
+            return false;
+        std::string key = arg.substr(2, eq - 2);
+        std::string value = arg.substr(eq + 1);
+        try
+        {
+            if (key == "clients")
+                cfg.clients = static_cast<unsigned>(std::stoul(value));
+            else if (key == "senders")
+                cfg.senders = static_cast<unsigned>(std::stoul(value));
+            else if (key == "rate")
+                cfg.rate = static_cast<unsigned>(std::stoul(value));
+            else if (key == "size")
+                cfg.size = std::stoul(value);
+            else if (key == "duration")
+                cfg.duration = std::stod(value);
+            else if (key == "warmup")
+                cfg.warmup = std::stod(value);
+            else
+                return false;
+        }
+        catch (const std::exception &)
+        {
+            return false;
+        }
+    }
+    if (cfg.clients == 0 || cfg.duration <= 0 || cfg.warmup < 0)
+        return false;
+    if (cfg.senders == 0 || cfg.senders > cfg.clients)
+        cfg.senders = cfg.clients;
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    BenchConfig cfg;
+    if (!parse_args(argc, argv, cfg))
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+#if defined(_WIN32)
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+    {
+        std::cerr << "WSAStartup failed\n";
+        return 1;
+    }
+#else
+    std::signal(SIGPIPE, SIG_IGN);
+#endif
+
+    std::vector<std::unique_ptr<BenchClient>> clients;
+    for (unsigned i = 0; i < cfg.clients; ++i)
+    {
+        std::unique_ptr<BenchClient> c(new BenchClient);
+        c->sock = connect_to(cfg.host, cfg.port);
+        if (c->sock == INVALID_SOCKET || !send_message(c->sock, "bench" + std::to_string(i)))
+        {
+            std::cerr << "connect " << cfg.host << ":" << cfg.port << " failed after " << i << " clients\n";
+            for (auto &prev : clients)
+                close_socket(prev->sock);
+            return 1;
+        }
+        clients.push_back(std::move(c));
+    }
+
+    // messages sent during the warm-up (while late joiners settle) are not measured
+    auto warmup = std::chrono::duration_cast<bench_clock::duration>(std::chrono::duration<double>(cfg.warmup));
+    auto duration = std::chrono::duration_cast<bench_clock::duration>(std::chrono::duration<double>(cfg.duration));
+    g_window_start = bench_clock::now() + warmup;
+    g_window_end = g_window_start + duration;
+
+    for (auto &c : clients)
+        c->reader = std::thread(read_loop, c.get());
+    for (unsigned i = 0; i < cfg.senders; ++i)
+        clients[i]->sender = std::thread(send_loop, clients[i].get(), std::cref(cfg));
+
+    std::cout << "chat_bench: " << cfg.clients << " clients, " << cfg.senders << " senders, "
+              << (cfg.rate ? std::to_string(cfg.rate) + " msg/s each" : std::string("unthrottled"))
+              << ", " << cfg.size << " byte payloads, " << cfg.duration << " s\n";
+
+    std::this_thread::sleep_until(g_window_end);
+    g_stop_senders = true;
+    for (auto &c : clients)
+        if (c->sender.joinable())
+            c->sender.join();
+
+    // give in-flight fan-out a moment to arrive, then unblock the readers
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    g_stop_readers = true;
+    for (auto &c : clients)
+        shutdown_socket(c->sock);
+    for (auto &c : clients)
+    {
+        c->reader.join();
+        close_socket(c->sock);
+    }
+
+    LatencyHistogram total;
+    uint64_t sent = 0, received = 0, bytes = 0;
+    for (auto &c : clients)
+    {
+        total.merge(c->latency);
+        sent += c->sent;
+        received += c->received;
+        bytes += c->received_bytes;
+    }
+    uint64_t expected = sent * cfg.clients;
+    double secs = cfg.duration;
+
+    auto us = [](uint64_t ns) { return static_cast<double>(ns) / 1000.0; };
+    std::cout << std::fixed << std::setprecision(1)
+              << "sent:       " << sent << " msgs (" << static_cast<double>(sent) / secs << " msg/s)\n"
+              << "delivered:  " << received << " of " << expected << " expected"
+              << " (" << static_cast<double>(received) / secs << " msg/s, "
+              << static_cast<double>(bytes) / secs / (1024.0 * 1024.0) << " MiB/s)\n"
+              << "latency us: p50=" << us(total.quantile(0.50))
+              << " p99=" << us(total.quantile(0.99))
+              << " p999=" << us(total.quantile(0.999))
+              << " max=" << us(total.max()) << "\n";
+
+#if defined(_WIN32)
+    WSACleanup();
+#endif
+    return received == 0 ? 1 : 0;
+}
@@ -0,0 +1,353 @@
+// Microbenchmarks of the server's hot paths, one subsystem at a time
+//
+// Framing (blocking helpers over a socketpair, the batch parser from
+// memory), fan-out to 10 / 1k / 10k recipients, the client registry and
+// user-list generation, all in-process: no server, no network. Recipients
+// are plain clients without an event loop, so delivering to one is a push
+// onto its outbound queue; the queues are emptied between batches, outside
+// the timed region.
+//
+// Built on Google Benchmark; write results as JSON to compare releases:
+//   ./chat_microbench --benchmark_out=run.json --benchmark_out_format=json
+
+#include "chat.h"
+#include "platform.h"
+#include "presence.h"
+#include "protocol.h"
+#include "registry.h"
+#include "rooms.h"
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <sys/socket.h>
+#endif
+
+using Clients = std::vector<std::shared_ptr<Client>>;
+
+// Protocol 1 clients are every `v1_every`th one; 0 = legacy only
+static Clients make_clients(size_t n, size_t v1_every = 0)
+{
+    Clients out;
+    out.reserve(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        auto c = make_client(INVALID_SOCKET);
+        c->name = "user" + std::to_string(i);
+        c->named.store(true, std::memory_order_release);
+        if (v1_every != 0 && i % v1_every == 0)
+            c->proto.store(PROTO_VERSION, std::memory_order_relaxed);
+        out.push_back(std::move(c));
+    }
+    return out;
+}
+
+// What the connection's I/O thread would do, minus the write
+static void drain(const Clients &clients)
+{
+    std::vector<FramePtr> batch;
+    for (auto &c : clients)
+    {
+        while (!c->out.empty())
+        {
+            size_t sent = c->out.peek(batch, 1024), bytes = 0;
+            for (const FramePtr &f : batch)
+                bytes += f->size();
+            bytes -= sent;
+            batch.clear();
+            c->out.consume(bytes);
+        }
+    }
+}
+
+// Fan-out benchmarks push one frame per recipient per iteration; this many
+// stay well inside the default queue limits, so nothing is dropped
+static const int DRAIN_EVERY = 256;
+
+// ---- framing ----------------------------------------------------------------
+
+#if !defined(_WIN32)
+// send_message + recv_message of one frame through a connected socketpair
+static void BM_SocketPairRoundTrip(benchmark::State &state)
+{
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+    {
+        state.SkipWithError("socketpair() failed");
+        return;
+    }
+    // one whole frame has to fit, since the same thread sends and receives
+    int buf = 1024 * 1024;
+    setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &buf, sizeof(buf));
+    setsockopt(pair[1], SOL_SOCKET, SO_RCVBUF, &buf, sizeof(buf));
+    std::string msg(static_cast<size_t>(state.range(0)), 'x'), in;
+    for (auto _ : state)
+    {
+        if (!send_message(pair[0], msg) || !recv_message(pair[1], in))
+        {
+            state.SkipWithError("frame lost");
+            break;
+        }
+        benchmark::DoNotOptimize(in.data());
+    }
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(msg.size() + 4));
+    close_socket(pair[0]);
+    close_socket(pair[1]);
+}
+BENCHMARK(BM_SocketPairRoundTrip)->Arg(64)->Arg(1024)->Arg(64 * 1024);
+#endif
+
+// FrameReader::feed + next over a buffer of back-to-back frames, as one
+// completion (io_uring) or one recv would hand it over
+static void BM_FrameReaderParse(benchmark::State &state)
+{
+    const size_t size = static_cast<size_t>(state.range(0));
+    const size_t frames = std::max<size_t>(1, FrameReader::READ_CHUNK / (size + 4));
+    std::string wire, msg(size, 'x');
+    for (size_t i = 0; i < frames; ++i)
+        append_frame(wire, msg);
+    FrameReader reader;
+    Buffer out;
+    for (auto _ : state)
+    {
+        reader.feed(wire.data(), wire.size());
+        while (reader.next(out))
+            benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * static_cast<int64_t>(frames));
+    state.SetBytesProcessed(state.iterations() * static_cast<int64_t>(wire.size()));
+}
+BENCHMARK(BM_FrameReaderParse)->Arg(16)->Arg(256)->Arg(4096);
+
+// Building a shared frame, legacy text and protocol 1
+static void BM_MakeFrame(benchmark::State &state)
+{
+    std::string body(static_cast<size_t>(state.range(0)), 'x');
+    for (auto _ : state)
+        benchmark::DoNotOptimize(make_frame({"[", "user42", "] ", body}));
+}
+BENCHMARK(BM_MakeFrame)->Arg(64)->Arg(1024);
+
+static void BM_MakeMessage(benchmark::State &state)
+{
+    std::string body(static_cast<size_t>(state.range(0)), 'x');
+    MsgHeader h;
+    h.sender = 42;
+    for (auto _ : state)
+    {
+        ++h.seq;
+        benchmark::DoNotOptimize(make_message(h, body));
+    }
+}
+BENCHMARK(BM_MakeMessage)->Arg(64)->Arg(1024);
+
+// ---- fan-out ----------------------------------------------------------------
+
+// One room message to N members: encoding, queueing and room history
+static void fan_out_room(benchmark::State &state, size_t v1_every)
+{
+    RoomId id = rooms.intern("bench-" + std::to_string(state.range(0)) + "-" + std::to_string(v1_every));
+    Room *room = rooms.get(id);
+    Clients clients = make_clients(static_cast<size_t>(state.range(0)), v1_every);
+    for (auto &c : clients)
+        room->members.add(c);
+    MsgHeader h;
+    h.type = MsgType::Text;
+    h.sender = clients.front()->id;
+    std::string text(128, 'x');
+    int pending = 0;
+    for (auto _ : state)
+    {
+        broadcast_room(id, h, text, clients.front()->name, text);
+        if (++pending == DRAIN_EVERY)
+        {
+            state.PauseTiming();
+            drain(clients);
+            pending = 0;
+            state.ResumeTiming();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0)); // deliveries
+    room->members.clear();
+    drain(clients);
+}
+
+static void BM_BroadcastRoom(benchmark::State &state)
+{
+    fan_out_room(state, 0);
+}
+BENCHMARK(BM_BroadcastRoom)->Arg(10)->Arg(1000)->Arg(10000);
+
+// Every fourth member on protocol 1: both encodings per message
+static void BM_BroadcastRoomMixed(benchmark::State &state)
+{
+    fan_out_room(state, 4);
+}
+BENCHMARK(BM_BroadcastRoomMixed)->Arg(10)->Arg(1000)->Arg(10000);
+
+// A server-wide notice to every connection in the registry
+static void BM_BroadcastAll(benchmark::State &state)
+{
+    Clients clients = make_clients(static_cast<size_t>(state.range(0)));
+    for (auto &c : clients)
+        registry.add(c);
+    std::string text(128, 'x');
+    int pending = 0;
+    for (auto _ : state)
+    {
+        broadcast("Server", text);
+        if (++pending == DRAIN_EVERY)
+        {
+            state.PauseTiming();
+            drain(clients);
+            pending = 0;
+            state.ResumeTiming();
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+    registry.clear();
+    drain(clients);
+}
+BENCHMARK(BM_BroadcastAll)->Arg(10)->Arg(1000)->Arg(10000);
+
+// ---- registry ---------------------------------------------------------------
+
+// N logins and then N logouts
+static void BM_RegistryAddRemove(benchmark::State &state)
+{
+    Clients clients = make_clients(static_cast<size_t>(state.range(0)));
+    ClientSet set;
+    for (auto _ : state)
+    {
+        for (auto &c : clients)
+            set.add(c);
+        for (auto &c : clients)
+            set.remove(*c);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0) * 2);
+}
+BENCHMARK(BM_RegistryAddRemove)->Arg(10)->Arg(1000)->Arg(10000);
+
+// Walking the published snapshot, the read side of every broadcast
+static void BM_RegistryIterate(benchmark::State &state)
+{
+    Clients clients = make_clients(static_cast<size_t>(state.range(0)));
+    ClientSet set;
+    for (auto &c : clients)
+        set.add(c);
+    for (auto _ : state)
+    {
+        uint64_t sum = 0;
+        for (auto &c : *set.snapshot())
+            sum += c->id;
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_RegistryIterate)->Arg(10)->Arg(1000)->Arg(10000);
+
+// One join between reads: the next snapshot is rebuilt
+static void BM_RegistryChurnSnapshot(benchmark::State &state)
+{
+    Clients clients = make_clients(static_cast<size_t>(state.range(0)));
+    ClientSet set;
+    for (auto &c : clients)
+        set.add(c);
+    auto extra = make_client(INVALID_SOCKET);
+    bool in = false;
+    for (auto _ : state)
+    {
+        in ? set.remove(*extra) : set.add(extra);
+        in = !in;
+        benchmark::DoNotOptimize(set.snapshot());
+    }
+}
+BENCHMARK(BM_RegistryChurnSnapshot)->Arg(10)->Arg(1000)->Arg(10000);
+
+// ---- user list --------------------------------------------------------------
+
+// Presence keeps its users for the whole process, so these only ever grow
+// the roster to N: main() registers them size by size, in ascending order
+static void ensure_online(size_t n)
+{
+    static size_t online = 0;
+    for (; online < n; ++online)
+        presence_adopt(online + 1, "user" + std::to_string(online));
+}
+
+// Re-serializing the roster of N users, both formats
+static void BM_RosterRebuild(benchmark::State &state)
+{
+    ensure_online(static_cast<size_t>(state.range(0)));
+    for (auto _ : state)
+    {
+        presence_adopt(1, "user0"); // invalidates the cached roster
+        benchmark::DoNotOptimize(presence_roster_text());
+        benchmark::DoNotOptimize(presence_roster_message());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+// A user logging in and out with N others online: each change is flushed at
+// once (window 0), announcing the delta and rebuilding the roster
+static void BM_PresenceJoinLeave(benchmark::State &state)
+{
+    ensure_online(static_cast<size_t>(state.range(0)));
+    const uint64_t id = 1ull << 40;
+    for (auto _ : state)
+    {
+        presence_online(id, "visitor");
+        presence_offline(id);
+    }
+}
+
+// Serving the cached list to a client that just logged in
+static void BM_SendUserList(benchmark::State &state)
+{
+    ensure_online(static_cast<size_t>(state.range(0)));
+    Clients clients = make_clients(1);
+    int pending = 0;
+    for (auto _ : state)
+    {
+        send_user_list_to_client(clients.front());
+        if (++pending == DRAIN_EVERY)
+        {
+            state.PauseTiming();
+            drain(clients);
+            pending = 0;
+            state.ResumeTiming();
+        }
+    }
+    drain(clients);
+}
+
+int main(int argc, char **argv)
+{
+#if defined(_WIN32)
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+        return 1;
+#endif
+    start_presence(0);
+    for (int64_t n : {10, 1000, 10000})
+    {
+        benchmark::RegisterBenchmark("BM_RosterRebuild", BM_RosterRebuild)->Arg(n);
+        benchmark::RegisterBenchmark("BM_PresenceJoinLeave", BM_PresenceJoinLeave)->Arg(n);
+        benchmark::RegisterBenchmark("BM_SendUserList", BM_SendUserList)->Arg(n);
+    }
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+        return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    stop_presence();
+#if defined(_WIN32)
+    WSACleanup();
+#endif
+    return 0;
+}
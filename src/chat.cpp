@@ -0,0 +1,805 @@
+#include "chat.h"
+#include "cluster.h"
+#include "compress.h"
+#include "directory.h"
+#include "log.h"
+#include "metrics.h"
+#include "presence.h"
+#include "reactor.h"
+#include "trace.h"
+#include "websocket.h"
+
+#include <algorithm>
+#include <sstream>
+
+std::atomic<bool> running{true};
+std::atomic<bool> restart_pending{false};
+
+std::shared_ptr<Client> make_client(socket_t sock)
+{
+    auto c = std::allocate_shared<Client>(SlabAllocator<Client>());
+    c->sock = sock;
+    return c;
+}
+
+static Waker *g_shutdown_waker = nullptr;
+
+void init_shutdown_notifier()
+{
+    if (!g_shutdown_waker)
+        g_shutdown_waker = new Waker(); // lives for the whole process
+}
+
+void request_shutdown()
+{
+    running = false;
+    if (g_shutdown_waker)
+        g_shutdown_waker->wake();
+}
+
+void request_restart()
+{
+    restart_pending = true;
+    if (g_shutdown_waker)
+        g_shutdown_waker->wake();
+}
+
+void wait_for_shutdown()
+{
+    // the timeout covers a signal that lands before we start waiting; the
+    // waker is drained because a failed restart goes back to waiting
+    while (running && !restart_pending)
+    {
+        if (wait_for_socket(g_shutdown_waker->fd(), false, 1000))
+            g_shutdown_waker->drain();
+    }
+}
+
+// The client's wire form of `shared`: compressed, or framed for WebSocket,
+// once per broadcast by the first recipient that needs it
+static FramePtr encode_for(const Client &client, const FramePtr &shared, uint8_t mode)
+{
+    if (client.ws)
+        return ws_frame(shared, client.ws->deflate(), client.proto.load(std::memory_order_relaxed) != 0);
+    return frame_for_mode(shared, mode);
+}
+
+bool deliver(const std::shared_ptr<Client> &client, const FramePtr &shared)
+{
+    FramePtr frame = encode_for(*client, shared, client->compress.load(std::memory_order_relaxed));
+    if (client->loop)
+        return client->loop->send(client, frame);
+    // threads engine: the client's writer thread picks it up
+    return client->out.push(frame) != OutboundQueue::Push::Disconnect;
+}
+
+bool deliver(const std::shared_ptr<Client> &client, std::string_view msg)
+{
+    return deliver(client, make_frame(msg));
+}
+
+bool deliver(const std::shared_ptr<Client> &client, const std::vector<FramePtr> &frames)
+{
+    static thread_local std::vector<FramePtr> encoded;
+    encoded.clear();
+    uint8_t mode = client->compress.load(std::memory_order_relaxed);
+    for (const FramePtr &f : frames)
+        encoded.push_back(encode_for(*client, f, mode));
+    bool ok = client->loop ? client->loop->send(client, encoded.data(), encoded.size())
+                           : client->out.push(encoded.data(), encoded.size()) != OutboundQueue::Push::Disconnect;
+    encoded.clear();
+    return ok;
+}
+
+// Sends one message to every client in `snap`, encoding each wire format
+// on first use so that a room of legacy clients never builds the binary
+// form and vice versa
+template <typename MakeText>
+static void fan_out(const ClientSet::Snapshot &snap, const MsgHeader &header, std::string_view body,
+                    MakeText make_text, FramePtr &text, FramePtr &binary, const char *what)
+{
+    metric_add(Counter::Broadcasts);
+    metric_record(Histogram::FanOut, snap.size());
+    uint64_t trace = trace_current();
+    for (auto &c : snap)
+    {
+        bool v1 = c->proto.load(std::memory_order_relaxed) != 0;
+        FramePtr &frame = v1 ? binary : text;
+        if (!frame)
+            frame = v1 ? make_message(header, body) : make_text();
+        // the owning I/O thread tears the client down; we only report it
+        if (!deliver(c, frame))
+            LOG_WARN(what << ": send queue overflow for " << display_name(*c) << " (sock=" << c->sock << "), disconnecting");
+        if (trace != 0 && &c == &snap.front())
+            trace_record(trace, TraceStage::FirstDelivery);
+    }
+    if (!snap.empty())
+        trace_record(trace, TraceStage::LastDelivery);
+}
+
+void broadcast(const std::string &from, std::string_view msg)
+{
+    static const std::string open = "[", close = "] ";
+    MsgHeader header;
+    header.type = MsgType::Notice;
+    header.room = INVALID_ROOM;
+    FramePtr text, binary;
+    fan_out(*registry.snapshot(), header, msg, [&] { return make_frame({open, from, close, msg}); },
+            text, binary, "broadcast");
+}
+
+// Legacy display text of a room message
+static FramePtr room_text(const Room &room, std::string_view from, std::string_view text)
+{
+    // the lobby keeps the original "[from] msg" format for legacy clients
+    static const std::string open = "[", at = " @ ", close = "] ";
+    return room.id == LOBBY_ROOM ? make_frame({open, from, close, text})
+                                 : make_frame({open, from, at, room.name, close, text});
+}
+
+void broadcast_room(RoomId room_id, MsgHeader header, std::string_view body,
+                    const std::string &from, std::string_view text)
+{
+    Room *room = rooms.get(room_id);
+    if (!room)
+        return;
+    header.room = room_id;
+    header.seq = room->seq.fetch_add(1, std::memory_order_relaxed) + 1;
+    auto make_text = [&] { return room_text(*room, from, text); };
+    FramePtr text_frame, binary_frame;
+    fan_out(*room->members.snapshot(), header, body, make_text, text_frame, binary_frame, "broadcast_room");
+    if (header.type != MsgType::Text)
+        return;
+    journal_append(JournalRecord{header.seq, header.sender, header.flags, room->name, from, body});
+    if (history_capacity == 0)
+        return;
+    // history serves both formats, whichever the current members lacked
+    if (!text_frame)
+        text_frame = make_text();
+    if (!binary_frame)
+        binary_frame = make_message(header, body);
+    room->history.record(header.seq, header.sender, header.flags, text_frame, binary_frame);
+}
+
+void restore_message(const JournalRecord &rec)
+{
+    RoomId id = rooms.intern(std::string(rec.room));
+    if (id == INVALID_ROOM)
+        return;
+    Room *room = rooms.get(id);
+    if (room->seq.load(std::memory_order_relaxed) < rec.seq)
+        room->seq.store(rec.seq, std::memory_order_relaxed);
+    // a sender id seen before the restart must not name a new connection
+    reserve_client_ids(rec.sender + 1);
+    if (history_capacity == 0)
+        return;
+    MsgHeader header;
+    header.type = MsgType::Text;
+    header.room = id;
+    header.sender = rec.sender;
+    header.seq = rec.seq;
+    header.flags = rec.flags; // pieces of a streamed message stay pieces
+    room->history.record(rec.seq, rec.sender, rec.flags, room_text(*room, rec.from, rec.text),
+                         make_message(header, rec.text));
+}
+
+static MsgHeader event(MsgType type, uint64_t sender, uint16_t flags = 0)
+{
+    MsgHeader h;
+    h.type = type;
+    h.sender = sender;
+    h.flags = flags;
+    return h;
+}
+
+bool send_user_list_to_client(const std::shared_ptr<Client> &client)
+{
+    bool v1 = client->proto.load(std::memory_order_relaxed) != 0;
+    return deliver(client, v1 ? presence_roster_message() : presence_roster_text());
+}
+
+bool send_ping(const std::shared_ptr<Client> &client)
+{
+    // the same two frames serve every heartbeat
+    static const FramePtr text = make_frame("__ping__");
+    static const FramePtr binary = make_message(event(MsgType::Ping, 0), {});
+    return deliver(client, client->proto.load(std::memory_order_relaxed) ? binary : text);
+}
+
+void send_to_lobby(const std::vector<FramePtr> &text, const FramePtr &binary)
+{
+    auto snap = rooms.get(LOBBY_ROOM)->members.snapshot();
+    metric_add(Counter::Broadcasts);
+    metric_record(Histogram::FanOut, snap->size());
+    for (auto &c : *snap)
+    {
+        bool v1 = c->proto.load(std::memory_order_relaxed) != 0;
+        if (!(v1 ? deliver(c, binary) : deliver(c, text)))
+            LOG_WARN("send_to_lobby: send queue overflow for " << display_name(*c) << " (sock=" << c->sock << "), disconnecting");
+    }
+}
+
+// Reply from the server to a single client
+static void notify(const std::shared_ptr<Client> &client, const std::string &text)
+{
+    if (client->proto.load(std::memory_order_relaxed))
+    {
+        MsgHeader h = event(MsgType::Notice, 0);
+        h.room = INVALID_ROOM;
+        deliver(client, make_message(h, text));
+    }
+    else
+        deliver(client, "[Server] " + text);
+}
+
+// Messages of a room after `since` as one batch. A message broadcast while
+// the client was joining may arrive both live and in the replay; protocol 1
+// clients can drop the duplicate by its sequence number.
+static void replay(const std::shared_ptr<Client> &client, RoomId id, uint64_t since)
+{
+    static thread_local std::vector<FramePtr> frames;
+    frames.clear();
+    rooms.get(id)->history.tail(since, client->proto.load(std::memory_order_relaxed) != 0, frames);
+    if (!frames.empty())
+        deliver(client, frames);
+    frames.clear();
+}
+
+static void announce_membership(Room *room, uint64_t sender, const std::string &name, bool joined)
+{
+    broadcast_room(room->id, event(joined ? MsgType::Join : MsgType::Leave, sender), room->name, "Server",
+                   "用户 '" + name + (joined ? "' 已加入房间 '" : "' 已离开房间 '") + room->name + "'");
+}
+
+// Membership and announcement only; false if already a member
+static bool enter_room(const std::shared_ptr<Client> &client, RoomId id)
+{
+    Room *room = rooms.get(id);
+    if (!room->members.add(client))
+        return false;
+    client->rooms.push_back(id);
+    if (id != LOBBY_ROOM)
+    {
+        announce_membership(room, client->id, client->name, true);
+        cluster_room_event(room->name, client->id, client->name, true);
+    }
+    return true;
+}
+
+static void join_room(const std::shared_ptr<Client> &client, RoomId id)
+{
+    if (!enter_room(client, id))
+    {
+        notify(client, "你已在房间 '" + rooms.get(id)->name + "' 中");
+        return;
+    }
+    replay(client, id, 0);
+}
+
+static void leave_room(const std::shared_ptr<Client> &client, RoomId id, bool announce)
+{
+    client->rooms.erase(std::remove(client->rooms.begin(), client->rooms.end(), id), client->rooms.end());
+    Room *room = rooms.get(id);
+    if (!room || !room->members.remove(*client))
+        return;
+    if (announce && id != LOBBY_ROOM)
+    {
+        announce_membership(room, client->id, client->name, false);
+        cluster_room_event(room->name, client->id, client->name, false);
+    }
+}
+
+static bool is_member(const Client &client, RoomId id)
+{
+    return std::find(client.rooms.begin(), client.rooms.end(), id) != client.rooms.end();
+}
+
+// One post, or one fragment of it with MSG_FRAGMENT in `flags`
+static void publish_post(const std::shared_ptr<Client> &client, RoomId id, std::string_view text, uint16_t flags)
+{
+    Room *room = rooms.get(id);
+    if (!room)
+        return;
+    broadcast_room(id, event(MsgType::Text, client->id, flags), text, client->name, text);
+    cluster_post(room->name, client->id, client->name, text, flags);
+}
+
+// False if the client may not post to the room, after telling it why; a
+// continuation of a message already charged skips the room budget
+static bool may_post(const std::shared_ptr<Client> &client, RoomId id, bool charge = true)
+{
+    Room *room = rooms.get(id);
+    if (!is_member(*client, id))
+    {
+        notify(client, room ? "你不在房间 '" + room->name + "' 中" : std::string("你不在该房间中"));
+        return false;
+    }
+    // a shared budget, so a busy room cannot multiply into a broadcast storm
+    if (charge && !room->limiter.try_take(rate_limits.room, monotonic_ns()))
+    {
+        metric_add(Counter::RoomRateLimited);
+        notify(client, "房间 '" + room->name + "' 消息过多，请稍后再发");
+        return false;
+    }
+    return true;
+}
+
+// A message a protocol 1 client fragmented itself counts against the room
+// budget once, with its first fragment, for up to frame_limits.max_frame
+// bytes; a fragment past that pays again as if it began a new message
+static void post(const std::shared_ptr<Client> &client, RoomId id, std::string_view text, uint16_t flags = 0)
+{
+    bool continued = client->stream_room != INVALID_ROOM && client->stream_room == id &&
+                     client->stream_bytes + text.size() <= frame_limits.max_frame;
+    if (!may_post(client, id, !continued))
+    {
+        client->stream_room = INVALID_ROOM;
+        return;
+    }
+    client->stream_bytes = continued ? client->stream_bytes + text.size() : text.size();
+    client->stream_room = flags & MSG_FRAGMENT ? id : INVALID_ROOM;
+    publish_post(client, id, text, flags);
+}
+
+void remote_post(const std::string &room_name, uint64_t sender, const std::string &from, std::string_view text,
+                 uint16_t flags)
+{
+    // interned even without local members, so the history is complete here too
+    RoomId id = rooms.intern(room_name);
+    if (id != INVALID_ROOM)
+        broadcast_room(id, event(MsgType::Text, sender, flags), text, from, text);
+}
+
+// Trailing bytes of `s` that begin a UTF-8 sequence it does not complete
+static size_t utf8_partial(std::string_view s)
+{
+    for (size_t back = 1; back <= 3 && back <= s.size(); ++back)
+    {
+        unsigned char c = static_cast<unsigned char>(s[s.size() - back]);
+        if ((c & 0xc0) == 0x80)
+            continue;
+        size_t len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc0 ? 2 : 1;
+        return len > back ? back : 0;
+    }
+    return 0;
+}
+
+// One piece of a frame over frame_limits.fragment, relayed as soon as it
+// arrived; pieces are cut at character boundaries so that every one is
+// valid text for legacy clients
+static void post_piece(const std::shared_ptr<Client> &client, std::string_view piece, bool last)
+{
+    if (!is_member(*client, client->stream_room))
+    {
+        client->stream_room = INVALID_ROOM; // left, or was removed, part way through
+        client->stream_tail.clear();
+        return;
+    }
+    std::string joined;
+    if (!client->stream_tail.empty())
+    {
+        joined = client->stream_tail;
+        joined.append(piece.data(), piece.size());
+        piece = joined;
+        client->stream_tail.clear();
+    }
+    size_t keep = last ? 0 : utf8_partial(piece);
+    client->stream_tail.assign(piece.data() + piece.size() - keep, keep);
+    publish_post(client, client->stream_room, piece.substr(0, piece.size() - keep), last ? 0 : MSG_FRAGMENT);
+}
+
+// First piece of a large frame: only a post may be this long. Picks the
+// room the rest goes to, or INVALID_ROOM to drop it.
+static void begin_stream(const std::shared_ptr<Client> &client, std::string_view msg)
+{
+    static const std::string_view post_cmd = "__post__ ";
+    client->stream_room = INVALID_ROOM;
+    client->stream_tail.clear();
+    RoomId id = INVALID_ROOM;
+    std::string_view text = msg;
+    if (client->proto.load(std::memory_order_relaxed))
+    {
+        MsgHeader h;
+        if (decode_header(msg, h, text) && h.type == MsgType::Text)
+            id = h.room;
+    }
+    else if (msg.compare(0, post_cmd.size(), post_cmd) == 0)
+    {
+        text.remove_prefix(post_cmd.size());
+        size_t sp = text.find(' ');
+        id = rooms.find(std::string(text.substr(0, sp)));
+        text = sp == std::string_view::npos ? std::string_view() : text.substr(sp + 1);
+        if (id == INVALID_ROOM)
+        {
+            notify(client, "你不在房间 '" + std::string(msg.substr(post_cmd.size(), sp)) + "' 中");
+            return;
+        }
+    }
+    else if (msg.compare(0, 2, "__") != 0)
+        id = LOBBY_ROOM;
+    if (id == INVALID_ROOM)
+    {
+        notify(client, "消息过长（超过 " + std::to_string(frame_limits.fragment) + " 字节的只能是聊天消息）");
+        return;
+    }
+    if (!may_post(client, id))
+        return;
+    client->stream_room = id;
+    post_piece(client, text, false);
+}
+
+void remote_room_event(const std::string &room_name, uint64_t sender, const std::string &name, bool joined)
+{
+    RoomId id = rooms.find(room_name);
+    if (id != INVALID_ROOM && id != LOBBY_ROOM)
+        announce_membership(rooms.get(id), sender, name, joined);
+}
+
+// To each of `targets` except the sender: "[from 私信] text", or a Direct
+// message from `sender` for protocol 1
+static void deliver_direct(const std::vector<std::shared_ptr<Client>> &targets, const Client *self,
+                           uint64_t sender, const std::string &from, std::string_view text)
+{
+    static const std::string open = "[", close = " 私信] ";
+    FramePtr text_frame, binary_frame;
+    for (auto &c : targets)
+    {
+        if (c.get() == self)
+            continue;
+        bool v1 = c->proto.load(std::memory_order_relaxed) != 0;
+        FramePtr &frame = v1 ? binary_frame : text_frame;
+        if (!frame)
+        {
+            MsgHeader h = event(MsgType::Direct, sender);
+            h.room = INVALID_ROOM;
+            frame = v1 ? make_message(h, text) : make_frame({open, from, close, text});
+        }
+        metric_add(Counter::DirectMessages);
+        if (!deliver(c, frame))
+            LOG_WARN("direct: send queue overflow for " << display_name(*c) << " (sock=" << c->sock << "), disconnecting");
+    }
+}
+
+// A direct message to connection `to`, or with to == 0 to every connection
+// logged in as `to_name`, here or on other nodes. Only the user's own
+// stripe of the directory is locked; the sender gets its message back as
+// confirmation, like a room post.
+static void direct(const std::shared_ptr<Client> &client, uint64_t to, const std::string &to_name, std::string_view text)
+{
+    static thread_local std::vector<std::shared_ptr<Client>> targets;
+    targets.clear();
+    bool remote = false;
+    std::string label = to_name;
+    if (to)
+    {
+        if (std::shared_ptr<Client> c = directory.find(to, &remote))
+        {
+            label = c->name;
+            targets.push_back(std::move(c));
+        }
+        if (label.empty())
+            label = "#" + std::to_string(to);
+    }
+    else
+        remote = directory.find(to_name, targets) != 0;
+    if (targets.empty() && !remote)
+    {
+        notify(client, "用户 '" + label + "' 不在线");
+        return;
+    }
+    deliver_direct(targets, client.get(), client->id, client->name, text);
+    targets.clear();
+    if (remote)
+        cluster_direct(to, to_name, client->id, client->name, text);
+
+    if (client->proto.load(std::memory_order_relaxed))
+    {
+        MsgHeader h = event(MsgType::Direct, to, MSG_SENT);
+        h.room = INVALID_ROOM;
+        deliver(client, make_message(h, text));
+    }
+    else
+        deliver(client, make_frame({"[私信 -> ", label, "] ", text}));
+}
+
+void remote_direct(uint64_t to, const std::string &to_name, uint64_t sender, const std::string &from,
+                   std::string_view text)
+{
+    static thread_local std::vector<std::shared_ptr<Client>> targets;
+    targets.clear();
+    if (to)
+    {
+        if (std::shared_ptr<Client> c = directory.find(to))
+            targets.push_back(std::move(c));
+    }
+    else
+        directory.find(to_name, targets);
+    deliver_direct(targets, nullptr, sender, from, text);
+    targets.clear();
+}
+
+static void join_by_name(const std::shared_ptr<Client> &client, const std::string &name)
+{
+    const RoomLimits &lim = room_limits;
+    if (!RoomTable::valid_name(name))
+    {
+        notify(client, "无效的房间名: " + name);
+        return;
+    }
+    RoomId id = rooms.find(name);
+    if (id != INVALID_ROOM && is_member(*client, id))
+    {
+        join_room(client, id); // tells it so
+        return;
+    }
+    // the lobby is in client->rooms too
+    if (client->rooms.size() > lim.per_client)
+    {
+        notify(client, "你已加入 " + std::to_string(lim.per_client) + " 个房间，请先离开一些房间");
+        return;
+    }
+    if (id == INVALID_ROOM)
+    {
+        if (client->rooms_created >= lim.creates_per_client)
+        {
+            notify(client, "你创建的房间已达上限（" + std::to_string(lim.creates_per_client) + " 个）");
+            return;
+        }
+        id = rooms.intern(name);
+        if (id == INVALID_ROOM)
+        {
+            LOG_WARN("room table full (" << lim.max_rooms << " rooms); refused to create '" << name << "'");
+            notify(client, "服务器房间数已达上限，无法创建房间 '" + name + "'");
+            return;
+        }
+        ++client->rooms_created;
+    }
+    join_room(client, id);
+}
+
+// Explicit leave; the leaver gets a confirmation (for protocol 1 a Leave
+// message about itself, since it is no longer a member when others hear it)
+static void leave_by_id(const std::shared_ptr<Client> &client, RoomId id, const std::string &label)
+{
+    if (id == INVALID_ROOM || !is_member(*client, id))
+    {
+        notify(client, "你不在房间 '" + label + "' 中");
+        return;
+    }
+    leave_room(client, id, true);
+    Room *room = rooms.get(id);
+    if (client->proto.load(std::memory_order_relaxed))
+    {
+        MsgHeader h = event(MsgType::Leave, client->id);
+        h.room = id;
+        deliver(client, make_message(h, room->name));
+    }
+    else
+        notify(client, "已离开房间 '" + room->name + "'");
+}
+
+static void history_request(const std::shared_ptr<Client> &client, RoomId id, uint64_t since, const std::string &label)
+{
+    if (id == INVALID_ROOM || !is_member(*client, id))
+        notify(client, "你不在房间 '" + label + "' 中");
+    else
+        replay(client, id, since);
+}
+
+// "__caps__" arguments: compression (compress.h) and "proto=<version>".
+// The reply goes out in the old format and compression mode; the new
+// settings apply to frames encoded after it. Other threads read the
+// settings without a lock, so a broadcast encoded just before the switch
+// may still be queued behind the reply in the old form. Clients tell the
+// formats apart by the leading version byte of a version 1 payload, and
+// keep the old codec around for a while when they change codecs.
+static void negotiate(const std::shared_ptr<Client> &client, const std::string &args)
+{
+    uint8_t mode = 0;
+    // WebSocket clients compress with permessage-deflate instead
+    std::string reply = negotiate_caps(client->ws ? std::string() : args, mode);
+    uint8_t before = client->proto.load(std::memory_order_relaxed);
+    uint8_t proto = before;
+    std::istringstream in(args);
+    std::string token;
+    while (in >> token)
+    {
+        if (token.compare(0, 6, "proto=") == 0)
+            proto = token.substr(6) == std::to_string(PROTO_VERSION) ? PROTO_VERSION : 0;
+    }
+    reply += " proto=" + std::to_string(proto);
+    if (before)
+        deliver(client, make_message(event(MsgType::Caps, 0), reply));
+    else
+        deliver(client, "__caps__ " + reply);
+    client->compress.store(mode, std::memory_order_relaxed);
+    client->proto.store(proto, std::memory_order_relaxed);
+    // a protocol 1 client learns who is online (and their ids) up front
+    if (proto && !before)
+        send_user_list_to_client(client);
+}
+
+// Room commands; returns false if msg is not one of them
+static bool handle_command(const std::shared_ptr<Client> &client, const std::string &msg)
+{
+    size_t sp = msg.find(' ');
+    std::string cmd = msg.substr(0, sp);
+    std::string arg = sp == std::string::npos ? std::string() : msg.substr(sp + 1);
+
+    if (cmd == "__caps__")
+    {
+        negotiate(client, arg);
+        return true;
+    }
+    if (cmd == "__join__")
+    {
+        join_by_name(client, arg);
+        return true;
+    }
+    if (cmd == "__leave__")
+    {
+        leave_by_id(client, rooms.find(arg), arg);
+        return true;
+    }
+    if (cmd == "__history__")
+    {
+        std::istringstream in(arg);
+        std::string name;
+        uint64_t since = 0;
+        in >> name >> since;
+        history_request(client, rooms.find(name), since, name);
+        return true;
+    }
+    if (cmd == "__dm__")
+    {
+        size_t sp2 = arg.find(' ');
+        direct(client, 0, arg.substr(0, sp2), sp2 == std::string::npos ? std::string() : arg.substr(sp2 + 1));
+        return true;
+    }
+    if (cmd == "__post__")
+    {
+        size_t sp2 = arg.find(' ');
+        std::string name = arg.substr(0, sp2);
+        RoomId id = rooms.find(name);
+        if (id == INVALID_ROOM)
+            notify(client, "你不在房间 '" + name + "' 中");
+        else
+            post(client, id, sp2 == std::string::npos ? std::string() : arg.substr(sp2 + 1));
+        return true;
+    }
+    return false;
+}
+
+// Protocol 1: dispatch on the header's type
+static bool handle_message(const std::shared_ptr<Client> &client, std::string_view payload)
+{
+    MsgHeader h;
+    std::string_view body;
+    if (!decode_header(payload, h, body))
+    {
+        notify(client, "无效的消息头");
+        return true;
+    }
+    switch (h.type)
+    {
+    case MsgType::Text:
+        post(client, h.room, body, h.flags & MSG_FRAGMENT);
+        return true;
+    case MsgType::Join:
+        join_by_name(client, std::string(body));
+        return true;
+    case MsgType::Leave:
+    {
+        Room *room = rooms.get(h.room);
+        leave_by_id(client, h.room, room ? room->name : std::to_string(h.room));
+        return true;
+    }
+    case MsgType::History:
+    {
+        Room *room = rooms.get(h.room);
+        history_request(client, h.room, h.seq, room ? room->name : std::to_string(h.room));
+        return true;
+    }
+    case MsgType::Ping:
+        deliver(client, make_message(event(MsgType::Pong, 0), {}));
+        return true;
+    case MsgType::Pong:
+        return true;
+    case MsgType::Quit:
+        return false;
+    case MsgType::Caps:
+        negotiate(client, std::string(body));
+        return true;
+    case MsgType::Direct:
+    {
+        if (h.sender)
+        {
+            direct(client, h.sender, std::string(), body);
+            return true;
+        }
+        size_t sp = body.find(' ');
+        std::string_view text = sp == std::string_view::npos ? std::string_view() : body.substr(sp + 1);
+        direct(client, 0, std::string(body.substr(0, sp)), text);
+        return true;
+    }
+    default:
+        notify(client, "未知的消息类型: " + std::to_string(static_cast<int>(h.type)));
+        return true;
+    }
+}
+
+bool client_joined(const std::shared_ptr<Client> &client, const std::string &name)
+{
+    client->name = name.empty() ? "anonymous" : name;
+    client->named.store(true, std::memory_order_release);
+    LOG_INFO("Client connected: " << client->name);
+    directory.add(client);
+    // In the lobby before reading the roster, so no presence delta is missed
+    enter_room(client, LOBBY_ROOM);
+    if (!send_user_list_to_client(client))
+        return false;
+    replay(client, LOBBY_ROOM, 0);
+    // Announced to everyone with the next presence delta
+    presence_online(client->id, client->name);
+    cluster_presence(client->id, client->name, true);
+    return true;
+}
+
+bool client_message(const std::shared_ptr<Client> &client, std::string_view msg, FramePart part)
+{
+    if (part == FramePart::First)
+    {
+        begin_stream(client, msg);
+        return true;
+    }
+    if (part != FramePart::Whole)
+    {
+        if (client->stream_room != INVALID_ROOM)
+            post_piece(client, msg, part == FramePart::Last);
+        if (part == FramePart::Last)
+            client->stream_room = INVALID_ROOM;
+        return true;
+    }
+    if (client->proto.load(std::memory_order_relaxed))
+        return handle_message(client, msg);
+    if (msg == "__quit__")
+        return false;
+    if (msg == "__pong__")
+        return true;
+    if (msg == "__ping__")
+    {
+        deliver(client, "__pong__");
+        return true;
+    }
+    // commands are rare; only they pay for a std::string copy
+    if (msg.compare(0, 2, "__") == 0 && handle_command(client, std::string(msg)))
+        return true;
+    post(client, LOBBY_ROOM, msg);
+    return true;
+}
+
+void client_left(const std::shared_ptr<Client> &client)
+{
+    if (!client->named)
+        return;
+    LOG_INFO("Client disconnected: " << client->name);
+    directory.remove(*client);
+    while (!client->rooms.empty())
+        leave_room(client, client->rooms.back(), true);
+    presence_offline(client->id);
+    cluster_presence(client->id, client->name, false);
+}
+
+void resume_session(const std::shared_ptr<Client> &client)
+{
+    for (RoomId id : client->rooms)
+    {
+        if (Room *room = rooms.get(id))
+            room->members.add(client);
+    }
+    if (client->named)
+    {
+        directory.add(client);
+        presence_adopt(client->id, client->name);
+    }
+}
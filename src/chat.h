@@ -0,0 +1,178 @@
+// Chat state shared by every engine: connected clients, rooms, broadcast, user list
+#pragma once
+
+#include "admission.h"
+#include "dispatch.h"
+#include "journal.h"
+#include "outbound.h"
+#include "platform.h"
+#include "protocol.h"
+#include "ratelimit.h"
+#include "registry.h"
+#include "ring.h"
+#include "rooms.h"
+#include "timer_wheel.h"
+#include "websocket.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+class EventLoop;
+
+struct Client
+{
+    uint64_t id = allocate_client_id(); // stable connection id
+    socket_t sock;
+    AdmissionSlot admission; // its share of the connection limits, released on close
+    std::string name;              // written once by the owning thread, then `named` is set
+    std::atomic<bool> named{false}; // username frame received; other threads may read `name`
+    std::thread worker; // thread handling this client (moved-into after creation)
+    std::thread writer; // threads engine: drains `out` so broadcasters never block
+    OutboundQueue out;
+    FrameReader reader;
+    std::vector<RoomId> rooms; // joined rooms; touched only by the thread handling input
+    RoomId stream_room = INVALID_ROOM; // where the pieces of a large frame go (chat.cpp); same thread
+    std::string stream_tail;           // incomplete UTF-8 sequence held back for the next piece
+    size_t stream_bytes = 0;           // posted so far of a message a protocol 1 client fragments itself
+    size_t rooms_created = 0;          // rooms this connection created (room_limits); same thread
+    TokenBucket rate;          // frames read; owned by the thread handling input
+    std::atomic<uint8_t> compress{0}; // negotiated compression mode (compress.h), 0 = off
+    std::atomic<uint8_t> proto{0};    // negotiated protocol version, 0 = plain text
+    std::unique_ptr<WsSession> ws;    // set at accept on the WebSocket listener, null otherwise
+
+    // Dispatch state (dispatch.cpp)
+    bool saw_username = false;        // owning I/O thread: first frame already dispatched
+    std::atomic<bool> quitting{false}; // __quit__ seen; later frames are ignored
+    std::mutex inbox_mutex;
+    RingQueue<InboxItem> inbox; // frames waiting for a worker
+    size_t inbox_bytes = 0;      // text bytes in `inbox`
+    bool inbox_full = false;     // over inbox_limits; input stays stopped until the strand drains it
+    std::condition_variable inbox_drained; // threads engine: the reader waits on it while inbox_full
+    bool scheduled = false;      // strand is queued or running
+
+    // Reactor engine state; loop stays null for the threads engine
+    EventLoop *loop = nullptr;
+    bool want_write = false; // write interest registered with the poller
+    std::atomic<bool> flush_queued{false}; // already waiting in the loop's flush list
+    std::atomic<bool> closed{false};
+    TimerNode timer;            // next deadline check (reactor.cpp)
+    uint64_t accepted_ms = 0;   // monotonic times owned by the loop thread
+    uint64_t last_read_ms = 0;
+    uint64_t last_write_ms = 0; // last write progress, or when output started waiting
+    uint64_t last_ping_ms = 0;
+    bool read_paused = false;   // over its rate limit: not reading until resume_ms
+    uint64_t paused_ms = 0;
+    uint64_t resume_ms = 0;
+#if defined(CHAT_HAVE_IO_URING)
+    // io_uring mode (reactor.cpp): the kernel holds on to these until the
+    // operations complete, which may be after the client closed
+    uint32_t ring_slot = 0;        // index in the loop's slot table, tags its operations
+    unsigned ring_ops = 0;         // submitted operations not yet completed
+    bool recv_armed = false;       // multishot recv in flight
+    bool send_armed = false;       // sendmsg in flight; want_write is set meanwhile
+    std::vector<FramePtr> sending; // frames of the send in flight
+    std::vector<iovec> send_iov;
+    msghdr send_msg{};
+#endif
+};
+
+// Connections are carved from a slab and recycled, not malloc'd per accept
+std::shared_ptr<Client> make_client(socket_t sock);
+
+extern std::atomic<bool> running;
+extern std::atomic<bool> restart_pending; // SIGUSR2, see restart.h
+
+// Shutdown notification. request_shutdown() only clears `running` and writes
+// to a pre-created descriptor, so it is safe to call from a signal handler;
+// request_restart() sets restart_pending the same way. wait_for_shutdown()
+// returns on either.
+void init_shutdown_notifier();
+void request_shutdown();
+void request_restart();
+void wait_for_shutdown();
+
+// Safe from any thread: the username once published, "anonymous" before that
+inline std::string display_name(const Client &c)
+{
+    return c.named.load(std::memory_order_acquire) ? c.name : std::string("anonymous");
+}
+
+// Queue a frame for a single client; never blocks on the network. Returns
+// false when the client overflowed its queue and is being disconnected.
+bool deliver(const std::shared_ptr<Client> &client, const FramePtr &frame);
+bool deliver(const std::shared_ptr<Client> &client, std::string_view msg);
+// Several frames with one queue lock and one flush, written out together
+bool deliver(const std::shared_ptr<Client> &client, const std::vector<FramePtr> &frames);
+
+// Each broadcast is encoded at most once per wire format, and only in the
+// formats its recipients use: protocol 1 clients (see protocol.h) get the
+// binary header and body, legacy clients the display text "[from] text".
+
+// Every connection (named or not); used for server-wide notices
+void broadcast(const std::string &from, std::string_view msg);
+// Members of one room only; O(1) room lookup, fan-out proportional to its
+// size. The room and the next sequence number of the room are filled into
+// `header`; legacy text outside the lobby reads "[from @ room] text". Chat
+// messages (MsgType::Text) are also kept in the room's history.
+void broadcast_room(RoomId room, MsgHeader header, std::string_view body,
+                    const std::string &from, std::string_view text);
+
+// Puts a journaled message back into its room's history on startup and
+// carries the room's sequence numbers on from it
+void restore_message(const JournalRecord &rec);
+
+// Send the online user list (presence.h) to the given client: one text
+// line, or one Presence roster message for protocol 1. A client that just
+// logged in is not in it yet. Returns false if sending failed (caller should
+// treat as client disconnected)
+bool send_user_list_to_client(const std::shared_ptr<Client> &client);
+
+// Heartbeat: "__ping__", or a Ping message for protocol 1. The client
+// answers "__pong__" / Pong, though any traffic keeps it alive.
+bool send_ping(const std::shared_ptr<Client> &client);
+
+// Lobby members get the `text` frames (legacy) or `binary` (protocol 1)
+void send_to_lobby(const std::vector<FramePtr> &text, const FramePtr &binary);
+
+// Cluster mode (cluster.h): a message or room join/leave relayed from a peer
+// node, fanned out to this node's members of the room by name
+void remote_post(const std::string &room, uint64_t sender, const std::string &from, std::string_view text,
+                 uint16_t flags = 0);
+void remote_room_event(const std::string &room, uint64_t sender, const std::string &name, bool joined);
+// A direct message relayed from a peer node: to connection `to` if non-zero,
+// else to every local connection named `to_name`
+void remote_direct(uint64_t to, const std::string &to_name, uint64_t sender, const std::string &from,
+                   std::string_view text);
+
+// Session flow shared by the engines. All three run on the thread that owns
+// the client's input, so per-client state such as `rooms` needs no lock.
+//
+// client_joined: the username frame arrived; publishes the name, joins the
+//   lobby, sends the user list and the lobby history and reports the client
+//   online. False if the client should be dropped.
+// client_message: any later frame, or one piece of it when part is not
+//   FramePart::Whole; handles __quit__ and the room commands
+//   (__join__ <room>, __leave__ <room>, __post__ <room> <text>, __caps__,
+//   __history__ <room> [since], __dm__ <name> <text>, __ping__, __pong__),
+//   everything else is posted to the lobby. After protocol 1 is negotiated
+//   it switches on the message type instead. Only posts may arrive in
+//   pieces: each is relayed as it comes, as a Text message flagged MSG_FRAGMENT
+//   but for the last. False when the client asked to quit.
+// client_left: leaves every room and reports the client offline.
+bool client_joined(const std::shared_ptr<Client> &client, const std::string &name);
+bool client_message(const std::shared_ptr<Client> &client, std::string_view msg,
+                    FramePart part = FramePart::Whole);
+void client_left(const std::shared_ptr<Client> &client);
+
+// Restart handoff (restart.h): a session carried over from the previous
+// process, with its name, protocol and `rooms` already filled in. Puts it
+// back into its rooms without announcing anything, since everyone else
+// already knows this user. Call on the thread owning the client's input
+// once the client can receive.
+void resume_session(const std::shared_ptr<Client> &client);
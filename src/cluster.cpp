@@ -0,0 +1,561 @@
+#include "cluster.h"
+#include "chat.h"
+#include "directory.h"
+#include "engine.h"
+#include "log.h"
+#include "metrics.h"
+#include "presence.h"
+#include "protocol.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+
+// Relayed frames waiting for one peer; beyond this they are dropped
+static const size_t MAX_PENDING_BYTES = 64 * 1024 * 1024;
+static const int CONNECT_TIMEOUT_MS = 1000;
+// A relay carries at most one client frame plus names and ids
+static const size_t MAX_RELAY_OVERHEAD = 64 * 1024;
+static const auto RECONNECT_DELAY = std::chrono::seconds(1);
+static const auto LINK_CHECK_INTERVAL = std::chrono::milliseconds(200);
+
+// Payload of a frame between nodes: one kind byte, then its fields
+// (integers big-endian, strings as a 4-byte length and the bytes)
+enum class Relay : uint8_t
+{
+    Hello = 1,     // u16 node; first frame on every link
+    Post = 2,      // room, u64 sender, from, text[, u16 flags]
+    RoomEvent = 3, // u8 joined, room, u64 sender, name
+    Presence = 4,  // u8 online, u64 id, name
+    Direct = 5,    // u64 to, to_name, u64 sender, from, text
+};
+
+struct Peer
+{
+    std::string host;
+    std::string port;
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::string pending; // wire frames for the next write
+    socket_t sock = INVALID_SOCKET;
+    std::thread thread;
+};
+
+// Users hosted by one remote node, to take offline when its link drops
+struct RemoteNode
+{
+    uint64_t link = 0; // inbound link that introduced the node last
+    std::unordered_set<uint64_t> users;
+};
+
+static uint16_t g_node = 0;
+static std::atomic<bool> g_stop{false};
+static std::atomic<bool> g_handed_over{false}; // inbound links belong to a successor
+static std::vector<std::unique_ptr<Peer>> g_peers;
+static socket_t g_listen = INVALID_SOCKET;
+static std::thread g_acceptor;
+
+static std::mutex g_links_mutex;
+static std::unordered_map<uint64_t, socket_t> g_inbound; // link -> socket
+static std::unordered_map<uint64_t, std::thread> g_readers;
+static std::vector<uint64_t> g_finished; // links whose reader has returned
+static uint64_t g_next_link = 1;
+
+// Source addresses the peers resolved to (network order); acceptor thread only
+static std::unordered_set<uint32_t> g_peer_addrs;
+static std::chrono::steady_clock::time_point g_resolved_at;
+
+static std::mutex g_remote_mutex;
+static std::unordered_map<uint16_t, RemoteNode> g_remote;
+
+static std::string presence_payload(uint64_t id, const std::string &name, bool online)
+{
+    std::string p;
+    p.push_back(static_cast<char>(Relay::Presence));
+    p.push_back(online ? 1 : 0);
+    put_int(p, id, 8);
+    put_str(p, name);
+    return p;
+}
+
+// Queues one payload for every peer
+static void publish(const std::string &payload)
+{
+    for (auto &peer : g_peers)
+    {
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lk(peer->mutex);
+            if (peer->pending.size() + payload.size() > MAX_PENDING_BYTES)
+            {
+                metric_add(Counter::ClusterDropped);
+                continue;
+            }
+            wake = peer->pending.empty();
+            append_frame(peer->pending, payload);
+        }
+        metric_add(Counter::ClusterOut);
+        if (wake)
+            peer->cv.notify_one();
+    }
+}
+
+void cluster_post(const std::string &room, uint64_t sender, const std::string &from, std::string_view text,
+                  uint16_t flags)
+{
+    if (g_peers.empty())
+        return;
+    std::string p;
+    p.push_back(static_cast<char>(Relay::Post));
+    put_str(p, room);
+    put_int(p, sender, 8);
+    put_str(p, from);
+    put_str(p, text);
+    if (flags)
+        put_int(p, flags, 2);
+    publish(p);
+}
+
+void cluster_room_event(const std::string &room, uint64_t sender, const std::string &name, bool joined)
+{
+    if (g_peers.empty())
+        return;
+    std::string p;
+    p.push_back(static_cast<char>(Relay::RoomEvent));
+    p.push_back(joined ? 1 : 0);
+    put_str(p, room);
+    put_int(p, sender, 8);
+    put_str(p, name);
+    publish(p);
+}
+
+void cluster_presence(uint64_t id, const std::string &name, bool online)
+{
+    if (g_peers.empty())
+        return;
+    publish(presence_payload(id, name, online));
+}
+
+void cluster_direct(uint64_t to, const std::string &to_name, uint64_t sender, const std::string &from,
+                    std::string_view text)
+{
+    if (g_peers.empty())
+        return;
+    std::string p;
+    p.push_back(static_cast<char>(Relay::Direct));
+    put_int(p, to, 8);
+    put_str(p, to_name);
+    put_int(p, sender, 8);
+    put_str(p, from);
+    put_str(p, text);
+    publish(p);
+}
+
+// Non-blocking connect bounded by CONNECT_TIMEOUT_MS; the socket stays
+// non-blocking so a peer that stops reading fails send_all instead of
+// wedging the link thread
+static socket_t connect_peer(const Peer &peer)
+{
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *res = nullptr;
+    if (getaddrinfo(peer.host.c_str(), peer.port.c_str(), &hints, &res) != 0 || !res)
+        return INVALID_SOCKET;
+    socket_t s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    bool ok = s != INVALID_SOCKET && set_nonblocking(s);
+    if (ok && connect(s, res->ai_addr, static_cast<socklen_t>(res->ai_addrlen)) == SOCKET_ERROR)
+    {
+        int err = last_socket_error();
+#if defined(_WIN32)
+        bool in_progress = err == WSAEWOULDBLOCK;
+#else
+        bool in_progress = err == EINPROGRESS;
+#endif
+        int so_error = 0;
+        socklen_t len = sizeof(so_error);
+        ok = in_progress && wait_for_socket(s, true, CONNECT_TIMEOUT_MS) &&
+             getsockopt(s, SOL_SOCKET, SO_ERROR, reinterpret_cast<char *>(&so_error), &len) == 0 &&
+             so_error == 0;
+    }
+    freeaddrinfo(res);
+    if (!ok)
+    {
+        if (s != INVALID_SOCKET)
+            close_socket(s);
+        return INVALID_SOCKET;
+    }
+    set_nosigpipe(s);
+    set_nodelay(s);
+    return s;
+}
+
+// Hello, whatever queued up while the link was down, then the users this
+// node hosts right now (later changes are queued behind them)
+static std::string link_preamble(Peer &peer)
+{
+    std::string out, hello;
+    hello.push_back(static_cast<char>(Relay::Hello));
+    put_int(hello, g_node, 2);
+    append_frame(out, hello);
+    out += peer.pending;
+    peer.pending.clear();
+    ClientSet::SnapshotPtr snap = registry.snapshot();
+    for (const auto &c : *snap)
+    {
+        if (c->named.load(std::memory_order_acquire))
+            append_frame(out, presence_payload(c->id, c->name, true));
+    }
+    return out;
+}
+
+// One outbound link: (re)connect, then write the pending buffer in batches
+static void link_loop(Peer *peer)
+{
+    std::string batch;
+    while (!g_stop)
+    {
+        socket_t s = connect_peer(*peer);
+        std::unique_lock<std::mutex> lk(peer->mutex);
+        if (s == INVALID_SOCKET)
+        {
+            peer->cv.wait_for(lk, RECONNECT_DELAY, [] { return g_stop.load(); });
+            continue;
+        }
+        LOG_INFO("cluster: connected to peer " << peer->host << ":" << peer->port);
+        peer->sock = s;
+        batch = link_preamble(*peer);
+        for (;;)
+        {
+            lk.unlock();
+            bool sent = send_all(s, batch.data(), batch.size());
+            batch.clear();
+            lk.lock();
+            if (!sent || g_stop)
+                break;
+            // the peer never writes on this link, so readable means it went
+            // away (a restart hands its links over); reconnect before the
+            // next batch is written into a dead socket
+            bool gone = false;
+            while (!peer->cv.wait_for(lk, LINK_CHECK_INTERVAL, [&] { return g_stop || !peer->pending.empty(); }))
+            {
+                if ((gone = wait_for_socket(s, false, 0)))
+                    break;
+            }
+            if (g_stop || gone)
+                break;
+            batch.swap(peer->pending);
+        }
+        peer->sock = INVALID_SOCKET;
+        lk.unlock();
+        close_socket(s);
+        if (!g_stop)
+            LOG_WARN("cluster: lost link to peer " << peer->host << ":" << peer->port << ", reconnecting");
+    }
+}
+
+static void apply(Fields &f, Relay kind, uint16_t node)
+{
+    switch (kind)
+    {
+    case Relay::Post:
+    {
+        std::string room = f.get_str();
+        uint64_t sender = f.get_int(8);
+        std::string from = f.get_str();
+        std::string text = f.get_str();
+        // absent from nodes that never fragment
+        uint16_t flags = f.data.empty() ? 0 : static_cast<uint16_t>(f.get_int(2));
+        if (f.ok)
+            remote_post(room, sender, from, text, flags);
+        break;
+    }
+    case Relay::RoomEvent:
+    {
+        bool joined = f.get_int(1) != 0;
+        std::string room = f.get_str();
+        uint64_t sender = f.get_int(8);
+        std::string name = f.get_str();
+        if (f.ok)
+            remote_room_event(room, sender, name, joined);
+        break;
+    }
+    case Relay::Presence:
+    {
+        bool online = f.get_int(1) != 0;
+        uint64_t id = f.get_int(8);
+        std::string name = f.get_str();
+        if (!f.ok)
+            break;
+        {
+            std::lock_guard<std::mutex> lk(g_remote_mutex);
+            auto &users = g_remote[node].users;
+            if (online)
+                users.insert(id);
+            else
+                users.erase(id);
+        }
+        if (online)
+        {
+            directory.add_remote(id, name);
+            presence_online(id, name);
+        }
+        else
+        {
+            directory.remove_remote(id);
+            presence_offline(id);
+        }
+        break;
+    }
+    case Relay::Direct:
+    {
+        uint64_t to = f.get_int(8);
+        std::string to_name = f.get_str();
+        uint64_t sender = f.get_int(8);
+        std::string from = f.get_str();
+        std::string text = f.get_str();
+        if (f.ok)
+            remote_direct(to, to_name, sender, from, text);
+        break;
+    }
+    default:
+        f.ok = false;
+        break;
+    }
+}
+
+// One inbound link from a peer, until it drops or the cluster stops
+static void read_loop(socket_t s, uint64_t link)
+{
+    std::string msg;
+    uint16_t node = 0;
+    while (!g_stop && !g_handed_over && recv_message(s, msg, frame_limits.max_frame + MAX_RELAY_OVERHEAD))
+    {
+        metric_add(Counter::ClusterIn);
+        Fields f{msg};
+        Relay kind = static_cast<Relay>(f.get_int(1));
+        if (node == 0)
+        {
+            node = kind == Relay::Hello ? static_cast<uint16_t>(f.get_int(2)) : 0;
+            if (node == 0 || node == g_node || !f.ok)
+            {
+                LOG_ERROR("cluster: rejecting link " << link << " (node " << node << ")");
+                break;
+            }
+            LOG_INFO("cluster: node " << node << " joined");
+            std::lock_guard<std::mutex> lk(g_remote_mutex);
+            g_remote[node].link = link;
+            continue;
+        }
+        apply(f, kind, node);
+        if (!f.ok)
+            LOG_WARN("cluster: malformed relay from node " << node);
+    }
+
+    std::vector<uint64_t> gone;
+    // after a hand-over the node reconnects to the successor; its users stay
+    if (node != 0 && !g_handed_over)
+    {
+        std::lock_guard<std::mutex> lk(g_remote_mutex);
+        RemoteNode &remote = g_remote[node];
+        // a reconnect may already have taken over; its roster stands
+        if (remote.link == link)
+        {
+            gone.assign(remote.users.begin(), remote.users.end());
+            remote.users.clear();
+        }
+    }
+    for (uint64_t id : gone)
+    {
+        directory.remove_remote(id);
+        presence_offline(id);
+    }
+    if (node != 0 && !g_stop && !g_handed_over)
+        LOG_WARN("cluster: node " << node << " left (" << gone.size() << " users)");
+
+    std::lock_guard<std::mutex> lk(g_links_mutex);
+    g_inbound.erase(link);
+    g_finished.push_back(link);
+    close_socket(s);
+}
+
+// Joins the readers of links that have dropped
+static void reap_readers()
+{
+    std::vector<std::thread> done;
+    {
+        std::lock_guard<std::mutex> lk(g_links_mutex);
+        for (uint64_t link : g_finished)
+        {
+            auto it = g_readers.find(link);
+            done.push_back(std::move(it->second));
+            g_readers.erase(it);
+        }
+        g_finished.clear();
+    }
+    for (auto &t : done)
+        t.join();
+}
+
+static void resolve_peers()
+{
+    g_peer_addrs.clear();
+    g_resolved_at = std::chrono::steady_clock::now();
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    for (const auto &peer : g_peers)
+    {
+        addrinfo *res = nullptr;
+        if (getaddrinfo(peer->host.c_str(), peer->port.c_str(), &hints, &res) != 0)
+            continue;
+        for (addrinfo *ai = res; ai; ai = ai->ai_next)
+            g_peer_addrs.insert(reinterpret_cast<const sockaddr_in *>(ai->ai_addr)->sin_addr.s_addr);
+        freeaddrinfo(res);
+    }
+}
+
+// A peer whose name did not resolve at startup, or resolves elsewhere now,
+// is looked up again, at most once per RECONNECT_DELAY
+static bool is_peer(const sockaddr_in &from)
+{
+    if (g_peer_addrs.count(from.sin_addr.s_addr))
+        return true;
+    if (std::chrono::steady_clock::now() - g_resolved_at < RECONNECT_DELAY)
+        return false;
+    resolve_peers();
+    return g_peer_addrs.count(from.sin_addr.s_addr) != 0;
+}
+
+static void accept_loop()
+{
+    while (!g_stop && !g_handed_over)
+    {
+        reap_readers();
+        if (!wait_for_socket(g_listen, false, 200))
+            continue;
+        sockaddr_in from{};
+        socklen_t len = sizeof(from);
+        socket_t s = accept(g_listen, reinterpret_cast<sockaddr *>(&from), &len);
+        if (s == INVALID_SOCKET)
+            continue;
+        if (from.sin_family != AF_INET || !is_peer(from))
+        {
+            char ip[INET_ADDRSTRLEN] = "?";
+            inet_ntop(AF_INET, &from.sin_addr, ip, sizeof(ip));
+            LOG_WARN("cluster: refusing a connection from " << ip << ", not a configured peer");
+            close_socket(s);
+            continue;
+        }
+        set_nosigpipe(s);
+        std::lock_guard<std::mutex> lk(g_links_mutex);
+        uint64_t link = g_next_link++;
+        g_inbound[link] = s;
+        g_readers.emplace(link, std::thread(read_loop, s, link));
+    }
+}
+
+static bool parse_peer(const std::string &spec, Peer &peer)
+{
+    size_t colon = spec.rfind(':');
+    if (colon == std::string::npos || colon == 0 || colon + 1 == spec.size())
+        return false;
+    peer.host = spec.substr(0, colon);
+    peer.port = spec.substr(colon + 1);
+    return true;
+}
+
+bool start_cluster(const ClusterConfig &cfg)
+{
+    if (cfg.node == 0)
+        return true;
+    g_node = cfg.node;
+    g_stop = false;
+    g_handed_over = false;
+    for (const std::string &spec : cfg.peers)
+    {
+        auto peer = std::make_unique<Peer>();
+        if (!parse_peer(spec, *peer))
+        {
+            LOG_ERROR("cluster: bad peer address '" << spec << "' (expected host:port)");
+            g_peers.clear();
+            return false;
+        }
+        g_peers.push_back(std::move(peer));
+    }
+    resolve_peers();
+    g_listen = open_listener(cfg.port, false, cfg.address);
+    if (g_listen == INVALID_SOCKET)
+    {
+        LOG_ERROR("cluster: cannot listen on " << cfg.address << ":" << cfg.port);
+        g_peers.clear();
+        return false;
+    }
+
+    ScopedSignalBlock block; // keep SIGINT on the main thread
+    g_acceptor = std::thread(accept_loop);
+    for (auto &peer : g_peers)
+        peer->thread = std::thread(link_loop, peer.get());
+    LOG_INFO("cluster: node " << g_node << " listening for peers on " << cfg.address << ":" << cfg.port << ", "
+                              << g_peers.size() << " peer(s)");
+    return true;
+}
+
+void cluster_hand_over()
+{
+    if (g_node == 0)
+        return;
+    g_handed_over = true;
+    // the acceptor notices within one wait; nothing may take a link after it
+    if (g_acceptor.joinable())
+        g_acceptor.join();
+    std::lock_guard<std::mutex> lk(g_links_mutex);
+    for (auto &kv : g_inbound)
+        shutdown_socket(kv.second);
+    LOG_INFO("cluster: handed peer links over to the new process");
+}
+
+void stop_cluster()
+{
+    if (g_node == 0)
+        return;
+    g_stop = true;
+    for (auto &peer : g_peers)
+    {
+        {
+            std::lock_guard<std::mutex> lk(peer->mutex);
+            if (peer->sock != INVALID_SOCKET)
+                shutdown_socket(peer->sock);
+        }
+        peer->cv.notify_all();
+    }
+    for (auto &peer : g_peers)
+    {
+        if (peer->thread.joinable())
+            peer->thread.join();
+    }
+    if (g_acceptor.joinable())
+        g_acceptor.join();
+    close_socket(g_listen);
+    g_listen = INVALID_SOCKET;
+
+    std::vector<std::thread> readers;
+    {
+        std::lock_guard<std::mutex> lk(g_links_mutex);
+        for (auto &kv : g_inbound)
+            shutdown_socket(kv.second);
+        for (auto &kv : g_readers)
+            readers.push_back(std::move(kv.second));
+        g_readers.clear();
+        g_finished.clear();
+    }
+    for (auto &t : readers)
+        t.join();
+    g_peers.clear();
+    g_peer_addrs.clear();
+    g_node = 0;
+}
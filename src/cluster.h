@@ -0,0 +1,45 @@
+// Cluster mode: several server instances sharing rooms and presence
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+struct ClusterConfig
+{
+    uint16_t node = 0;              // this node's id (1-65535); 0 = standalone
+    uint16_t port = 0;              // where peers connect to us
+    std::string address = "127.0.0.1"; // address that port binds; peers can speak for any user
+    std::vector<std::string> peers; // host:port of every other node
+};
+
+// The nodes form a full mesh. Each node keeps one outbound link per peer and
+// relays every local chat message, room join/leave and presence change to
+// each peer exactly once; the peer fans it out to its own members of the
+// room (rooms are matched by name) and relays nothing further. Relays are
+// appended to a per-peer buffer and written by the link's thread, so any
+// number of relays queued meanwhile leave in one write, and a slow or
+// unreachable peer never blocks the broadcast path.
+//
+// When a link comes up the node first re-sends the users it hosts; when the
+// link from a peer drops, the peer's users are reported offline.
+//
+// A peer may post and send direct messages in any user's name, so the
+// cluster port only accepts connections whose source address is one the
+// configured peers resolve to.
+bool start_cluster(const ClusterConfig &cfg);
+void stop_cluster();
+// Restart: stops accepting and drops the inbound links, so peers reconnect
+// to the successor and their relays reach the clients handed over to it.
+// Outbound links keep going until stop_cluster().
+void cluster_hand_over();
+
+// Thread-safe; no-ops when clustering is off. `flags` of a post: MSG_FRAGMENT or 0
+void cluster_post(const std::string &room, uint64_t sender, const std::string &from, std::string_view text,
+                  uint16_t flags = 0);
+void cluster_room_event(const std::string &room, uint64_t sender, const std::string &name, bool joined);
+void cluster_presence(uint64_t id, const std::string &name, bool online);
+// A direct message for a user another node hosts; `to` as in remote_direct (chat.h)
+void cluster_direct(uint64_t to, const std::string &to_name, uint64_t sender, const std::string &from,
+                    std::string_view text);
@@ -0,0 +1,354 @@
+#include "compress.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <sstream>
+
+#if defined(CHAT_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+#if defined(CHAT_HAVE_ZSTD)
+#include <zstd.h>
+#endif
+#if defined(CHAT_HAVE_LZ4)
+#include <lz4.h>
+#endif
+
+CompressConfig compress_config;
+
+// Fragments of the messages the server itself generates, most frequent last
+// (zlib gives the end of a preset dictionary the shortest distances)
+static const char BUILTIN_DICTIONARY[] =
+    "服务器正在关闭（无其他在线用户）你不在房间 ' 中无效的房间名: 已离开房间 '"
+    "你已在房间 '[Server @ ' 已离开房间 '' 已加入房间 '在线用户: "
+    "[Server] 用户 '' 已离开聊天[Server] 用户 '' 已加入聊天";
+
+static std::string g_dictionary;
+static std::string g_dictionary_id;
+static const size_t HEADER = 2 * sizeof(uint32_t); // length prefix + original length
+
+static std::string fnv1a_hex(const std::string &data)
+{
+    uint32_t h = 2166136261u;
+    for (unsigned char c : data)
+    {
+        h ^= c;
+        h *= 16777619u;
+    }
+    char buf[9];
+    std::snprintf(buf, sizeof(buf), "%08x", h);
+    return buf;
+}
+
+#if defined(CHAT_HAVE_ZSTD)
+static ZSTD_CDict *g_zstd_dict = nullptr;
+#endif
+
+bool init_compression()
+{
+    if (compress_config.dict_path.empty())
+        g_dictionary.assign(BUILTIN_DICTIONARY, sizeof(BUILTIN_DICTIONARY) - 1);
+    else
+    {
+        std::ifstream in(compress_config.dict_path, std::ios::binary);
+        if (!in)
+        {
+            LOG_ERROR("compression: cannot read dictionary " << compress_config.dict_path);
+            return false;
+        }
+        g_dictionary.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    g_dictionary_id = fnv1a_hex(g_dictionary);
+#if defined(CHAT_HAVE_ZSTD)
+    int level = compress_config.level ? compress_config.level : 3;
+    g_zstd_dict = ZSTD_createCDict(g_dictionary.data(), g_dictionary.size(), level);
+#endif
+#if defined(CHAT_HAVE_ZLIB)
+    if (compress_config.level > 9)
+        LOG_WARN("compression: level " << compress_config.level
+                                       << " is above zlib's 9; deflate and WebSocket permessage-deflate use 9");
+#endif
+    return true;
+}
+
+int max_compress_level()
+{
+#if defined(CHAT_HAVE_ZSTD)
+    return 22;
+#else
+    return 9;
+#endif
+}
+
+int deflate_level()
+{
+#if defined(CHAT_HAVE_ZLIB)
+    if (compress_config.level == 0)
+        return Z_DEFAULT_COMPRESSION;
+#endif
+    return std::min(compress_config.level, 9);
+}
+
+bool codec_available(Codec codec)
+{
+    switch (codec)
+    {
+#if defined(CHAT_HAVE_ZLIB)
+    case Codec::Deflate:
+        return true;
+#endif
+#if defined(CHAT_HAVE_ZSTD)
+    case Codec::Zstd:
+        return true;
+#endif
+#if defined(CHAT_HAVE_LZ4)
+    case Codec::Lz4:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+const char *codec_name(Codec codec)
+{
+    switch (codec)
+    {
+    case Codec::Deflate:
+        return "deflate";
+    case Codec::Zstd:
+        return "zstd";
+    case Codec::Lz4:
+        return "lz4";
+    case Codec::None:
+        break;
+    }
+    return "none";
+}
+
+Codec parse_codec(const std::string &name)
+{
+    if (name == "deflate")
+        return Codec::Deflate;
+    if (name == "zstd")
+        return Codec::Zstd;
+    if (name == "lz4")
+        return Codec::Lz4;
+    return Codec::None;
+}
+
+const std::string &dictionary_id()
+{
+    return g_dictionary_id;
+}
+
+uint8_t compress_mode(Codec codec, bool use_dict)
+{
+    if (codec == Codec::None)
+        return 0;
+    return static_cast<uint8_t>(1 + (static_cast<int>(codec) - 1) * 2 + (use_dict ? 1 : 0));
+}
+
+static_assert(1 + (static_cast<int>(Codec::Lz4) - 1) * 2 + 1 < static_cast<int>(FRAME_WS_VARIANTS),
+              "every compression mode needs a Frame::variants slot");
+
+// ---- codecs: compress src into dst (capacity cap); returns bytes or 0 ----
+
+#if defined(CHAT_HAVE_ZLIB)
+struct DeflateState
+{
+    z_stream zs{};
+    bool ready = false;
+
+    ~DeflateState()
+    {
+        if (ready)
+            deflateEnd(&zs);
+    }
+};
+
+static size_t deflate_bound(size_t n)
+{
+    return compressBound(static_cast<uLong>(n)) + 16;
+}
+
+static size_t deflate_into(const char *src, size_t n, char *dst, size_t cap, bool use_dict)
+{
+    static thread_local DeflateState st;
+    if (!st.ready)
+    {
+        if (deflateInit2(&st.zs, deflate_level(), Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return 0;
+        st.ready = true;
+    }
+    else
+        deflateReset(&st.zs);
+    if (use_dict)
+        deflateSetDictionary(&st.zs, reinterpret_cast<const Bytef *>(g_dictionary.data()),
+                             static_cast<uInt>(g_dictionary.size()));
+    st.zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src));
+    st.zs.avail_in = static_cast<uInt>(n);
+    st.zs.next_out = reinterpret_cast<Bytef *>(dst);
+    st.zs.avail_out = static_cast<uInt>(cap);
+    if (deflate(&st.zs, Z_FINISH) != Z_STREAM_END)
+        return 0;
+    return cap - st.zs.avail_out;
+}
+#endif
+
+#if defined(CHAT_HAVE_ZSTD)
+struct ZstdState
+{
+    ZSTD_CCtx *cctx = ZSTD_createCCtx();
+
+    ~ZstdState() { ZSTD_freeCCtx(cctx); }
+};
+
+static size_t zstd_into(const char *src, size_t n, char *dst, size_t cap, bool use_dict)
+{
+    static thread_local ZstdState st;
+    size_t r = use_dict && g_zstd_dict
+                   ? ZSTD_compress_usingCDict(st.cctx, dst, cap, src, n, g_zstd_dict)
+                   : ZSTD_compressCCtx(st.cctx, dst, cap, src, n, compress_config.level ? compress_config.level : 3);
+    return ZSTD_isError(r) ? 0 : r;
+}
+#endif
+
+#if defined(CHAT_HAVE_LZ4)
+struct Lz4State
+{
+    LZ4_stream_t *stream = LZ4_createStream();
+
+    ~Lz4State() { LZ4_freeStream(stream); }
+};
+
+static size_t lz4_into(const char *src, size_t n, char *dst, size_t cap, bool use_dict)
+{
+    int r;
+    if (use_dict)
+    {
+        static thread_local Lz4State st;
+        LZ4_loadDict(st.stream, g_dictionary.data(), static_cast<int>(g_dictionary.size()));
+        r = LZ4_compress_fast_continue(st.stream, src, dst, static_cast<int>(n), static_cast<int>(cap), 1);
+    }
+    else
+        r = LZ4_compress_default(src, dst, static_cast<int>(n), static_cast<int>(cap));
+    return r > 0 ? static_cast<size_t>(r) : 0;
+}
+#endif
+
+static size_t compress_bound(Codec codec, size_t n)
+{
+    switch (codec)
+    {
+#if defined(CHAT_HAVE_ZLIB)
+    case Codec::Deflate:
+        return deflate_bound(n);
+#endif
+#if defined(CHAT_HAVE_ZSTD)
+    case Codec::Zstd:
+        return ZSTD_compressBound(n);
+#endif
+#if defined(CHAT_HAVE_LZ4)
+    case Codec::Lz4:
+        return static_cast<size_t>(LZ4_compressBound(static_cast<int>(n)));
+#endif
+    default:
+        return 0;
+    }
+}
+
+static size_t compress_into(Codec codec, const char *src, size_t n, char *dst, size_t cap, bool use_dict)
+{
+    switch (codec)
+    {
+#if defined(CHAT_HAVE_ZLIB)
+    case Codec::Deflate:
+        return deflate_into(src, n, dst, cap, use_dict);
+#endif
+#if defined(CHAT_HAVE_ZSTD)
+    case Codec::Zstd:
+        return zstd_into(src, n, dst, cap, use_dict);
+#endif
+#if defined(CHAT_HAVE_LZ4)
+    case Codec::Lz4:
+        return lz4_into(src, n, dst, cap, use_dict);
+#endif
+    default:
+        (void)src, (void)n, (void)dst, (void)cap, (void)use_dict;
+        return 0;
+    }
+}
+
+// The compressed re-encoding of `frame`, or `frame` itself if it does not shrink
+static Frame *build_variant(const Frame &frame, size_t mode)
+{
+    Codec codec = static_cast<Codec>((mode - 1) / 2 + 1);
+    bool use_dict = (mode - 1) % 2 != 0;
+    const char *payload = frame.data() + sizeof(uint32_t);
+    size_t n = frame.size() - sizeof(uint32_t);
+
+    Frame *v = new_variant();
+    size_t cap = compress_bound(codec, n);
+    v->wire.resize(HEADER + cap);
+    size_t out = cap ? compress_into(codec, payload, n, v->wire.data() + HEADER, cap, use_dict) : 0;
+    if (out == 0 || HEADER + out >= frame.size())
+    {
+        free_variant(v);
+        return const_cast<Frame *>(&frame);
+    }
+    v->wire.resize(HEADER + out);
+    uint32_t be = htonl(static_cast<uint32_t>(sizeof(uint32_t) + out) | FRAME_COMPRESSED);
+    uint32_t orig = htonl(static_cast<uint32_t>(n));
+    std::memcpy(v->wire.data(), &be, sizeof(be));
+    std::memcpy(v->wire.data() + sizeof(be), &orig, sizeof(orig));
+    metric_add(Counter::CompressedFrames);
+    metric_add(Counter::CompressIn, frame.size());
+    metric_add(Counter::CompressOut, v->wire.size());
+    return v;
+}
+
+FramePtr frame_for_mode(const FramePtr &frame, uint8_t mode)
+{
+    if (mode == 0 || mode >= FRAME_WS_VARIANTS || frame->size() - sizeof(uint32_t) < compress_config.min_size)
+        return frame;
+    return shared_variant(frame, mode, build_variant);
+}
+
+std::string negotiate_caps(const std::string &args, uint8_t &mode)
+{
+    Codec chosen = Codec::None;
+    bool use_dict = false;
+    std::istringstream in(args);
+    std::string token;
+    while (in >> token)
+    {
+        if (token.compare(0, 9, "compress=") == 0)
+        {
+            // client lists codecs in order of preference
+            std::istringstream list(token.substr(9));
+            std::string name;
+            while (chosen == Codec::None && std::getline(list, name, ','))
+            {
+                Codec c = parse_codec(name);
+                if (c != Codec::None && codec_available(c))
+                    chosen = c;
+            }
+        }
+        else if (token.compare(0, 5, "dict=") == 0)
+            use_dict = token.substr(5) == g_dictionary_id;
+    }
+    if (!compress_config.enabled)
+        chosen = Codec::None;
+    use_dict = use_dict && chosen != Codec::None;
+    mode = compress_mode(chosen, use_dict);
+    return std::string("compress=") + codec_name(chosen) +
+           " dict=" + (use_dict ? g_dictionary_id : std::string("none")) +
+           " min=" + std::to_string(compress_config.min_size);
+}
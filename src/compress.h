@@ -0,0 +1,61 @@
+// Negotiated per-frame compression for server -> client traffic
+#pragma once
+
+#include "protocol.h"
+
+#include <cstdint>
+#include <string>
+
+// Wire format of a compressed frame:
+//   4 bytes  big-endian (payload length | FRAME_COMPRESSED)
+//   4 bytes  big-endian uncompressed length
+//   N bytes  compressed payload (raw deflate / zstd frame / lz4 block)
+// A client opts in with "__caps__ compress=<codec>[,<codec>...] [dict=<id>]"
+// and the server's answer carries "compress=<codec|none> dict=<id|none> min=<bytes>";
+// only frames sent after that answer may be compressed.
+enum class Codec : uint8_t
+{
+    None,
+    Deflate,
+    Zstd,
+    Lz4,
+};
+
+struct CompressConfig
+{
+    bool enabled = true;
+    size_t min_size = 128;  // smaller payloads are always sent as they are
+    int level = 0;          // 0 = codec default
+    std::string dict_path;  // trained dictionary; empty = built-in one
+};
+
+extern CompressConfig compress_config; // set once at startup
+
+// Loads the dictionary; false if the dictionary file cannot be read
+bool init_compression();
+
+// Highest --compress-level any codec built in accepts: zstd goes to 22,
+// zlib only to 9
+int max_compress_level();
+// The level zlib uses (deflate, WebSocket permessage-deflate): its default
+// for 0, and 9 for a level only zstd has
+int deflate_level();
+
+bool codec_available(Codec codec);
+const char *codec_name(Codec codec);
+Codec parse_codec(const std::string &name);
+
+// Id announced for the dictionary in use ("%08x" of its FNV-1a hash)
+const std::string &dictionary_id();
+
+// A connection's compression choice, as a Frame::variants slot (0 = none)
+uint8_t compress_mode(Codec codec, bool use_dict);
+
+// The frame to queue for a client in `mode`: the shared compressed variant
+// of `frame` (built once, by whichever recipient needs it first) or `frame`
+// itself when the mode is 0, the payload is small or compression gains nothing
+FramePtr frame_for_mode(const FramePtr &frame, uint8_t mode);
+
+// Compression part of the reply to a "__caps__ ..." request (arguments after
+// the command); sets `mode`
+std::string negotiate_caps(const std::string &args, uint8_t &mode);
@@ -0,0 +1,280 @@
+#include "config.h"
+#include "platform.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+static void print_usage(const char *prog)
+{
+    std::cerr << "usage: " << prog << " [port] [shards] [options]\n"
+              << "  port                      TCP port (default " << DEFAULT_PORT << ")\n"
+              << "  shards                    reactor event loops, one listener each (default: CPU count)\n"
+              << "  --ws-port=N               also accept WebSocket clients on port N (reactor engines, default off)\n"
+              << "  --engine=NAME             I/O model: reactor, uring or threads (default reactor)\n"
+              << "  --cpu-affinity=SPEC       pin event loops: auto, nic:IFACE or a CPU list like 0-3,8 (default off)\n"
+              << "  --incoming-cpu=on|off     steer each connection to the shard pinned to the CPU that received it (default off)\n"
+              << "  --busy-poll=US            busy-poll client sockets for up to US microseconds (SO_BUSY_POLL, default off)\n"
+              << "  --max-connections=N       refuse connections beyond N open ones (default unlimited)\n"
+              << "  --max-per-ip=N            refuse connections beyond N open ones per client address (default unlimited)\n"
+              << "  --defer-accept=S          accept connections only once they send data, or after S seconds (default off)\n"
+              << "  --queue-frames=N          max frames waiting per client (default 1024)\n"
+              << "  --queue-bytes=N           max bytes waiting per client (default 4194304)\n"
+              << "  --max-frame=N             largest frame a client may send; larger ones close it (default 16777216)\n"
+              << "  --fragment-size=N         frames over N bytes are relayed in pieces of N as they arrive (default 65536)\n"
+              << "  --overflow=POLICY         drop-oldest|drop-new|disconnect when a queue is full\n"
+              << "  --flush-iov=N             frames coalesced into one gathered write (default 64)\n"
+              << "  --flush-bytes=N           bytes coalesced into one gathered write (default 262144)\n"
+              << "  --workers=N               message-processing threads (default 0: inline on I/O threads)\n"
+              << "  --worker-queue=N          bounded queue size per worker (default 4096)\n"
+              << "  --inbox-frames=N          frames one client may have waiting for workers before it is not read (default 256)\n"
+              << "  --inbox-bytes=N           bytes one client may have waiting for workers before it is not read (default 1048576)\n"
+              << "  --admin-port=N            serve Prometheus metrics at /metrics (default off)\n"
+              << "  --admin-address=IP        address the admin port binds (default 127.0.0.1; 0.0.0.0 = all)\n"
+              << "  --stats-interval=S        log a metrics summary every S seconds (default off)\n"
+              << "  --trace-sample=N          trace one frame in N through the pipeline, see /trace (default off)\n"
+              << "  --client-rate=N           messages per second read from one connection (default unlimited)\n"
+              << "  --client-burst=N          messages a connection may send back to back (default: one second's worth)\n"
+              << "  --room-rate=N             messages per second posted to one room (default unlimited)\n"
+              << "  --room-burst=N            messages a room accepts back to back (default: one second's worth)\n"
+              << "  --handshake-timeout=S     close connections that send no username within S seconds (default 10, 0 = off)\n"
+              << "  --idle-timeout=S          close connections that send nothing for S seconds (default off)\n"
+              << "  --ping-interval=S         ping clients that have been silent for S seconds (default off)\n"
+              << "  --write-timeout=S         close connections whose output makes no progress for S seconds (default 30, 0 = off)\n"
+              << "  --drain-timeout=S         on shutdown, wait up to S seconds for queued output to go out (default 5)\n"
+              << "  --handoff=on|off          on restart (SIGUSR2), pass open connections to the new process (default on)\n"
+              << "  --max-rooms=N             rooms the server holds at most, lobby included (default 65536)\n"
+              << "  --rooms-per-client=N      rooms one connection may join besides the lobby (default 64)\n"
+              << "  --room-creates=N          new rooms one connection may create (default 16)\n"
+              << "  --history=N               messages kept per room and replayed on join (default 100, 0 = off)\n"
+              << "  --history-bytes=N         bytes of them kept per room, at most half of --queue-bytes (default 1048576)\n"
+              << "  --node-id=N               cluster mode: this node's id, 1-65535 (default off)\n"
+              << "  --cluster-port=N          port peer nodes connect to (required with --node-id)\n"
+              << "  --cluster-address=IP      address the cluster port binds (default 127.0.0.1; 0.0.0.0 = all)\n"
+              << "  --peer=HOST:PORT          another node's cluster port; repeat for each peer\n"
+              << "  --presence-window=MS      batch join/leave announcements over MS (default 50, 0 = off)\n"
+              << "  --journal=DIR             persist chat messages in DIR and restore history on start\n"
+              << "  --journal-segment=N       bytes per journal segment file (default 67108864)\n"
+              << "  --journal-sync-ms=N       longest a message waits for fsync (default 50)\n"
+              << "  --journal-sync-bytes=N    unsynced bytes that force an earlier fsync (default 1048576)\n"
+              << "  --compress=on|off         allow clients to negotiate compression (default on)\n"
+              << "  --compress-min=N          smallest payload worth compressing (default 128)\n"
+              << "  --compress-level=N        codec compression level (default: codec default; zlib uses at most 9)\n"
+              << "  --compress-dict=PATH      trained dictionary instead of the built-in one\n"
+              << "  --log-level=LEVEL         debug|info|warn|error (default info)\n"
+              << "  --log-file=PATH           append log records to PATH instead of stdout/stderr\n";
+}
+
+static bool parse_uint(const std::string &text, unsigned long max, unsigned long &out)
+{
+    try
+    {
+        size_t pos = 0;
+        unsigned long v = std::stoul(text, &pos);
+        if (pos != text.size() || v > max)
+            return false;
+        out = v;
+        return true;
+    }
+    catch (const std::exception &)
+    {
+        return false;
+    }
+}
+
+static bool valid_ipv4(const std::string &text)
+{
+    in_addr addr;
+    return inet_pton(AF_INET, text.c_str(), &addr) == 1;
+}
+
+static bool parse_level(const std::string &text, LogLevel &out)
+{
+    static const struct
+    {
+        const char *name;
+        LogLevel level;
+    } levels[] = {{"debug", LogLevel::Debug}, {"info", LogLevel::Info}, {"warn", LogLevel::Warn}, {"error", LogLevel::Error}};
+    for (auto &l : levels)
+    {
+        if (text == l.name)
+        {
+            out = l.level;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool parse_args(int argc, char *argv[], ServerConfig &cfg)
+{
+    int positional = 0;
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        unsigned long v = 0;
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            bool ok = false;
+            if (positional == 0 && parse_uint(arg, 65535, v))
+            {
+                cfg.port = static_cast<uint16_t>(v);
+                ok = true;
+            }
+            else if (positional == 1 && parse_uint(arg, 1024, v) && v > 0)
+            {
+                cfg.shards = static_cast<unsigned>(v);
+                ok = true;
+            }
+            if (!ok)
+            {
+                print_usage(argv[0]);
+                return false;
+            }
+            ++positional;
+            continue;
+        }
+
+        std::string key = arg.substr(2);
+        std::string value;
+        size_t eq = key.find('=');
+        if (eq != std::string::npos)
+        {
+            value = key.substr(eq + 1);
+            key.resize(eq);
+        }
+
+        if (key == "engine" && value == "reactor")
+            cfg.engine = Engine::Reactor;
+        else if (key == "engine" && value == "uring")
+            cfg.engine = Engine::Uring;
+        else if (key == "engine" && value == "threads")
+            cfg.engine = Engine::Threads;
+        else if (key == "cpu-affinity" && !value.empty() && value != "off")
+            cfg.placement.cpus = value;
+        else if (key == "cpu-affinity" && value == "off")
+            cfg.placement.cpus.clear();
+        else if (key == "incoming-cpu" && (value == "on" || value == "off"))
+            cfg.placement.incoming_cpu = value == "on";
+        else if (key == "busy-poll" && parse_uint(value, 1000000, v))
+            cfg.placement.busy_poll_us = static_cast<unsigned>(v);
+        else if (key == "queue-frames" && parse_uint(value, 1ul << 24, v) && v > 0)
+            cfg.queue.max_frames = v;
+        else if (key == "queue-bytes" && parse_uint(value, 1ul << 31, v) && v > 0)
+            cfg.queue.max_bytes = v;
+        else if (key == "max-frame" && parse_uint(value, (1ul << 31) - 1, v) && v > 0)
+            cfg.frames.max_frame = v;
+        else if (key == "fragment-size" && parse_uint(value, 1ul << 30, v) && v >= 1024)
+            cfg.frames.fragment = v;
+        else if (key == "overflow" && value == "drop-oldest")
+            cfg.queue.policy = OverflowPolicy::DropOldest;
+        else if (key == "overflow" && value == "drop-new")
+            cfg.queue.policy = OverflowPolicy::DropNew;
+        else if (key == "overflow" && value == "disconnect")
+            cfg.queue.policy = OverflowPolicy::Disconnect;
+        else if (key == "max-connections" && parse_uint(value, 1ul << 30, v))
+            cfg.admission.max_connections = v;
+        else if (key == "max-per-ip" && parse_uint(value, 1ul << 30, v))
+            cfg.admission.max_per_ip = v;
+        else if (key == "defer-accept" && parse_uint(value, 3600, v))
+            cfg.admission.defer_accept_sec = static_cast<unsigned>(v);
+        else if (key == "flush-iov" && parse_uint(value, 1024, v) && v > 0)
+            cfg.coalesce.max_iov = v;
+        else if (key == "flush-bytes" && parse_uint(value, 1ul << 30, v) && v > 0)
+            cfg.coalesce.max_bytes = v;
+        else if (key == "workers" && parse_uint(value, 1024, v))
+            cfg.workers = static_cast<unsigned>(v);
+        else if (key == "worker-queue" && parse_uint(value, 1ul << 24, v) && v > 0)
+            cfg.worker_queue = v;
+        else if (key == "inbox-frames" && parse_uint(value, 1ul << 24, v) && v > 0)
+            cfg.inbox.max_items = v;
+        else if (key == "inbox-bytes" && parse_uint(value, 1ul << 30, v) && v > 0)
+            cfg.inbox.max_bytes = v;
+        else if (key == "ws-port" && parse_uint(value, 65535, v) && v > 0)
+            cfg.ws_port = static_cast<uint16_t>(v);
+        else if (key == "admin-port" && parse_uint(value, 65535, v) && v > 0)
+            cfg.admin_port = static_cast<uint16_t>(v);
+        else if (key == "admin-address" && valid_ipv4(value))
+            cfg.admin_address = value;
+        else if (key == "stats-interval" && parse_uint(value, 86400, v))
+            cfg.stats_interval = static_cast<unsigned>(v);
+        else if (key == "trace-sample" && parse_uint(value, 1000000000, v))
+            cfg.trace_sample = static_cast<unsigned>(v);
+        else if (key == "client-rate" && parse_uint(value, 1000000000, v))
+            cfg.rates.client.rate = static_cast<unsigned>(v);
+        else if (key == "client-burst" && parse_uint(value, 1000000, v))
+            cfg.rates.client.burst = static_cast<unsigned>(v);
+        else if (key == "room-rate" && parse_uint(value, 1000000000, v))
+            cfg.rates.room.rate = static_cast<unsigned>(v);
+        else if (key == "room-burst" && parse_uint(value, 1000000, v))
+            cfg.rates.room.burst = static_cast<unsigned>(v);
+        else if (key == "handshake-timeout" && parse_uint(value, 86400, v))
+            cfg.timeouts.handshake_ms = static_cast<unsigned>(v * 1000);
+        else if (key == "idle-timeout" && parse_uint(value, 86400, v))
+            cfg.timeouts.idle_ms = static_cast<unsigned>(v * 1000);
+        else if (key == "ping-interval" && parse_uint(value, 86400, v))
+            cfg.timeouts.ping_ms = static_cast<unsigned>(v * 1000);
+        else if (key == "write-timeout" && parse_uint(value, 86400, v))
+            cfg.timeouts.write_ms = static_cast<unsigned>(v * 1000);
+        else if (key == "drain-timeout" && parse_uint(value, 3600, v))
+            cfg.drain_ms = static_cast<unsigned>(v * 1000);
+        else if (key == "handoff" && (value == "on" || value == "off"))
+            cfg.handoff = value == "on";
+        else if (key == "max-rooms" && parse_uint(value, MAX_ROOMS, v) && v > 0)
+            cfg.room_limits.max_rooms = v;
+        else if (key == "rooms-per-client" && parse_uint(value, MAX_ROOMS, v))
+            cfg.room_limits.per_client = v;
+        else if (key == "room-creates" && parse_uint(value, MAX_ROOMS, v))
+            cfg.room_limits.creates_per_client = v;
+        else if (key == "history" && parse_uint(value, 1ul << 16, v))
+            cfg.history = v;
+        else if (key == "history-bytes" && parse_uint(value, 1ul << 31, v) && v > 0)
+            cfg.history_bytes = v;
+        else if (key == "node-id" && parse_uint(value, 65535, v) && v > 0)
+            cfg.cluster.node = static_cast<uint16_t>(v);
+        else if (key == "cluster-port" && parse_uint(value, 65535, v) && v > 0)
+            cfg.cluster.port = static_cast<uint16_t>(v);
+        else if (key == "cluster-address" && valid_ipv4(value))
+            cfg.cluster.address = value;
+        else if (key == "peer" && value.find(':') != std::string::npos)
+            cfg.cluster.peers.push_back(value);
+        else if (key == "presence-window" && parse_uint(value, 60000, v))
+            cfg.presence_window = static_cast<unsigned>(v);
+        else if (key == "journal" && !value.empty())
+            cfg.journal.dir = value;
+        else if (key == "journal-segment" && parse_uint(value, 1ul << 31, v) && v >= 4096)
+            cfg.journal.segment_bytes = v;
+        else if (key == "journal-sync-ms" && parse_uint(value, 60000, v) && v > 0)
+            cfg.journal.sync_ms = static_cast<unsigned>(v);
+        else if (key == "journal-sync-bytes" && parse_uint(value, 1ul << 31, v) && v > 0)
+            cfg.journal.sync_bytes = v;
+        else if (key == "compress" && (value == "on" || value == "off"))
+            cfg.compress.enabled = value == "on";
+        else if (key == "compress-min" && parse_uint(value, 1ul << 30, v))
+            cfg.compress.min_size = v;
+        else if (key == "compress-level" && parse_uint(value, static_cast<unsigned long>(max_compress_level()), v))
+            cfg.compress.level = static_cast<int>(v);
+        else if (key == "compress-dict" && !value.empty())
+            cfg.compress.dict_path = value;
+        else if (key == "log-level" && parse_level(value, cfg.log_level))
+            ;
+        else if (key == "log-file" && !value.empty())
+            cfg.log_file = value;
+        else
+        {
+            std::cerr << "invalid option: " << arg << "\n";
+            print_usage(argv[0]);
+            return false;
+        }
+    }
+    // a replay goes out as one batch and has to fit the joiner's send queue
+    // next to live traffic
+    cfg.history_bytes = std::min(cfg.history_bytes, cfg.queue.max_bytes / 2);
+    if (cfg.cluster.node != 0 && cfg.cluster.port == 0)
+    {
+        std::cerr << "--node-id needs --cluster-port\n";
+        print_usage(argv[0]);
+        return false;
+    }
+    return true;
+}
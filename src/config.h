@@ -0,0 +1,62 @@
+// Command-line configuration
+#pragma once
+
+#include "admission.h"
+#include "cluster.h"
+#include "affinity.h"
+#include "compress.h"
+#include "dispatch.h"
+#include "journal.h"
+#include "log.h"
+#include "outbound.h"
+#include "ratelimit.h"
+#include "reactor.h"
+#include "rooms.h"
+
+#include <cstdint>
+#include <string>
+
+static const uint16_t DEFAULT_PORT = 5555;
+
+enum class Engine
+{
+    Threads, // one blocking std::thread per connection (original model)
+    Reactor, // fixed set of non-blocking event-loop threads
+    Uring,   // the reactor on io_uring (Linux); falls back to Reactor where unavailable
+};
+
+struct ServerConfig
+{
+    uint16_t port = DEFAULT_PORT;
+    uint16_t ws_port = 0; // WebSocket listener for browsers (websocket.h); 0 = off
+    Engine engine = Engine::Reactor;
+    unsigned shards = 0; // reactor event loops; 0 = one per hardware thread
+    PlacementConfig placement; // CPU pinning and busy polling of the I/O threads
+    QueueLimits queue;   // per-client outbound queue bounds
+    CoalesceLimits coalesce;
+    AdmissionLimits admission; // connection caps and deferred accept
+    FrameLimits frames;  // largest frame accepted, and the piece size for relaying large ones
+    unsigned workers = 0;         // message-processing threads; 0 = inline on the I/O thread
+    size_t worker_queue = 4096;   // strands per worker queue
+    InboxLimits inbox;            // frames one client may have waiting for the workers
+    uint16_t admin_port = 0;      // Prometheus /metrics endpoint; 0 = off
+    std::string admin_address = "127.0.0.1"; // it also controls tracing, so local only by default
+    unsigned trace_sample = 0;    // trace one frame in N (trace.h); 0 = off
+    unsigned stats_interval = 0;  // seconds between stats log lines; 0 = off
+    CompressConfig compress;
+    size_t history = 100;         // chat messages kept per room for replay; 0 = off
+    size_t history_bytes = 1024 * 1024; // and at most this many bytes of them
+    RoomLimits room_limits;       // room creation caps
+    JournalConfig journal;
+    RateLimits rates;             // message rate limits; 0 = unlimited
+    ConnectionTimeouts timeouts;  // reactor connection deadlines (threads engine: handshake/idle/write)
+    unsigned drain_ms = 5000;     // shutdown waits this long for queued output
+    bool handoff = true;          // restart passes connections on (reactor engine)
+    ClusterConfig cluster;
+    unsigned presence_window = 50; // ms joins/leaves are batched for; 0 = announce each at once
+    LogLevel log_level = LogLevel::Info;
+    std::string log_file;         // empty: stdout / stderr
+};
+
+// Parses `chat_server [port] [shards] [--option=value ...]`; prints usage and returns false on bad input
+bool parse_args(int argc, char *argv[], ServerConfig &cfg);
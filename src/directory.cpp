@@ -0,0 +1,129 @@
+#include "directory.h"
+#include "chat.h"
+
+#include <algorithm>
+#include <functional>
+
+Directory directory;
+
+Directory::NameStripe &Directory::name_stripe(const std::string &name) const
+{
+    return names_[std::hash<std::string>()(name) % STRIPES];
+}
+
+Directory::IdStripe &Directory::id_stripe(uint64_t id) const
+{
+    // ids are handed out in sequence, so consecutive logins spread evenly
+    return ids_[id % STRIPES];
+}
+
+void Directory::add(const std::shared_ptr<Client> &client)
+{
+    {
+        IdStripe &s = id_stripe(client->id);
+        std::lock_guard<std::mutex> lk(s.mutex);
+        s.local[client->id] = client;
+    }
+    NameStripe &s = name_stripe(client->name);
+    std::lock_guard<std::mutex> lk(s.mutex);
+    auto &local = s.names[client->name].local;
+    auto pos = std::lower_bound(local.begin(), local.end(), client->id,
+                                [](const std::shared_ptr<Client> &c, uint64_t id) { return c->id < id; });
+    if (pos == local.end() || (*pos)->id != client->id)
+        local.insert(pos, client);
+}
+
+void Directory::remove(const Client &client)
+{
+    {
+        IdStripe &s = id_stripe(client.id);
+        std::lock_guard<std::mutex> lk(s.mutex);
+        s.local.erase(client.id);
+    }
+    NameStripe &s = name_stripe(client.name);
+    std::lock_guard<std::mutex> lk(s.mutex);
+    auto it = s.names.find(client.name);
+    if (it == s.names.end())
+        return;
+    auto &local = it->second.local;
+    local.erase(std::remove_if(local.begin(), local.end(),
+                               [&](const std::shared_ptr<Client> &c) { return c.get() == &client; }),
+                local.end());
+    if (local.empty() && it->second.remote == 0)
+        s.names.erase(it);
+}
+
+void Directory::adjust_remote(const std::string &name, bool add)
+{
+    NameStripe &s = name_stripe(name);
+    std::lock_guard<std::mutex> lk(s.mutex);
+    NameEntry &entry = s.names[name];
+    if (add)
+        ++entry.remote;
+    else if (entry.remote)
+        --entry.remote;
+    if (entry.local.empty() && entry.remote == 0)
+        s.names.erase(name);
+}
+
+void Directory::add_remote(uint64_t id, const std::string &name)
+{
+    {
+        IdStripe &s = id_stripe(id);
+        std::lock_guard<std::mutex> lk(s.mutex);
+        if (!s.remote.emplace(id, name).second)
+            return; // announced again when a link came back
+    }
+    adjust_remote(name, true);
+}
+
+void Directory::remove_remote(uint64_t id)
+{
+    std::string name;
+    {
+        IdStripe &s = id_stripe(id);
+        std::lock_guard<std::mutex> lk(s.mutex);
+        auto it = s.remote.find(id);
+        if (it == s.remote.end())
+            return;
+        name = std::move(it->second);
+        s.remote.erase(it);
+    }
+    adjust_remote(name, false);
+}
+
+void Directory::clear()
+{
+    for (IdStripe &s : ids_)
+    {
+        std::lock_guard<std::mutex> lk(s.mutex);
+        s.local.clear();
+        s.remote.clear();
+    }
+    for (NameStripe &s : names_)
+    {
+        std::lock_guard<std::mutex> lk(s.mutex);
+        s.names.clear();
+    }
+}
+
+size_t Directory::find(const std::string &name, std::vector<std::shared_ptr<Client>> &out) const
+{
+    NameStripe &s = name_stripe(name);
+    std::lock_guard<std::mutex> lk(s.mutex);
+    auto it = s.names.find(name);
+    if (it == s.names.end())
+        return 0;
+    out.insert(out.end(), it->second.local.begin(), it->second.local.end());
+    return it->second.remote;
+}
+
+std::shared_ptr<Client> Directory::find(uint64_t id, bool *remote) const
+{
+    IdStripe &s = id_stripe(id);
+    std::lock_guard<std::mutex> lk(s.mutex);
+    if (remote)
+        *remote = s.remote.count(id) != 0;
+    auto it = s.local.find(id);
+    return it == s.local.end() ? nullptr : it->second;
+}
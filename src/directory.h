@@ -0,0 +1,72 @@
+// Who is logged in under which name and connection id, for direct messages
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct Client;
+
+// Two hash indexes, username -> connections and connection id ->
+// connection, each split into STRIPES independently locked stripes picked
+// by the key's hash. A lookup locks one stripe just long enough to copy a
+// few pointers, so lookups, logins and logouts of different keys run in
+// parallel and never wait for the registry, the rooms or presence.
+//
+// Names are not unique. Every connection logged in under a name is kept,
+// ordered by connection id, and a lookup by name returns all of them (the
+// same user on several devices); an id always means exactly one
+// connection. In cluster mode (cluster.h) the users of other nodes are
+// indexed too, by count only, so the caller knows when to relay.
+class Directory
+{
+public:
+    static const size_t STRIPES = 64;
+
+    // A named client logging in, or carried over on restart
+    void add(const std::shared_ptr<Client> &client);
+    void remove(const Client &client);
+    // Users hosted by other nodes
+    void add_remote(uint64_t id, const std::string &name);
+    void remove_remote(uint64_t id);
+    void clear();
+
+    // Appends the local connections named `name` to out, oldest first, and
+    // returns how many users of that name other nodes host
+    size_t find(const std::string &name, std::vector<std::shared_ptr<Client>> &out) const;
+    // The local connection with this id, or null; `remote` tells whether
+    // another node hosts it instead
+    std::shared_ptr<Client> find(uint64_t id, bool *remote = nullptr) const;
+
+private:
+    struct NameEntry
+    {
+        std::vector<std::shared_ptr<Client>> local; // by id
+        size_t remote = 0;
+    };
+    struct NameStripe
+    {
+        std::mutex mutex;
+        std::unordered_map<std::string, NameEntry> names;
+    };
+    struct IdStripe
+    {
+        std::mutex mutex;
+        std::unordered_map<uint64_t, std::shared_ptr<Client>> local;
+        std::unordered_map<uint64_t, std::string> remote; // id -> name
+    };
+
+    NameStripe &name_stripe(const std::string &name) const;
+    IdStripe &id_stripe(uint64_t id) const;
+    void adjust_remote(const std::string &name, bool add);
+
+    mutable std::array<NameStripe, STRIPES> names_;
+    mutable std::array<IdStripe, STRIPES> ids_;
+};
+
+extern Directory directory;
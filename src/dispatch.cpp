@@ -0,0 +1,303 @@
+#include "dispatch.h"
+#include "chat.h"
+#include "log.h"
+#include "metrics.h"
+#include "mpmc.h"
+#include "reactor.h"
+#include "trace.h"
+
+#include <condition_variable>
+
+// Items handled per turn before a busy client goes to the back of the queue
+static const int ITEMS_PER_TURN = 64;
+// Empty polls before an idle worker goes to sleep
+static const int IDLE_SPINS = 64;
+
+// A client with pending inbox items is a "strand": it sits in at most one
+// worker queue at a time and is run by one thread at a time, which is what
+// keeps its messages in order. Workers pop from their own queue first and
+// steal from the others when it is empty.
+class WorkerPool
+{
+public:
+    WorkerPool(unsigned workers, size_t queue_capacity);
+    ~WorkerPool();
+
+    // False when every queue is full; the caller then runs the strand itself
+    bool submit(std::shared_ptr<Client> client);
+
+private:
+    void run(size_t self);
+    bool take(size_t self, std::shared_ptr<Client> &out);
+
+    std::vector<std::unique_ptr<BoundedMpmcQueue<std::shared_ptr<Client>>>> queues_;
+    std::vector<std::thread> threads_;
+    std::atomic<bool> stopping_{false};
+    std::atomic<int> sleepers_{0};
+    std::mutex sleep_mutex_;
+    std::condition_variable sleep_cv_;
+};
+
+static std::unique_ptr<WorkerPool> g_pool;
+
+InboxLimits inbox_limits;
+
+// inbox_mutex held
+static bool inbox_over(const Client &client)
+{
+    return client.inbox.size() >= inbox_limits.max_items || client.inbox_bytes >= inbox_limits.max_bytes;
+}
+
+// Lets the I/O side read again; any thread
+static void resume_input(const std::shared_ptr<Client> &client)
+{
+    if (client->loop)
+        client->loop->resume_input(client);
+    else
+        client->inbox_drained.notify_all();
+}
+
+static void process(const std::shared_ptr<Client> &client, InboxItem &item)
+{
+    TraceScope scope(item.trace);
+    trace_record(item.trace, TraceStage::Dispatched);
+    switch (item.kind)
+    {
+    case InboxItem::Kind::Username:
+        if (!client_joined(client, item.text.str()))
+        {
+            LOG_WARN("Failed to send user list to client; closing");
+            client->quitting = true;
+            disconnect(client);
+        }
+        break;
+    case InboxItem::Kind::Message:
+        // frames that arrived after __quit__ are ignored
+        if (!client->quitting && !client_message(client, item.text.view(), item.part))
+        {
+            client->quitting = true;
+            disconnect(client);
+        }
+        break;
+    case InboxItem::Kind::Closed:
+        client_left(client);
+        break;
+    }
+}
+
+// Runs one turn of the strand; returns true if it still has items (and is
+// therefore still scheduled)
+static bool run_strand(const std::shared_ptr<Client> &client)
+{
+    for (int i = 0; i < ITEMS_PER_TURN; ++i)
+    {
+        InboxItem item;
+        bool resume = false;
+        {
+            std::lock_guard<std::mutex> lk(client->inbox_mutex);
+            if (client->inbox.empty())
+            {
+                client->scheduled = false;
+                return false;
+            }
+            item = std::move(client->inbox.front());
+            client->inbox.pop_front();
+            client->inbox_bytes -= item.text.size();
+            // low-water mark: half of both limits
+            if (client->inbox_full && client->inbox.size() <= inbox_limits.max_items / 2 &&
+                client->inbox_bytes <= inbox_limits.max_bytes / 2)
+            {
+                client->inbox_full = false;
+                resume = true;
+            }
+        }
+        if (resume)
+            resume_input(client);
+        process(client, item);
+    }
+    std::lock_guard<std::mutex> lk(client->inbox_mutex);
+    if (client->inbox.empty())
+    {
+        client->scheduled = false;
+        return false;
+    }
+    return true;
+}
+
+WorkerPool::WorkerPool(unsigned workers, size_t queue_capacity)
+{
+    for (unsigned i = 0; i < workers; ++i)
+        queues_.emplace_back(new BoundedMpmcQueue<std::shared_ptr<Client>>(queue_capacity));
+    ScopedSignalBlock block; // keep SIGINT on the main thread
+    for (unsigned i = 0; i < workers; ++i)
+        threads_.emplace_back(&WorkerPool::run, this, i);
+}
+
+WorkerPool::~WorkerPool()
+{
+    stopping_ = true;
+    {
+        std::lock_guard<std::mutex> lk(sleep_mutex_);
+        sleep_cv_.notify_all();
+    }
+    for (auto &t : threads_)
+        t.join();
+}
+
+bool WorkerPool::submit(std::shared_ptr<Client> client)
+{
+    // home queue by client id keeps a client's state warm on one worker
+    size_t n = queues_.size();
+    size_t home = static_cast<size_t>(client->id % n);
+    bool pushed = false;
+    for (size_t i = 0; i < n && !pushed; ++i)
+        pushed = queues_[(home + i) % n]->try_push(client);
+    if (!pushed)
+        return false;
+    if (sleepers_.load() > 0)
+    {
+        std::lock_guard<std::mutex> lk(sleep_mutex_);
+        sleep_cv_.notify_one();
+    }
+    return true;
+}
+
+bool WorkerPool::take(size_t self, std::shared_ptr<Client> &out)
+{
+    size_t n = queues_.size();
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (queues_[(self + i) % n]->try_pop(out))
+            return true;
+    }
+    return false;
+}
+
+void WorkerPool::run(size_t self)
+{
+    std::shared_ptr<Client> client;
+    int idle = 0;
+    while (!stopping_)
+    {
+        bool found = take(self, client);
+        if (!found && ++idle >= IDLE_SPINS)
+        {
+            std::unique_lock<std::mutex> lk(sleep_mutex_);
+            ++sleepers_;
+            // re-check after announcing ourselves so a concurrent submit is not missed
+            found = take(self, client);
+            if (!found && !stopping_)
+                sleep_cv_.wait_for(lk, std::chrono::milliseconds(100));
+            --sleepers_;
+            idle = 0;
+        }
+        if (!found)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+        idle = 0;
+        // a busy strand goes to the back of a queue; if all are full we keep it
+        if (run_strand(client) && !submit(client))
+        {
+            while (run_strand(client))
+            {
+            }
+        }
+        client.reset();
+    }
+}
+
+void start_workers(unsigned workers, size_t queue_capacity)
+{
+    if (workers > 0)
+        g_pool.reset(new WorkerPool(workers, queue_capacity));
+}
+
+void stop_workers()
+{
+    g_pool.reset();
+}
+
+// False when the inbox is now over its limits (see InboxLimits)
+static bool enqueue(const std::shared_ptr<Client> &client, InboxItem &&item)
+{
+    bool schedule;
+    {
+        std::lock_guard<std::mutex> lk(client->inbox_mutex);
+        client->inbox_bytes += item.text.size();
+        client->inbox.push_back(std::move(item));
+        if (inbox_over(*client))
+            client->inbox_full = true;
+        schedule = !client->scheduled;
+        client->scheduled = true;
+    }
+    if (schedule && !g_pool->submit(client))
+    {
+        // pool saturated: the I/O thread holds the strand and runs it, which
+        // also slows down its own reading
+        while (run_strand(client))
+        {
+        }
+    }
+    std::lock_guard<std::mutex> lk(client->inbox_mutex);
+    return !client->inbox_full;
+}
+
+void wait_for_inbox(const std::shared_ptr<Client> &client)
+{
+    std::unique_lock<std::mutex> lk(client->inbox_mutex);
+    // timed, so that a shutdown that stops the workers is noticed
+    while (client->inbox_full && running)
+        client->inbox_drained.wait_for(lk, std::chrono::milliseconds(100));
+}
+
+bool dispatch_frame(const std::shared_ptr<Client> &client, Buffer &&msg, FramePart part)
+{
+    uint64_t trace = trace_begin();
+    metric_add(Counter::FramesIn);
+    metric_add(Counter::BytesIn, msg.size() + (part == FramePart::Whole || part == FramePart::First ? 4 : 0));
+    InboxItem::Kind kind = client->saw_username ? InboxItem::Kind::Message : InboxItem::Kind::Username;
+    if (kind == InboxItem::Kind::Username && part != FramePart::Whole)
+    {
+        LOG_WARN("Username frame of over " << frame_limits.fragment << " bytes; closing");
+        client->quitting = true;
+        disconnect(client);
+        return true;
+    }
+    client->saw_username = true;
+    if (g_pool)
+    {
+        trace_record(trace, TraceStage::Queued);
+        if (enqueue(client, InboxItem{kind, std::move(msg), part, trace}))
+            return true;
+        metric_add(Counter::InboxFull);
+        return false;
+    }
+    InboxItem item{kind, std::move(msg), part, trace};
+    process(client, item);
+    return true;
+}
+
+void dispatch_close(const std::shared_ptr<Client> &client)
+{
+    if (g_pool)
+    {
+        enqueue(client, InboxItem{InboxItem::Kind::Closed, Buffer()});
+        return;
+    }
+    client_left(client);
+}
+
+void disconnect(const std::shared_ptr<Client> &client)
+{
+    if (client->loop)
+    {
+        client->loop->close_later(client);
+        return;
+    }
+    // threads engine: the reader thread sees EOF and cleans up
+    std::lock_guard<std::mutex> lk(client->inbox_mutex);
+    if (!client->closed)
+        shutdown_socket(client->sock);
+}
@@ -0,0 +1,55 @@
+// Hand-off of decoded frames from the I/O threads to the chat logic
+#pragma once
+
+#include "pool.h"
+#include "protocol.h"
+
+#include <cstdint>
+#include <memory>
+
+struct Client;
+
+// One unit of work in a client's inbox
+struct InboxItem
+{
+    enum class Kind
+    {
+        Username, // first frame of the connection
+        Message,  // any later frame
+        Closed,   // connection is gone; always the last item
+    };
+    Kind kind = Kind::Message;
+    Buffer text;
+    FramePart part = FramePart::Whole; // of a frame handed on in pieces (protocol.h)
+    uint64_t trace = 0;                // sampled for tracing (trace.h); 0 = not traced
+};
+
+// Bounds on one client's inbox (workers > 0 only). At either limit the I/O
+// thread stops reading the connection, as a rate limit does, and the strand
+// resumes it once it has worked the inbox down to half, so a fast sender
+// fills its own TCP window rather than server memory.
+struct InboxLimits
+{
+    size_t max_items = 256;
+    size_t max_bytes = 1024 * 1024; // of frame text
+};
+extern InboxLimits inbox_limits; // set once at startup
+
+// With workers > 0 frames are processed on a pool of worker threads; with 0
+// (the default) they are processed inline on the I/O thread that decoded them.
+// Either way a client's items are handled one at a time, in arrival order.
+void start_workers(unsigned workers, size_t queue_capacity);
+void stop_workers();
+
+// Called by the I/O thread that owns the client. False when the frame
+// filled the inbox: the caller reads no more from the client until the
+// strand resumes it (EventLoop::resume_input, or wait_for_inbox for the
+// threads engine).
+bool dispatch_frame(const std::shared_ptr<Client> &client, Buffer &&msg, FramePart part = FramePart::Whole);
+void dispatch_close(const std::shared_ptr<Client> &client);
+// Threads engine: blocks the reader until the inbox is below its low-water
+// mark again, or the server stops
+void wait_for_inbox(const std::shared_ptr<Client> &client);
+
+// Ask the engine that owns the client to drop the connection (any thread)
+void disconnect(const std::shared_ptr<Client> &client);
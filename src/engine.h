@@ -0,0 +1,48 @@
+// Connection engines; each runs the accept loop until `running` is cleared
+// and then tears down its connections
+#pragma once
+
+#include "config.h"
+#include "platform.h"
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// True when the kernel load-balances connections across SO_REUSEPORT listeners
+bool reuse_port_supported();
+
+// Bound and listening IPv4 socket, or INVALID_SOCKET (error already reported).
+// With reuse_port several sockets (one per shard) may bind the same port.
+// `address` is the IPv4 address to bind; empty = every interface.
+// A restarted process (restart.h) gets the inherited socket bound to the
+// same port and address back instead, once per socket the previous process
+// had open. One bound to another address stays unused; while the previous
+// process still listens on it, binding the port anew fails, so moving a
+// port to another address takes a full restart.
+socket_t open_listener(uint16_t port, bool reuse_port, const std::string &address = std::string());
+// Every socket open_listener() has returned (port, socket); they stay open
+// until shutdown, so a restart can pass them on
+std::vector<std::pair<uint16_t, socket_t>> open_listeners();
+// Closes inherited sockets for ports this process did not ask for
+void release_inherited_listeners();
+
+// Environment variable carrying the inherited listeners to a new process
+static const char *const LISTEN_FDS_ENV = "CHAT_LISTEN_FDS";
+
+// Both engines drain on shutdown: clients get the shutdown notice and their
+// queued output, all in parallel, for up to cfg.drain_ms before the rest is
+// cut off. A restart (restart.h) is started from the accept loop.
+
+// Thread-per-connection model (fallback, kept for A/B comparisons)
+void run_threads_engine(socket_t listen_sock, const ServerConfig &cfg);
+
+// Non-blocking sockets multiplexed over cfg.shards event loops. With
+// SO_REUSEPORT listen_sock becomes shard 0's listener and every other shard
+// opens its own; otherwise the calling thread accepts on listen_sock and hands
+// connections to the least-loaded shard. `handoff` is the channel a restarted
+// process receives the previous one's connections on (restart.h). With
+// Engine::Uring the shards run on io_uring when the build and the kernel
+// support it (see EventLoop), else on the poller with a warning.
+void run_reactor_engine(socket_t listen_sock, const ServerConfig &cfg, socket_t handoff);
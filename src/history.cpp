@@ -0,0 +1,97 @@
+#include "history.h"
+
+#include <algorithm>
+
+size_t history_capacity = 100;
+size_t history_bytes = 1024 * 1024;
+
+void RoomHistory::drop(Entry &e)
+{
+    bytes_ -= e.bytes;
+    e = Entry();
+}
+
+void RoomHistory::record(uint64_t seq, uint64_t sender, uint16_t flags, const FramePtr &text,
+                         const FramePtr &binary)
+{
+    if (history_capacity == 0)
+        return;
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (slots_.empty())
+        slots_.resize(history_capacity);
+    if (last_.pos != 0 && seq > last_.seq + slots_.size())
+    {
+        // continue right after the newest entry, so the older ones stay
+        base_ = seq - last_.pos - 1;
+        floor_ = seq;
+    }
+    if (seq < floor_)
+        return;
+    Mark at{seq, seq - base_};
+
+    // one sender's pieces are posted in order, whatever else interleaves
+    Mark start = at;
+    auto open = open_.find(sender);
+    if (open != open_.end())
+    {
+        start = open->second;
+        if (!(flags & MSG_FRAGMENT))
+            open_.erase(open);
+    }
+    else if (flags & MSG_FRAGMENT)
+    {
+        // a sender that went away mid-message leaves its entry behind
+        if (open_.size() >= slots_.size())
+        {
+            for (auto it = open_.begin(); it != open_.end();)
+                it = it->second.pos < first_ ? open_.erase(it) : std::next(it);
+        }
+        open_.emplace(sender, at);
+    }
+    if (at.pos < first_)
+        return; // evicted already
+    Entry &e = slots_[at.pos % slots_.size()];
+    if (e.at.pos > at.pos)
+        return; // a newer message already took the slot
+    drop(e);
+    e.at = at;
+    e.start = start;
+    e.bytes = std::max(text->size(), binary->size());
+    e.text = text;
+    e.binary = binary;
+    bytes_ += e.bytes;
+    if (at.pos > last_.pos)
+        last_ = at;
+    if (last_.pos >= slots_.size())
+        first_ = std::max(first_, last_.pos - slots_.size() + 1);
+    // oldest first, down to the byte budget; the newest message always stays
+    while (bytes_ > history_bytes && first_ < last_.pos)
+    {
+        Entry &old = slots_[first_ % slots_.size()];
+        if (old.at.pos == first_)
+            drop(old);
+        ++first_;
+    }
+}
+
+size_t RoomHistory::tail(uint64_t since, bool binary, std::vector<FramePtr> &out) const
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (slots_.empty() || last_.seq <= since)
+        return 0;
+    size_t n = 0;
+    for (uint64_t p = first_; p <= last_.pos; ++p)
+    {
+        const Entry &e = slots_[p % slots_.size()];
+        // gaps: recorded out of order and not there yet, or not a chat message
+        if (e.at.pos != p || e.at.seq <= since)
+            continue;
+        // the rest of a message whose beginning is gone, unless the client
+        // has that beginning already
+        if (e.start.pos < first_ && e.start.seq > since)
+            continue;
+        out.push_back(binary ? e.binary : e.text);
+        ++n;
+    }
+    return n;
+}
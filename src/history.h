@@ -0,0 +1,63 @@
+// Bounded recent history of a room, kept as already-framed messages
+#pragma once
+
+#include "protocol.h"
+
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+extern size_t history_capacity; // messages kept per room, 0 = off; set once at startup
+extern size_t history_bytes;    // bytes kept per room (the larger format of each message); set at startup
+
+// Fixed-capacity ring indexed by sequence number: message `seq` lives in
+// slot seq % capacity, so concurrent broadcasters that record slightly out
+// of order still land in the right place and replay comes out sorted. Each
+// entry holds both wire formats, so replay is a list of shared frames that
+// goes out as one batch with no re-encoding. Join and leave announcements
+// use sequence numbers too but are not kept, so churn in a room leaves gaps
+// and fewer than `history_capacity` messages. A jump wider than the ring
+// (after a restart, see restart.cpp) shifts the indexing instead of
+// emptying it; messages below the jump are not recorded afterwards.
+//
+// The oldest messages also go once the room holds more than history_bytes,
+// so a replay fits a client's send queue. The pieces of a streamed message
+// (MSG_FRAGMENT) each take an entry; replay never starts in the middle of
+// one whose first piece is gone.
+class RoomHistory
+{
+public:
+    void record(uint64_t seq, uint64_t sender, uint16_t flags, const FramePtr &text, const FramePtr &binary);
+    // Appends the frames of messages after `since`, oldest first, in the
+    // legacy (`binary` false) or protocol 1 format; returns how many
+    size_t tail(uint64_t since, bool binary, std::vector<FramePtr> &out) const;
+
+private:
+    // Sequence numbers and their positions in the ring; they differ by
+    // base_ since the last jump
+    struct Mark
+    {
+        uint64_t seq = 0;
+        uint64_t pos = 0;
+    };
+    struct Entry
+    {
+        Mark at;
+        Mark start; // first piece of its message
+        size_t bytes = 0;
+        FramePtr text;
+        FramePtr binary;
+    };
+
+    mutable std::mutex mutex_;
+    std::vector<Entry> slots_; // allocated on the first record
+    Mark last_;                // highest recorded
+    uint64_t base_ = 0;
+    uint64_t floor_ = 0;       // seq of the last jump
+    uint64_t first_ = 1;       // lowest position that may still be held
+    size_t bytes_ = 0;         // of the entries held
+    std::unordered_map<uint64_t, Mark> open_; // sender -> start of its unfinished message
+
+    void drop(Entry &e);
+};
@@ -0,0 +1,627 @@
+#include "journal.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+
+bool open_journal(const JournalConfig &, size_t, const std::function<void(const JournalRecord &)> &)
+{
+    LOG_ERROR("journal: not supported on this platform");
+    return false;
+}
+
+void journal_append(const JournalRecord &) {}
+
+void suspend_journal() {}
+
+void close_journal() {}
+
+#else
+
+// Segment layout: 8-byte magic, then records back to back. A record is
+//   u32 size      bytes after this field (0 = end of the written part)
+//   u32 checksum  FNV-1a of the bytes after this field
+//   u64 seq, u64 sender
+//   u16 room length, u16 from length, u32 text length
+//   u16 flags     the message's MsgHeader flags (not in version 1 segments)
+//   room, from, text
+// in host byte order; the files are not meant to move between machines.
+// A record torn by a crash fails its checksum and ends the scan. Version 1
+// segments are still read, as messages without flags, but never appended to.
+static const char SEGMENT_MAGIC[8] = {'C', 'H', 'A', 'T', 'J', 'N', 'L', '2'};
+static const char SEGMENT_MAGIC_V1[8] = {'C', 'H', 'A', 'T', 'J', 'N', 'L', '1'};
+static const char INDEX_MAGIC[8] = {'C', 'H', 'A', 'T', 'I', 'D', 'X', '1'};
+static const size_t RECORD_FIXED = 4 + 4 + 8 + 8 + 2 + 2 + 4 + 2;
+static const size_t RECORD_FIXED_V1 = RECORD_FIXED - 2;
+
+static uint32_t fnv1a(const char *p, size_t n)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < n; ++i)
+    {
+        h ^= static_cast<unsigned char>(p[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+template <typename T>
+static T load(const char *p)
+{
+    T v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+template <typename T>
+static char *store(char *p, T v)
+{
+    std::memcpy(p, &v, sizeof(v));
+    return p + sizeof(v);
+}
+
+// Per segment and room: where its newest records are and how far it got
+struct RoomIndex
+{
+    uint64_t last_seq = 0;
+    std::vector<uint32_t> offsets; // ascending; only the newest `keep` matter
+};
+using SegmentIndex = std::map<std::string, RoomIndex, std::less<>>;
+
+struct Segment
+{
+    uint64_t number = 0;
+    int fd = -1;
+    char *base = nullptr;
+    size_t size = 0; // mapped (and file) size
+    size_t used = 0; // bytes written, including the magic
+    bool v1 = false; // records without flags
+    SegmentIndex index;
+};
+
+static std::string segment_path(const std::string &dir, uint64_t number, const char *ext)
+{
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llu.%s", static_cast<unsigned long long>(number), ext);
+    return dir + "/" + name;
+}
+
+static void unmap(Segment &seg)
+{
+    if (seg.base)
+        munmap(seg.base, seg.size);
+    if (seg.fd >= 0)
+        ::close(seg.fd);
+    seg.base = nullptr;
+    seg.fd = -1;
+}
+
+// Creates segment `number` of at least `size` bytes, zero-filled and mapped
+static bool create_segment(const std::string &dir, uint64_t number, size_t size, Segment &seg)
+{
+    std::string path = segment_path(dir, number, "seg");
+    int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    if (ftruncate(fd, static_cast<off_t>(size)) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        ::close(fd);
+        return false;
+    }
+    seg.number = number;
+    seg.fd = fd;
+    seg.base = static_cast<char *>(p);
+    seg.size = size;
+    std::memcpy(seg.base, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC));
+    seg.used = sizeof(SEGMENT_MAGIC);
+    seg.v1 = false;
+    seg.index.clear();
+    return true;
+}
+
+static bool map_segment(const std::string &dir, uint64_t number, bool writable, Segment &seg)
+{
+    std::string path = segment_path(dir, number, "seg");
+    int fd = ::open(path.c_str(), writable ? O_RDWR : O_RDONLY);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(SEGMENT_MAGIC))
+    {
+        ::close(fd);
+        return false;
+    }
+    size_t size = static_cast<size_t>(st.st_size);
+    void *p = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        ::close(fd);
+        return false;
+    }
+    seg.number = number;
+    seg.fd = fd;
+    seg.base = static_cast<char *>(p);
+    seg.size = size;
+    seg.used = sizeof(SEGMENT_MAGIC);
+    seg.index.clear();
+    seg.v1 = std::memcmp(seg.base, SEGMENT_MAGIC_V1, sizeof(SEGMENT_MAGIC_V1)) == 0;
+    if (!seg.v1 && std::memcmp(seg.base, SEGMENT_MAGIC, sizeof(SEGMENT_MAGIC)) != 0)
+    {
+        unmap(seg);
+        return false;
+    }
+    return true;
+}
+
+// Parses the record at `off`; false at the end of the written data
+static bool read_record(const Segment &seg, size_t off, JournalRecord &rec, size_t &next)
+{
+    size_t fixed = seg.v1 ? RECORD_FIXED_V1 : RECORD_FIXED;
+    if (off + fixed > seg.size)
+        return false;
+    const char *p = seg.base + off;
+    uint32_t size = load<uint32_t>(p);
+    if (size < fixed - 4 || off + 4 + size > seg.size)
+        return false;
+    if (load<uint32_t>(p + 4) != fnv1a(p + 8, size - 4))
+        return false;
+    uint16_t room_len = load<uint16_t>(p + 24);
+    uint16_t from_len = load<uint16_t>(p + 26);
+    uint32_t text_len = load<uint32_t>(p + 28);
+    if (fixed - 4 + room_len + from_len + static_cast<size_t>(text_len) != size)
+        return false;
+    rec.seq = load<uint64_t>(p + 8);
+    rec.sender = load<uint64_t>(p + 16);
+    rec.flags = seg.v1 ? 0 : load<uint16_t>(p + 32);
+    const char *body = p + fixed;
+    rec.room = std::string_view(body, room_len);
+    rec.from = std::string_view(body + room_len, from_len);
+    rec.text = std::string_view(body + room_len + from_len, text_len);
+    next = off + 4 + size;
+    return true;
+}
+
+// Index entry for a record; keeps at most `keep` offsets per room (amortized)
+static void index_record(SegmentIndex &index, std::string_view room, uint64_t seq, uint32_t off, size_t keep)
+{
+    auto it = index.find(room);
+    if (it == index.end())
+        it = index.emplace(std::string(room), RoomIndex()).first;
+    RoomIndex &ri = it->second;
+    ri.last_seq = std::max(ri.last_seq, seq);
+    ri.offsets.push_back(off);
+    if (ri.offsets.size() >= 2 * keep)
+        ri.offsets.erase(ri.offsets.begin(), ri.offsets.end() - static_cast<std::ptrdiff_t>(keep));
+}
+
+static void scan_segment(Segment &seg, size_t keep)
+{
+    size_t off = sizeof(SEGMENT_MAGIC);
+    JournalRecord rec;
+    size_t next;
+    while (read_record(seg, off, rec, next))
+    {
+        index_record(seg.index, rec.room, rec.seq, static_cast<uint32_t>(off), keep);
+        off = next;
+    }
+    seg.used = off;
+}
+
+static bool write_index(const std::string &dir, const Segment &seg, size_t keep)
+{
+    std::string out(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+    char buf[16];
+    out.append(buf, store(buf, static_cast<uint32_t>(seg.index.size())) - buf);
+    for (const auto &kv : seg.index)
+    {
+        const RoomIndex &ri = kv.second;
+        size_t n = std::min(keep, ri.offsets.size());
+        out.append(buf, store(buf, static_cast<uint16_t>(kv.first.size())) - buf);
+        out += kv.first;
+        out.append(buf, store(buf, ri.last_seq) - buf);
+        out.append(buf, store(buf, static_cast<uint32_t>(n)) - buf);
+        for (size_t i = ri.offsets.size() - n; i < ri.offsets.size(); ++i)
+            out.append(buf, store(buf, ri.offsets[i]) - buf);
+    }
+    // written aside and renamed, so a crash never leaves a half index
+    std::string path = segment_path(dir, seg.number, "idx");
+    std::string tmp = path + ".tmp";
+    int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    bool ok = ::write(fd, out.data(), out.size()) == static_cast<ssize_t>(out.size()) && fsync(fd) == 0;
+    ::close(fd);
+    return ok && ::rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+static bool read_index(const std::string &dir, uint64_t number, SegmentIndex &index)
+{
+    std::string path = segment_path(dir, number, "idx");
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    std::string data;
+    char buf[64 * 1024];
+    ssize_t n;
+    while ((n = ::read(fd, buf, sizeof(buf))) > 0)
+        data.append(buf, static_cast<size_t>(n));
+    ::close(fd);
+
+    const char *p = data.data(), *end = p + data.size();
+    auto have = [&](size_t bytes) { return static_cast<size_t>(end - p) >= bytes; };
+    if (!have(sizeof(INDEX_MAGIC) + 4) || std::memcmp(p, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0)
+        return false;
+    p += sizeof(INDEX_MAGIC);
+    uint32_t rooms_n = load<uint32_t>(p);
+    p += 4;
+    index.clear();
+    for (uint32_t r = 0; r < rooms_n; ++r)
+    {
+        if (!have(2))
+            return false;
+        uint16_t len = load<uint16_t>(p);
+        p += 2;
+        if (!have(len + 12u))
+            return false;
+        RoomIndex &ri = index[std::string(p, len)];
+        p += len;
+        ri.last_seq = load<uint64_t>(p);
+        uint32_t count = load<uint32_t>(p + 8);
+        p += 12;
+        if (!have(static_cast<size_t>(count) * 4))
+            return false;
+        for (uint32_t i = 0; i < count; ++i, p += 4)
+            ri.offsets.push_back(load<uint32_t>(p));
+    }
+    return true;
+}
+
+class Journal
+{
+public:
+    Journal(const JournalConfig &cfg, size_t keep) : cfg_(cfg), keep_(std::max<size_t>(keep, 1)) {}
+
+    bool open(const std::function<void(const JournalRecord &)> &restore);
+    void append(const JournalRecord &rec);
+    void close();
+
+private:
+    void sync_loop();
+    bool roll(size_t need);
+
+    JournalConfig cfg_;
+    size_t keep_; // newest records per room worth indexing (at least 1)
+
+    std::mutex mutex_; // appenders; guards everything below
+    Segment active_;
+    Segment spare_;                 // prepared by the sync thread
+    std::vector<Segment> retired_;  // full segments waiting to be synced and sealed
+    size_t synced_ = 0;             // bytes of active_ known to be on disk
+    size_t unsynced_ = 0;
+    bool stopping_ = false;
+    std::condition_variable cv_;
+    std::thread sync_thread_;
+};
+
+bool Journal::open(const std::function<void(const JournalRecord &)> &restore)
+{
+    const std::string &dir = cfg_.dir;
+    if (::mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        LOG_ERROR("journal: cannot create " << dir << ": " << std::strerror(errno));
+        return false;
+    }
+    DIR *d = opendir(dir.c_str());
+    if (!d)
+    {
+        LOG_ERROR("journal: cannot open " << dir << ": " << std::strerror(errno));
+        return false;
+    }
+    std::vector<uint64_t> numbers;
+    while (dirent *e = readdir(d))
+    {
+        const char *name = e->d_name;
+        size_t len = std::strlen(name);
+        if (len == 20 && std::strcmp(name + 16, ".seg") == 0)
+            numbers.push_back(std::strtoull(name, nullptr, 10));
+    }
+    closedir(d);
+    std::sort(numbers.begin(), numbers.end());
+
+    auto started = std::chrono::steady_clock::now();
+    // newest first: learn from the indexes which records each room needs
+    std::vector<SegmentIndex> indexes(numbers.size());
+    size_t scanned = 0;
+    bool reuse_last = false;
+    for (size_t i = numbers.size(); i-- > 0;)
+    {
+        bool newest = i + 1 == numbers.size();
+        if (read_index(dir, numbers[i], indexes[i]))
+            continue;
+        // no index: the segment that was active when we stopped (or one whose
+        // seal was interrupted); scan it and, unless we keep writing to it, seal it
+        Segment seg;
+        if (!map_segment(dir, numbers[i], newest, seg))
+        {
+            LOG_WARN("journal: skipping unreadable segment " << segment_path(dir, numbers[i], "seg"));
+            continue;
+        }
+        scan_segment(seg, keep_);
+        scanned += seg.used;
+        indexes[i] = seg.index;
+        if (newest && seg.used < seg.size && !seg.v1)
+        {
+            active_ = std::move(seg);
+            reuse_last = true;
+        }
+        else
+        {
+            write_index(dir, seg, keep_);
+            unmap(seg);
+        }
+    }
+
+    std::unordered_map<std::string, size_t> need;
+    std::vector<std::vector<uint32_t>> wanted(numbers.size());
+    for (size_t i = numbers.size(); i-- > 0;)
+    {
+        for (const auto &kv : indexes[i])
+        {
+            auto it = need.find(kv.first);
+            if (it == need.end())
+                it = need.emplace(kv.first, keep_).first;
+            const std::vector<uint32_t> &offs = kv.second.offsets;
+            size_t take = std::min(it->second, offs.size());
+            wanted[i].insert(wanted[i].end(), offs.end() - static_cast<std::ptrdiff_t>(take), offs.end());
+            it->second -= take;
+        }
+        std::sort(wanted[i].begin(), wanted[i].end());
+    }
+
+    // oldest first, so every room's messages come out in journal order
+    size_t restored = 0;
+    for (size_t i = 0; i < numbers.size(); ++i)
+    {
+        if (wanted[i].empty())
+            continue;
+        bool is_active = reuse_last && i + 1 == numbers.size();
+        Segment seg;
+        if (!is_active && !map_segment(dir, numbers[i], false, seg))
+            continue;
+        const Segment &src = is_active ? active_ : seg;
+        for (uint32_t off : wanted[i])
+        {
+            JournalRecord rec;
+            size_t next;
+            if (read_record(src, off, rec, next))
+            {
+                restore(rec);
+                ++restored;
+            }
+        }
+        if (!is_active)
+            unmap(seg);
+    }
+
+    if (!reuse_last)
+    {
+        uint64_t number = numbers.empty() ? 1 : numbers.back() + 1;
+        if (!create_segment(dir, number, cfg_.segment_bytes, active_))
+        {
+            LOG_ERROR("journal: cannot create segment in " << dir << ": " << std::strerror(errno));
+            return false;
+        }
+    }
+    synced_ = active_.used;
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+    LOG_INFO("Journal " << dir << ": " << numbers.size() << " segment(s), restored " << restored
+                        << " message(s) in " << need.size() << " room(s), scanned " << scanned
+                        << " bytes in " << ms << " ms");
+    sync_thread_ = std::thread(&Journal::sync_loop, this);
+    return true;
+}
+
+// Called with mutex_ held: retire the active segment and start the next one
+bool Journal::roll(size_t need)
+{
+    size_t size = std::max(cfg_.segment_bytes, need + sizeof(SEGMENT_MAGIC));
+    Segment next;
+    if (spare_.base && spare_.size >= size)
+    {
+        next = std::move(spare_);
+        spare_ = Segment();
+    }
+    else
+    {
+        // the sync thread has not caught up; pay for the file here
+        uint64_t number = std::max(active_.number, spare_.number) + 1;
+        if (!create_segment(cfg_.dir, number, size, next))
+            return false;
+    }
+    retired_.push_back(std::move(active_));
+    active_ = std::move(next);
+    synced_ = active_.used;
+    cv_.notify_one();
+    return true;
+}
+
+void Journal::append(const JournalRecord &rec)
+{
+    size_t room_len = std::min<size_t>(rec.room.size(), 0xffff);
+    size_t from_len = std::min<size_t>(rec.from.size(), 0xffff);
+    size_t total = RECORD_FIXED + room_len + from_len + rec.text.size();
+
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (!active_.base)
+        return;
+    if (active_.used + total > active_.size && !roll(total))
+    {
+        LOG_ERROR("journal: cannot create a new segment: " << std::strerror(errno));
+        return;
+    }
+    size_t off = active_.used;
+    char *p = active_.base + off;
+    char *q = p + 8;
+    q = store(q, rec.seq);
+    q = store(q, rec.sender);
+    q = store(q, static_cast<uint16_t>(room_len));
+    q = store(q, static_cast<uint16_t>(from_len));
+    q = store(q, static_cast<uint32_t>(rec.text.size()));
+    q = store(q, rec.flags);
+    std::memcpy(q, rec.room.data(), room_len);
+    std::memcpy(q + room_len, rec.from.data(), from_len);
+    std::memcpy(q + room_len + from_len, rec.text.data(), rec.text.size());
+    store(p + 4, fnv1a(p + 8, total - 8));
+    // the size goes in last: a reader never sees a record before its body
+    store(p, static_cast<uint32_t>(total - 4));
+    active_.used += total;
+    index_record(active_.index, rec.room, rec.seq, static_cast<uint32_t>(off), keep_);
+    metric_add(Counter::JournalBytes, total);
+
+    unsynced_ += total;
+    if (unsynced_ >= cfg_.sync_bytes)
+        cv_.notify_one();
+}
+
+void Journal::sync_loop()
+{
+    std::unique_lock<std::mutex> lk(mutex_);
+    const long page = sysconf(_SC_PAGESIZE);
+    for (;;)
+    {
+        cv_.wait_for(lk, std::chrono::milliseconds(cfg_.sync_ms),
+                     [&] { return stopping_ || unsynced_ >= cfg_.sync_bytes || !retired_.empty(); });
+        bool stop = stopping_;
+
+        // group commit: one msync covers every record written since the last
+        char *base = active_.base;
+        size_t from = synced_ / page * page, to = active_.used;
+        synced_ = to;
+        unsynced_ = 0;
+        std::vector<Segment> retired;
+        retired.swap(retired_);
+        bool want_spare = !stop && !spare_.base;
+        uint64_t spare_number = active_.number + 1;
+        lk.unlock();
+
+        if (base && to > from)
+        {
+            auto t0 = std::chrono::steady_clock::now();
+            msync(base + from, to - from, MS_SYNC);
+            metric_record(Histogram::JournalSyncNanos,
+                          static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                    std::chrono::steady_clock::now() - t0)
+                                                    .count()));
+        }
+        for (Segment &seg : retired)
+        {
+            msync(seg.base, seg.used, MS_SYNC);
+            write_index(cfg_.dir, seg, keep_);
+            unmap(seg);
+        }
+        Segment spare;
+        if (want_spare && !create_segment(cfg_.dir, spare_number, cfg_.segment_bytes, spare))
+            LOG_WARN("journal: cannot prepare the next segment: " << std::strerror(errno));
+
+        lk.lock();
+        if (spare.base)
+        {
+            if (!spare_.base && spare.number > active_.number)
+                spare_ = std::move(spare);
+            else
+            {
+                // an appender rolled over on its own meanwhile
+                std::string path = segment_path(cfg_.dir, spare.number, "seg");
+                unmap(spare);
+                if (spare.number > active_.number)
+                    ::unlink(path.c_str());
+            }
+        }
+        if (stop && retired_.empty() && synced_ == active_.used)
+            return;
+    }
+}
+
+void Journal::close()
+{
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        stopping_ = true;
+        cv_.notify_one();
+    }
+    if (sync_thread_.joinable())
+        sync_thread_.join();
+    // the active segment stays unsealed and is scanned and reused next time;
+    // an append racing a suspend_journal() finds it unmapped and drops out
+    std::lock_guard<std::mutex> lk(mutex_);
+    unmap(active_);
+    if (spare_.base)
+    {
+        std::string path = segment_path(cfg_.dir, spare_.number, "seg");
+        unmap(spare_);
+        ::unlink(path.c_str());
+    }
+}
+
+static std::atomic<Journal *> g_journal{nullptr};
+
+bool open_journal(const JournalConfig &cfg, size_t per_room,
+                  const std::function<void(const JournalRecord &)> &restore)
+{
+    std::unique_ptr<Journal> j(new Journal(cfg, per_room));
+    if (!j->open(restore))
+        return false;
+    g_journal.store(j.release(), std::memory_order_release);
+    return true;
+}
+
+void journal_append(const JournalRecord &rec)
+{
+    if (Journal *j = g_journal.load(std::memory_order_acquire))
+        j->append(rec);
+}
+
+void suspend_journal()
+{
+    if (Journal *j = g_journal.load(std::memory_order_acquire))
+        j->close();
+}
+
+void close_journal()
+{
+    Journal *j = g_journal.exchange(nullptr, std::memory_order_acq_rel);
+    if (!j)
+        return;
+    j->close();
+    delete j; // no append can still be running: the engine has stopped
+}
+
+#endif
@@ -0,0 +1,52 @@
+// Optional append-only journal of chat messages, for history across restarts
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+struct JournalConfig
+{
+    std::string dir;                      // empty = no journal
+    size_t segment_bytes = 64 * 1024 * 1024; // size of each segment file
+    unsigned sync_ms = 50;                // longest a record waits for fsync
+    size_t sync_bytes = 1024 * 1024;      // unsynced bytes that trigger an early fsync
+};
+
+// One chat message as journaled; the views point into the journal while a
+// restore callback runs and must be copied to outlive it
+struct JournalRecord
+{
+    uint64_t seq = 0;    // sequence number within the room
+    uint64_t sender = 0; // connection id of the author
+    uint16_t flags = 0;  // MsgHeader flags: MSG_FRAGMENT for a piece of a longer message
+    std::string_view room;
+    std::string_view from;
+    std::string_view text;
+};
+
+// The journal is a directory of fixed-size segment files mapped into
+// memory. Appending is a memcpy under a mutex; a background thread flushes
+// the mapped pages with msync in groups (every sync_ms, or sooner after
+// sync_bytes) and prepares the next segment, so the broadcast path never
+// waits on the disk. A full segment is sealed with a small index file
+// listing, per room, the offsets of its last records and its highest
+// sequence number. On startup only those index files are read (plus a scan
+// of the unsealed newest segment), and exactly the records needed to refill
+// `per_room` messages of every room are visited.
+//
+// Opens or creates the journal and feeds `restore` the last `per_room`
+// records of every room (at least the newest one, so that sequence numbers
+// carry on), oldest segment first. False if the directory is unusable.
+bool open_journal(const JournalConfig &cfg, size_t per_room,
+                  const std::function<void(const JournalRecord &)> &restore);
+// Thread-safe; ignored when no journal is open
+void journal_append(const JournalRecord &rec);
+// Flushes everything written so far and closes the journal
+void close_journal();
+// Flushes and closes the files while appends may still arrive (they are
+// dropped from then on), so that a restarted process can open the journal
+// before this one has stopped (restart.h)
+void suspend_journal();
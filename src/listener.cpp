@@ -0,0 +1,160 @@
+// Listening socket setup shared by the engines
+#include "engine.h"
+#include "log.h"
+
+#include <cstdlib>
+#include <mutex>
+#include <string>
+
+static std::mutex g_listeners_mutex;
+static std::vector<std::pair<uint16_t, socket_t>> g_listeners; // every socket handed out
+static std::vector<std::pair<uint16_t, socket_t>> g_inherited; // not claimed yet
+static bool g_inherited_parsed = false;
+
+// CHAT_LISTEN_FDS="port:fd,port:fd,..." is set for a restarted process (restart.h)
+static void parse_inherited()
+{
+    g_inherited_parsed = true;
+    const char *env = std::getenv(LISTEN_FDS_ENV);
+    if (!env)
+        return;
+    std::string spec(env);
+    size_t pos = 0;
+    while (pos < spec.size())
+    {
+        size_t comma = spec.find(',', pos);
+        if (comma == std::string::npos)
+            comma = spec.size();
+        std::string item = spec.substr(pos, comma - pos);
+        size_t colon = item.find(':');
+        if (colon != std::string::npos)
+        {
+            unsigned long port = std::strtoul(item.c_str(), nullptr, 10);
+            long fd = std::strtol(item.c_str() + colon + 1, nullptr, 10);
+            if (port > 0 && port <= 0xffff && fd >= 0)
+                g_inherited.emplace_back(static_cast<uint16_t>(port), static_cast<socket_t>(fd));
+        }
+        pos = comma + 1;
+    }
+#if !defined(_WIN32)
+    unsetenv(LISTEN_FDS_ENV); // not for our own successor
+#endif
+}
+
+// An inherited listener for the port and address, if one is left. One bound
+// elsewhere is left alone, so a changed address is not silently ignored.
+static socket_t claim_inherited(uint16_t port, const in_addr &address)
+{
+    if (!g_inherited_parsed)
+        parse_inherited();
+    for (auto it = g_inherited.begin(); it != g_inherited.end(); ++it)
+    {
+        if (it->first != port)
+            continue;
+        sockaddr_in bound{};
+        socklen_t len = sizeof(bound);
+        if (getsockname(it->second, reinterpret_cast<sockaddr *>(&bound), &len) == SOCKET_ERROR ||
+            bound.sin_addr.s_addr != address.s_addr)
+        {
+            char was[INET_ADDRSTRLEN] = "?", now[INET_ADDRSTRLEN] = "?";
+            inet_ntop(AF_INET, &bound.sin_addr, was, sizeof(was));
+            inet_ntop(AF_INET, &address, now, sizeof(now));
+            LOG_WARN("Inherited listener for port " << port << " is bound to " << was << ", not " << now
+                                                    << "; binding anew");
+            continue;
+        }
+        socket_t s = it->second;
+        g_inherited.erase(it);
+        return s;
+    }
+    return INVALID_SOCKET;
+}
+
+bool reuse_port_supported()
+{
+#if defined(__linux__) && defined(SO_REUSEPORT)
+    return true;
+#elif defined(SO_REUSEPORT_LB)
+    return true;
+#else
+    // macOS/Windows accept SO_REUSEPORT-like options but do not balance load
+    return false;
+#endif
+}
+
+socket_t open_listener(uint16_t port, bool reuse_port, const std::string &address)
+{
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (!address.empty() && inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+    {
+        LOG_ERROR("invalid listen address " << address);
+        return INVALID_SOCKET;
+    }
+
+    std::lock_guard<std::mutex> lk(g_listeners_mutex);
+    socket_t inherited = claim_inherited(port, addr.sin_addr);
+    if (inherited != INVALID_SOCKET)
+    {
+        // still bound and listening; its backlog carried over the restart
+        LOG_INFO("Listening on inherited socket " << inherited << " for port " << port);
+        g_listeners.emplace_back(port, inherited);
+        return inherited;
+    }
+
+    socket_t listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listen_sock == INVALID_SOCKET)
+    {
+        LOG_ERROR("socket() failed");
+        return INVALID_SOCKET;
+    }
+
+    int opt = 1;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR,
+               reinterpret_cast<const char *>(&opt), sizeof(opt));
+    if (reuse_port)
+    {
+#if defined(__linux__) && defined(SO_REUSEPORT)
+        setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+#elif defined(SO_REUSEPORT_LB)
+        setsockopt(listen_sock, SOL_SOCKET, SO_REUSEPORT_LB, &opt, sizeof(opt));
+#endif
+    }
+
+    if (bind(listen_sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == SOCKET_ERROR)
+    {
+        LOG_ERROR("bind() failed");
+        close_socket(listen_sock);
+        return INVALID_SOCKET;
+    }
+
+    if (listen(listen_sock, SOMAXCONN) == SOCKET_ERROR)
+    {
+        LOG_ERROR("listen() failed");
+        close_socket(listen_sock);
+        return INVALID_SOCKET;
+    }
+    g_listeners.emplace_back(port, listen_sock);
+    return listen_sock;
+}
+
+std::vector<std::pair<uint16_t, socket_t>> open_listeners()
+{
+    std::lock_guard<std::mutex> lk(g_listeners_mutex);
+    return g_listeners;
+}
+
+void release_inherited_listeners()
+{
+    std::lock_guard<std::mutex> lk(g_listeners_mutex);
+    if (!g_inherited_parsed)
+        parse_inherited();
+    for (auto &kv : g_inherited)
+    {
+        LOG_INFO("Closing inherited listener for port " << kv.first << " (no longer configured)");
+        close_socket(kv.second);
+    }
+    g_inherited.clear();
+}
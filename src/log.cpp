@@ -0,0 +1,331 @@
+#include "log.h"
+#include "platform.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+std::atomic<int> log_threshold{static_cast<int>(LogLevel::Info)};
+
+static uint64_t now_sec()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+}
+
+// Limiters that have suppressed something; they are function-local statics
+// and live until exit
+static std::mutex g_limits_mutex;
+static std::vector<LogRateLimit *> g_limits;
+
+bool LogRateLimit::allow()
+{
+    uint64_t now = now_sec();
+    uint64_t w = window_.load(std::memory_order_relaxed);
+    if (w != now && window_.compare_exchange_strong(w, now, std::memory_order_relaxed))
+        count_.store(0, std::memory_order_relaxed);
+    if (count_.fetch_add(1, std::memory_order_relaxed) < PER_SECOND)
+        return true;
+    suppressed_.fetch_add(1, std::memory_order_relaxed);
+    if (!listed_.exchange(true))
+    {
+        std::lock_guard<std::mutex> lk(g_limits_mutex);
+        g_limits.push_back(this);
+    }
+    return false;
+}
+
+uint64_t LogRateLimit::take_suppressed(uint64_t now)
+{
+    if (window_.load(std::memory_order_relaxed) == now)
+        return 0; // still inside the window that is being suppressed
+    return suppressed_.exchange(0, std::memory_order_relaxed);
+}
+
+std::ostringstream &log_stream()
+{
+    static thread_local std::ostringstream os;
+    os.str(std::string());
+    os.clear();
+    return os;
+}
+
+struct LogRecord
+{
+    uint64_t ts_ns = 0; // wall clock
+    LogLevel level = LogLevel::Info;
+    std::string text;
+};
+
+// Single-producer (the owning thread) / single-consumer (the drain thread)
+// ring. Strings are moved in and out, so neither side allocates under
+// contention and the producer never waits.
+class LogRing
+{
+public:
+    static const size_t CAPACITY = 1024;
+
+    bool push(LogRecord &&rec)
+    {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == CAPACITY)
+        {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        slots_[tail % CAPACITY] = std::move(rec);
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const
+    {
+        return tail_.load(std::memory_order_acquire) - head_.load(std::memory_order_relaxed);
+    }
+
+    void drain(std::vector<LogRecord> &out)
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        size_t tail = tail_.load(std::memory_order_acquire);
+        for (; head != tail; ++head)
+            out.push_back(std::move(slots_[head % CAPACITY]));
+        head_.store(head, std::memory_order_release);
+    }
+
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> retired{false}; // owning thread has exited
+
+private:
+    LogRecord slots_[CAPACITY];
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
+
+static std::mutex g_rings_mutex;
+static std::vector<std::shared_ptr<LogRing>> g_rings;
+
+static std::atomic<bool> g_async{false};
+static std::thread g_drain_thread;
+static std::mutex g_drain_mutex;
+static std::condition_variable g_drain_cv;
+static bool g_drain_stop = false;
+static FILE *g_file = nullptr; // null: stdout / stderr
+static std::mutex g_sync_mutex; // serializes synchronous writes
+
+// Drain interval when nobody asks for an early flush
+static const int DRAIN_INTERVAL_MS = 20;
+
+struct RingHolder
+{
+    std::shared_ptr<LogRing> ring;
+
+    ~RingHolder()
+    {
+        if (ring)
+            ring->retired = true; // the drain thread empties and frees it
+    }
+};
+
+static LogRing &local_ring()
+{
+    static thread_local RingHolder holder;
+    if (!holder.ring)
+    {
+        holder.ring = std::make_shared<LogRing>();
+        std::lock_guard<std::mutex> lk(g_rings_mutex);
+        g_rings.push_back(holder.ring);
+    }
+    return *holder.ring;
+}
+
+static uint64_t wall_ns()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::system_clock::now().time_since_epoch())
+                                     .count());
+}
+
+static const char *level_name(LogLevel level)
+{
+    switch (level)
+    {
+    case LogLevel::Debug:
+        return "DEBUG";
+    case LogLevel::Info:
+        return "INFO ";
+    case LogLevel::Warn:
+        return "WARN ";
+    case LogLevel::Error:
+        return "ERROR";
+    }
+    return "?    ";
+}
+
+// "2026-01-31 12:34:56.789 INFO  text\n"
+static void format_record(const LogRecord &rec, std::string &out)
+{
+    time_t secs = static_cast<time_t>(rec.ts_ns / 1000000000ull);
+    unsigned ms = static_cast<unsigned>(rec.ts_ns / 1000000ull % 1000);
+    tm t{};
+#if defined(_WIN32)
+    localtime_s(&t, &secs);
+#else
+    localtime_r(&secs, &t);
+#endif
+    char head[48];
+    size_t n = strftime(head, sizeof(head), "%Y-%m-%d %H:%M:%S", &t);
+    snprintf(head + n, sizeof(head) - n, ".%03u %s ", ms, level_name(rec.level));
+    out += head;
+    out += rec.text;
+    out += '\n';
+}
+
+static void write_out(const std::string &normal, const std::string &errors)
+{
+    if (g_file)
+    {
+        fwrite(normal.data(), 1, normal.size(), g_file);
+        fflush(g_file);
+        return;
+    }
+    if (!normal.empty())
+    {
+        fwrite(normal.data(), 1, normal.size(), stdout);
+        fflush(stdout);
+    }
+    if (!errors.empty())
+    {
+        fwrite(errors.data(), 1, errors.size(), stderr);
+        fflush(stderr);
+    }
+}
+
+// One batch: everything buffered in every ring, merged by timestamp and
+// written with one call per stream
+static void drain_once(std::vector<LogRecord> &batch, std::string &normal, std::string &errors)
+{
+    std::vector<std::shared_ptr<LogRing>> rings;
+    {
+        std::lock_guard<std::mutex> lk(g_rings_mutex);
+        rings = g_rings;
+    }
+    uint64_t dropped = 0;
+    for (auto &r : rings)
+    {
+        bool retired = r->retired.load(std::memory_order_acquire);
+        r->drain(batch);
+        dropped += r->dropped.exchange(0, std::memory_order_relaxed);
+        if (retired)
+        {
+            std::lock_guard<std::mutex> lk(g_rings_mutex);
+            g_rings.erase(std::remove(g_rings.begin(), g_rings.end(), r), g_rings.end());
+        }
+    }
+    {
+        uint64_t now = now_sec();
+        std::lock_guard<std::mutex> lk(g_limits_mutex);
+        for (LogRateLimit *l : g_limits)
+        {
+            uint64_t n = l->take_suppressed(now);
+            if (n)
+                batch.push_back(LogRecord{wall_ns(), LogLevel::Warn,
+                                          "log: " + std::to_string(n) + " similar messages suppressed (" +
+                                              l->file() + ":" + std::to_string(l->line()) + ")"});
+        }
+    }
+    if (dropped)
+        batch.push_back(LogRecord{wall_ns(), LogLevel::Warn,
+                                  "log: " + std::to_string(dropped) + " records dropped (ring buffer full)"});
+    if (batch.empty())
+        return;
+
+    std::stable_sort(batch.begin(), batch.end(), [](const LogRecord &a, const LogRecord &b)
+                     { return a.ts_ns < b.ts_ns; });
+    for (auto &rec : batch)
+        format_record(rec, g_file || rec.level < LogLevel::Warn ? normal : errors);
+    write_out(normal, errors);
+    batch.clear();
+    normal.clear();
+    errors.clear();
+}
+
+static void drain_loop()
+{
+    std::vector<LogRecord> batch;
+    std::string normal, errors;
+    std::unique_lock<std::mutex> lk(g_drain_mutex);
+    while (!g_drain_stop)
+    {
+        g_drain_cv.wait_for(lk, std::chrono::milliseconds(DRAIN_INTERVAL_MS));
+        lk.unlock();
+        drain_once(batch, normal, errors);
+        lk.lock();
+    }
+    lk.unlock();
+    drain_once(batch, normal, errors);
+}
+
+void log_write(LogLevel level, std::string &&text)
+{
+    LogRecord rec{wall_ns(), level, std::move(text)};
+    if (!g_async.load(std::memory_order_acquire))
+    {
+        std::string line;
+        format_record(rec, line);
+        std::lock_guard<std::mutex> lk(g_sync_mutex);
+        write_out(g_file || level < LogLevel::Warn ? line : std::string(),
+                  !g_file && level >= LogLevel::Warn ? line : std::string());
+        return;
+    }
+    LogRing &ring = local_ring();
+    ring.push(std::move(rec));
+    // wake the drain thread early for errors or a ring filling up
+    if (level == LogLevel::Error || ring.size() == LogRing::CAPACITY / 2)
+        g_drain_cv.notify_one();
+}
+
+bool start_logger(const std::string &path)
+{
+    if (!path.empty())
+    {
+        g_file = fopen(path.c_str(), "a");
+        if (!g_file)
+        {
+            LOG_ERROR("cannot open log file " << path);
+            return false;
+        }
+    }
+    g_drain_stop = false;
+    {
+        ScopedSignalBlock block; // keep SIGINT on the main thread
+        g_drain_thread = std::thread(drain_loop);
+    }
+    g_async.store(true, std::memory_order_release);
+    return true;
+}
+
+void stop_logger()
+{
+    if (!g_drain_thread.joinable())
+        return;
+    g_async.store(false, std::memory_order_release);
+    {
+        std::lock_guard<std::mutex> lk(g_drain_mutex);
+        g_drain_stop = true;
+    }
+    g_drain_cv.notify_one();
+    g_drain_thread.join();
+    std::lock_guard<std::mutex> lk(g_sync_mutex);
+    if (g_file)
+    {
+        fclose(g_file);
+        g_file = nullptr;
+    }
+}
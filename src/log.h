@@ -0,0 +1,89 @@
+// Asynchronous logging: producers never block on an output stream
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <sstream>
+#include <string>
+
+enum class LogLevel
+{
+    Debug,
+    Info,
+    Warn,
+    Error,
+};
+
+extern std::atomic<int> log_threshold; // lowest LogLevel that is written
+
+inline bool log_enabled(LogLevel level)
+{
+    return static_cast<int>(level) >= log_threshold.load(std::memory_order_relaxed);
+}
+
+// Lets PER_SECOND records through per call site and counts the rest. The
+// drain thread reports the count once the one-second window has passed.
+class LogRateLimit
+{
+public:
+    static const uint32_t PER_SECOND = 10;
+
+    LogRateLimit(const char *file, int line) : file_(file), line_(line) {}
+
+    bool allow();
+    // Drain thread: returns and clears the count of a finished window
+    uint64_t take_suppressed(uint64_t now_sec);
+
+    const char *file() const { return file_; }
+    int line() const { return line_; }
+
+private:
+    const char *file_;
+    int line_;
+    std::atomic<uint64_t> window_{0};
+    std::atomic<uint32_t> count_{0};
+    std::atomic<uint64_t> suppressed_{0};
+    std::atomic<bool> listed_{false}; // registered with the drain thread
+};
+
+// Thread-local scratch stream for formatting a record
+std::ostringstream &log_stream();
+
+// Hands a formatted record to this thread's ring buffer. When the ring is
+// full the record is dropped (and counted) rather than blocking; before
+// start_logger() and after stop_logger() records are written synchronously.
+void log_write(LogLevel level, std::string &&text);
+
+// Starts the drain thread. An empty path logs Debug/Info to stdout and
+// Warn/Error to stderr; otherwise everything is appended to the file.
+bool start_logger(const std::string &path);
+// Drains everything still buffered and stops the drain thread
+void stop_logger();
+
+#define CHAT_LOG(level, expr)                                                       \
+    do                                                                              \
+    {                                                                               \
+        if (log_enabled(level))                                                     \
+        {                                                                           \
+            std::ostringstream &log_os_ = log_stream();                             \
+            log_os_ << expr;                                                        \
+            log_write(level, log_os_.str());                                        \
+        }                                                                           \
+    } while (0)
+
+#define CHAT_LOG_LIMITED(level, expr)                                                \
+    do                                                                               \
+    {                                                                                \
+        static LogRateLimit log_limit_(__FILE__, __LINE__);                          \
+        if (log_enabled(level) && log_limit_.allow())                                \
+        {                                                                            \
+            std::ostringstream &log_os_ = log_stream();                              \
+            log_os_ << expr;                                                         \
+            log_write(level, log_os_.str());                                         \
+        }                                                                            \
+    } while (0)
+
+#define LOG_DEBUG(expr) CHAT_LOG(LogLevel::Debug, expr)
+#define LOG_INFO(expr) CHAT_LOG(LogLevel::Info, expr)
+#define LOG_WARN(expr) CHAT_LOG_LIMITED(LogLevel::Warn, expr)
+#define LOG_ERROR(expr) CHAT_LOG_LIMITED(LogLevel::Error, expr)
@@ -0,0 +1,401 @@
+#include "metrics.h"
+#include "engine.h"
+#include "log.h"
+#include "outbound.h"
+#include "platform.h"
+#include "protocol.h"
+#include "trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+static const size_t COUNTERS = static_cast<size_t>(Counter::Count);
+static const size_t HISTOGRAMS = static_cast<size_t>(Histogram::Count);
+
+size_t HistogramBuckets::index(uint64_t v)
+{
+    if (v < SUB)
+        return static_cast<size_t>(v);
+    int msb = 0;
+    while (v >> (msb + 1))
+        ++msb;
+    int shift = msb - SUB_BITS;
+    return static_cast<size_t>(shift + 1) * SUB + static_cast<size_t>((v >> shift) - SUB);
+}
+
+uint64_t HistogramBuckets::upper(size_t i)
+{
+    if (i < SUB)
+        return i;
+    int shift = static_cast<int>(i / SUB) - 1;
+    uint64_t base = (SUB + i % SUB) << shift;
+    return base + ((uint64_t(1) << shift) - 1);
+}
+
+uint64_t HistogramSnapshot::quantile(double q) const
+{
+    if (count == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(std::ceil(q * static_cast<double>(count)));
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HistogramBuckets::BUCKETS; ++i)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+            return HistogramBuckets::upper(i);
+    }
+    return HistogramBuckets::upper(HistogramBuckets::BUCKETS - 1);
+}
+
+// ---- per-thread shards ----
+
+struct alignas(64) MetricShard
+{
+    std::atomic<uint64_t> counters[COUNTERS];
+    std::atomic<uint64_t> buckets[HISTOGRAMS][HistogramBuckets::BUCKETS];
+    std::atomic<uint64_t> sums[HISTOGRAMS];
+};
+
+static std::mutex g_shards_mutex;
+static std::vector<std::unique_ptr<MetricShard>> g_shards; // every shard ever made
+static std::vector<MetricShard *> g_free_shards;           // left behind by exited threads
+
+// Returns the thread's shard to the free list when the thread exits
+struct ShardLease
+{
+    MetricShard *shard = nullptr;
+
+    ~ShardLease()
+    {
+        if (!shard)
+            return;
+        std::lock_guard<std::mutex> lk(g_shards_mutex);
+        g_free_shards.push_back(shard);
+    }
+};
+
+static thread_local ShardLease t_lease;
+
+static MetricShard &local_shard()
+{
+    if (!t_lease.shard)
+    {
+        std::lock_guard<std::mutex> lk(g_shards_mutex);
+        if (!g_free_shards.empty())
+        {
+            t_lease.shard = g_free_shards.back();
+            g_free_shards.pop_back();
+        }
+        else
+        {
+            g_shards.emplace_back(new MetricShard()); // value-initialized: all zero
+            t_lease.shard = g_shards.back().get();
+        }
+    }
+    return *t_lease.shard;
+}
+
+// Only the owning thread writes a shard, so no read-modify-write is needed
+static inline void bump(std::atomic<uint64_t> &a, uint64_t n)
+{
+    a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+void metric_add(Counter c, uint64_t n)
+{
+    bump(local_shard().counters[static_cast<size_t>(c)], n);
+}
+
+void metric_record(Histogram h, uint64_t value)
+{
+    MetricShard &s = local_shard();
+    size_t hi = static_cast<size_t>(h);
+    bump(s.buckets[hi][HistogramBuckets::index(value)], 1);
+    bump(s.sums[hi], value);
+}
+
+void collect_metrics(MetricsSnapshot &out)
+{
+    out = MetricsSnapshot();
+    std::lock_guard<std::mutex> lk(g_shards_mutex);
+    for (auto &s : g_shards)
+    {
+        for (size_t c = 0; c < COUNTERS; ++c)
+            out.counters[c] += s->counters[c].load(std::memory_order_relaxed);
+        for (size_t h = 0; h < HISTOGRAMS; ++h)
+        {
+            HistogramSnapshot &hs = out.histograms[h];
+            for (size_t b = 0; b < HistogramBuckets::BUCKETS; ++b)
+            {
+                uint64_t n = s->buckets[h][b].load(std::memory_order_relaxed);
+                hs.buckets[b] += n;
+                hs.count += n;
+            }
+            hs.sum += s->sums[h].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+// ---- exposition ----
+
+static void write_counter(std::ostringstream &os, const char *name, const char *help, uint64_t v)
+{
+    os << "# HELP " << name << ' ' << help << "\n# TYPE " << name << " counter\n"
+       << name << ' ' << v << '\n';
+}
+
+static void write_summary(std::ostringstream &os, const char *name, const char *help,
+                          const HistogramSnapshot &h, double scale)
+{
+    os << "# HELP " << name << ' ' << help << "\n# TYPE " << name << " summary\n";
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    for (double q : quantiles)
+        os << name << "{quantile=\"" << q << "\"} " << static_cast<double>(h.quantile(q)) * scale << '\n';
+    os << name << "_sum " << static_cast<double>(h.sum) * scale << '\n'
+       << name << "_count " << h.count << '\n';
+}
+
+std::string format_prometheus(const MetricsSnapshot &snap)
+{
+    std::ostringstream os;
+    uint64_t accepted = snap.get(Counter::ConnectionsAccepted);
+    uint64_t closed = snap.get(Counter::ConnectionsClosed);
+    write_counter(os, "chat_connections_accepted_total", "Connections accepted.", accepted);
+    write_counter(os, "chat_connections_closed_total", "Connections closed.", closed);
+    write_counter(os, "chat_connections_handed_off_total", "Connections passed to the new process on restart.",
+                  snap.get(Counter::ConnectionsHandedOff));
+    os << "# HELP chat_connections_rejected_total Connections refused at accept by admission control.\n"
+       << "# TYPE chat_connections_rejected_total counter\n"
+       << "chat_connections_rejected_total{reason=\"limit\"} " << snap.get(Counter::RejectedTotal) << '\n'
+       << "chat_connections_rejected_total{reason=\"per_ip\"} " << snap.get(Counter::RejectedPerIp) << '\n';
+    os << "# HELP chat_connections Open connections.\n# TYPE chat_connections gauge\n"
+       << "chat_connections " << (accepted > closed ? accepted - closed : 0) << '\n';
+    write_counter(os, "chat_frames_received_total", "Frames received from clients.", snap.get(Counter::FramesIn));
+    write_counter(os, "chat_bytes_received_total", "Bytes received from clients, including length prefixes.", snap.get(Counter::BytesIn));
+    write_counter(os, "chat_frames_sent_total", "Frames fully written to clients.", snap.get(Counter::FramesOut));
+    write_counter(os, "chat_bytes_sent_total", "Bytes written to clients.", snap.get(Counter::BytesOut));
+    write_counter(os, "chat_broadcasts_total", "Messages fanned out to a room.", snap.get(Counter::Broadcasts));
+    write_counter(os, "chat_direct_messages_total", "Direct messages delivered, one per recipient connection.",
+                  snap.get(Counter::DirectMessages));
+
+    os << "# HELP chat_buffer_allocations_total Pooled buffer requests by where the memory came from.\n"
+       << "# TYPE chat_buffer_allocations_total counter\n"
+       << "chat_buffer_allocations_total{source=\"pool\"} " << snap.get(Counter::PoolReused) << '\n'
+       << "chat_buffer_allocations_total{source=\"heap\"} " << snap.get(Counter::PoolHeapAllocs) << '\n';
+    write_counter(os, "chat_client_allocations_total", "Connection objects taken from the slab.", snap.get(Counter::SlabAllocations));
+    write_counter(os, "chat_client_slab_chunks_total", "Slab chunks allocated from the heap.", snap.get(Counter::SlabChunks));
+
+    write_counter(os, "chat_compressed_frames_total", "Compressed frame variants built.", snap.get(Counter::CompressedFrames));
+    write_counter(os, "chat_compression_input_bytes_total", "Bytes of frames that were compressed.", snap.get(Counter::CompressIn));
+    write_counter(os, "chat_compression_output_bytes_total", "Bytes of the compressed variants.", snap.get(Counter::CompressOut));
+
+    write_counter(os, "chat_journal_bytes_total", "Bytes appended to the message journal.", snap.get(Counter::JournalBytes));
+
+    os << "# HELP chat_connection_timeouts_total Connections closed by a lifecycle deadline.\n"
+       << "# TYPE chat_connection_timeouts_total counter\n"
+       << "chat_connection_timeouts_total{reason=\"handshake\"} " << snap.get(Counter::HandshakeTimeouts) << '\n'
+       << "chat_connection_timeouts_total{reason=\"idle\"} " << snap.get(Counter::IdleTimeouts) << '\n'
+       << "chat_connection_timeouts_total{reason=\"write\"} " << snap.get(Counter::WriteTimeouts) << '\n';
+    os << "# HELP chat_rate_limited_total Rate limit decisions: connections paused, room posts refused.\n"
+       << "# TYPE chat_rate_limited_total counter\n"
+       << "chat_rate_limited_total{scope=\"client\"} " << snap.get(Counter::ClientRateLimited) << '\n'
+       << "chat_rate_limited_total{scope=\"room\"} " << snap.get(Counter::RoomRateLimited) << '\n';
+    os << "# HELP chat_cluster_relays_total Frames exchanged with peer nodes.\n"
+       << "# TYPE chat_cluster_relays_total counter\n"
+       << "chat_cluster_relays_total{direction=\"out\"} " << snap.get(Counter::ClusterOut) << '\n'
+       << "chat_cluster_relays_total{direction=\"in\"} " << snap.get(Counter::ClusterIn) << '\n';
+    write_counter(os, "chat_inbox_full_total", "Times a connection stopped being read until workers caught up.",
+                  snap.get(Counter::InboxFull));
+    write_counter(os, "chat_cluster_dropped_total", "Relays dropped because a peer link was backed up.", snap.get(Counter::ClusterDropped));
+    write_counter(os, "chat_pings_sent_total", "Heartbeat pings sent to silent clients.", snap.get(Counter::PingsSent));
+
+    os << "# HELP chat_queue_dropped_total Frames dropped by the overflow policy.\n"
+       << "# TYPE chat_queue_dropped_total counter\n"
+       << "chat_queue_dropped_total{reason=\"oldest\"} " << queue_stats.dropped_oldest << '\n'
+       << "chat_queue_dropped_total{reason=\"new\"} " << queue_stats.dropped_new << '\n';
+    write_counter(os, "chat_queue_disconnects_total", "Clients disconnected by the overflow policy.", queue_stats.disconnects);
+
+    write_summary(os, "chat_broadcast_fanout", "Recipients per broadcast.", snap.get(Histogram::FanOut), 1.0);
+    write_summary(os, "chat_outbound_queue_depth", "Frames queued for a client after a push.", snap.get(Histogram::QueueDepth), 1.0);
+    write_summary(os, "chat_send_seconds", "Duration of one gathered write.", snap.get(Histogram::SendNanos), 1e-9);
+    write_summary(os, "chat_rate_limit_pause_seconds", "How long a rate-limited connection was not read.", snap.get(Histogram::ThrottleNanos), 1e-9);
+    write_summary(os, "chat_journal_sync_seconds", "Duration of one journal group commit.", snap.get(Histogram::JournalSyncNanos), 1e-9);
+    return os.str();
+}
+
+static void log_summary(const MetricsSnapshot &snap)
+{
+    uint64_t accepted = snap.get(Counter::ConnectionsAccepted);
+    uint64_t closed = snap.get(Counter::ConnectionsClosed);
+    LOG_INFO("stats: connections=" << (accepted > closed ? accepted - closed : 0)
+          << " frames_in=" << snap.get(Counter::FramesIn)
+          << " frames_out=" << snap.get(Counter::FramesOut)
+          << " bytes_in=" << snap.get(Counter::BytesIn)
+          << " bytes_out=" << snap.get(Counter::BytesOut)
+          << " fanout_p99=" << snap.get(Histogram::FanOut).quantile(0.99)
+          << " queue_p99=" << snap.get(Histogram::QueueDepth).quantile(0.99)
+          << " send_p99_us=" << snap.get(Histogram::SendNanos).quantile(0.99) / 1000
+          << " heap_allocs=" << snap.get(Counter::PoolHeapAllocs));
+}
+
+// ---- admin endpoint ----
+
+static std::thread g_admin_thread;
+static std::atomic<bool> g_admin_stop{false};
+
+using AdminClock = std::chrono::steady_clock;
+
+static unsigned ms_left(AdminClock::time_point deadline)
+{
+    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - AdminClock::now()).count();
+    return left > 0 ? static_cast<unsigned>(left) : 0;
+}
+
+// Written in slices so that a client reading slowly cannot hold the
+// endpoint past its deadline
+static void send_response(socket_t s, AdminClock::time_point deadline, const char *status, const std::string &body,
+                          const char *type = "text/plain; version=0.0.4; charset=utf-8")
+{
+    std::ostringstream head;
+    head << "HTTP/1.0 " << status << "\r\n"
+         << "Content-Type: " << type << "\r\n"
+         << "Content-Length: " << body.size() << "\r\n"
+         << "Connection: close\r\n\r\n";
+    std::string out = head.str() + body;
+    size_t sent = 0;
+    while (sent < out.size())
+    {
+        unsigned left = ms_left(deadline);
+        if (left == 0)
+            return;
+        set_socket_timeout(s, true, left);
+        size_t chunk = std::min<size_t>(out.size() - sent, 64 * 1024);
+        int n = send(s, out.data() + sent, static_cast<int>(chunk), 0);
+        if (n <= 0)
+            return;
+        sent += static_cast<size_t>(n);
+    }
+}
+
+// Sampling rate from "?sample=N"; 100 when absent
+static unsigned sample_param(const std::string &req)
+{
+    size_t at = req.find("?sample=");
+    size_t end = req.find(' ', 4);
+    if (at == std::string::npos || at > end)
+        return 100;
+    unsigned long v = std::strtoul(req.c_str() + at + 8, nullptr, 10);
+    return v == 0 || v > 1000000000 ? 100 : static_cast<unsigned>(v);
+}
+
+// One short-lived HTTP/1.0 exchange: GET /metrics, and the tracing controls
+// /trace/start[?sample=N] (clears earlier events), /trace/stop and /trace
+// (the events as Chrome trace JSON)
+static void serve_scrape(socket_t s)
+{
+    auto deadline = AdminClock::now() + std::chrono::milliseconds(ADMIN_REQUEST_MS);
+    std::string req;
+    char buf[1024];
+    while (req.find("\r\n\r\n") == std::string::npos && req.size() < 8192)
+    {
+        unsigned left = ms_left(deadline);
+        if (left == 0 || !wait_for_socket(s, false, static_cast<int>(left)))
+            return;
+        int n = recv(s, buf, sizeof(buf), 0);
+        if (n <= 0)
+            return;
+        req.append(buf, static_cast<size_t>(n));
+    }
+    if (req.compare(0, 13, "GET /metrics ") == 0 || req.compare(0, 6, "GET / ") == 0)
+    {
+        MetricsSnapshot snap;
+        collect_metrics(snap);
+        send_response(s, deadline, "200 OK", format_prometheus(snap));
+    }
+    else if (req.compare(0, 17, "GET /trace/start ") == 0 || req.compare(0, 17, "GET /trace/start?") == 0)
+    {
+        unsigned every = sample_param(req);
+        trace_clear();
+        trace_sample = every;
+        LOG_INFO("tracing one frame in " << every);
+        send_response(s, deadline, "200 OK", "tracing one frame in " + std::to_string(every) + "\n");
+    }
+    else if (req.compare(0, 16, "GET /trace/stop ") == 0)
+    {
+        trace_sample = 0;
+        LOG_INFO("tracing stopped");
+        send_response(s, deadline, "200 OK", "tracing stopped\n");
+    }
+    else if (req.compare(0, 11, "GET /trace ") == 0)
+        send_response(s, deadline, "200 OK", trace_export_json(), "application/json");
+    else
+        send_response(s, deadline, "404 Not Found", "not found\n");
+}
+
+static void admin_loop(socket_t listen_sock, unsigned interval_sec)
+{
+    using clock = std::chrono::steady_clock;
+    auto next_dump = clock::now() + std::chrono::seconds(interval_sec);
+    while (!g_admin_stop)
+    {
+        if (listen_sock != INVALID_SOCKET && wait_for_socket(listen_sock, false, 200))
+        {
+            socket_t s = accept(listen_sock, nullptr, nullptr);
+            if (s != INVALID_SOCKET)
+            {
+                set_nosigpipe(s);
+                serve_scrape(s);
+                close_socket(s);
+            }
+        }
+        else if (listen_sock == INVALID_SOCKET)
+            std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        if (interval_sec && clock::now() >= next_dump)
+        {
+            MetricsSnapshot snap;
+            collect_metrics(snap);
+            log_summary(snap);
+            next_dump += std::chrono::seconds(interval_sec);
+        }
+    }
+    if (listen_sock != INVALID_SOCKET)
+        close_socket(listen_sock);
+}
+
+bool start_admin(uint16_t admin_port, const std::string &address, unsigned interval_sec)
+{
+    if (admin_port == 0 && interval_sec == 0)
+        return true;
+    socket_t listen_sock = INVALID_SOCKET;
+    if (admin_port != 0)
+    {
+        listen_sock = open_listener(admin_port, false, address);
+        if (listen_sock == INVALID_SOCKET)
+        {
+            LOG_ERROR("admin: cannot listen on " << address << ":" << admin_port);
+            return false;
+        }
+        LOG_INFO("Metrics available at http://" << address << ":" << admin_port << "/metrics");
+    }
+    ScopedSignalBlock block; // keep SIGINT on the main thread
+    g_admin_thread = std::thread(admin_loop, listen_sock, interval_sec);
+    return true;
+}
+
+void stop_admin()
+{
+    if (!g_admin_thread.joinable())
+        return;
+    g_admin_stop = true;
+    g_admin_thread.join();
+}
@@ -0,0 +1,108 @@
+// Process-wide counters and latency/size histograms
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+enum class Counter
+{
+    ConnectionsAccepted,
+    ConnectionsClosed,
+    FramesIn,
+    BytesIn,
+    FramesOut,
+    BytesOut,
+    Broadcasts,
+    DirectMessages,  // direct messages delivered (one per recipient connection)
+    PoolReused,      // buffer pool hits (thread cache or depot)
+    PoolHeapAllocs,  // buffer pool misses and oversized buffers
+    SlabAllocations, // connection objects handed out
+    SlabChunks,      // slab chunks taken from the heap
+    CompressedFrames, // compressed variants built (once per broadcast and mode)
+    CompressIn,       // wire bytes of frames before compression
+    CompressOut,      // wire bytes of their compressed variants
+    JournalBytes,     // bytes appended to the message journal
+    HandshakeTimeouts, // connections closed before sending a username
+    IdleTimeouts,      // connections closed after receiving nothing for too long
+    WriteTimeouts,     // connections closed because their output made no progress
+    PingsSent,
+    ClientRateLimited, // times a connection stopped being read for exceeding its rate
+    RoomRateLimited,   // posts refused because their room exceeded its rate
+    ClusterOut,        // relays queued for peer nodes (one per peer)
+    ClusterIn,         // relays received from peer nodes
+    ClusterDropped,    // relays dropped because a peer's buffer was full
+    ConnectionsHandedOff, // passed to the new process on restart (also counted as closed)
+    RejectedTotal,        // refused at accept: --max-connections reached
+    RejectedPerIp,        // refused at accept: --max-per-ip reached for the address
+    InboxFull,            // times a connection stopped being read because workers were behind on it
+    Count
+};
+
+enum class Histogram
+{
+    FanOut,     // recipients per broadcast
+    QueueDepth, // frames in a client's outbound queue after a push
+    SendNanos,  // duration of one gathered write
+    JournalSyncNanos, // duration of one journal group commit (msync)
+    ThrottleNanos,    // how long a rate-limited connection was not read
+    Count
+};
+
+// Log-linear buckets: values below 2^SUB_BITS are exact, larger ones land in
+// one of 2^SUB_BITS buckets per power of two (about 6% relative error)
+struct HistogramBuckets
+{
+    static const int SUB_BITS = 4;
+    static const size_t SUB = size_t(1) << SUB_BITS;
+    static const size_t BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+    static size_t index(uint64_t v);
+    static uint64_t upper(size_t i); // largest value mapped to bucket i
+};
+
+// Each thread updates its own cache-line aligned shard with plain relaxed
+// stores, so the hot path never contends; readers sum all shards. Shards
+// of exited threads are handed to new threads, so totals are never lost.
+void metric_add(Counter c, uint64_t n = 1);
+void metric_record(Histogram h, uint64_t value);
+
+inline uint64_t monotonic_ns()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+}
+
+// Point-in-time sum over all threads
+struct HistogramSnapshot
+{
+    uint64_t buckets[HistogramBuckets::BUCKETS] = {};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    uint64_t quantile(double q) const;
+};
+
+struct MetricsSnapshot
+{
+    uint64_t counters[static_cast<size_t>(Counter::Count)] = {};
+    HistogramSnapshot histograms[static_cast<size_t>(Histogram::Count)];
+
+    uint64_t get(Counter c) const { return counters[static_cast<size_t>(c)]; }
+    const HistogramSnapshot &get(Histogram h) const { return histograms[static_cast<size_t>(h)]; }
+};
+
+void collect_metrics(MetricsSnapshot &out);
+
+// Prometheus text exposition format (version 0.0.4)
+std::string format_prometheus(const MetricsSnapshot &snap);
+
+// Serve /metrics on admin_port of `address` (0 = off) and print a summary
+// line every interval_sec seconds (0 = off) until stop_admin(). Requests are
+// served one at a time, each given up on after ADMIN_REQUEST_MS.
+static const unsigned ADMIN_REQUEST_MS = 2000;
+bool start_admin(uint16_t admin_port, const std::string &address, unsigned interval_sec);
+void stop_admin();
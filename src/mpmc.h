@@ -0,0 +1,98 @@
+// Bounded lock-free multi-producer/multi-consumer queue (Vyukov's ring)
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// Each cell carries a sequence number that tells producers and consumers whose
+// turn it is, so push/pop are one CAS on the shared index plus a store on the
+// cell. Capacity is rounded up to a power of two.
+template <typename T>
+class BoundedMpmcQueue
+{
+public:
+    explicit BoundedMpmcQueue(size_t capacity)
+    {
+        size_t cap = 2;
+        while (cap < capacity)
+            cap <<= 1;
+        mask_ = cap - 1;
+        cells_.reset(new Cell[cap]);
+        for (size_t i = 0; i < cap; ++i)
+            cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    BoundedMpmcQueue(const BoundedMpmcQueue &) = delete;
+    BoundedMpmcQueue &operator=(const BoundedMpmcQueue &) = delete;
+
+    // False when the queue is full; value is left untouched in that case
+    bool try_push(T &value)
+    {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = cells_[pos & mask_];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    cell.value = std::move(value);
+                    cell.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = tail_.load(std::memory_order_relaxed);
+        }
+    }
+
+    bool try_pop(T &out)
+    {
+        size_t pos = head_.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = cells_[pos & mask_];
+            size_t seq = cell.seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0)
+            {
+                if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    out = std::move(cell.value);
+                    cell.value = T();
+                    cell.seq.store(pos + mask_ + 1, std::memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false;
+            else
+                pos = head_.load(std::memory_order_relaxed);
+        }
+    }
+
+    // Approximate; only meaningful as a hint
+    bool empty() const
+    {
+        return head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
@@ -0,0 +1,160 @@
+#include "outbound.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <algorithm>
+
+QueueLimits queue_limits;
+QueueStats queue_stats;
+CoalesceLimits coalesce_limits;
+
+void log_queue_stats()
+{
+    LOG_INFO("Outbound queue overflow: dropped_oldest=" << queue_stats.dropped_oldest
+          << " dropped_new=" << queue_stats.dropped_new
+          << " disconnects=" << queue_stats.disconnects);
+}
+
+OutboundQueue::Push OutboundQueue::push(const FramePtr &frame)
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    return push_locked(frame);
+}
+
+OutboundQueue::Push OutboundQueue::push(const FramePtr *frames, size_t n)
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    Push result = Push::Queued;
+    for (size_t i = 0; i < n; ++i)
+    {
+        Push r = push_locked(frames[i]);
+        if (r == Push::Disconnect)
+            return r;
+        if (r == Push::Dropped)
+            result = r;
+    }
+    return result;
+}
+
+OutboundQueue::Push OutboundQueue::push_locked(const FramePtr &frame)
+{
+    if (closed_ || aborted_)
+        return Push::Dropped;
+
+    const QueueLimits &lim = queue_limits;
+    size_t size = frame->size();
+    auto over = [&](size_t count, size_t bytes)
+    { return count > 0 && (count >= lim.max_frames || bytes + size > lim.max_bytes); };
+
+    if (over(frames_.size(), bytes_))
+    {
+        switch (lim.policy)
+        {
+        case OverflowPolicy::DropNew:
+            ++queue_stats.dropped_new;
+            return Push::Dropped;
+        case OverflowPolicy::Disconnect:
+            aborted_ = true;
+            ++queue_stats.disconnects;
+            cv_.notify_one();
+            return Push::Disconnect;
+        case OverflowPolicy::DropOldest:
+        {
+            // a partially written front frame must stay or the stream desyncs
+            size_t keep = std::max(pinned_, offset_ > 0 ? size_t(1) : size_t(0));
+            // the oldest droppable frames follow the kept prefix; dropping them
+            // moves only that prefix (at most one batch), never the rest
+            size_t drop = 0, freed = 0;
+            while (keep + drop < frames_.size() && over(frames_.size() - drop, bytes_ - freed))
+                freed += frames_[keep + drop++]->size();
+            frames_.erase_after(keep, drop);
+            bytes_ -= freed;
+            queue_stats.dropped_oldest += drop;
+            if (over(frames_.size(), bytes_))
+            {
+                ++queue_stats.dropped_new;
+                return Push::Dropped;
+            }
+            break;
+        }
+        }
+    }
+
+    bool was_empty = frames_.empty();
+    frames_.push_back(frame);
+    bytes_ += size;
+    metric_record(Histogram::QueueDepth, frames_.size());
+    if (was_empty)
+        cv_.notify_one();
+    return Push::Queued;
+}
+
+size_t OutboundQueue::peek(std::vector<FramePtr> &out, size_t max_frames)
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    size_t n = std::min(max_frames, frames_.size());
+    out.clear();
+    for (size_t i = 0; i < n; ++i)
+        out.push_back(frames_[i]);
+    pinned_ = n;
+    return offset_;
+}
+
+void OutboundQueue::consume(size_t bytes)
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    pinned_ = 0;
+    metric_add(Counter::BytesOut, bytes);
+    while (bytes > 0 && !frames_.empty())
+    {
+        size_t rem = frames_.front()->size() - offset_;
+        if (bytes < rem)
+        {
+            offset_ += bytes;
+            return;
+        }
+        bytes -= rem;
+        metric_add(Counter::FramesOut);
+        bytes_ -= frames_.front()->size();
+        frames_.pop_front();
+        offset_ = 0;
+    }
+}
+
+bool OutboundQueue::empty() const
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    return frames_.empty();
+}
+
+bool OutboundQueue::wait()
+{
+    std::unique_lock<std::mutex> lk(mutex_);
+    cv_.wait(lk, [&]
+             { return !frames_.empty() || closed_ || aborted_; });
+    return !aborted_ && !frames_.empty();
+}
+
+void OutboundQueue::close()
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    closed_ = true;
+    cv_.notify_one();
+}
+
+void OutboundQueue::abort()
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    aborted_ = true;
+    frames_.clear();
+    bytes_ = 0;
+    offset_ = 0;
+    pinned_ = 0;
+    cv_.notify_one();
+}
+
+bool OutboundQueue::aborted() const
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    return aborted_;
+}
@@ -0,0 +1,89 @@
+// Bounded per-client outbound queue of shared frames
+#pragma once
+
+#include "protocol.h"
+#include "ring.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+// What push() does when a queue is over its limits
+enum class OverflowPolicy
+{
+    DropOldest, // discard the oldest frames that are not already being written
+    DropNew,    // discard the frame being pushed
+    Disconnect, // give up on the client
+};
+
+struct QueueLimits
+{
+    size_t max_frames = 1024;
+    size_t max_bytes = 4 * 1024 * 1024;
+    OverflowPolicy policy = OverflowPolicy::DropOldest;
+};
+
+// How much of a client's queue a single gathered write may coalesce
+struct CoalesceLimits
+{
+    size_t max_iov = 64;           // frames per writev/WSASend
+    size_t max_bytes = 256 * 1024; // bytes per writev/WSASend
+};
+
+// Process-wide overflow counters, one per policy outcome
+struct QueueStats
+{
+    std::atomic<uint64_t> dropped_oldest{0};
+    std::atomic<uint64_t> dropped_new{0};
+    std::atomic<uint64_t> disconnects{0};
+};
+
+extern QueueLimits queue_limits; // set once at startup, before any client exists
+extern QueueStats queue_stats;
+extern CoalesceLimits coalesce_limits; // set once at startup
+
+void log_queue_stats();
+
+// Many producers (broadcasters) push; one consumer (the connection's I/O
+// thread) peeks a batch, writes it without holding the lock, then consumes.
+class OutboundQueue
+{
+public:
+    enum class Push
+    {
+        Queued,
+        Dropped,    // frame (or older ones) discarded, client stays
+        Disconnect, // limits hit under OverflowPolicy::Disconnect
+    };
+
+    Push push(const FramePtr &frame);
+    // Several frames under one lock and at most one wake-up; stops at the
+    // first Disconnect
+    Push push(const FramePtr *frames, size_t n);
+
+    // Refs to up to max_frames unsent frames; returns bytes of out[0] already sent
+    size_t peek(std::vector<FramePtr> &out, size_t max_frames);
+    // Mark `bytes` from the front as written
+    void consume(size_t bytes);
+    bool empty() const;
+
+    // Blocks until there is something to send; false once closed and drained or aborted
+    bool wait();
+    void close(); // accept no more frames, consumer drains what is left
+    void abort(); // stop now and drop whatever is queued
+    bool aborted() const;
+
+private:
+    Push push_locked(const FramePtr &frame);
+
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    RingQueue<FramePtr> frames_;
+    size_t bytes_ = 0;  // total size of queued frames
+    size_t offset_ = 0; // bytes of frames_.front() already sent
+    size_t pinned_ = 0; // frames handed out by the last peek; never dropped
+    bool closed_ = false;
+    bool aborted_ = false;
+};
@@ -0,0 +1,184 @@
+// Cross-platform socket helpers shared by every engine
+#pragma once
+
+#include <cstdint>
+#include <cerrno>
+#include <csignal>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+typedef SOCKET socket_t;
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#define SOCKET_ERROR (-1)
+#endif
+
+// send() flag that suppresses SIGPIPE where the platform supports it
+#if defined(MSG_NOSIGNAL)
+#define CHAT_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define CHAT_SEND_FLAGS 0
+#endif
+
+// Helper: close socket cross-platform
+inline void close_socket(socket_t s)
+{
+#if defined(_WIN32)
+    closesocket(s);
+#else
+    close(s);
+#endif
+}
+
+// Shut down both directions; wakes threads blocked in send/recv on s
+inline void shutdown_socket(socket_t s)
+{
+#if defined(_WIN32)
+    shutdown(s, SD_BOTH);
+#else
+    shutdown(s, SHUT_RDWR);
+#endif
+}
+
+// Last socket error code (errno / WSAGetLastError)
+inline int last_socket_error()
+{
+#if defined(_WIN32)
+    return WSAGetLastError();
+#else
+    return errno;
+#endif
+}
+
+inline bool socket_would_block(int err)
+{
+#if defined(_WIN32)
+    return err == WSAEWOULDBLOCK;
+#else
+    return err == EAGAIN || err == EWOULDBLOCK;
+#endif
+}
+
+inline bool socket_interrupted(int err)
+{
+#if defined(_WIN32)
+    return err == WSAEINTR;
+#else
+    return err == EINTR;
+#endif
+}
+
+// Switch a socket to non-blocking mode (returns false on failure)
+inline bool set_nonblocking(socket_t s)
+{
+#if defined(_WIN32)
+    u_long mode = 1;
+    return ioctlsocket(s, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0)
+        return false;
+    return fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+// accept() of a non-blocking socket; on Linux a single accept4 call that
+// also sets close-on-exec
+inline socket_t accept_nonblocking(socket_t listener, sockaddr_in &peer)
+{
+    socklen_t plen = sizeof(peer);
+#if defined(__linux__)
+    return accept4(listener, reinterpret_cast<sockaddr *>(&peer), &plen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+    socket_t s = accept(listener, reinterpret_cast<sockaddr *>(&peer), &plen);
+    if (s != INVALID_SOCKET && !set_nonblocking(s))
+    {
+        close_socket(s);
+        return INVALID_SOCKET;
+    }
+    return s;
+#endif
+}
+
+// Disable Nagle: the send path coalesces frames itself, so delaying small
+// segments would only add latency
+inline void set_nodelay(socket_t s)
+{
+    int opt = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char *>(&opt), sizeof(opt));
+}
+
+// Stop the kernel from raising SIGPIPE for this socket on platforms without MSG_NOSIGNAL
+inline void set_nosigpipe(socket_t s)
+{
+#if defined(SO_NOSIGPIPE)
+    int opt = 1;
+    setsockopt(s, SOL_SOCKET, SO_NOSIGPIPE, &opt, sizeof(opt));
+#else
+    (void)s;
+#endif
+}
+
+// Blocking receives (or sends) on the socket fail after ms milliseconds
+// without any progress; 0 = never
+inline void set_socket_timeout(socket_t s, bool for_write, unsigned ms)
+{
+#if defined(_WIN32)
+    DWORD tv = ms;
+#else
+    timeval tv;
+    tv.tv_sec = static_cast<time_t>(ms / 1000);
+    tv.tv_usec = static_cast<suseconds_t>((ms % 1000) * 1000);
+#endif
+    setsockopt(s, SOL_SOCKET, for_write ? SO_SNDTIMEO : SO_RCVTIMEO, reinterpret_cast<const char *>(&tv), sizeof(tv));
+}
+
+// Blocks the shutdown signals for the lifetime of the object so that threads
+// spawned inside the scope inherit the mask and SIGINT keeps landing on main().
+class ScopedSignalBlock
+{
+public:
+    ScopedSignalBlock()
+    {
+#if !defined(_WIN32)
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGTERM);
+#if defined(SIGUSR2)
+        sigaddset(&set, SIGUSR2);
+#endif
+        pthread_sigmask(SIG_BLOCK, &set, &old_);
+#endif
+    }
+    ~ScopedSignalBlock()
+    {
+#if !defined(_WIN32)
+        pthread_sigmask(SIG_SETMASK, &old_, nullptr);
+#endif
+    }
+    ScopedSignalBlock(const ScopedSignalBlock &) = delete;
+    ScopedSignalBlock &operator=(const ScopedSignalBlock &) = delete;
+
+private:
+#if !defined(_WIN32)
+    sigset_t old_;
+#endif
+};
@@ -0,0 +1,169 @@
+#include "pool.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstdint>
+
+// Blocks each thread may hold per class, and how many move to or from the
+// depot at once
+static const size_t CACHE_LIMIT[POOL_CLASSES] = {256, 32, 4};
+static const size_t DEPOT_BATCH[POOL_CLASSES] = {128, 16, 2};
+
+static int class_of(size_t size)
+{
+    for (size_t c = 0; c < POOL_CLASSES; ++c)
+    {
+        if (size <= POOL_CLASS_SIZES[c])
+            return static_cast<int>(c);
+    }
+    return -1;
+}
+
+size_t pool_capacity(size_t size)
+{
+    int c = class_of(size);
+    return c < 0 ? size : POOL_CLASS_SIZES[c];
+}
+
+struct Depot
+{
+    std::mutex mutex;
+    std::vector<void *> free[POOL_CLASSES];
+};
+
+// Never destroyed: frames may still be released by static destructors
+static Depot *depots()
+{
+    static Depot *d = new Depot[POOL_MAX_NODES];
+    return d;
+}
+
+// The calling thread's node; trivially destructible, like t_cache_dead
+static thread_local unsigned t_node = 0;
+
+static Depot &depot()
+{
+    return depots()[t_node];
+}
+
+void pool_bind_node(unsigned node)
+{
+    t_node = node % POOL_MAX_NODES;
+}
+
+// Set once this thread's cache has been destroyed (thread or process exit);
+// a trivially destructible flag stays readable after that
+static thread_local bool t_cache_dead = false;
+
+struct ThreadCache
+{
+    std::vector<void *> free[POOL_CLASSES];
+
+    ThreadCache()
+    {
+        for (size_t c = 0; c < POOL_CLASSES; ++c)
+            free[c].reserve(CACHE_LIMIT[c]);
+    }
+
+    ~ThreadCache()
+    {
+        t_cache_dead = true;
+        Depot &d = depot();
+        std::lock_guard<std::mutex> lk(d.mutex);
+        for (size_t c = 0; c < POOL_CLASSES; ++c)
+            d.free[c].insert(d.free[c].end(), free[c].begin(), free[c].end());
+    }
+};
+
+static thread_local ThreadCache t_cache;
+
+static void refill(size_t c, std::vector<void *> &local)
+{
+    Depot &d = depot();
+    std::lock_guard<std::mutex> lk(d.mutex);
+    std::vector<void *> &shared = d.free[c];
+    size_t n = std::min(DEPOT_BATCH[c], shared.size());
+    local.insert(local.end(), shared.end() - static_cast<std::ptrdiff_t>(n), shared.end());
+    shared.resize(shared.size() - n);
+}
+
+static void spill(size_t c, std::vector<void *> &local)
+{
+    Depot &d = depot();
+    std::lock_guard<std::mutex> lk(d.mutex);
+    size_t n = std::min(DEPOT_BATCH[c], local.size());
+    d.free[c].insert(d.free[c].end(), local.end() - static_cast<std::ptrdiff_t>(n), local.end());
+    local.resize(local.size() - n);
+}
+
+void *pool_allocate(size_t size)
+{
+    int c = class_of(size);
+    if (c >= 0 && !t_cache_dead)
+    {
+        std::vector<void *> &local = t_cache.free[c];
+        if (local.empty())
+            refill(static_cast<size_t>(c), local);
+        if (!local.empty())
+        {
+            void *p = local.back();
+            local.pop_back();
+            metric_add(Counter::PoolReused);
+            return p;
+        }
+    }
+    metric_add(Counter::PoolHeapAllocs);
+    return ::operator new(c < 0 ? size : POOL_CLASS_SIZES[c]);
+}
+
+void pool_release(void *p, size_t size)
+{
+    if (!p)
+        return;
+    int c = class_of(size);
+    if (c < 0)
+    {
+        ::operator delete(p);
+        return;
+    }
+    if (t_cache_dead)
+    {
+        Depot &d = depot();
+        std::lock_guard<std::mutex> lk(d.mutex);
+        d.free[c].push_back(p);
+        return;
+    }
+    std::vector<void *> &local = t_cache.free[c];
+    if (local.size() == CACHE_LIMIT[c])
+        spill(static_cast<size_t>(c), local);
+    local.push_back(p);
+}
+
+Slab::Slab(size_t object_size)
+{
+    // keep every object in a chunk suitably aligned
+    size_t align = alignof(std::max_align_t);
+    object_size_ = (object_size + align - 1) / align * align;
+}
+
+void *Slab::allocate()
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    if (free_.empty())
+    {
+        char *chunk = static_cast<char *>(::operator new(object_size_ * OBJECTS_PER_CHUNK));
+        for (size_t i = OBJECTS_PER_CHUNK; i-- > 0;)
+            free_.push_back(chunk + i * object_size_);
+        metric_add(Counter::SlabChunks);
+    }
+    void *p = free_.back();
+    free_.pop_back();
+    metric_add(Counter::SlabAllocations);
+    return p;
+}
+
+void Slab::release(void *p)
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    free_.push_back(p);
+}
@@ -0,0 +1,174 @@
+// Pooled memory for frames, receive buffers and connection objects
+#pragma once
+
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Size classes (256 B / 4 KB / 64 KB). Each thread keeps a bounded cache per
+// class; blocks freed on another thread land in that thread's cache, and
+// caches trade surplus with a shared depot in batches. Larger requests go
+// straight to the heap. After warm-up, steady traffic never calls malloc.
+static const size_t POOL_CLASS_SIZES[] = {256, 4 * 1024, 64 * 1024};
+static const size_t POOL_CLASSES = sizeof(POOL_CLASS_SIZES) / sizeof(POOL_CLASS_SIZES[0]);
+
+// NUMA: every node has its own depot. A thread pinned to a CPU (affinity.h)
+// binds its cache to that CPU's node, so the blocks it frees are reused on
+// the same node; other threads use node 0's. Nodes past POOL_MAX_NODES
+// share depots.
+static const unsigned POOL_MAX_NODES = 8;
+void pool_bind_node(unsigned node);
+
+// Bytes actually reserved for a request of `size` bytes
+size_t pool_capacity(size_t size);
+void *pool_allocate(size_t size);
+// `size` must be the value passed to pool_allocate (or its pool_capacity)
+void pool_release(void *p, size_t size);
+
+// std::allocator replacement backed by the pool; used with allocate_shared
+// so that shared frames' control blocks are pooled as well
+template <typename T>
+struct PoolAllocator
+{
+    using value_type = T;
+
+    PoolAllocator() = default;
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U> &) {}
+
+    T *allocate(size_t n) { return static_cast<T *>(pool_allocate(n * sizeof(T))); }
+    void deallocate(T *p, size_t n) { pool_release(p, n * sizeof(T)); }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U> &) const { return true; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U> &) const { return false; }
+};
+
+// Fixed-size object slab: objects are carved from chunks of OBJECTS_PER_CHUNK
+// and recycled through a free list. Chunks are never returned to the heap.
+class Slab
+{
+public:
+    static const size_t OBJECTS_PER_CHUNK = 64;
+
+    explicit Slab(size_t object_size);
+
+    void *allocate();
+    void release(void *p);
+
+private:
+    size_t object_size_;
+    std::mutex mutex_;
+    std::vector<void *> free_;
+};
+
+// Allocator for allocate_shared of long-lived objects (connections); one
+// slab per allocated type
+template <typename T>
+struct SlabAllocator
+{
+    using value_type = T;
+
+    SlabAllocator() = default;
+    template <typename U>
+    SlabAllocator(const SlabAllocator<U> &) {}
+
+    static Slab &slab()
+    {
+        static Slab *s = new Slab(sizeof(T)); // outlives every static destructor
+        return *s;
+    }
+
+    T *allocate(size_t n)
+    {
+        if (n != 1)
+            return static_cast<T *>(::operator new(n * sizeof(T)));
+        return static_cast<T *>(slab().allocate());
+    }
+    void deallocate(T *p, size_t n)
+    {
+        if (n != 1)
+            ::operator delete(p);
+        else
+            slab().release(p);
+    }
+
+    template <typename U>
+    bool operator==(const SlabAllocator<U> &) const { return true; }
+    template <typename U>
+    bool operator!=(const SlabAllocator<U> &) const { return false; }
+};
+
+// Move-only byte buffer whose storage comes from the pool
+class Buffer
+{
+public:
+    Buffer() = default;
+    Buffer(const char *data, size_t len) { assign(data, len); }
+    ~Buffer() { reset(); }
+
+    Buffer(Buffer &&other) noexcept
+        : data_(other.data_), size_(other.size_), cap_(other.cap_)
+    {
+        other.data_ = nullptr;
+        other.size_ = other.cap_ = 0;
+    }
+    Buffer &operator=(Buffer &&other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            std::swap(data_, other.data_);
+            std::swap(size_, other.size_);
+            std::swap(cap_, other.cap_);
+        }
+        return *this;
+    }
+    Buffer(const Buffer &) = delete;
+    Buffer &operator=(const Buffer &) = delete;
+
+    // Contents are unspecified after a resize that needs more capacity
+    void resize(size_t len)
+    {
+        if (len > cap_)
+        {
+            reset();
+            cap_ = pool_capacity(len);
+            data_ = static_cast<char *>(pool_allocate(cap_));
+        }
+        size_ = len;
+    }
+    void assign(const char *data, size_t len)
+    {
+        resize(len);
+        if (len)
+            std::memcpy(data_, data, len);
+    }
+    void clear() { size_ = 0; }
+    void reset()
+    {
+        if (data_)
+            pool_release(data_, cap_);
+        data_ = nullptr;
+        size_ = cap_ = 0;
+    }
+
+    char *data() { return data_; }
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    std::string_view view() const { return std::string_view(data_, size_); }
+    std::string str() const { return std::string(data_, size_); }
+
+private:
+    char *data_ = nullptr;
+    size_t size_ = 0;
+    size_t cap_ = 0;
+};
@@ -0,0 +1,218 @@
+#include "presence.h"
+#include "chat.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+struct PendingChange
+{
+    bool online;
+    std::string name;
+};
+
+static std::mutex g_mutex;
+static std::condition_variable g_cv;
+static std::unordered_map<uint64_t, std::string> g_online; // as of the last flush
+static std::unordered_map<uint64_t, PendingChange> g_pending;
+static std::vector<uint64_t> g_order; // pending ids in arrival order (may hold stale ids)
+static FramePtr g_roster_text;
+static FramePtr g_roster_message;
+static unsigned g_window_ms = 0;
+static bool g_stopping = false;
+static std::thread g_flusher;
+
+using Entry = std::pair<uint64_t, std::string>;
+
+// Protocol 1 body: per user, 1 byte state (1 = online), 8 bytes id, 2 bytes
+// name length, name; all big-endian
+static void append_entry(std::string &out, bool online, uint64_t id, const std::string &name)
+{
+    out.push_back(online ? 1 : 0);
+    for (int shift = 56; shift >= 0; shift -= 8)
+        out.push_back(static_cast<char>((id >> shift) & 0xff));
+    size_t len = std::min<size_t>(name.size(), 0xffff);
+    out.push_back(static_cast<char>(len >> 8));
+    out.push_back(static_cast<char>(len & 0xff));
+    out.append(name, 0, len);
+}
+
+static MsgHeader presence_header(uint16_t flags)
+{
+    MsgHeader h;
+    h.type = MsgType::Presence;
+    h.flags = flags;
+    h.room = LOBBY_ROOM;
+    return h;
+}
+
+// Called with g_mutex held
+static void rebuild_roster()
+{
+    std::string list, body;
+    for (const auto &kv : g_online)
+    {
+        if (!list.empty())
+            list += ", ";
+        list += kv.second;
+        append_entry(body, true, kv.first, kv.second);
+    }
+    g_roster_text = make_frame(list.empty() ? std::string("（无其他在线用户）") : "在线用户: " + list);
+    g_roster_message = make_message(presence_header(MSG_ROSTER), body);
+}
+
+static std::string quoted_names(const std::vector<Entry> &users)
+{
+    std::string s;
+    for (const Entry &e : users)
+    {
+        if (!s.empty())
+            s += ", ";
+        s += "'" + e.second + "'";
+    }
+    return s;
+}
+
+static void flush()
+{
+    std::vector<Entry> joined, left;
+    {
+        std::lock_guard<std::mutex> lk(g_mutex);
+        for (uint64_t id : g_order)
+        {
+            auto it = g_pending.find(id);
+            if (it == g_pending.end())
+                continue; // came and went within the window, or already taken
+            if (it->second.online)
+            {
+                // a peer node re-sends its users after reconnecting
+                if (g_online.emplace(id, it->second.name).second)
+                    joined.emplace_back(id, std::move(it->second.name));
+            }
+            else
+            {
+                auto on = g_online.find(id);
+                if (on != g_online.end())
+                {
+                    left.emplace_back(id, std::move(on->second));
+                    g_online.erase(on);
+                }
+            }
+            g_pending.erase(it);
+        }
+        g_order.clear();
+        if (joined.empty() && left.empty())
+            return;
+        rebuild_roster();
+    }
+
+    // the original one-line announcements, now one line per batch
+    std::vector<FramePtr> text;
+    if (!joined.empty())
+        text.push_back(make_frame("[Server] 用户 " + quoted_names(joined) + " 已加入聊天"));
+    if (!left.empty())
+        text.push_back(make_frame("[Server] 用户 " + quoted_names(left) + " 已离开聊天"));
+    std::string body;
+    for (const Entry &e : joined)
+        append_entry(body, true, e.first, e.second);
+    for (const Entry &e : left)
+        append_entry(body, false, e.first, e.second);
+    send_to_lobby(text, make_message(presence_header(0), body));
+}
+
+static void flush_loop()
+{
+    std::unique_lock<std::mutex> lk(g_mutex);
+    while (!g_stopping)
+    {
+        g_cv.wait(lk, [] { return g_stopping || !g_order.empty(); });
+        // let the rest of the window's changes pile up behind the first
+        g_cv.wait_for(lk, std::chrono::milliseconds(g_window_ms), [] { return g_stopping; });
+        if (g_stopping)
+            break;
+        lk.unlock();
+        flush();
+        lk.lock();
+    }
+}
+
+static void record(uint64_t id, PendingChange change)
+{
+    bool wake;
+    {
+        std::lock_guard<std::mutex> lk(g_mutex);
+        auto it = g_pending.find(id);
+        if (!change.online && it != g_pending.end() && it->second.online)
+        {
+            // nobody has heard of this user yet; nothing to announce
+            g_pending.erase(it);
+            return;
+        }
+        wake = g_order.empty();
+        g_pending[id] = std::move(change);
+        g_order.push_back(id);
+    }
+    if (g_window_ms == 0)
+        flush();
+    else if (wake)
+        g_cv.notify_one();
+}
+
+void start_presence(unsigned window_ms)
+{
+    g_window_ms = window_ms;
+    g_stopping = false;
+    if (window_ms > 0)
+        g_flusher = std::thread(flush_loop);
+}
+
+void stop_presence()
+{
+    {
+        std::lock_guard<std::mutex> lk(g_mutex);
+        g_stopping = true;
+    }
+    g_cv.notify_one();
+    if (g_flusher.joinable())
+        g_flusher.join();
+}
+
+void presence_online(uint64_t id, const std::string &name)
+{
+    record(id, PendingChange{true, name});
+}
+
+void presence_offline(uint64_t id)
+{
+    record(id, PendingChange{false, std::string()});
+}
+
+void presence_adopt(uint64_t id, const std::string &name)
+{
+    std::lock_guard<std::mutex> lk(g_mutex);
+    g_online[id] = name;
+    // rebuilt on the next read, not once per adopted user
+    g_roster_text.reset();
+    g_roster_message.reset();
+}
+
+FramePtr presence_roster_text()
+{
+    std::lock_guard<std::mutex> lk(g_mutex);
+    if (!g_roster_text)
+        rebuild_roster();
+    return g_roster_text;
+}
+
+FramePtr presence_roster_message()
+{
+    std::lock_guard<std::mutex> lk(g_mutex);
+    if (!g_roster_message)
+        rebuild_roster();
+    return g_roster_message;
+}
@@ -0,0 +1,30 @@
+// Who is online: a maintained set with a cached roster and batched deltas
+#pragma once
+
+#include "protocol.h"
+
+#include <cstdint>
+#include <string>
+
+// Joins and leaves only touch a pending-changes table. The flusher turns the
+// changes of one window into a single delta for the lobby (a user who came
+// and went inside the window is never announced) and re-serializes the
+// roster at most once per window, so a reconnect storm of N users costs
+// O(N) work and a handful of frames instead of N lists and N² announcements.
+//
+// With window_ms == 0 every change is flushed at once, on the caller's thread.
+void start_presence(unsigned window_ms);
+void stop_presence();
+
+void presence_online(uint64_t id, const std::string &name);
+void presence_offline(uint64_t id);
+// A user carried over from the previous process on restart (restart.h):
+// back in the roster at once, without a join announcement
+void presence_adopt(uint64_t id, const std::string &name);
+
+// Roster as of the last flush: "在线用户: a, b" (or "（无其他在线用户）") for
+// legacy clients and one Presence message (MSG_ROSTER) for protocol 1. A
+// client that reads it after joining the lobby sees every later change in
+// the deltas, so the two together are never missing anyone.
+FramePtr presence_roster_text();
+FramePtr presence_roster_message();
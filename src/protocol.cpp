@@ -0,0 +1,665 @@
+#include "protocol.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Wait until socket is readable/writable (returns true if ready)
+bool wait_for_socket(socket_t s, bool for_write, int timeout_ms)
+{
+    fd_set readfds;
+    fd_set writefds;
+    FD_ZERO(&readfds);
+    FD_ZERO(&writefds);
+    if (for_write)
+        FD_SET(s, &writefds);
+    else
+        FD_SET(s, &readfds);
+    timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+#if defined(_WIN32)
+    int rv = select(0, &readfds, &writefds, nullptr, &tv);
+#else
+    int rv = select(static_cast<int>(s) + 1, &readfds, &writefds, nullptr, &tv);
+#endif
+    return rv > 0;
+}
+
+bool send_all(socket_t s, const char *data, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+#if defined(_WIN32)
+        int n = send(s, data + sent, static_cast<int>(len - sent), 0);
+        if (n == SOCKET_ERROR)
+        {
+            int err = WSAGetLastError();
+            if (err == WSAEINTR)
+                continue;
+            if (err == WSAEWOULDBLOCK)
+            {
+                if (!wait_for_socket(s, true))
+                {
+                    LOG_WARN("send_all: socket not writable (WSAEWOULDBLOCK)");
+                    return false;
+                }
+                continue;
+            }
+            LOG_WARN("send_all: send failed, WSA error=" << err);
+            return false;
+        }
+        if (n <= 0)
+            return false;
+        sent += static_cast<size_t>(n);
+#else
+        ssize_t n = ::send(s, data + sent, len - sent, CHAT_SEND_FLAGS);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (!wait_for_socket(s, true))
+                {
+                    LOG_WARN("send_all: socket not writable (EAGAIN)");
+                    return false;
+                }
+                continue;
+            }
+            LOG_WARN("send_all: send failed, errno=" << errno);
+            return false;
+        }
+        if (n == 0)
+            return false;
+        sent += static_cast<size_t>(n);
+#endif
+    }
+    return true;
+}
+
+bool recv_all(socket_t s, char *data, size_t len)
+{
+    size_t recvd = 0;
+    while (recvd < len)
+    {
+#if defined(_WIN32)
+        int n = recv(s, data + recvd, static_cast<int>(len - recvd), 0);
+        if (n == SOCKET_ERROR)
+        {
+            int err = WSAGetLastError();
+            if (err == WSAEINTR)
+                continue;
+            if (err == WSAEWOULDBLOCK)
+            {
+                if (!wait_for_socket(s, false))
+                {
+                    LOG_WARN("recv_all: socket not readable (WSAEWOULDBLOCK)");
+                    return false;
+                }
+                continue;
+            }
+            LOG_WARN("recv_all: recv failed, WSA error=" << err);
+            return false;
+        }
+        if (n <= 0)
+            return false;
+        recvd += static_cast<size_t>(n);
+#else
+        ssize_t n = ::recv(s, data + recvd, len - recvd, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                if (!wait_for_socket(s, false))
+                {
+                    LOG_WARN("recv_all: socket not readable (EAGAIN)");
+                    return false;
+                }
+                continue;
+            }
+            LOG_WARN("recv_all: recv failed, errno=" << errno);
+            return false;
+        }
+        if (n == 0)
+            return false;
+        recvd += static_cast<size_t>(n);
+#endif
+    }
+    return true;
+}
+
+long send_gather(socket_t s, const ConstBuf *bufs, size_t n)
+{
+#if defined(_WIN32)
+    static thread_local std::vector<WSABUF> iov;
+    iov.resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        iov[i].buf = const_cast<char *>(bufs[i].data);
+        iov[i].len = static_cast<ULONG>(bufs[i].len);
+    }
+    for (;;)
+    {
+        DWORD sent = 0;
+        if (WSASend(s, iov.data(), static_cast<DWORD>(n), &sent, 0, nullptr, nullptr) == 0)
+            return static_cast<long>(sent);
+        int err = WSAGetLastError();
+        if (err == WSAEINTR)
+            continue;
+        return err == WSAEWOULDBLOCK ? 0 : -1;
+    }
+#else
+    static thread_local std::vector<iovec> iov;
+    iov.resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        iov[i].iov_base = const_cast<char *>(bufs[i].data);
+        iov[i].iov_len = bufs[i].len;
+    }
+    msghdr mh{};
+    mh.msg_iov = iov.data();
+    mh.msg_iovlen = n;
+    for (;;)
+    {
+        // sendmsg rather than writev so MSG_NOSIGNAL applies
+        ssize_t sent = ::sendmsg(s, &mh, CHAT_SEND_FLAGS);
+        if (sent >= 0)
+            return static_cast<long>(sent);
+        if (errno == EINTR)
+            continue;
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+#endif
+}
+
+// Header and payload go out in one gathered write
+bool send_message(socket_t s, const std::string &msg)
+{
+    uint32_t be = htonl(static_cast<uint32_t>(msg.size()));
+    ConstBuf bufs[2] = {{reinterpret_cast<const char *>(&be), sizeof(be)},
+                        {msg.data(), msg.size()}};
+    size_t first = 0;
+    while (first < 2)
+    {
+        long n = send_gather(s, bufs + first, 2 - first);
+        if (n < 0)
+        {
+            LOG_WARN("send_message: send failed, error=" << last_socket_error());
+            return false;
+        }
+        if (n == 0)
+        {
+            if (!wait_for_socket(s, true))
+            {
+                LOG_WARN("send_message: socket not writable");
+                return false;
+            }
+            continue;
+        }
+        size_t left = static_cast<size_t>(n);
+        while (first < 2 && left >= bufs[first].len)
+            left -= bufs[first++].len;
+        if (first < 2)
+        {
+            bufs[first].data += left;
+            bufs[first].len -= left;
+        }
+    }
+    return true;
+}
+
+FrameLimits frame_limits;
+
+bool recv_message(socket_t s, std::string &out, size_t max_len)
+{
+    uint32_t be;
+    if (!recv_all(s, reinterpret_cast<char *>(&be), sizeof(be)))
+        return false;
+    uint32_t len = ntohl(be);
+    if (len == 0)
+    {
+        out.clear();
+        return true;
+    }
+    if (len > max_len)
+    {
+        LOG_WARN("recv_message: frame of " << len << " bytes over the limit of " << max_len);
+        return false;
+    }
+    out.resize(len);
+    if (!recv_all(s, out.data(), len))
+        return false;
+    return true;
+}
+
+void append_frame(std::string &out, const std::string &msg)
+{
+    uint32_t be = htonl(static_cast<uint32_t>(msg.size()));
+    out.append(reinterpret_cast<const char *>(&be), sizeof(be));
+    out.append(msg);
+}
+
+void put_int(std::string &out, uint64_t v, int bytes)
+{
+    for (int shift = (bytes - 1) * 8; shift >= 0; shift -= 8)
+        out.push_back(static_cast<char>((v >> shift) & 0xff));
+}
+
+void put_str(std::string &out, std::string_view s)
+{
+    put_int(out, s.size(), 4);
+    out.append(s.data(), s.size());
+}
+
+uint64_t Fields::get_int(size_t bytes)
+{
+    if (data.size() < bytes)
+    {
+        ok = false;
+        return 0;
+    }
+    uint64_t v = 0;
+    for (size_t i = 0; i < bytes; ++i)
+        v = (v << 8) | static_cast<unsigned char>(data[i]);
+    data.remove_prefix(bytes);
+    return v;
+}
+
+std::string Fields::get_str()
+{
+    size_t len = static_cast<size_t>(get_int(4));
+    if (!ok || data.size() < len)
+    {
+        ok = false;
+        return std::string();
+    }
+    std::string s(data.substr(0, len));
+    data.remove_prefix(len);
+    return s;
+}
+
+Frame::~Frame()
+{
+    for (auto &slot : variants)
+    {
+        Frame *v = slot.load(std::memory_order_relaxed);
+        if (v && v != this)
+            free_variant(v);
+    }
+}
+
+Frame *new_variant()
+{
+    return new (pool_allocate(sizeof(Frame))) Frame();
+}
+
+void free_variant(Frame *v)
+{
+    v->~Frame();
+    pool_release(v, sizeof(Frame));
+}
+
+FramePtr shared_variant(const FramePtr &frame, size_t slot, Frame *(*build)(const Frame &frame, size_t slot))
+{
+    std::atomic<Frame *> &at = frame->variants[slot];
+    Frame *v = at.load(std::memory_order_acquire);
+    if (!v)
+    {
+        Frame *made = build(*frame, slot);
+        Frame *expected = nullptr;
+        if (at.compare_exchange_strong(expected, made, std::memory_order_acq_rel))
+            v = made;
+        else
+        {
+            // another recipient's thread won the race; use its copy
+            if (made != frame.get())
+                free_variant(made);
+            v = expected;
+        }
+    }
+    if (v == frame.get())
+        return frame;
+    return FramePtr(frame, v); // shares the original's lifetime
+}
+
+FramePtr make_frame(std::string_view payload)
+{
+    return make_frame({payload});
+}
+
+FramePtr make_frame(std::initializer_list<std::string_view> parts)
+{
+    size_t len = 0;
+    for (std::string_view p : parts)
+        len += p.size();
+    auto f = std::allocate_shared<Frame>(PoolAllocator<Frame>());
+    f->wire.resize(sizeof(uint32_t) + len);
+    uint32_t be = htonl(static_cast<uint32_t>(len));
+    char *out = f->wire.data();
+    std::memcpy(out, &be, sizeof(be));
+    out += sizeof(be);
+    for (std::string_view p : parts)
+    {
+        if (!p.empty())
+            std::memcpy(out, p.data(), p.size());
+        out += p.size();
+    }
+    return f;
+}
+
+static void put_be(char *out, uint64_t v, size_t bytes)
+{
+    for (size_t i = bytes; i-- > 0; v >>= 8)
+        out[i] = static_cast<char>(v & 0xff);
+}
+
+static uint64_t get_be(const char *in, size_t bytes)
+{
+    uint64_t v = 0;
+    for (size_t i = 0; i < bytes; ++i)
+        v = (v << 8) | static_cast<unsigned char>(in[i]);
+    return v;
+}
+
+bool decode_header(std::string_view payload, MsgHeader &header, std::string_view &body)
+{
+    if (payload.size() < MSG_HEADER_SIZE || static_cast<uint8_t>(payload[0]) != PROTO_VERSION)
+        return false;
+    const char *p = payload.data();
+    header.version = PROTO_VERSION;
+    header.type = static_cast<MsgType>(p[1]);
+    header.flags = static_cast<uint16_t>(get_be(p + 2, 2));
+    header.room = static_cast<uint32_t>(get_be(p + 4, 4));
+    header.sender = get_be(p + 8, 8);
+    header.seq = get_be(p + 16, 8);
+    body = payload.substr(MSG_HEADER_SIZE);
+    return true;
+}
+
+FramePtr make_message(const MsgHeader &header, std::string_view body)
+{
+    char h[MSG_HEADER_SIZE];
+    h[0] = static_cast<char>(header.version);
+    h[1] = static_cast<char>(header.type);
+    put_be(h + 2, header.flags, 2);
+    put_be(h + 4, header.room, 4);
+    put_be(h + 8, header.sender, 8);
+    put_be(h + 16, header.seq, 8);
+    return make_frame({std::string_view(h, sizeof(h)), body});
+}
+
+long send_frames(socket_t s, const std::vector<FramePtr> &frames, size_t offset, size_t max_bytes)
+{
+    static thread_local std::vector<ConstBuf> bufs;
+    bufs.clear();
+    size_t total = 0;
+    for (const FramePtr &f : frames)
+    {
+        size_t len = f->size() - offset;
+        if (!bufs.empty() && total + len > max_bytes)
+            break;
+        bufs.push_back({f->data() + offset, len});
+        total += len;
+        offset = 0;
+    }
+    return send_gather(s, bufs.data(), bufs.size());
+}
+
+long recv_some(socket_t s, char *data, size_t len)
+{
+    for (;;)
+    {
+#if defined(_WIN32)
+        int n = recv(s, data, static_cast<int>(len), 0);
+#else
+        ssize_t n = ::recv(s, data, len, 0);
+#endif
+        if (n > 0)
+            return static_cast<long>(n);
+        if (n == 0)
+            return -1;
+        int err = last_socket_error();
+        if (socket_interrupted(err))
+            continue;
+        if (socket_would_block(err))
+            return 0;
+        return -1;
+    }
+}
+
+static_assert(FrameReader::READ_CHUNK > FrameReader::LARGE_FRAME + sizeof(uint32_t),
+              "a carried-over partial frame must fit in the scratch buffer");
+
+// Shared by every FrameReader on the thread
+static std::vector<char> &scratch_buffer()
+{
+    static thread_local std::vector<char> scratch(FrameReader::READ_CHUNK);
+    return scratch;
+}
+
+FrameReader::Status FrameReader::fill(socket_t s)
+{
+    if (failed_)
+        return Status::Closed;
+    if (in_large_)
+    {
+        long n = recv_some(s, large_.data() + large_have_, large_.size() - large_have_);
+        if (n < 0)
+            return Status::Closed;
+        if (n == 0)
+            return Status::WouldBlock;
+        large_have_ += static_cast<size_t>(n);
+        return Status::Ok;
+    }
+
+    std::vector<char> &scratch = scratch_buffer();
+    size_t carried = carry_.size();
+    std::memcpy(scratch.data(), carry_.data(), carried);
+    long n = recv_some(s, scratch.data() + carried, scratch.size() - carried);
+    if (n < 0)
+        return Status::Closed;
+    if (n == 0)
+        return Status::WouldBlock;
+    carry_.clear();
+    cur_ = scratch.data();
+    end_ = cur_ + carried + static_cast<size_t>(n);
+    return Status::Ok;
+}
+
+void FrameReader::feed(const char *data, size_t n)
+{
+    if (failed_)
+        return;
+    if (in_large_)
+    {
+        size_t take = std::min(n, large_.size() - large_have_);
+        std::memcpy(large_.data() + large_have_, data, take);
+        large_have_ += take;
+        // whatever follows the frame (or piece) waits until next() has returned it
+        carry_.append(data + take, n - take);
+        return;
+    }
+    if (carry_.empty())
+    {
+        cur_ = data;
+        end_ = data + n;
+        return;
+    }
+    carry_.append(data, n);
+    unpark();
+}
+
+void FrameReader::park()
+{
+    // a partial frame is already in carry_ once next() returned false
+    if (cur_ == end_)
+        return;
+    carry_.assign(cur_, static_cast<size_t>(end_ - cur_));
+    cur_ = end_ = nullptr;
+}
+
+void FrameReader::unpark()
+{
+    // in large mode carry_ only ever holds bytes past the end of large_
+    if (carry_.empty())
+        return;
+    std::vector<char> &scratch = scratch_buffer();
+    // only feed() carries more than a fill's worth; nothing points into
+    // the scratch buffer between readers
+    if (scratch.size() < carry_.size())
+        scratch.resize(carry_.size());
+    std::memcpy(scratch.data(), carry_.data(), carry_.size());
+    cur_ = scratch.data();
+    end_ = cur_ + carry_.size();
+    carry_.clear();
+}
+
+std::string FrameReader::take_pending()
+{
+    park();
+    std::string bytes;
+    if (in_large_)
+    {
+        uint32_t be = htonl(static_cast<uint32_t>(large_.size()));
+        bytes.assign(reinterpret_cast<const char *>(&be), sizeof(be));
+        bytes.append(large_.data(), large_have_);
+        bytes += carry_;
+        carry_.clear();
+        large_ = Buffer();
+        large_have_ = 0;
+        in_large_ = false;
+    }
+    else
+        bytes.swap(carry_);
+    return bytes;
+}
+
+void FrameReader::restore_pending(std::string bytes)
+{
+    // the bytes come from a client, so they get the checks next() applies
+    uint32_t be = 0;
+    if (bytes.size() < sizeof(be))
+    {
+        carry_ = std::move(bytes);
+        return;
+    }
+    std::memcpy(&be, bytes.data(), sizeof(be));
+    size_t len = ntohl(be);
+    if (len > frame_limits.max_frame)
+    {
+        LOG_WARN("FrameReader: restored frame of " << len << " bytes over the limit of " << frame_limits.max_frame);
+        failed_ = true;
+        return;
+    }
+    if (len > frame_limits.fragment)
+    {
+        streamed_ = true;
+        pieces_ = 0;
+        frame_left_ = len;
+        start_piece();
+        // what does not fit the first piece is carried as feed() would
+        feed(bytes.data() + sizeof(be), bytes.size() - sizeof(be));
+        return;
+    }
+    carry_ = std::move(bytes); // unpark() and next() parse it like fresh input
+}
+
+// The next piece of a streamed frame goes into a fresh large_
+void FrameReader::start_piece()
+{
+    large_ = Buffer();
+    large_.resize(std::min(frame_limits.fragment, frame_left_));
+    frame_left_ -= large_.size();
+    large_have_ = 0;
+    in_large_ = true;
+}
+
+// Moves parsed-but-unread bytes into large_, as far as they belong to it
+void FrameReader::absorb()
+{
+    size_t take = std::min(static_cast<size_t>(end_ - cur_), large_.size() - large_have_);
+    if (take == 0)
+        return;
+    std::memcpy(large_.data() + large_have_, cur_, take);
+    large_have_ += take;
+    cur_ += take;
+}
+
+bool FrameReader::next(Buffer &out)
+{
+    if (failed_)
+        return false;
+    if (in_large_)
+    {
+        absorb();
+        if (large_have_ < large_.size())
+        {
+            cur_ = end_ = nullptr; // all of it went into large_
+            return false;
+        }
+        out = std::move(large_);
+        in_large_ = false;
+        part_ = FramePart::Whole;
+        if (streamed_)
+        {
+            part_ = pieces_++ == 0 ? FramePart::First : frame_left_ ? FramePart::Middle : FramePart::Last;
+            if (frame_left_)
+                start_piece();
+            else
+                streamed_ = false;
+        }
+        unpark(); // bytes fed past the end of the frame or piece
+        return true;
+    }
+
+    size_t avail = static_cast<size_t>(end_ - cur_);
+    if (avail >= sizeof(uint32_t))
+    {
+        uint32_t be;
+        std::memcpy(&be, cur_, sizeof(be));
+        size_t len = ntohl(be);
+        const char *body = cur_ + sizeof(be);
+        size_t have = avail - sizeof(be);
+        if (len > frame_limits.max_frame)
+        {
+            LOG_WARN("FrameReader: frame of " << len << " bytes over the limit of " << frame_limits.max_frame);
+            failed_ = true;
+            cur_ = end_ = nullptr;
+            carry_.clear();
+            return false;
+        }
+        if (len > frame_limits.fragment)
+        {
+            streamed_ = true;
+            pieces_ = 0;
+            frame_left_ = len;
+            cur_ = body;
+            start_piece();
+            return next(out);
+        }
+        part_ = FramePart::Whole;
+        if (have >= len)
+        {
+            out.assign(body, len);
+            cur_ = body + len;
+            return true;
+        }
+        if (len >= LARGE_FRAME)
+        {
+            // the rest of the body goes straight into its final buffer
+            large_.resize(len);
+            std::memcpy(large_.data(), body, have);
+            large_have_ = have;
+            in_large_ = true;
+            cur_ = end_ = nullptr;
+            return false;
+        }
+    }
+    carry_.assign(cur_, avail);
+    cur_ = end_ = nullptr;
+    return false;
+}
@@ -0,0 +1,240 @@
+// Message framing: 4-byte big-endian length + payload
+#pragma once
+
+#include "platform.h"
+#include "pool.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <cstddef>
+#include <initializer_list>
+#include <vector>
+
+// Wait until socket is readable/writable (returns true if ready)
+bool wait_for_socket(socket_t s, bool for_write, int timeout_ms = 5000);
+
+// Blocking helpers used by the thread-per-connection engine
+bool send_all(socket_t s, const char *data, size_t len);
+bool recv_all(socket_t s, char *data, size_t len);
+bool send_message(socket_t s, const std::string &msg);
+// False as well when the peer announces more than max_len bytes, before
+// anything is allocated for them
+bool recv_message(socket_t s, std::string &out, size_t max_len = SIZE_MAX);
+
+// Append the wire form (length prefix + payload) of msg to out
+void append_frame(std::string &out, const std::string &msg);
+
+// Records exchanged between nodes (cluster.h) and with a restarted process
+// (restart.h): integers big-endian in `bytes` bytes, strings as a 4-byte
+// length and the bytes
+void put_int(std::string &out, uint64_t v, int bytes);
+void put_str(std::string &out, std::string_view s);
+
+// Bounds-checked reader over one record; `ok` clears on truncation
+struct Fields
+{
+    std::string_view data;
+    bool ok = true;
+
+    uint64_t get_int(size_t bytes);
+    std::string get_str();
+};
+
+// Byte range for gathered writes
+struct ConstBuf
+{
+    const char *data;
+    size_t len;
+};
+
+// One writev/sendmsg/WSASend over bufs; returns bytes written, 0 if the
+// socket would block, -1 on error
+long send_gather(socket_t s, const ConstBuf *bufs, size_t n);
+// Single non-blocking recv; returns bytes read, 0 for would-block, -1 for closed/error
+long recv_some(socket_t s, char *data, size_t len);
+
+// Set in the length prefix of frames whose payload is compressed (only sent
+// to clients that negotiated it, see compress.h)
+static const uint32_t FRAME_COMPRESSED = 0x80000000u;
+
+// Number of alternative encodings a frame can carry (see Frame::variants):
+// the compression modes (compress.h) below FRAME_WS_VARIANTS, the
+// WebSocket encodings (websocket.h) from there on
+static const size_t FRAME_WS_VARIANTS = 7;
+static const size_t FRAME_VARIANTS = FRAME_WS_VARIANTS + 4;
+
+// Immutable wire frame (length prefix + payload). It is built once and then
+// referenced by every recipient's outbound queue, so fan-out never copies it.
+// The frame, its control block and its bytes all come from the buffer pool.
+struct Frame
+{
+    Buffer wire;
+    // Re-encodings of the same message (e.g. compressed), built on first use
+    // and shared by every recipient that wants them; owned by this frame. A
+    // slot pointing back at the frame itself means "no better encoding".
+    mutable std::atomic<Frame *> variants[FRAME_VARIANTS] = {};
+
+    Frame() = default;
+    ~Frame();
+    Frame(const Frame &) = delete;
+    Frame &operator=(const Frame &) = delete;
+
+    const char *data() const { return wire.data(); }
+    size_t size() const { return wire.size(); }
+};
+using FramePtr = std::shared_ptr<const Frame>;
+
+FramePtr make_frame(std::string_view payload);
+
+// The re-encoding of `frame` in variants[slot], made by `build` for the
+// first recipient that needs it and shared by all later ones (a thread
+// that loses the race to publish it frees its copy). `build` returns a
+// frame from new_variant(), or `frame` itself for "no better encoding".
+FramePtr shared_variant(const FramePtr &frame, size_t slot, Frame *(*build)(const Frame &frame, size_t slot));
+Frame *new_variant();
+void free_variant(Frame *v);
+
+// Coalesce frames (the first one starting at `offset`) into a single gathered
+// write of at most max_bytes; same return convention as send_gather
+long send_frames(socket_t s, const std::vector<FramePtr> &frames, size_t offset, size_t max_bytes);
+// Frame whose payload is the concatenation of the given parts
+FramePtr make_frame(std::initializer_list<std::string_view> parts);
+
+// Protocol version 1: a connection that negotiated it ("__caps__ proto=1")
+// starts every payload, in both directions, with a fixed binary header:
+//   1 byte   version (1)
+//   1 byte   MsgType
+//   2 bytes  flags
+//   4 bytes  room id
+//   8 bytes  sender id (connection id; 0 = the server)
+//   8 bytes  sequence number (per room, assigned by the server)
+// all big-endian, followed by the body. Connections that never negotiate
+// keep the plain text payloads.
+static const uint8_t PROTO_VERSION = 1;
+static const size_t MSG_HEADER_SIZE = 24;
+
+enum class MsgType : uint8_t
+{
+    Text = 1,     // c->s: post body to `room`; s->c: `sender` said body in `room`
+    Join = 2,     // c->s: body = room name; s->c: `sender` joined `room` (body = room name)
+    Leave = 3,    // c->s: leave `room`; s->c: `sender` left `room` (body = room name)
+    Quit = 4,     // c->s only
+    Notice = 5,   // s->c: server text (errors, shutdown)
+    Caps = 6,     // body = "__caps__" arguments / reply
+    Presence = 7, // s->c: users that went online or offline (see presence.cpp for the body)
+    History = 8,  // c->s: replay `room` messages with sequence numbers after `seq`
+    Ping = 9,     // either way: answered with Pong
+    Pong = 10,    // reply to Ping; no other effect
+    Direct = 11,  // c->s: body to connection `sender`, or with sender 0 body = "<name> <text>"
+                  // to every connection of that user; s->c: `sender` wrote body to you
+};
+
+// Presence flag: the full user list (sent on login and negotiation), not a delta
+static const uint16_t MSG_ROSTER = 2;
+// Direct flag: the client's own message coming back; `sender` is the
+// recipient, or 0 if it was addressed by name
+static const uint16_t MSG_SENT = 4;
+// Text flag: a fragment; the message goes on in the sender's next Text
+// message to the same room
+static const uint16_t MSG_FRAGMENT = 8;
+
+struct MsgHeader
+{
+    uint8_t version = PROTO_VERSION;
+    MsgType type = MsgType::Text;
+    uint16_t flags = 0;
+    uint32_t room = 0;
+    uint64_t sender = 0;
+    uint64_t seq = 0;
+};
+
+// Splits a version 1 payload; false if it is too short or of another version
+bool decode_header(std::string_view payload, MsgHeader &header, std::string_view &body);
+// Frame holding header + body, built in one allocation like make_frame
+FramePtr make_message(const MsgHeader &header, std::string_view body);
+
+// What a client may send. The length prefix is checked before anything is
+// allocated; a frame over max_frame fails the connection, one over
+// `fragment` is handed on in pieces of at most that many bytes as they
+// arrive, so a connection never holds more than one piece.
+struct FrameLimits
+{
+    size_t max_frame = 16 * 1024 * 1024;
+    size_t fragment = 64 * 1024;
+};
+extern FrameLimits frame_limits; // set once at startup
+
+// Which part of a frame next() returned
+enum class FramePart : uint8_t
+{
+    Whole,
+    First, // of a frame over frame_limits.fragment; Middle pieces follow, then Last
+    Middle,
+    Last,
+};
+
+// Buffered, batch-parsing receive path for one connection. fill() issues a
+// single recv into a per-thread scratch buffer; next() then yields every
+// complete frame it contains. A trailing partial frame is carried over to the
+// next fill(), and bodies of LARGE_FRAME bytes or more are received straight
+// into the string that is handed to the caller. Frames over
+// frame_limits.fragment come out of next() piece by piece, part() telling
+// which; a frame over frame_limits.max_frame sets failed() and nothing more
+// is parsed.
+//
+// next() must be called until it returns false before another FrameReader on
+// the same thread calls fill(), since they share the scratch buffer. A
+// reader that has to stop early (rate limiting) calls park() to keep the
+// rest in its own storage and unpark() before calling next() again.
+// take_pending() and restore_pending() move a parked reader's input, as
+// raw wire bytes, to a reader in another process (restart.h), but not in
+// the middle of a frame that is handed on in pieces (streaming()). The
+// restored bytes are held to frame_limits like any other input.
+//
+// Completion-based I/O (io_uring, see uring.h) receives into buffers of its
+// own and hands them over with feed() instead of fill(). The bytes are
+// parsed in place when nothing is carried over, so the buffer has to stay
+// valid until next() returns false or park() is called.
+class FrameReader
+{
+public:
+    static const size_t READ_CHUNK = 64 * 1024;
+    static const size_t LARGE_FRAME = 32 * 1024;
+
+    enum class Status
+    {
+        Ok,         // new bytes arrived; drain them with next()
+        WouldBlock, // no more data available right now
+        Closed,     // peer closed the connection or a hard error occurred
+    };
+
+    Status fill(socket_t s);
+    void feed(const char *data, size_t n);
+    bool next(Buffer &out);
+    FramePart part() const { return part_; } // of the last frame next() returned
+    bool failed() const { return failed_; }
+    bool streaming() const { return streamed_; }
+    void park();
+    void unpark();
+    std::string take_pending();
+    void restore_pending(std::string bytes); // then unpark() and next() as usual
+
+private:
+    const char *cur_ = nullptr; // unparsed bytes of the last fill
+    const char *end_ = nullptr;
+    std::string carry_;         // partial frame kept between fills
+    Buffer large_;              // body of a large frame being received in place
+    size_t large_have_ = 0;
+    bool in_large_ = false;
+    bool streamed_ = false;    // large_ is one piece of a bigger frame
+    size_t pieces_ = 0;        // pieces of it returned so far
+    size_t frame_left_ = 0;    // body bytes of it after large_
+    FramePart part_ = FramePart::Whole;
+    bool failed_ = false;
+
+    void start_piece();
+    void absorb();
+};
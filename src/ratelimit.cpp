@@ -0,0 +1,51 @@
+#include "ratelimit.h"
+
+#include <algorithm>
+
+RateLimits rate_limits;
+
+static uint64_t interval_ns(const RateLimit &limit)
+{
+    return 1000000000ull / limit.rate;
+}
+
+// How far ahead of now the bucket may be full before it counts as empty
+static uint64_t tolerance_ns(const RateLimit &limit)
+{
+    uint64_t burst = limit.burst ? limit.burst : limit.rate;
+    return interval_ns(limit) * burst;
+}
+
+uint64_t TokenBucket::wait(const RateLimit &limit, uint64_t now_ns) const
+{
+    if (limit.rate == 0)
+        return 0;
+    uint64_t full_at = full_at_.load(std::memory_order_relaxed);
+    uint64_t next = now_ns + tolerance_ns(limit);
+    // one more message moves full_at by an interval; it must stay within tolerance
+    uint64_t after = std::max(full_at, now_ns) + interval_ns(limit);
+    return after > next ? after - next : 0;
+}
+
+void TokenBucket::take(const RateLimit &limit, uint64_t now_ns)
+{
+    if (limit.rate == 0)
+        return;
+    uint64_t full_at = full_at_.load(std::memory_order_relaxed);
+    full_at_.store(std::max(full_at, now_ns) + interval_ns(limit), std::memory_order_relaxed);
+}
+
+bool TokenBucket::try_take(const RateLimit &limit, uint64_t now_ns)
+{
+    if (limit.rate == 0)
+        return true;
+    uint64_t full_at = full_at_.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        uint64_t after = std::max(full_at, now_ns) + interval_ns(limit);
+        if (after > now_ns + tolerance_ns(limit))
+            return false;
+        if (full_at_.compare_exchange_weak(full_at, after, std::memory_order_relaxed))
+            return true;
+    }
+}
@@ -0,0 +1,37 @@
+// Token buckets for message rate limits
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+struct RateLimit
+{
+    unsigned rate = 0;  // messages per second; 0 = unlimited
+    unsigned burst = 0; // messages accepted back to back (0 = one second's worth)
+};
+
+struct RateLimits
+{
+    RateLimit client; // frames read from one connection
+    RateLimit room;   // chat messages posted to one room, by everyone
+};
+extern RateLimits rate_limits; // set once at startup
+
+// A token bucket in its GCRA form: instead of a token count it keeps the
+// time at which the bucket will be full again, advanced by 1/rate per
+// message. A message conforms while that time is less than `burst`
+// intervals ahead of now. One atomic word, no refill timer, and try_take is
+// lock-free, so a bucket can be shared by the threads posting to a room.
+class TokenBucket
+{
+public:
+    // Nanoseconds until a message would conform; 0 if one may go now
+    uint64_t wait(const RateLimit &limit, uint64_t now_ns) const;
+    // Accounts for one message (after wait() returned 0; owner thread only)
+    void take(const RateLimit &limit, uint64_t now_ns);
+    // wait() == 0 and take() in one step, safe from any thread
+    bool try_take(const RateLimit &limit, uint64_t now_ns);
+
+private:
+    std::atomic<uint64_t> full_at_{0};
+};
@@ -0,0 +1,1420 @@
+#include "reactor.h"
+#include "affinity.h"
+#include "chat.h"
+#include "dispatch.h"
+#include "log.h"
+#include "metrics.h"
+#include "restart.h"
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+#define CHAT_USE_KQUEUE 1
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#include <algorithm>
+#include <cstring>
+
+// Gathered writes per flush before yielding to other sockets
+static const int MAX_WRITES_PER_FLUSH = 16;
+// Connections accepted per listener readiness event before servicing other sockets
+static const int MAX_ACCEPTS_PER_EVENT = 64;
+// Resolution of connection deadlines
+static const uint64_t TIMER_TICK_MS = 100;
+// How often a draining loop looks for connections that have flushed
+static const int DRAIN_POLL_MS = 20;
+#if defined(CHAT_HAVE_IO_URING)
+// Submission queue entries per loop (the completion queue gets twice as many)
+static const unsigned RING_ENTRIES = 4096;
+// Provided receive buffers per loop; a connection holds one only from the
+// completion until its frames are parsed
+static const unsigned RING_BUFFERS = 256;
+static const unsigned RING_BUFFER_SIZE = 16 * 1024;
+static const uint16_t RING_GROUP = 0;
+#endif
+
+ConnectionTimeouts connection_timeouts;
+
+static uint64_t monotonic_ms()
+{
+    return monotonic_ns() / 1000000;
+}
+
+// ---------------------------------------------------------------------------
+// Poller
+// ---------------------------------------------------------------------------
+
+#if defined(__linux__)
+
+Poller::Poller() : epfd_(epoll_create1(EPOLL_CLOEXEC)) {}
+
+Poller::~Poller()
+{
+    if (epfd_ >= 0)
+        close(epfd_);
+}
+
+bool Poller::ok() const { return epfd_ >= 0; }
+
+bool Poller::add(socket_t fd)
+{
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    return epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev) == 0;
+}
+
+bool Poller::set_interest(socket_t fd, bool read, bool write)
+{
+    epoll_event ev{};
+    ev.events = (read ? uint32_t(EPOLLIN) : 0u) | (write ? uint32_t(EPOLLOUT) : 0u);
+    ev.data.fd = fd;
+    return epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev) == 0;
+}
+
+void Poller::remove(socket_t fd)
+{
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int Poller::wait(std::vector<PollEvent> &events, int timeout_ms)
+{
+    epoll_event raw[256];
+    int n = epoll_wait(epfd_, raw, 256, timeout_ms);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+    events.resize(static_cast<size_t>(n));
+    for (int i = 0; i < n; ++i)
+    {
+        // errors and hang-ups surface as readable so the next recv reports them
+        events[i].fd = raw[i].data.fd;
+        events[i].readable = (raw[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0;
+        events[i].writable = (raw[i].events & EPOLLOUT) != 0;
+    }
+    return n;
+}
+
+#elif defined(CHAT_USE_KQUEUE)
+
+Poller::Poller() : kq_(kqueue()) {}
+
+Poller::~Poller()
+{
+    if (kq_ >= 0)
+        close(kq_);
+}
+
+bool Poller::ok() const { return kq_ >= 0; }
+
+bool Poller::add(socket_t fd)
+{
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, nullptr);
+    return kevent(kq_, &ev, 1, nullptr, 0, nullptr) == 0;
+}
+
+bool Poller::set_interest(socket_t fd, bool read, bool write)
+{
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, read ? EV_ENABLE : EV_DISABLE, 0, 0, nullptr);
+    bool ok = kevent(kq_, &ev, 1, nullptr, 0, nullptr) == 0;
+    EV_SET(&ev, fd, EVFILT_WRITE, write ? EV_ADD : EV_DELETE, 0, 0, nullptr);
+    return (kevent(kq_, &ev, 1, nullptr, 0, nullptr) == 0 || !write) && ok;
+}
+
+void Poller::remove(socket_t fd)
+{
+    struct kevent ev[2];
+    EV_SET(&ev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+    EV_SET(&ev[1], fd, EVFILT_WRITE, EV_DELETE, 0, 0, nullptr);
+    kevent(kq_, ev, 2, nullptr, 0, nullptr);
+}
+
+int Poller::wait(std::vector<PollEvent> &events, int timeout_ms)
+{
+    struct kevent raw[256];
+    timespec ts;
+    timespec *tsp = nullptr;
+    if (timeout_ms >= 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        tsp = &ts;
+    }
+    int n = kevent(kq_, nullptr, 0, raw, 256, tsp);
+    if (n < 0)
+        return errno == EINTR ? 0 : -1;
+    events.resize(static_cast<size_t>(n));
+    for (int i = 0; i < n; ++i)
+    {
+        events[i].fd = static_cast<socket_t>(raw[i].ident);
+        events[i].readable = raw[i].filter == EVFILT_READ || (raw[i].flags & (EV_EOF | EV_ERROR));
+        events[i].writable = raw[i].filter == EVFILT_WRITE;
+    }
+    return n;
+}
+
+#else // Windows: WSAPoll
+
+Poller::Poller() {}
+Poller::~Poller() {}
+
+bool Poller::ok() const { return true; }
+
+bool Poller::add(socket_t fd)
+{
+    WSAPOLLFD p{};
+    p.fd = fd;
+    p.events = POLLRDNORM;
+    index_[fd] = fds_.size();
+    fds_.push_back(p);
+    return true;
+}
+
+bool Poller::set_interest(socket_t fd, bool read, bool write)
+{
+    auto it = index_.find(fd);
+    if (it == index_.end())
+        return false;
+    fds_[it->second].events = (read ? POLLRDNORM : 0) | (write ? POLLWRNORM : 0);
+    return true;
+}
+
+void Poller::remove(socket_t fd)
+{
+    auto it = index_.find(fd);
+    if (it == index_.end())
+        return;
+    size_t pos = it->second;
+    index_.erase(it);
+    if (pos != fds_.size() - 1)
+    {
+        fds_[pos] = fds_.back();
+        index_[fds_[pos].fd] = pos;
+    }
+    fds_.pop_back();
+}
+
+int Poller::wait(std::vector<PollEvent> &events, int timeout_ms)
+{
+    events.clear();
+    if (fds_.empty())
+        return 0;
+    int n = WSAPoll(fds_.data(), static_cast<ULONG>(fds_.size()), timeout_ms);
+    if (n < 0)
+        return -1;
+    for (auto &p : fds_)
+    {
+        if (p.revents == 0)
+            continue;
+        PollEvent ev;
+        ev.fd = p.fd;
+        ev.readable = (p.revents & (POLLRDNORM | POLLERR | POLLHUP)) != 0;
+        ev.writable = (p.revents & POLLWRNORM) != 0;
+        events.push_back(ev);
+        p.revents = 0;
+    }
+    return static_cast<int>(events.size());
+}
+
+#endif
+
+// ---------------------------------------------------------------------------
+// Waker
+// ---------------------------------------------------------------------------
+
+#if defined(__linux__)
+
+Waker::Waker()
+{
+    read_fd_ = write_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+Waker::~Waker()
+{
+    if (read_fd_ >= 0)
+        close(read_fd_);
+}
+
+void Waker::wake()
+{
+    uint64_t one = 1;
+    ssize_t rv = write(write_fd_, &one, sizeof(one));
+    (void)rv;
+}
+
+void Waker::drain()
+{
+    uint64_t value;
+    ssize_t rv = read(read_fd_, &value, sizeof(value));
+    (void)rv;
+}
+
+#elif !defined(_WIN32)
+
+Waker::Waker()
+{
+    int fds[2];
+    if (pipe(fds) == 0)
+    {
+        read_fd_ = fds[0];
+        write_fd_ = fds[1];
+        set_nonblocking(read_fd_);
+        set_nonblocking(write_fd_);
+    }
+}
+
+Waker::~Waker()
+{
+    if (read_fd_ >= 0)
+        close(read_fd_);
+    if (write_fd_ >= 0)
+        close(write_fd_);
+}
+
+void Waker::wake()
+{
+    char b = 1;
+    ssize_t rv = write(write_fd_, &b, 1);
+    (void)rv;
+}
+
+void Waker::drain()
+{
+    char buf[64];
+    while (read(read_fd_, buf, sizeof(buf)) > 0)
+    {
+    }
+}
+
+#else // Windows: a UDP socket connected to itself on loopback
+
+Waker::Waker()
+{
+    socket_t s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (s == INVALID_SOCKET)
+        return;
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    int alen = sizeof(addr);
+    if (bind(s, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == SOCKET_ERROR ||
+        getsockname(s, reinterpret_cast<sockaddr *>(&addr), &alen) == SOCKET_ERROR ||
+        connect(s, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == SOCKET_ERROR)
+    {
+        closesocket(s);
+        return;
+    }
+    set_nonblocking(s);
+    read_fd_ = write_fd_ = s;
+}
+
+Waker::~Waker()
+{
+    if (read_fd_ != INVALID_SOCKET)
+        closesocket(read_fd_);
+}
+
+void Waker::wake()
+{
+    char b = 1;
+    ::send(write_fd_, &b, 1, 0);
+}
+
+void Waker::drain()
+{
+    char buf[64];
+    while (recv(read_fd_, buf, sizeof(buf), 0) > 0)
+    {
+    }
+}
+
+#endif
+
+// ---------------------------------------------------------------------------
+// EventLoop
+// ---------------------------------------------------------------------------
+
+EventLoop::EventLoop(bool use_ring) : now_ms_(monotonic_ms()), timers_(now_ms_ / TIMER_TICK_MS)
+{
+    if (!poller_.ok() || waker_.fd() == INVALID_SOCKET)
+        LOG_ERROR("EventLoop: failed to create poller/waker");
+    poller_.add(waker_.fd());
+#if defined(CHAT_HAVE_IO_URING)
+    if (use_ring)
+    {
+        ring_.reset(new Uring(RING_ENTRIES));
+        if (!ring_->ok() || !ring_->setup_buffers(RING_GROUP, RING_BUFFERS, RING_BUFFER_SIZE))
+        {
+            LOG_WARN("EventLoop: io_uring setup failed (" << std::strerror(errno) << "); using the poller");
+            ring_.reset();
+        }
+    }
+#else
+    (void)use_ring;
+#endif
+}
+
+EventLoop::~EventLoop()
+{
+    stop();
+    join();
+}
+
+void EventLoop::listen(socket_t listen_sock, Transport transport)
+{
+    listen_socks_[static_cast<size_t>(transport)] = listen_sock;
+    if (!set_nonblocking(listen_sock) || !poller_.add(listen_sock))
+        LOG_ERROR("EventLoop: failed to register listen socket");
+}
+
+void EventLoop::start()
+{
+    thread_ = std::thread(&EventLoop::run, this);
+}
+
+void EventLoop::stop()
+{
+    stopping_ = true;
+    waker_.wake();
+}
+
+void EventLoop::join()
+{
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void EventLoop::adopt(socket_t s, AdmissionSlot slot)
+{
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lk(inbox_mutex_);
+        was_empty = inbox_empty();
+        pending_adopt_.emplace_back(s, std::move(slot));
+    }
+    if (was_empty)
+        waker_.wake();
+}
+
+void EventLoop::adopt(const std::shared_ptr<Client> &client)
+{
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lk(inbox_mutex_);
+        was_empty = inbox_empty();
+        pending_resume_.push_back(client);
+    }
+    if (was_empty)
+        waker_.wake();
+}
+
+void EventLoop::drain(unsigned timeout_ms, socket_t handoff)
+{
+    drain_ms_ = timeout_ms;
+    handoff_ = handoff;
+    draining_.store(true, std::memory_order_release);
+    waker_.wake();
+}
+
+bool EventLoop::send(const std::shared_ptr<Client> &client, const FramePtr &frame)
+{
+    if (client->closed)
+        return true;
+    OutboundQueue::Push r = client->out.push(frame);
+    // an aborted queue also needs the loop's attention so it can close the client
+    if (r != OutboundQueue::Push::Dropped && !client->flush_queued.exchange(true))
+        schedule_flush(client);
+    return r != OutboundQueue::Push::Disconnect;
+}
+
+bool EventLoop::send(const std::shared_ptr<Client> &client, const FramePtr *frames, size_t n)
+{
+    if (client->closed || n == 0)
+        return true;
+    OutboundQueue::Push r = client->out.push(frames, n);
+    if (!client->flush_queued.exchange(true))
+        schedule_flush(client);
+    return r != OutboundQueue::Push::Disconnect;
+}
+
+void EventLoop::close_later(const std::shared_ptr<Client> &client)
+{
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lk(inbox_mutex_);
+        was_empty = inbox_empty();
+        pending_close_.push_back(client);
+    }
+    if (was_empty && tid_.load() != std::this_thread::get_id())
+        waker_.wake();
+}
+
+void EventLoop::resume_input(const std::shared_ptr<Client> &client)
+{
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lk(inbox_mutex_);
+        was_empty = inbox_empty();
+        pending_input_.push_back(client);
+    }
+    if (was_empty && tid_.load() != std::this_thread::get_id())
+        waker_.wake();
+}
+
+void EventLoop::schedule_flush(const std::shared_ptr<Client> &client)
+{
+    bool was_empty;
+    {
+        std::lock_guard<std::mutex> lk(inbox_mutex_);
+        was_empty = inbox_empty();
+        pending_flush_.push_back(client);
+    }
+    // the loop thread drains its own inbox before blocking again
+    if (was_empty && tid_.load() != std::this_thread::get_id())
+        waker_.wake();
+}
+
+bool EventLoop::inbox_empty() const
+{
+    return pending_adopt_.empty() && pending_flush_.empty() && pending_close_.empty() && pending_resume_.empty() &&
+           pending_input_.empty();
+}
+
+void EventLoop::run()
+{
+    tid_ = std::this_thread::get_id();
+    // before the first allocation, which then lands on the CPU's node
+    if (cpu_ >= 0)
+        pin_thread(cpu_);
+    std::vector<PollEvent> events;
+#if defined(CHAT_HAVE_IO_URING)
+    if (ring_)
+    {
+        ring_poll_waker();
+        ring_accept(Transport::Stream);
+        ring_accept(Transport::WebSocket);
+    }
+#endif
+    while (!stopping_)
+    {
+        // wake for the next tick only while some deadline is pending
+        int timeout = -1;
+        if (!timers_.empty())
+        {
+            uint64_t next_tick = (timers_.now() + 1) * TIMER_TICK_MS;
+            timeout = next_tick > now_ms_ ? static_cast<int>(next_tick - now_ms_) : 0;
+        }
+        if (drain_started_ && (timeout < 0 || timeout > DRAIN_POLL_MS))
+            timeout = DRAIN_POLL_MS;
+#if defined(CHAT_HAVE_IO_URING)
+        if (ring_)
+        {
+            // submits everything queued since the last iteration
+            if (ring_->submit_and_wait(timeout) < 0)
+            {
+                LOG_ERROR("EventLoop: io_uring_enter failed, error=" << errno);
+                break;
+            }
+            now_ms_ = monotonic_ms();
+            ring_->for_each_cqe([this](const io_uring_cqe &cqe) { ring_complete(cqe); });
+            expire_timers();
+            process_inbox();
+            if (draining_.load(std::memory_order_acquire) && drain_step())
+                break;
+            continue;
+        }
+#endif
+        int n = poller_.wait(events, timeout);
+        if (n < 0)
+        {
+            LOG_ERROR("EventLoop: poll failed, error=" << last_socket_error());
+            break;
+        }
+        now_ms_ = monotonic_ms();
+        for (int i = 0; i < n; ++i)
+        {
+            const PollEvent &ev = events[static_cast<size_t>(i)];
+            if (ev.fd == waker_.fd())
+            {
+                waker_.drain();
+                continue;
+            }
+            if (ev.fd == listen_socks_[0] || ev.fd == listen_socks_[1])
+            {
+                accept_ready(ev.fd == listen_socks_[0] ? Transport::Stream : Transport::WebSocket);
+                continue;
+            }
+            auto it = conns_.find(ev.fd);
+            if (it == conns_.end())
+                continue;
+            std::shared_ptr<Client> c = it->second;
+            if (ev.writable)
+                flush(c);
+            if (ev.readable && !c->closed)
+                handle_readable(c);
+        }
+        // before the inbox, so pings and the fallout of closes go out at once
+        expire_timers();
+        process_inbox();
+        if (draining_.load(std::memory_order_acquire) && drain_step())
+            break;
+    }
+
+    if (drain_started_ && !conns_.empty())
+        LOG_WARN("EventLoop: drain timed out; closing " << conns_.size() << " connection(s) with unsent output");
+    stop_listening();
+
+    // final attempt to push out queued messages (e.g. the shutdown notice)
+    process_inbox();
+#if defined(CHAT_HAVE_IO_URING)
+    if (ring_)
+    {
+        ring_->submit_and_wait(0); // sends are tried inline on submission
+        // clients closed earlier whose operations are still outstanding
+        for (auto &c : ring_slots_)
+        {
+            if (c && c->closed)
+                close_socket(c->sock);
+        }
+    }
+#endif
+    for (auto &kv : conns_)
+    {
+        kv.second->closed = true;
+        timers_.cancel(kv.second->timer);
+        --load_;
+        poller_.remove(kv.first);
+        close_socket(kv.first);
+    }
+    conns_.clear();
+#if defined(CHAT_HAVE_IO_URING)
+    ring_.reset(); // cancels whatever is left, then the clients can go
+    ring_slots_.clear();
+#endif
+}
+
+void EventLoop::process_inbox()
+{
+    std::vector<std::pair<socket_t, AdmissionSlot>> adopt;
+    std::vector<std::shared_ptr<Client>> flushes;
+    std::vector<std::shared_ptr<Client>> closes;
+    std::vector<std::shared_ptr<Client>> resumes;
+    std::vector<std::shared_ptr<Client>> inputs;
+    for (;;)
+    {
+        {
+            std::lock_guard<std::mutex> lk(inbox_mutex_);
+            adopt.swap(pending_adopt_);
+            flushes.swap(pending_flush_);
+            closes.swap(pending_close_);
+            resumes.swap(pending_resume_);
+            inputs.swap(pending_input_);
+        }
+        if (adopt.empty() && flushes.empty() && closes.empty() && resumes.empty() && inputs.empty())
+            return;
+
+        for (auto &a : adopt)
+            accepted(a.first, std::move(a.second), Transport::Stream);
+        for (auto &c : resumes)
+            resume_client(c);
+        // only a pause for the inbox ends here, and none while draining
+        for (auto &c : inputs)
+        {
+            if (!c->closed && c->read_paused && c->resume_ms == UINT64_MAX && !drain_started_)
+                resume_reading(c);
+        }
+        // flush first so replies such as the quit acknowledgement still go out
+        for (auto &c : flushes)
+            flush(c);
+        for (auto &c : closes)
+        {
+            flush(c);
+            close_client(c, true);
+        }
+        adopt.clear();
+        flushes.clear();
+        closes.clear();
+        resumes.clear();
+        inputs.clear();
+    }
+}
+
+// The listener's whole backlog up to MAX_ACCEPTS_PER_EVENT per wake-up;
+// a refused connection costs the accept and a close, nothing more
+void EventLoop::accept_ready(Transport transport)
+{
+    for (int i = 0; i < MAX_ACCEPTS_PER_EVENT; ++i)
+    {
+        sockaddr_in peer{};
+        socket_t s = accept_nonblocking(listen_socks_[static_cast<size_t>(transport)], peer);
+        if (s == INVALID_SOCKET)
+        {
+            int err = last_socket_error();
+            if (socket_interrupted(err))
+                continue;
+            if (!socket_would_block(err))
+                LOG_ERROR("accept() failed, error=" << err);
+            return;
+        }
+        AdmissionSlot slot;
+        if (!admit_connection(s, &peer, slot))
+        {
+            close_socket(s);
+            continue;
+        }
+        accepted(s, std::move(slot), transport);
+    }
+}
+
+void EventLoop::accepted(socket_t s, AdmissionSlot slot, Transport transport)
+{
+    set_nosigpipe(s);
+    set_nodelay(s);
+    auto c = make_client(s);
+    c->admission = std::move(slot);
+    if (transport == Transport::WebSocket)
+        c->ws.reset(new WsSession());
+    register_client(c);
+}
+
+// Connection is pinned to this loop from here until close_client
+void EventLoop::register_client(const std::shared_ptr<Client> &c)
+{
+    socket_t s = c->sock;
+    c->loop = this;
+    if (placement.busy_poll_us)
+        set_busy_poll(s, placement.busy_poll_us);
+#if defined(CHAT_HAVE_IO_URING)
+    if (ring_)
+    {
+        if (ring_free_.empty())
+        {
+            ring_free_.push_back(static_cast<uint32_t>(ring_slots_.size()));
+            ring_slots_.emplace_back();
+        }
+        c->ring_slot = ring_free_.back();
+        ring_free_.pop_back();
+        ring_slots_[c->ring_slot] = c;
+        // accepted while draining: held for the handoff, not read
+        if (drain_started_)
+            c->read_paused = true;
+        else if (!ring_recv(*c))
+        {
+            c->closed = true;
+            ring_release(*c);
+            return;
+        }
+    }
+    else
+#endif
+    if (!poller_.add(s))
+    {
+        LOG_WARN("EventLoop: failed to register socket " << s);
+        c->closed = true;
+        close_socket(s);
+        return;
+    }
+    conns_[s] = c;
+    ++load_;
+    metric_add(Counter::ConnectionsAccepted);
+    // the rest join the registry with their first frame (drain_frames)
+    if (c->saw_username)
+        registry.add(c);
+    c->timer.owner = c.get();
+    c->accepted_ms = c->last_read_ms = now_ms_;
+    check_deadlines(c);
+}
+
+// A connection handed over on restart: back in its rooms before anything
+// it sent meanwhile is dispatched
+void EventLoop::resume_client(const std::shared_ptr<Client> &client)
+{
+    register_client(client);
+    if (client->closed)
+        return;
+    resume_session(client);
+    client->reader.unpark();
+    drain_frames(client);
+}
+
+void EventLoop::handle_readable(const std::shared_ptr<Client> &client)
+{
+    // only a hang-up or error reports readable while paused, and it keeps
+    // doing so until the fd is gone; the peer is lost, so close at once
+    // rather than spin until the pause ends
+    if (client->read_paused)
+    {
+        close_client(client, !drain_started_);
+        return;
+    }
+    // one recv per readiness event keeps the loop fair; the poller is level
+    // triggered, so whatever is left reports readable again
+    if (client->ws)
+    {
+        static thread_local std::vector<char> scratch(FrameReader::READ_CHUNK);
+        long n = recv_some(client->sock, scratch.data(), scratch.size());
+        if (n == 0)
+            return;
+        if (n < 0)
+        {
+            close_client(client, true);
+            return;
+        }
+        client->last_read_ms = now_ms_;
+        ws_input(client, scratch.data(), static_cast<size_t>(n));
+        return;
+    }
+    FrameReader::Status st = client->reader.fill(client->sock);
+    if (st == FrameReader::Status::WouldBlock)
+        return;
+    if (st == FrameReader::Status::Closed)
+    {
+        close_client(client, true);
+        return;
+    }
+    client->last_read_ms = now_ms_; // a pong, or any other traffic, proves the peer alive
+    drain_frames(client);
+}
+
+// Bytes from a WebSocket client: its messages come out of the session in
+// the pieces the reader would make of them, and from there on go like any
+// other frame
+void EventLoop::ws_input(const std::shared_ptr<Client> &client, const char *data, size_t n)
+{
+    client->ws->feed(data, n);
+    // paused (a cancel raced with new data): kept for later or the handoff
+    if (!client->read_paused)
+        drain_frames(client);
+    client->ws->park(); // the buffer is reused, or goes back to the kernel
+}
+
+// What the session answers by itself. Every way of closing leaves a last
+// answer (a close frame or an HTTP error), after which the queue takes
+// nothing more and the connection closes once it has gone out.
+void EventLoop::ws_answer(const std::shared_ptr<Client> &client)
+{
+    std::string &reply = client->ws->reply();
+    if (reply.empty())
+        return;
+    send(client, raw_frame(reply));
+    reply.clear();
+    if (client->ws->closing())
+    {
+        client->out.close();
+        close_later(client);
+    }
+}
+
+// Dispatches the frames received so far while the client's rate allows. Past
+// its budget the rest stays parked in the reader and the socket is not read
+// again until tokens are available, so a flooding client fills its own TCP
+// window instead of server memory.
+void EventLoop::drain_frames(const std::shared_ptr<Client> &client)
+{
+    const RateLimit &limit = rate_limits.client;
+    Buffer msg;
+    while (!client->quitting)
+    {
+        uint64_t now = limit.rate ? monotonic_ns() : 0;
+        uint64_t wait = client->rate.wait(limit, now);
+        if (wait)
+        {
+            pause_reading(client, wait);
+            break;
+        }
+        bool got = client->ws ? client->ws->next(msg) : client->reader.next(msg);
+        // the session's own answers, the 101 first of all, go out before
+        // anything it decoded is dispatched
+        if (client->ws)
+            ws_answer(client);
+        if (!got)
+        {
+            if (!client->ws && client->reader.failed())
+            {
+                close_client(client, true);
+                return;
+            }
+            break;
+        }
+        client->rate.take(limit, now);
+        if (!client->saw_username)
+            registry.add(client);
+        FramePart part = client->ws ? client->ws->part() : client->reader.part();
+        if (!dispatch_frame(client, std::move(msg), part))
+        {
+            pause_for_inbox(client);
+            break;
+        }
+    }
+    // what was decoded is not decoded again by the next feed()
+    if (client->ws)
+        client->ws->park();
+}
+
+void EventLoop::pause_reading(const std::shared_ptr<Client> &client, uint64_t wait_ns)
+{
+    client->reader.park();
+    client->read_paused = true;
+    client->paused_ms = now_ms_;
+    client->resume_ms = now_ms_ + (wait_ns + 999999) / 1000000;
+    set_reading(*client, false);
+    metric_add(Counter::ClientRateLimited);
+    arm(*client, client->resume_ms);
+}
+
+// Like a rate limit pause, but with no deadline: the strand ends it
+// through resume_input() once the workers have caught up
+void EventLoop::pause_for_inbox(const std::shared_ptr<Client> &client)
+{
+    client->reader.park();
+    client->read_paused = true;
+    client->paused_ms = now_ms_;
+    client->resume_ms = UINT64_MAX;
+    set_reading(*client, false);
+}
+
+void EventLoop::resume_reading(const std::shared_ptr<Client> &client)
+{
+    metric_record(Histogram::ThrottleNanos, (now_ms_ - client->paused_ms) * 1000000);
+    client->read_paused = false;
+    client->last_read_ms = now_ms_; // it was sending all along
+    set_reading(*client, true);
+    client->reader.unpark();
+    drain_frames(client);
+}
+
+void EventLoop::flush(const std::shared_ptr<Client> &client)
+{
+    client->flush_queued = false;
+    if (client->closed)
+        return;
+
+    bool failed = client->out.aborted();
+    if (failed)
+        LOG_WARN("EventLoop: send queue overflow for " << display_name(*client) << ", disconnecting");
+#if defined(CHAT_HAVE_IO_URING)
+    if (ring_ && !failed)
+    {
+        ring_flush(client);
+        return;
+    }
+#endif
+    for (int i = 0; i < MAX_WRITES_PER_FLUSH && !failed; ++i)
+    {
+        size_t off = client->out.peek(batch_, coalesce_limits.max_iov);
+        if (batch_.empty())
+            break;
+        uint64_t t0 = monotonic_ns();
+        long n = send_frames(client->sock, batch_, off, coalesce_limits.max_bytes);
+        metric_record(Histogram::SendNanos, monotonic_ns() - t0);
+        batch_.clear();
+        if (n < 0)
+            failed = true;
+        else if (n == 0)
+            break; // kernel buffer full
+        else
+        {
+            client->out.consume(static_cast<size_t>(n));
+            client->last_write_ms = now_ms_;
+        }
+    }
+
+    if (failed)
+    {
+        if (!client->out.aborted())
+        {
+            LOG_WARN("EventLoop: failed to send to " << display_name(*client) << " (sock=" << client->sock << ")");
+        }
+        close_client(client, true);
+        return;
+    }
+    // anything left (socket full or write budget used up) waits for writability
+    bool pending = !client->out.empty();
+    if (pending != client->want_write)
+    {
+        client->want_write = pending;
+        poller_.set_interest(client->sock, !client->read_paused, pending);
+        if (pending)
+        {
+            // the stall clock starts when output first has to wait
+            client->last_write_ms = now_ms_;
+            if (connection_timeouts.write_ms)
+                arm(*client, now_ms_ + connection_timeouts.write_ms);
+        }
+    }
+}
+
+void EventLoop::close_client(const std::shared_ptr<Client> &client, bool announce)
+{
+    if (client->closed.exchange(true))
+        return;
+    client->out.abort(); // release queued frames
+    client->admission.release();
+    registry.remove(*client);
+    conns_.erase(client->sock);
+    timers_.cancel(client->timer);
+    --load_;
+    metric_add(Counter::ConnectionsClosed);
+#if defined(CHAT_HAVE_IO_URING)
+    if (ring_)
+    {
+        // the socket stays open until the kernel has let go of it
+        if (client->recv_armed)
+            ring_cancel(RingOp::Recv, client->ring_slot);
+        if (client->send_armed)
+            ring_cancel(RingOp::Send, client->ring_slot);
+        ring_release(*client);
+    }
+    else
+#endif
+    {
+        poller_.remove(client->sock);
+        close_socket(client->sock);
+    }
+    if (announce)
+        dispatch_close(client);
+}
+
+// Draining: after the listener is closed and reading stops, a connection is
+// finished as soon as its queue has gone out, so the loop needs no more
+// than the slowest reader's time (bounded by the deadline). True when the
+// loop may exit.
+bool EventLoop::drain_step()
+{
+    if (!drain_started_)
+    {
+        drain_started_ = true;
+        drain_deadline_ms_ = now_ms_ + drain_ms_;
+        stop_listening();
+        for (auto &kv : conns_)
+        {
+            Client &c = *kv.second;
+            c.reader.park();
+            c.read_paused = true;
+            set_reading(c, false);
+        }
+    }
+
+    std::vector<std::shared_ptr<Client>> done;
+    for (auto &kv : conns_)
+    {
+        Client &c = *kv.second;
+        if (c.want_write || !c.out.empty())
+            continue;
+        if (handoff_ != INVALID_SOCKET)
+        {
+#if defined(CHAT_HAVE_IO_URING)
+            // a recv still in flight could take bytes meant for the successor
+            if (c.ring_ops)
+                continue;
+#endif
+            // a worker may still be running its strand, and with it `rooms`
+            std::lock_guard<std::mutex> lk(c.inbox_mutex);
+            if (c.scheduled || !c.inbox.empty())
+                continue;
+        }
+        done.push_back(kv.second);
+    }
+    for (auto &c : done)
+    {
+        if (!hand_off(c))
+            close_client(c, false);
+    }
+    return conns_.empty() || now_ms_ >= drain_deadline_ms_;
+}
+
+void EventLoop::stop_listening()
+{
+    for (size_t t = 0; t < static_cast<size_t>(Transport::Count); ++t)
+    {
+        socket_t &ls = listen_socks_[t];
+        if (ls == INVALID_SOCKET)
+            continue;
+#if defined(CHAT_HAVE_IO_URING)
+        if (ring_)
+            ring_cancel(RingOp::Accept, static_cast<uint32_t>(t)); // else it keeps the socket accepting
+        else
+#endif
+        poller_.remove(ls);
+        close_socket(ls);
+        ls = INVALID_SOCKET;
+    }
+}
+
+// Passes the socket and session to the new process; the connection itself
+// stays up, only this process's descriptor is closed
+bool EventLoop::hand_off(const std::shared_ptr<Client> &client)
+{
+    // half of a streamed frame would reach the successor without its start;
+    // a WebSocket session's framing state does not travel
+    if (handoff_ == INVALID_SOCKET || client->quitting || client->reader.streaming() || client->ws)
+        return false;
+    HandoffSession session;
+    session.id = client->id;
+    session.proto = client->proto.load(std::memory_order_relaxed);
+    session.compress = client->compress.load(std::memory_order_relaxed);
+    session.saw_username = client->saw_username;
+    session.named = client->named.load(std::memory_order_acquire);
+    if (session.named)
+        session.name = client->name;
+    for (RoomId id : client->rooms)
+    {
+        if (Room *room = rooms.get(id))
+            session.rooms.push_back(room->name);
+    }
+    session.input = client->reader.take_pending();
+    if (!send_connection(handoff_, client->sock, session))
+    {
+        LOG_WARN("EventLoop: lost the handoff channel; closing the remaining connections");
+        handoff_ = INVALID_SOCKET;
+        return false;
+    }
+    metric_add(Counter::ConnectionsHandedOff);
+    close_client(client, false);
+    return true;
+}
+
+// Every connection has at most one armed timer, set for the earliest of its
+// deadlines. Traffic only stamps last_read_ms / last_write_ms; the timer is
+// not moved, and when it fires the deadlines are recomputed from the stamps
+// and the timer re-armed for whatever is next. A busy connection therefore
+// costs one check per timeout period, and a tick only touches the
+// connections whose check is due.
+void EventLoop::expire_timers()
+{
+    timers_.advance(now_ms_ / TIMER_TICK_MS, [this](TimerNode &node)
+    {
+        auto it = conns_.find(static_cast<Client *>(node.owner)->sock);
+        if (it == conns_.end())
+            return;
+        std::shared_ptr<Client> c = it->second; // close_client erases the map entry
+        check_deadlines(c);
+    });
+}
+
+void EventLoop::check_deadlines(const std::shared_ptr<Client> &client)
+{
+    if (drain_started_)
+        return; // the drain deadline is the only one left
+    const ConnectionTimeouts &t = connection_timeouts;
+    uint64_t next = UINT64_MAX;
+    auto due = [&](uint64_t at)
+    {
+        if (at <= now_ms_)
+            return true;
+        next = std::min(next, at);
+        return false;
+    };
+    if (client->read_paused && due(client->resume_ms))
+    {
+        resume_reading(client);
+        if (client->closed)
+            return;
+    }
+    const char *reason = nullptr;
+    if (t.handshake_ms && !client->saw_username && due(client->accepted_ms + t.handshake_ms))
+    {
+        reason = "no username received";
+        metric_add(Counter::HandshakeTimeouts);
+    }
+    else if (t.write_ms && client->want_write && due(client->last_write_ms + t.write_ms))
+    {
+        reason = "writes stalled";
+        metric_add(Counter::WriteTimeouts);
+    }
+    else if (t.idle_ms && !client->read_paused && due(client->last_read_ms + t.idle_ms))
+    {
+        reason = "idle";
+        metric_add(Counter::IdleTimeouts);
+    }
+    if (reason)
+    {
+        LOG_INFO("Closing " << display_name(*client) << " (sock=" << client->sock << "): " << reason);
+        close_client(client, true);
+        return;
+    }
+    // ping only after the username, so the answer cannot be taken for one
+    if (t.ping_ms && client->saw_username && !client->read_paused &&
+        due(std::max(client->last_read_ms, client->last_ping_ms) + t.ping_ms))
+    {
+        client->last_ping_ms = now_ms_;
+        metric_add(Counter::PingsSent);
+        if (!send_ping(client))
+            return;
+        next = std::min<uint64_t>(next, now_ms_ + t.ping_ms);
+    }
+    if (next != UINT64_MAX)
+        arm(*client, next);
+}
+
+// Turns reading on or off; write interest stays as it is
+void EventLoop::set_reading(Client &client, bool on)
+{
+#if defined(CHAT_HAVE_IO_URING)
+    if (ring_)
+    {
+        // a recv being cancelled is re-armed by its last completion
+        if (on && !client.recv_armed)
+            ring_recv(client);
+        else if (!on && client.recv_armed)
+            ring_cancel(RingOp::Recv, client.ring_slot);
+        return;
+    }
+#endif
+    poller_.set_interest(client.sock, on, client.want_write);
+}
+
+// Brings the client's check forward to at_ms if it is not already due by then
+void EventLoop::arm(Client &client, uint64_t at_ms)
+{
+    uint64_t tick = (at_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (!client.timer.armed() || client.timer.expires > tick)
+        timers_.schedule(client.timer, tick);
+}
+
+#if defined(CHAT_HAVE_IO_URING)
+
+// ---------------------------------------------------------------------------
+// io_uring mode
+// ---------------------------------------------------------------------------
+
+static uint64_t ring_tag(uint8_t op, uint32_t slot)
+{
+    return static_cast<uint64_t>(op) << 56 | slot;
+}
+
+io_uring_sqe *EventLoop::ring_sqe(RingOp op, uint32_t slot)
+{
+    io_uring_sqe *e = ring_->sqe();
+    if (!e)
+    {
+        LOG_ERROR("EventLoop: io_uring submission queue unavailable, error=" << errno);
+        return nullptr;
+    }
+    e->user_data = ring_tag(static_cast<uint8_t>(op), slot);
+    return e;
+}
+
+void EventLoop::ring_poll_waker()
+{
+    if (io_uring_sqe *e = ring_sqe(RingOp::Wake, 0))
+    {
+        e->opcode = IORING_OP_POLL_ADD;
+        e->fd = waker_.fd();
+        e->len = IORING_POLL_ADD_MULTI;
+        e->poll32_events = POLLIN;
+    }
+}
+
+void EventLoop::ring_accept(Transport transport)
+{
+    socket_t ls = listen_socks_[static_cast<size_t>(transport)];
+    if (ls == INVALID_SOCKET)
+        return;
+    if (io_uring_sqe *e = ring_sqe(RingOp::Accept, static_cast<uint32_t>(transport)))
+    {
+        e->opcode = IORING_OP_ACCEPT;
+        e->fd = ls;
+        e->ioprio = IORING_ACCEPT_MULTISHOT;
+        e->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+}
+
+bool EventLoop::ring_recv(Client &client)
+{
+    io_uring_sqe *e = ring_sqe(RingOp::Recv, client.ring_slot);
+    if (!e)
+        return false;
+    e->opcode = IORING_OP_RECV;
+    e->fd = client.sock;
+    e->ioprio = IORING_RECV_MULTISHOT;
+    e->flags = IOSQE_BUFFER_SELECT;
+    e->buf_group = RING_GROUP;
+    client.recv_armed = true;
+    ++client.ring_ops;
+    return true;
+}
+
+void EventLoop::ring_cancel(RingOp op, uint32_t slot)
+{
+    if (io_uring_sqe *e = ring_sqe(RingOp::Cancel, slot))
+    {
+        e->opcode = IORING_OP_ASYNC_CANCEL;
+        e->addr = ring_tag(static_cast<uint8_t>(op), slot);
+    }
+}
+
+// A closed client keeps its slot, and its socket, until its last operation
+// has completed
+void EventLoop::ring_release(Client &client)
+{
+    if (client.ring_ops || ring_slots_[client.ring_slot].get() != &client)
+        return;
+    close_socket(client.sock);
+    ring_slots_[client.ring_slot].reset();
+    ring_free_.push_back(client.ring_slot);
+}
+
+void EventLoop::ring_complete(const io_uring_cqe &cqe)
+{
+    RingOp op = static_cast<RingOp>(cqe.user_data >> 56);
+    uint32_t slot = static_cast<uint32_t>(cqe.user_data);
+    bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    if (op == RingOp::Wake)
+    {
+        waker_.drain();
+        if (!more)
+            ring_poll_waker();
+        return;
+    }
+    if (op == RingOp::Accept)
+    {
+        Transport transport = static_cast<Transport>(slot);
+        if (cqe.res >= 0)
+            ring_accepted(cqe.res, transport);
+        else if (cqe.res != -ECANCELED)
+            LOG_ERROR("accept() failed, error=" << -cqe.res);
+        if (!more)
+            ring_accept(transport);
+        return;
+    }
+    if (op != RingOp::Recv && op != RingOp::Send)
+        return;
+
+    std::shared_ptr<Client> c = ring_slots_[slot]; // closing frees the slot
+    if (!c)
+        return;
+    if (!more)
+        --c->ring_ops;
+    if (op == RingOp::Recv)
+        ring_received(c, cqe);
+    else
+        ring_sent(c, cqe.res);
+    if (c->closed)
+        ring_release(*c);
+}
+
+void EventLoop::ring_accepted(socket_t s, Transport transport)
+{
+    AdmissionSlot slot;
+    if (!admit_connection(s, nullptr, slot))
+    {
+        close_socket(s);
+        return;
+    }
+    accepted(s, std::move(slot), transport);
+}
+
+void EventLoop::ring_received(const std::shared_ptr<Client> &client, const io_uring_cqe &cqe)
+{
+    bool more = (cqe.flags & IORING_CQE_F_MORE) != 0;
+    if (!more)
+        client->recv_armed = false;
+    if (cqe.flags & IORING_CQE_F_BUFFER)
+    {
+        uint16_t bid = static_cast<uint16_t>(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+        if (cqe.res > 0 && !client->closed && client->ws)
+        {
+            client->last_read_ms = now_ms_;
+            ws_input(client, ring_->buffer(bid), static_cast<size_t>(cqe.res));
+        }
+        else if (cqe.res > 0 && !client->closed)
+        {
+            client->reader.feed(ring_->buffer(bid), static_cast<size_t>(cqe.res));
+            // paused (a cancel raced with new data): kept for later or the handoff
+            if (!client->read_paused)
+            {
+                client->last_read_ms = now_ms_;
+                drain_frames(client);
+            }
+            client->reader.park(); // the buffer goes back to the kernel now
+        }
+        ring_->recycle(bid);
+    }
+    if (client->closed)
+        return;
+    // ENOBUFS: every buffer was taken; this completion returned one
+    if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED))
+    {
+        close_client(client, true);
+        return;
+    }
+    if (!more && !client->read_paused && !ring_recv(*client))
+        close_client(client, true);
+}
+
+void EventLoop::ring_sent(const std::shared_ptr<Client> &client, int res)
+{
+    client->send_armed = false;
+    client->sending.clear();
+    if (client->closed)
+        return;
+    if (res < 0)
+    {
+        LOG_WARN("EventLoop: failed to send to " << display_name(*client) << " (sock=" << client->sock << ")");
+        close_client(client, true);
+        return;
+    }
+    client->out.consume(static_cast<size_t>(res));
+    client->last_write_ms = now_ms_;
+    flush(client); // whatever queued up meanwhile
+}
+
+// One gathered sendmsg at a time; its completion flushes the rest. The
+// frames stay referenced until then, the queue only gives them up as they
+// are acknowledged.
+void EventLoop::ring_flush(const std::shared_ptr<Client> &client)
+{
+    if (client->send_armed)
+        return;
+    size_t off = client->out.peek(client->sending, coalesce_limits.max_iov);
+    if (client->sending.empty())
+    {
+        client->want_write = false;
+        return;
+    }
+    client->send_iov.clear();
+    size_t total = 0;
+    for (const FramePtr &f : client->sending)
+    {
+        size_t len = f->size() - off;
+        if (!client->send_iov.empty() && total + len > coalesce_limits.max_bytes)
+            break;
+        client->send_iov.push_back({const_cast<char *>(f->data()) + off, len});
+        total += len;
+        off = 0;
+    }
+    client->send_msg = msghdr{};
+    client->send_msg.msg_iov = client->send_iov.data();
+    client->send_msg.msg_iovlen = client->send_iov.size();
+
+    io_uring_sqe *e = ring_sqe(RingOp::Send, client->ring_slot);
+    if (!e)
+    {
+        client->sending.clear();
+        close_client(client, true);
+        return;
+    }
+    e->opcode = IORING_OP_SENDMSG;
+    e->fd = client->sock;
+    e->addr = reinterpret_cast<uint64_t>(&client->send_msg);
+    e->len = 1;
+    e->msg_flags = MSG_NOSIGNAL;
+    client->send_armed = true;
+    ++client->ring_ops;
+    if (!client->want_write)
+    {
+        client->want_write = true;
+        client->last_write_ms = now_ms_;
+        if (connection_timeouts.write_ms)
+            arm(*client, now_ms_ + connection_timeouts.write_ms);
+    }
+}
+
+#endif
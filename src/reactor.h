@@ -0,0 +1,215 @@
+// Readiness-based event loop: epoll (Linux), kqueue (BSD/macOS), WSAPoll
+// (Windows); on Linux optionally completion-based over io_uring instead
+#pragma once
+
+#include "admission.h"
+#include "platform.h"
+#include "protocol.h"
+#include "timer_wheel.h"
+#include "uring.h"
+#include "websocket.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct Client;
+
+// Connection lifecycle deadlines in milliseconds; 0 disables one
+struct ConnectionTimeouts
+{
+    unsigned handshake_ms = 10000; // accept until the username frame
+    unsigned idle_ms = 0;          // nothing received for this long
+    unsigned ping_ms = 0;          // silence after which the server pings
+    unsigned write_ms = 30000;     // queued output without any write progress
+};
+extern ConnectionTimeouts connection_timeouts; // set once at startup
+
+struct PollEvent
+{
+    socket_t fd;
+    bool readable;
+    bool writable;
+};
+
+// Thin level-triggered wrapper over the platform readiness API
+class Poller
+{
+public:
+    Poller();
+    ~Poller();
+    Poller(const Poller &) = delete;
+    Poller &operator=(const Poller &) = delete;
+
+    bool ok() const;
+    bool add(socket_t fd);                    // registers read interest
+    bool set_interest(socket_t fd, bool read, bool write);
+    void remove(socket_t fd);
+    // Fills events, returns how many are valid (0 on timeout/EINTR, -1 on error)
+    int wait(std::vector<PollEvent> &events, int timeout_ms);
+
+private:
+#if defined(__linux__)
+    int epfd_ = -1;
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+    int kq_ = -1;
+#else
+    std::vector<WSAPOLLFD> fds_;
+    std::unordered_map<socket_t, size_t> index_;
+#endif
+};
+
+// Lets other threads interrupt a Poller::wait (eventfd / pipe / loopback UDP)
+class Waker
+{
+public:
+    Waker();
+    ~Waker();
+    Waker(const Waker &) = delete;
+    Waker &operator=(const Waker &) = delete;
+
+    socket_t fd() const { return read_fd_; }
+    void wake();
+    void drain();
+
+private:
+    socket_t read_fd_ = INVALID_SOCKET;
+    socket_t write_fd_ = INVALID_SOCKET;
+};
+
+// One event-loop thread driving a set of non-blocking client sockets.
+//
+// With use_ring (builds with CHAT_HAVE_IO_URING, see uring.h) the same loop
+// runs on io_uring instead of the poller: a multishot accept per listener,
+// a multishot recv per connection that picks its buffer from a ring of
+// provided buffers, and at most one gathered sendmsg per connection in
+// flight. Everything the loop queues during an iteration, such as the
+// writes of a broadcast, goes to the kernel in one io_uring_enter. If the
+// ring cannot be set up the loop falls back to the poller.
+class EventLoop
+{
+public:
+    explicit EventLoop(bool use_ring = false);
+    ~EventLoop();
+    EventLoop(const EventLoop &) = delete;
+    EventLoop &operator=(const EventLoop &) = delete;
+
+    // Give the loop its own listening socket (SO_REUSEPORT shard), one per
+    // transport at most; call before start()
+    void listen(socket_t listen_sock, Transport transport = Transport::Stream);
+    // Run the loop's thread on this CPU (affinity.h); call before start()
+    void pin(int cpu) { cpu_ = cpu; }
+    void start();
+    void stop(); // thread-safe; closes remaining connections and exits run()
+    void join();
+
+    // Thread-safe: hand a freshly accepted and admitted socket (of the
+    // stream protocol) to this loop
+    void adopt(socket_t s, AdmissionSlot slot);
+    // Thread-safe: take over a session handed over by the previous process
+    // (restart.h); its name, protocol and rooms are already filled in
+    void adopt(const std::shared_ptr<Client> &client);
+    // Thread-safe: stop accepting and reading, and exit once every
+    // connection has flushed its queue, or after timeout_ms. With a handoff
+    // channel (restart.h) flushed connections are passed on to the new
+    // process instead of being closed.
+    void drain(unsigned timeout_ms, socket_t handoff);
+    // Connections currently pinned to this loop (used for least-loaded hand-off)
+    size_t load() const { return load_.load(std::memory_order_relaxed); }
+    // Thread-safe: queue a frame for a client owned by this loop; false if
+    // the client's queue overflowed and it is being disconnected
+    bool send(const std::shared_ptr<Client> &client, const FramePtr &frame);
+    bool send(const std::shared_ptr<Client> &client, const FramePtr *frames, size_t n);
+    // Thread-safe: close a client owned by this loop on its next iteration
+    void close_later(const std::shared_ptr<Client> &client);
+    // Thread-safe: the workers have worked the client's inbox down
+    // (dispatch.h); read from it again
+    void resume_input(const std::shared_ptr<Client> &client);
+
+private:
+    void run();
+    void process_inbox();
+    void accept_ready(Transport transport);
+    void accepted(socket_t s, AdmissionSlot slot, Transport transport);
+    bool inbox_empty() const; // inbox_mutex_ held
+    void register_client(const std::shared_ptr<Client> &client);
+    void resume_client(const std::shared_ptr<Client> &client);
+    bool drain_step();
+    bool hand_off(const std::shared_ptr<Client> &client);
+    void schedule_flush(const std::shared_ptr<Client> &client);
+    void handle_readable(const std::shared_ptr<Client> &client);
+    void ws_input(const std::shared_ptr<Client> &client, const char *data, size_t n);
+    void ws_answer(const std::shared_ptr<Client> &client);
+    void drain_frames(const std::shared_ptr<Client> &client);
+    void pause_reading(const std::shared_ptr<Client> &client, uint64_t wait_ns);
+    void pause_for_inbox(const std::shared_ptr<Client> &client);
+    void resume_reading(const std::shared_ptr<Client> &client);
+    void flush(const std::shared_ptr<Client> &client);
+    void close_client(const std::shared_ptr<Client> &client, bool announce);
+    void expire_timers();
+    void check_deadlines(const std::shared_ptr<Client> &client);
+    void arm(Client &client, uint64_t at_ms);
+    void set_reading(Client &client, bool on);
+    void stop_listening();
+#if defined(CHAT_HAVE_IO_URING)
+    // user_data of every submission: the operation in the top byte, the
+    // client's slot below
+    enum class RingOp : uint8_t
+    {
+        Wake = 1, // multishot poll on the waker
+        Accept,   // multishot accept on a listener; the slot is its Transport
+        Recv,     // multishot recv into provided buffers
+        Send,     // one gathered sendmsg
+        Cancel,   // cancels one of the above; its own result does not matter
+    };
+    io_uring_sqe *ring_sqe(RingOp op, uint32_t slot);
+    void ring_poll_waker();
+    void ring_accept(Transport transport);
+    void ring_complete(const io_uring_cqe &cqe);
+    void ring_accepted(socket_t s, Transport transport);
+    void ring_received(const std::shared_ptr<Client> &client, const io_uring_cqe &cqe);
+    void ring_sent(const std::shared_ptr<Client> &client, int res);
+    bool ring_recv(Client &client);
+    void ring_flush(const std::shared_ptr<Client> &client);
+    void ring_cancel(RingOp op, uint32_t slot);
+    void ring_release(Client &client);
+#endif
+
+    Poller poller_;
+    Waker waker_;
+    std::thread thread_;
+    int cpu_ = -1; // not pinned
+    std::atomic<std::thread::id> tid_{};
+    std::atomic<bool> stopping_{false};
+    std::atomic<bool> draining_{false};
+    std::atomic<size_t> load_{0};
+    socket_t listen_socks_[static_cast<size_t>(Transport::Count)] = {INVALID_SOCKET, INVALID_SOCKET};
+
+    std::mutex inbox_mutex_;
+    std::vector<std::pair<socket_t, AdmissionSlot>> pending_adopt_;
+    std::vector<std::shared_ptr<Client>> pending_flush_;
+    std::vector<std::shared_ptr<Client>> pending_close_;
+    std::vector<std::shared_ptr<Client>> pending_resume_;
+    std::vector<std::shared_ptr<Client>> pending_input_; // resume_input()
+    unsigned drain_ms_ = 0;                 // set by drain() before draining_
+    socket_t handoff_ = INVALID_SOCKET;
+
+    // owned by the loop thread
+    std::unordered_map<socket_t, std::shared_ptr<Client>> conns_;
+    std::vector<FramePtr> batch_; // scratch for flush()
+    uint64_t now_ms_;             // monotonic time of the current iteration
+    TimerWheel timers_;           // one timer per connection, see check_deadlines()
+    bool drain_started_ = false;
+    uint64_t drain_deadline_ms_ = 0;
+#if defined(CHAT_HAVE_IO_URING)
+    // io_uring mode; completions find their client by slot, since a closed
+    // client's operations may still be outstanding
+    std::vector<std::shared_ptr<Client>> ring_slots_;
+    std::vector<uint32_t> ring_free_;
+    std::unique_ptr<Uring> ring_; // destroyed before the clients it may still reference
+#endif
+};
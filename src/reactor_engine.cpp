@@ -0,0 +1,211 @@
+// Reactor engine: a fixed set of event-loop shards. Each shard owns an
+// SO_REUSEPORT listener when available; otherwise the main thread accepts and
+// hands sockets to the least-loaded shard. The WebSocket listener
+// (--ws-port) is sharded the same way, or served by the first shard alone.
+#include "engine.h"
+#include "affinity.h"
+#include "chat.h"
+#include "directory.h"
+#include "log.h"
+#include "reactor.h"
+#include "restart.h"
+
+#include <algorithm>
+#include <string>
+
+static EventLoop *least_loaded(std::vector<std::unique_ptr<EventLoop>> &loops)
+{
+    EventLoop *target = loops.front().get();
+    for (auto &l : loops)
+    {
+        if (l->load() < target->load())
+            target = l.get();
+    }
+    return target;
+}
+
+// Fallback acceptor for platforms without load-balancing SO_REUSEPORT
+static void accept_and_hand_off(socket_t listen_sock, std::vector<std::unique_ptr<EventLoop>> &loops,
+                                socket_t *successor)
+{
+    while (running)
+    {
+        if (restart_pending && start_successor(successor))
+            break;
+        // polled, so that a restart request is noticed between connections
+        if (!wait_for_socket(listen_sock, false, 200))
+            continue;
+        sockaddr_in peer{};
+        socket_t client_sock = accept_nonblocking(listen_sock, peer);
+        if (client_sock == INVALID_SOCKET)
+        {
+            if (!running)
+                break;
+            LOG_ERROR("accept() failed");
+            continue;
+        }
+        AdmissionSlot slot;
+        if (!admit_connection(client_sock, &peer, slot))
+        {
+            close_socket(client_sock);
+            continue;
+        }
+        least_loaded(loops)->adopt(client_sock, std::move(slot));
+    }
+}
+
+// Restart: sessions passed over by the previous process, until it is done
+static void receive_handoffs(socket_t channel, std::vector<std::unique_ptr<EventLoop>> &loops)
+{
+    socket_t sock;
+    HandoffSession session;
+    size_t n = 0;
+    while (receive_connection(channel, sock, session))
+    {
+        auto c = make_client(sock);
+        admit_connection(sock, nullptr, c->admission, true); // already in, whatever the limits
+        c->id = session.id;
+        c->proto = session.proto;
+        c->compress = session.compress;
+        c->saw_username = session.saw_username;
+        if (session.named)
+        {
+            c->name = session.name;
+            c->named.store(true, std::memory_order_release);
+        }
+        for (const std::string &name : session.rooms)
+        {
+            RoomId id = rooms.intern(name);
+            if (id != INVALID_ROOM)
+                c->rooms.push_back(id);
+        }
+        c->reader.restore_pending(std::move(session.input));
+        least_loaded(loops)->adopt(c);
+        ++n;
+    }
+    LOG_INFO("Restart: took over " << n << " connection(s)");
+}
+
+// "0,1,2,3" for the log line
+static std::string cpu_list(const std::vector<int> &cpus, size_t n)
+{
+    std::string s;
+    for (size_t i = 0; i < n && i < cpus.size(); ++i)
+        s += (i ? "," : "") + std::to_string(cpus[i]);
+    return s;
+}
+
+static bool use_uring(const ServerConfig &cfg)
+{
+    if (cfg.engine != Engine::Uring)
+        return false;
+#if defined(CHAT_HAVE_IO_URING)
+    std::string why;
+    if (uring_supported(why))
+        return true;
+    LOG_WARN("io_uring engine unavailable (" << why << "), using the poller");
+#else
+    LOG_WARN("built without io_uring support, using the poller");
+#endif
+    return false;
+}
+
+void run_reactor_engine(socket_t listen_sock, const ServerConfig &cfg, socket_t handoff)
+{
+    unsigned n = cfg.shards;
+    if (n == 0)
+        n = std::max(1u, std::thread::hardware_concurrency());
+    bool sharded_accept = reuse_port_supported();
+    bool ring = use_uring(cfg);
+    std::vector<int> cpus;
+    if (!plan_cpus(n, cpus))
+        LOG_WARN("running the event loops unpinned");
+
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    for (unsigned i = 0; i < n; ++i)
+    {
+        loops.emplace_back(new EventLoop(ring));
+        if (!cpus.empty())
+            loops.back()->pin(cpus[i]);
+        if (!sharded_accept)
+            continue;
+        socket_t ls = i == 0 ? listen_sock : open_listener(cfg.port, true);
+        if (ls == INVALID_SOCKET)
+        {
+            loops.pop_back();
+            break;
+        }
+        if (i > 0)
+            set_defer_accept(ls, admission_limits.defer_accept_sec);
+        // the kernel then picks this shard for connections arriving on its CPU
+        if (placement.incoming_cpu && !cpus.empty())
+            set_incoming_cpu(ls, cpus[i]);
+        loops.back()->listen(ls);
+    }
+    size_t ws_listeners = 0;
+    for (size_t i = 0; cfg.ws_port && i < (sharded_accept ? loops.size() : 1); ++i)
+    {
+        socket_t ls = open_listener(cfg.ws_port, sharded_accept);
+        if (ls == INVALID_SOCKET)
+            break;
+        // a browser sends its upgrade request at once
+        set_defer_accept(ls, admission_limits.defer_accept_sec);
+        if (placement.incoming_cpu && sharded_accept && !cpus.empty())
+            set_incoming_cpu(ls, cpus[i]);
+        loops[i]->listen(ls, Transport::WebSocket);
+        ++ws_listeners;
+    }
+    if (cfg.ws_port && ws_listeners == 0)
+        LOG_ERROR("could not listen for WebSocket clients on port " << cfg.ws_port);
+    release_inherited_listeners();
+    std::thread receiver;
+    {
+        ScopedSignalBlock block; // keep SIGINT on the main thread
+        for (auto &l : loops)
+            l->start();
+        if (handoff != INVALID_SOCKET)
+            receiver = std::thread(receive_handoffs, handoff, std::ref(loops));
+    }
+    LOG_INFO("Reactor engine running " << loops.size() << " shard(s) on " << (ring ? "io_uring" : "the poller") << ", "
+          << (sharded_accept ? "SO_REUSEPORT listener per shard" : "least-loaded hand-off")
+          << (cpus.empty() ? "" : ", pinned to CPUs " + cpu_list(cpus, loops.size())));
+    if (ws_listeners)
+        LOG_INFO("WebSocket clients on port " << cfg.ws_port << " (" << ws_listeners << " listener(s))");
+
+    socket_t successor = INVALID_SOCKET;
+    socket_t *want = cfg.handoff ? &successor : nullptr;
+    if (sharded_accept)
+    {
+        for (;;)
+        {
+            wait_for_shutdown();
+            if (!running || start_successor(want))
+                break;
+        }
+    }
+    else
+        accept_and_hand_off(listen_sock, loops, want);
+
+    // shutdown
+    LOG_INFO("Shutting down server...");
+    if (receiver.joinable())
+    {
+        shutdown_socket(handoff); // the previous process may still be draining
+        receiver.join();
+        close_socket(handoff);
+    }
+
+    // a successor takes the connections over; otherwise clients hear why they go
+    if (successor == INVALID_SOCKET)
+        broadcast("Server", "服务器正在关闭");
+    // every loop drains at once, so the slowest client bounds the whole shutdown
+    for (auto &l : loops)
+        l->drain(cfg.drain_ms, successor);
+    for (auto &l : loops)
+        l->join();
+    if (successor != INVALID_SOCKET)
+        close_socket(successor);
+
+    registry.clear();
+    directory.clear();
+}
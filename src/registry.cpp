@@ -0,0 +1,88 @@
+#include "registry.h"
+#include "chat.h"
+
+ClientSet registry;
+
+static std::atomic<uint64_t> g_next_client_id{1};
+static uint64_t g_node = 0;
+
+uint64_t allocate_client_id()
+{
+    return g_next_client_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+void reserve_client_ids(uint64_t next)
+{
+    if (((next - 1) >> NODE_ID_SHIFT) != g_node)
+        return; // relayed from another node
+    uint64_t cur = g_next_client_id.load(std::memory_order_relaxed);
+    while (cur < next && !g_next_client_id.compare_exchange_weak(cur, next, std::memory_order_relaxed))
+    {
+    }
+}
+
+void set_node_id(uint16_t node)
+{
+    g_node = node;
+    reserve_client_ids((uint64_t(node) << NODE_ID_SHIFT) + 1);
+}
+
+ClientSet::ClientSet() : published_(std::make_shared<Snapshot>()) {}
+
+bool ClientSet::add(const std::shared_ptr<Client> &client)
+{
+    std::lock_guard<std::mutex> lk(write_mutex_);
+    if (!index_.emplace(client->id, members_.size()).second)
+        return false;
+    members_.push_back(client);
+    version_.fetch_add(1, std::memory_order_release);
+    return true;
+}
+
+bool ClientSet::remove(const Client &client)
+{
+    std::lock_guard<std::mutex> lk(write_mutex_);
+    auto it = index_.find(client.id);
+    if (it == index_.end())
+        return false;
+    size_t pos = it->second;
+    index_.erase(it);
+    if (pos != members_.size() - 1)
+    {
+        members_[pos] = std::move(members_.back());
+        index_[members_[pos]->id] = pos;
+    }
+    members_.pop_back();
+    version_.fetch_add(1, std::memory_order_release);
+    return true;
+}
+
+void ClientSet::clear()
+{
+    std::lock_guard<std::mutex> lk(write_mutex_);
+    members_.clear();
+    index_.clear();
+    version_.fetch_add(1, std::memory_order_release);
+}
+
+size_t ClientSet::size() const
+{
+    std::lock_guard<std::mutex> lk(write_mutex_);
+    return members_.size();
+}
+
+ClientSet::SnapshotPtr ClientSet::snapshot() const
+{
+    if (published_version_.load(std::memory_order_acquire) == version_.load(std::memory_order_acquire))
+        return std::atomic_load(&published_);
+
+    // membership changed since the last publish; the first reader rebuilds
+    std::lock_guard<std::mutex> lk(write_mutex_);
+    uint64_t v = version_.load(std::memory_order_relaxed);
+    if (published_version_.load(std::memory_order_relaxed) != v)
+    {
+        std::atomic_store(&published_, SnapshotPtr(std::make_shared<Snapshot>(members_)));
+        published_version_.store(v, std::memory_order_release);
+    }
+    return std::atomic_load(&published_);
+}
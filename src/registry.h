@@ -0,0 +1,59 @@
+// Read-mostly sets of connected clients (global registry, room membership)
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct Client;
+
+// Readers (broadcast, user list) iterate an immutable snapshot without taking
+// a lock; writers update a private member list and bump a version, and the
+// next reader publishes a fresh snapshot. A storm of joins therefore costs one
+// rebuild per broadcast at most instead of one copy per join. Removed clients
+// stay alive until the last snapshot referencing them is released.
+class ClientSet
+{
+public:
+    using Snapshot = std::vector<std::shared_ptr<Client>>;
+    using SnapshotPtr = std::shared_ptr<const Snapshot>;
+
+    ClientSet();
+
+    // Keyed by Client::id; returns false if the client was already a member
+    bool add(const std::shared_ptr<Client> &client);
+    // O(1) swap-remove by id; returns false if the client was not a member
+    bool remove(const Client &client);
+    void clear();
+    size_t size() const;
+
+    SnapshotPtr snapshot() const;
+
+private:
+    mutable std::mutex write_mutex_;
+    std::vector<std::shared_ptr<Client>> members_;
+    std::unordered_map<uint64_t, size_t> index_; // id -> position in members_
+    std::atomic<uint64_t> version_{0};
+
+    // published state, read lock-free
+    mutable SnapshotPtr published_;
+    mutable std::atomic<uint64_t> published_version_{0};
+};
+
+// Every live connection, named or not
+extern ClientSet registry;
+
+// Cluster nodes keep their id in the top bits of every connection id they
+// hand out, so ids stay unique across the cluster
+static const unsigned NODE_ID_SHIFT = 48;
+
+// Stable, never reused connection id for a new Client
+uint64_t allocate_client_id();
+// Make later ids start at `next` or above (ids restored from the journal);
+// ids of other nodes are ignored
+void reserve_client_ids(uint64_t next);
+// Call once at startup, before any id is handed out or reserved
+void set_node_id(uint16_t node);
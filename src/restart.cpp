@@ -0,0 +1,377 @@
+// Hot restart (restart.h): starting the successor and carrying state over
+#include "restart.h"
+#include "chat.h"
+#include "cluster.h"
+#include "engine.h"
+#include "journal.h"
+#include "log.h"
+#include "protocol.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string_view>
+
+#if !defined(_WIN32)
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#endif
+
+static char **g_argv = nullptr;
+
+void init_restart(char *argv[])
+{
+    g_argv = argv;
+}
+
+#if defined(_WIN32)
+
+bool start_successor(socket_t *)
+{
+    LOG_ERROR("restart: not supported on this platform");
+    restart_pending = false;
+    return false;
+}
+
+bool take_over(socket_t *)
+{
+    return false;
+}
+
+bool send_connection(socket_t, socket_t, const HandoffSession &)
+{
+    return false;
+}
+
+bool receive_connection(socket_t, socket_t &, HandoffSession &)
+{
+    return false;
+}
+
+#else
+
+// Channel descriptor of a successor, see take_over()
+static const char *const RESTART_FD_ENV = "CHAT_RESTART_FD";
+// How long a new process may take to report in before the restart is abandoned
+static const int STARTUP_TIMEOUT_MS = 10000;
+// Connection ids the predecessor may still hand out after reporting its
+// next one, until every loop has noticed that it is draining
+static const uint64_t ID_MARGIN = uint64_t(1) << 20;
+// Likewise for the sequence numbers of each room: the predecessor's workers
+// still finish queued posts while it drains, and those must not collide
+// with the successor's first ones
+static const uint64_t SEQ_MARGIN = uint64_t(1) << 20;
+
+static const char READY = 'R';
+static const char GO = 'G';
+
+static std::string listen_fds_spec()
+{
+    std::string spec;
+    for (const auto &kv : open_listeners())
+    {
+        if (!spec.empty())
+            spec += ',';
+        spec += std::to_string(kv.first) + ":" + std::to_string(kv.second);
+    }
+    return spec;
+}
+
+// Marks every descriptor but `keep` close-on-exec. Done before fork(); the
+// child repeats it with close_range() where available, which also covers
+// descriptors other threads opened in between.
+static void close_on_exec_except(const std::vector<int> &keep)
+{
+    std::vector<int> fds;
+#if defined(__linux__)
+    if (DIR *d = opendir("/proc/self/fd"))
+    {
+        while (dirent *e = readdir(d))
+        {
+            if (e->d_name[0] != '.')
+                fds.push_back(std::atoi(e->d_name));
+        }
+        closedir(d);
+    }
+#endif
+    if (fds.empty())
+    {
+        for (int fd = 3; fd < getdtablesize(); ++fd)
+            fds.push_back(fd);
+    }
+    for (int fd : fds)
+    {
+        if (fd < 3 || std::find(keep.begin(), keep.end(), fd) != keep.end())
+            continue;
+        int flags = fcntl(fd, F_GETFD);
+        if (flags >= 0)
+            fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+    }
+}
+
+// Forks and execs our own command line with the listeners and one end of a
+// fresh channel inherited; the other end, or INVALID_SOCKET
+static socket_t spawn(pid_t &pid)
+{
+    if (!g_argv || !g_argv[0])
+        return INVALID_SOCKET;
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+    {
+        LOG_ERROR("restart: socketpair() failed: " << std::strerror(errno));
+        return INVALID_SOCKET;
+    }
+    std::vector<int> keep;
+    for (const auto &kv : open_listeners())
+        keep.push_back(kv.second);
+    keep.push_back(pair[1]);
+    close_on_exec_except(keep);
+    fcntl(pair[0], F_SETFD, FD_CLOEXEC);
+
+    setenv(LISTEN_FDS_ENV, listen_fds_spec().c_str(), 1);
+    setenv(RESTART_FD_ENV, std::to_string(pair[1]).c_str(), 1);
+    pid = fork();
+    if (pid == 0)
+    {
+        // only async-signal-safe calls from here to exec
+#if defined(__linux__) && defined(SYS_close_range)
+        syscall(SYS_close_range, 3u, ~0u, 4u /* CLOSE_RANGE_CLOEXEC */);
+#endif
+        for (int fd : keep)
+            fcntl(fd, F_SETFD, 0);
+        execvp(g_argv[0], g_argv);
+        _exit(127);
+    }
+    unsetenv(LISTEN_FDS_ENV);
+    unsetenv(RESTART_FD_ENV);
+    close_socket(pair[1]);
+    if (pid < 0)
+    {
+        LOG_ERROR("restart: fork() failed: " << std::strerror(errno));
+        close_socket(pair[0]);
+        return INVALID_SOCKET;
+    }
+    return pair[0];
+}
+
+// GO, the id the successor's connection ids start at, then every room
+// (name and the sequence number it continues after) in id order so that
+// room ids stay put
+static std::string go_message()
+{
+    std::string msg(1, GO);
+    put_int(msg, allocate_client_id() + ID_MARGIN, 8);
+    std::string table;
+    uint32_t n = 0;
+    for (RoomId id = 0; Room *room = rooms.get(id); ++id, ++n)
+    {
+        put_str(table, room->name);
+        put_int(table, room->seq.load(std::memory_order_relaxed) + SEQ_MARGIN, 8);
+    }
+    put_int(msg, n, 4);
+    return msg + table;
+}
+
+bool start_successor(socket_t *successor)
+{
+    restart_pending = false;
+    LOG_INFO("Restart requested: starting " << g_argv[0]);
+    pid_t pid = -1;
+    socket_t ch = spawn(pid);
+    if (ch == INVALID_SOCKET)
+        return false;
+    char ready = 0;
+    bool ok = wait_for_socket(ch, false, STARTUP_TIMEOUT_MS) && recv_all(ch, &ready, 1) && ready == READY;
+    if (!ok)
+    {
+        LOG_ERROR("restart: new process (pid " << pid << ") did not start; still serving");
+        close_socket(ch);
+        kill(pid, SIGKILL);
+        waitpid(pid, nullptr, 0);
+        return false;
+    }
+    // from here the successor owns the journal; what we still append is dropped
+    suspend_journal();
+    std::string go = go_message();
+    if (!send_all(ch, go.data(), go.size()))
+    {
+        LOG_ERROR("restart: lost the new process (pid " << pid << "); still serving, without the journal");
+        close_socket(ch);
+        return false;
+    }
+    // relays from peers now belong to the successor, which shares our listener
+    cluster_hand_over();
+    LOG_INFO("Restart: pid " << pid << " took over; draining");
+    if (successor)
+        *successor = ch;
+    else
+        close_socket(ch);
+    request_shutdown();
+    return true;
+}
+
+bool take_over(socket_t *handoff)
+{
+    const char *env = std::getenv(RESTART_FD_ENV);
+    if (!env)
+        return false;
+    socket_t ch = static_cast<socket_t>(std::atoi(env));
+    unsetenv(RESTART_FD_ENV);
+    fcntl(ch, F_SETFD, FD_CLOEXEC);
+
+    char go = 0;
+    char head[12];
+    if (!send_all(ch, &READY, 1) || !recv_all(ch, &go, 1) || go != GO || !recv_all(ch, head, sizeof(head)))
+    {
+        LOG_WARN("restart: previous process went away; starting fresh");
+        close_socket(ch);
+        return false;
+    }
+    Fields h{std::string_view(head, sizeof(head))};
+    uint64_t next_id = h.get_int(8);
+    uint32_t n = static_cast<uint32_t>(h.get_int(4));
+    for (uint32_t i = 0; i < n; ++i)
+    {
+        // the lobby (id 0) exists already; the rest are interned in order
+        char len_bytes[4];
+        if (!recv_all(ch, len_bytes, sizeof(len_bytes)))
+            break;
+        Fields lf{std::string_view(len_bytes, sizeof(len_bytes))};
+        std::string name(static_cast<size_t>(lf.get_int(4)), '\0');
+        char seq_bytes[8];
+        if ((!name.empty() && !recv_all(ch, &name[0], name.size())) || !recv_all(ch, seq_bytes, sizeof(seq_bytes)))
+            break;
+        Fields sf{std::string_view(seq_bytes, sizeof(seq_bytes))};
+        uint64_t seq = sf.get_int(8);
+        RoomId id = rooms.intern(name);
+        if (Room *room = rooms.get(id))
+        {
+            if (room->seq.load(std::memory_order_relaxed) < seq)
+                room->seq.store(seq, std::memory_order_relaxed);
+        }
+    }
+    reserve_client_ids(next_id);
+    LOG_INFO("Taking over from the previous process (" << n << " rooms)");
+    if (handoff)
+        *handoff = ch;
+    else
+        close_socket(ch);
+    return true;
+}
+
+// Serializes records of several loop threads on the one channel
+static std::mutex g_send_mutex;
+
+bool send_connection(socket_t channel, socket_t sock, const HandoffSession &session)
+{
+    std::string rec(4, '\0');
+    put_int(rec, session.id, 8);
+    rec.push_back(static_cast<char>(session.proto));
+    rec.push_back(static_cast<char>(session.compress));
+    rec.push_back(static_cast<char>((session.saw_username ? 1 : 0) | (session.named ? 2 : 0)));
+    put_str(rec, session.name);
+    put_int(rec, session.rooms.size(), 4);
+    for (const std::string &room : session.rooms)
+        put_str(rec, room);
+    put_str(rec, session.input);
+    std::string len;
+    put_int(len, rec.size() - 4, 4);
+    rec.replace(0, 4, len);
+
+    // the descriptor rides on the first byte of the record
+    iovec iov;
+    iov.iov_base = &rec[0];
+    iov.iov_len = rec.size();
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    std::memcpy(CMSG_DATA(cm), &sock, sizeof(int));
+
+    std::lock_guard<std::mutex> lk(g_send_mutex);
+    ssize_t n;
+    do
+        n = sendmsg(channel, &msg, CHAT_SEND_FLAGS);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return false;
+    size_t sent = static_cast<size_t>(n);
+    return sent == rec.size() || send_all(channel, rec.data() + sent, rec.size() - sent);
+}
+
+bool receive_connection(socket_t channel, socket_t &sock, HandoffSession &session)
+{
+    char len_bytes[4];
+    iovec iov;
+    iov.iov_base = len_bytes;
+    iov.iov_len = sizeof(len_bytes);
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg{};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    int flags = 0;
+#if defined(MSG_CMSG_CLOEXEC)
+    flags |= MSG_CMSG_CLOEXEC;
+#endif
+    ssize_t n;
+    do
+        n = recvmsg(channel, &msg, flags);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return false;
+    sock = INVALID_SOCKET;
+    for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+    {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+            std::memcpy(&sock, CMSG_DATA(cm), sizeof(int));
+    }
+    size_t got = static_cast<size_t>(n);
+    std::string rec;
+    if ((got < sizeof(len_bytes) && !recv_all(channel, len_bytes + got, sizeof(len_bytes) - got)) || sock == INVALID_SOCKET)
+    {
+        LOG_ERROR("restart: malformed connection record");
+        if (sock != INVALID_SOCKET)
+            close_socket(sock);
+        return false;
+    }
+    Fields lf{std::string_view(len_bytes, sizeof(len_bytes))};
+    rec.resize(static_cast<size_t>(lf.get_int(4)));
+    if (!rec.empty() && !recv_all(channel, &rec[0], rec.size()))
+    {
+        close_socket(sock);
+        return false;
+    }
+
+    Fields f{rec};
+    session.id = f.get_int(8);
+    session.proto = static_cast<uint8_t>(f.get_int(1));
+    session.compress = static_cast<uint8_t>(f.get_int(1));
+    uint8_t state = static_cast<uint8_t>(f.get_int(1));
+    session.saw_username = (state & 1) != 0;
+    session.named = (state & 2) != 0;
+    session.name = f.get_str();
+    size_t count = static_cast<size_t>(f.get_int(4));
+    session.rooms.clear();
+    for (size_t i = 0; i < count && f.ok; ++i)
+        session.rooms.push_back(f.get_str());
+    session.input = f.get_str();
+    if (!f.ok)
+    {
+        LOG_ERROR("restart: malformed connection record");
+        close_socket(sock);
+        return false;
+    }
+    return true;
+}
+
+#endif
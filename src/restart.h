@@ -0,0 +1,56 @@
+// Zero-downtime restart: a new server process takes over the listening
+// sockets (and optionally the live connections) of the running one
+#pragma once
+
+#include "platform.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// SIGUSR2 asks the server to restart. The running process (the predecessor)
+// forks and execs its own command line again; the new process (the
+// successor) inherits every listening socket, so no connection attempt is
+// refused across the switch. Once the successor reports that it started,
+// the predecessor hands over the journal and the room table, stops
+// accepting and drains; with handoff it also passes each idle connection,
+// file descriptor and session state, over a UNIX socket (SCM_RIGHTS), and
+// the client never notices. If the successor fails to start, the running
+// process carries on as if nothing happened.
+//
+// POSIX only; elsewhere a restart request is logged and ignored.
+
+// Remembers the command line to re-exec; call once from main()
+void init_restart(char *argv[]);
+
+// For the engines' accept loops, once restart_pending (chat.h) is seen:
+// starts the successor and hands it the journal and the room table. True
+// when it took over; shutdown has then been requested and the engine winds
+// down as usual, handing connections over `*successor` (null: none are
+// handed over) before closing it. False if the successor failed: the
+// request is cleared and the server keeps running.
+bool start_successor(socket_t *successor);
+
+// Successor side, from main() before the journal is opened: reports to the
+// predecessor and takes the room table over. True when this process is a
+// successor; `*handoff` is then the channel connections arrive on.
+bool take_over(socket_t *handoff);
+
+// One connection's session, as carried across a restart
+struct HandoffSession
+{
+    uint64_t id = 0;
+    uint8_t proto = 0;
+    uint8_t compress = 0;
+    bool saw_username = false;
+    bool named = false;
+    std::string name;
+    std::vector<std::string> rooms; // joined rooms by name, lobby included
+    std::string input;              // received but unparsed bytes (FrameReader::take_pending)
+};
+
+// Thread-safe; the socket stays open on the caller's side. False if the
+// successor is gone.
+bool send_connection(socket_t channel, socket_t sock, const HandoffSession &session);
+// Blocks for the next connection; false once the predecessor is done
+bool receive_connection(socket_t channel, socket_t &sock, HandoffSession &session);
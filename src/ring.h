@@ -0,0 +1,68 @@
+// Growable FIFO backed by a power-of-two ring
+#pragma once
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Unlike std::deque, storage is kept once grown, so a queue that is pushed
+// and popped at a steady rate never allocates. Vacated slots are reset to T()
+// right away so that shared references are released promptly.
+template <typename T>
+class RingQueue
+{
+public:
+    bool empty() const { return count_ == 0; }
+    size_t size() const { return count_; }
+
+    T &operator[](size_t i) { return slots_[(head_ + i) & (slots_.size() - 1)]; }
+    const T &operator[](size_t i) const { return slots_[(head_ + i) & (slots_.size() - 1)]; }
+    T &front() { return slots_[head_]; }
+
+    void push_back(T value)
+    {
+        if (count_ == slots_.size())
+            grow();
+        (*this)[count_] = std::move(value);
+        ++count_;
+    }
+
+    void pop_front()
+    {
+        slots_[head_] = T();
+        head_ = (head_ + 1) & (slots_.size() - 1);
+        --count_;
+    }
+
+    // Remove the n elements from index `keep` on, keeping the order of the
+    // rest; the first `keep` slide up to close the gap, so this costs keep +
+    // n moves however long the queue is
+    void erase_after(size_t keep, size_t n)
+    {
+        for (size_t i = keep; i-- > 0;)
+            (*this)[i + n] = std::move((*this)[i]);
+        for (size_t i = 0; i < n; ++i)
+            pop_front();
+    }
+
+    void clear()
+    {
+        while (count_)
+            pop_front();
+        head_ = 0;
+    }
+
+private:
+    void grow()
+    {
+        std::vector<T> next(slots_.empty() ? 16 : slots_.size() * 2);
+        for (size_t i = 0; i < count_; ++i)
+            next[i] = std::move((*this)[i]);
+        slots_.swap(next);
+        head_ = 0;
+    }
+
+    std::vector<T> slots_;
+    size_t head_ = 0;
+    size_t count_ = 0;
+};
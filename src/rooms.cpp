@@ -0,0 +1,59 @@
+#include "rooms.h"
+
+#include <algorithm>
+
+RoomLimits room_limits;
+RoomTable rooms;
+
+RoomTable::RoomTable() : slots_(new std::atomic<Room *>[MAX_ROOMS])
+{
+    for (size_t i = 0; i < MAX_ROOMS; ++i)
+        slots_[i].store(nullptr, std::memory_order_relaxed);
+    intern("lobby");
+}
+
+bool RoomTable::valid_name(const std::string &name)
+{
+    if (name.empty() || name.size() > MAX_ROOM_NAME)
+        return false;
+    for (unsigned char ch : name)
+    {
+        if (ch <= ' ')
+            return false;
+    }
+    return true;
+}
+
+RoomId RoomTable::intern(const std::string &name)
+{
+    if (!valid_name(name))
+        return INVALID_ROOM;
+    std::lock_guard<std::mutex> lk(intern_mutex_);
+    auto it = by_name_.find(name);
+    if (it != by_name_.end())
+        return it->second;
+    if (owned_.size() >= std::min(room_limits.max_rooms, MAX_ROOMS))
+        return INVALID_ROOM;
+
+    std::unique_ptr<Room> room(new Room());
+    room->id = static_cast<RoomId>(owned_.size());
+    room->name = name;
+    slots_[room->id].store(room.get(), std::memory_order_release);
+    by_name_.emplace(name, room->id);
+    owned_.push_back(std::move(room));
+    return owned_.back()->id;
+}
+
+RoomId RoomTable::find(const std::string &name) const
+{
+    std::lock_guard<std::mutex> lk(intern_mutex_);
+    auto it = by_name_.find(name);
+    return it == by_name_.end() ? INVALID_ROOM : it->second;
+}
+
+Room *RoomTable::get(RoomId id) const
+{
+    if (id >= MAX_ROOMS)
+        return nullptr;
+    return slots_[id].load(std::memory_order_acquire);
+}
@@ -0,0 +1,67 @@
+// Named chat rooms with per-room membership sets
+#pragma once
+
+#include "history.h"
+#include "ratelimit.h"
+#include "registry.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using RoomId = uint32_t;
+
+static const RoomId INVALID_ROOM = static_cast<RoomId>(-1);
+static const RoomId LOBBY_ROOM = 0; // every named client joins it; plain messages go here
+static const size_t MAX_ROOMS = 65536;
+static const size_t MAX_ROOM_NAME = 64;
+
+// Rooms are never destroyed (see RoomTable), so creating them is bounded
+struct RoomLimits
+{
+    size_t max_rooms = MAX_ROOMS;   // rooms in the table, the lobby included
+    size_t per_client = 64;         // rooms one connection may be in besides the lobby
+    size_t creates_per_client = 16; // new rooms one connection may create
+};
+extern RoomLimits room_limits; // set once at startup
+
+struct Room
+{
+    RoomId id;
+    std::string name;
+    ClientSet members;
+    std::atomic<uint64_t> seq{0}; // last sequence number handed out here
+    RoomHistory history;          // recent chat messages, replayed on join
+    TokenBucket limiter;          // posts by all members (rate_limits.room)
+};
+
+// Room names are interned once into dense ids; after that every lookup is an
+// array index with no lock and no string compare. Rooms are never destroyed,
+// so a Room* stays valid for the life of the process.
+class RoomTable
+{
+public:
+    RoomTable();
+
+    // Id for name, creating the room on first use; INVALID_ROOM if the name
+    // is malformed or the table holds room_limits.max_rooms rooms
+    RoomId intern(const std::string &name);
+    // Existing room or INVALID_ROOM; never creates
+    RoomId find(const std::string &name) const;
+    // O(1); null for an unknown id
+    Room *get(RoomId id) const;
+
+    static bool valid_name(const std::string &name);
+
+private:
+    mutable std::mutex intern_mutex_;
+    std::unordered_map<std::string, RoomId> by_name_;
+    std::vector<std::unique_ptr<Room>> owned_;
+    std::unique_ptr<std::atomic<Room *>[]> slots_;
+};
+
+extern RoomTable rooms;
@@ -0,0 +1,230 @@
+// Thread-per-connection engine: one blocking std::thread per accepted socket
+#include "engine.h"
+#include "affinity.h"
+#include "chat.h"
+#include "directory.h"
+#include "log.h"
+#include "metrics.h"
+#include "restart.h"
+
+#include <chrono>
+
+// Orders worker assignment, self-detach and the shutdown snapshot
+static std::mutex g_threads_mutex;
+// Set (under g_threads_mutex) when shutdown snapshots the clients it will join
+static bool g_joining = false;
+
+// Drop the client from the registry. Before the shutdown snapshot nobody
+// joins the worker any more, so it detaches itself; afterwards main() joins it.
+// A detached thread must not touch shared state afterwards (the worker pool
+// in particular is torn down without waiting for it), so this comes last.
+static void retire_client(const std::shared_ptr<Client> &client)
+{
+    std::lock_guard<std::mutex> lk(g_threads_mutex);
+    client->admission.release();
+    registry.remove(*client);
+    if (!g_joining && client->worker.joinable())
+        client->worker.detach();
+}
+
+// Blocking counterpart of the reactor's read path: parse buffered frames
+// first and only go back to the socket when none is complete
+static bool read_frame(const std::shared_ptr<Client> &client, Buffer &out)
+{
+    while (!client->reader.next(out))
+    {
+        if (client->reader.fill(client->sock) != FrameReader::Status::Ok)
+            return false;
+    }
+    return true;
+}
+
+// Drains the client's outbound queue so a slow reader only ever stalls itself
+static void write_loop(std::shared_ptr<Client> client)
+{
+    std::vector<FramePtr> batch;
+    while (client->out.wait())
+    {
+        size_t off = client->out.peek(batch, coalesce_limits.max_iov);
+        uint64_t t0 = monotonic_ns();
+        long n = send_frames(client->sock, batch, off, coalesce_limits.max_bytes);
+        metric_record(Histogram::SendNanos, monotonic_ns() - t0);
+        batch.clear();
+        if (n > 0)
+            client->out.consume(static_cast<size_t>(n));
+        // with a send timeout, nothing sent at all means the peer stalled for that long
+        else if (n < 0 || connection_timeouts.write_ms || !wait_for_socket(client->sock, true))
+        {
+            client->out.abort();
+            break;
+        }
+    }
+    if (client->out.aborted())
+        LOG_WARN("Send queue aborted for " << display_name(*client) << "; closing");
+    // wakes the reader thread if it is still blocked in recv
+    shutdown_socket(client->sock);
+}
+
+// Over its rate, the reader thread simply sleeps: nothing is read meanwhile,
+// so TCP flow control pushes back on the sender
+static void throttle(const std::shared_ptr<Client> &client)
+{
+    const RateLimit &limit = rate_limits.client;
+    if (!limit.rate)
+        return;
+    uint64_t now = monotonic_ns();
+    uint64_t wait = client->rate.wait(limit, now);
+    if (wait)
+    {
+        metric_add(Counter::ClientRateLimited);
+        metric_record(Histogram::ThrottleNanos, wait);
+        std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+        now += wait;
+    }
+    client->rate.take(limit, now);
+}
+
+static void handle_client(std::shared_ptr<Client> client)
+{
+    set_socket_timeout(client->sock, true, connection_timeouts.write_ms);
+    client->writer = std::thread(write_loop, client);
+    // let the writer flush what is queued, then release the socket;
+    // retire_client() follows once nothing else is left to do
+    auto finish = [&]
+    {
+        client->out.close();
+        client->writer.join();
+        {
+            // disconnect() from a worker must not touch a reused descriptor
+            std::lock_guard<std::mutex> lk(client->inbox_mutex);
+            client->closed = true;
+        }
+        close_socket(client->sock);
+        metric_add(Counter::ConnectionsClosed);
+    };
+
+    try
+    {
+        // First message is username. No pings here: a blocked recv cannot
+        // send them, so the deadlines are plain receive timeouts.
+        set_socket_timeout(client->sock, false, connection_timeouts.handshake_ms);
+        Buffer name;
+        if (!read_frame(client, name))
+        {
+            LOG_WARN("Failed username recv; closing client");
+            finish();
+            retire_client(client);
+            return;
+        }
+        dispatch_frame(client, std::move(name), client->reader.part());
+        set_socket_timeout(client->sock, false, connection_timeouts.idle_ms);
+
+        // Loop receiving messages; __quit__ or a failed join sets `quitting`
+        Buffer msg;
+        while (running && !client->quitting && read_frame(client, msg))
+        {
+            throttle(client);
+            if (!dispatch_frame(client, std::move(msg), client->reader.part()))
+                wait_for_inbox(client);
+        }
+    }
+    catch (...)
+    {
+        // swallow
+    }
+    // cleanup
+    finish();
+    dispatch_close(client);
+    retire_client(client);
+}
+
+void run_threads_engine(socket_t listen_sock, const ServerConfig &cfg)
+{
+    release_inherited_listeners();
+    if (!placement.cpus.empty() || placement.incoming_cpu)
+        LOG_WARN("--cpu-affinity and --incoming-cpu apply to the reactor engine only; ignored");
+    if (cfg.ws_port)
+        LOG_WARN("--ws-port applies to the reactor engines only; ignored");
+    // Accept loop; polled, so that a restart request is noticed between connections
+    while (running)
+    {
+        if (restart_pending && start_successor(nullptr))
+            break;
+        if (!wait_for_socket(listen_sock, false, 200))
+            continue;
+        sockaddr_in peer{};
+        socklen_t plen = sizeof(peer);
+        socket_t client_sock = accept(listen_sock, reinterpret_cast<sockaddr *>(&peer), &plen);
+        if (client_sock == INVALID_SOCKET)
+        {
+            if (!running)
+                break;
+            LOG_ERROR("accept() failed");
+            continue;
+        }
+
+        AdmissionSlot slot;
+        if (!admit_connection(client_sock, &peer, slot))
+        {
+            close_socket(client_sock);
+            continue;
+        }
+        set_nosigpipe(client_sock);
+        set_nodelay(client_sock);
+        if (placement.busy_poll_us)
+            set_busy_poll(client_sock, placement.busy_poll_us);
+        auto c = make_client(client_sock);
+        c->admission = std::move(slot);
+        // start worker thread and store it in the client object so we can join later;
+        // the lock keeps retire_client from seeing a half-assigned worker
+        std::lock_guard<std::mutex> lk(g_threads_mutex);
+        registry.add(c);
+        metric_add(Counter::ConnectionsAccepted);
+        c->worker = std::thread(handle_client, c);
+    }
+
+    // shutdown
+    LOG_INFO("Shutting down server...");
+
+    // notify clients that server is shutting down
+    broadcast("Server", "服务器正在关闭");
+
+    // join worker threads stored in client objects
+    std::vector<std::shared_ptr<Client>> copy;
+    {
+        // writers drain (bounded by send_all's timeout) and then shut their
+        // sockets down, which releases the reader threads
+        std::lock_guard<std::mutex> lk(g_threads_mutex);
+        g_joining = true;
+        copy = *registry.snapshot(); // keeps clients alive while joining
+        for (auto &c : copy)
+            c->out.close();
+    }
+    // the writers flush side by side; whoever is still at it at the deadline
+    // is cut off, which also releases its reader
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(cfg.drain_ms);
+    for (auto &c : copy)
+    {
+        while (!c->closed && std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::lock_guard<std::mutex> lk(c->inbox_mutex);
+        if (!c->closed)
+            shutdown_socket(c->sock);
+    }
+    for (auto &c : copy)
+    {
+        try
+        {
+            if (c->worker.joinable())
+                c->worker.join();
+        }
+        catch (const std::system_error &e)
+        {
+            LOG_ERROR("Error joining client thread: " << e.what());
+        }
+    }
+
+    // now safe to clear the registry
+    registry.clear();
+    directory.clear();
+}
@@ -0,0 +1,133 @@
+// Hierarchical timer wheel for per-connection deadlines
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Intrusive timer: embedded in the object it times, never allocated
+struct TimerNode
+{
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expires = 0; // tick
+    void *owner = nullptr;
+
+    bool armed() const { return next != nullptr; }
+};
+
+// Four levels of 64 slots (the classic kernel layout): level 0 holds timers
+// due within 64 ticks, each higher level 64 times the span of the one below.
+// Scheduling, cancelling and re-arming are O(1) list operations; a tick
+// expires one level-0 slot and, every 64 ticks, redistributes one slot of
+// the level above, so the cost per tick does not depend on how many timers
+// exist. Deadlines beyond the top level are clamped; owners are expected to
+// re-check their real deadline when a timer fires.
+//
+// Not thread-safe: each event loop owns its wheel.
+class TimerWheel
+{
+public:
+    static const unsigned SLOT_BITS = 6;
+    static const size_t SLOTS = size_t(1) << SLOT_BITS;
+    static const unsigned LEVELS = 4;
+    static const uint64_t MAX_DELTA = (uint64_t(1) << (SLOT_BITS * LEVELS)) - 1;
+
+    explicit TimerWheel(uint64_t now = 0) : now_(now)
+    {
+        for (auto &level : slots_)
+            for (TimerNode &head : level)
+                head.prev = head.next = &head;
+    }
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    uint64_t now() const { return now_; }
+    bool empty() const { return count_ == 0; }
+
+    // (Re-)arms `node` to fire at tick `expires` (next tick if already past)
+    void schedule(TimerNode &node, uint64_t expires)
+    {
+        if (node.armed())
+            cancel(node);
+        node.expires = expires > now_ ? expires : now_ + 1;
+        if (node.expires - now_ > MAX_DELTA)
+            node.expires = now_ + MAX_DELTA;
+        insert(node);
+        ++count_;
+    }
+
+    void cancel(TimerNode &node)
+    {
+        if (!node.armed())
+            return;
+        unlink(node);
+        --count_;
+    }
+
+    // Moves time forward to tick `to`, calling fire(node) for every timer that
+    // expires; the node is already disarmed and may be re-armed by fire
+    template <typename Fire>
+    void advance(uint64_t to, Fire fire)
+    {
+        while (now_ < to)
+        {
+            if (count_ == 0)
+            {
+                now_ = to; // nothing to expire on the way
+                return;
+            }
+            ++now_;
+            cascade(1);
+            TimerNode &head = slots_[0][now_ & (SLOTS - 1)];
+            while (head.next != &head)
+            {
+                TimerNode *n = head.next;
+                unlink(*n);
+                --count_;
+                fire(*n);
+            }
+        }
+    }
+
+private:
+    void insert(TimerNode &node)
+    {
+        uint64_t delta = node.expires - now_;
+        unsigned level = 0;
+        while (level + 1 < LEVELS && delta >= (uint64_t(1) << (SLOT_BITS * (level + 1))))
+            ++level;
+        TimerNode &head = slots_[level][(node.expires >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        node.prev = head.prev;
+        node.next = &head;
+        head.prev->next = &node;
+        head.prev = &node;
+    }
+
+    static void unlink(TimerNode &node)
+    {
+        node.prev->next = node.next;
+        node.next->prev = node.prev;
+        node.prev = node.next = nullptr;
+    }
+
+    // When the lower levels wrap, spread the matching slot of `level` back down
+    void cascade(unsigned level)
+    {
+        if (level >= LEVELS || (now_ & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) != 0)
+            return;
+        cascade(level + 1);
+        TimerNode &head = slots_[level][(now_ >> (SLOT_BITS * level)) & (SLOTS - 1)];
+        TimerNode *n = head.next;
+        head.prev = head.next = &head;
+        while (n != &head)
+        {
+            TimerNode *next = n->next;
+            insert(*n);
+            n = next;
+        }
+    }
+
+    TimerNode slots_[LEVELS][SLOTS];
+    uint64_t now_;
+    size_t count_ = 0;
+};
@@ -0,0 +1,199 @@
+#include "trace.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+std::atomic<unsigned> trace_sample{0};
+
+// Events kept per thread; older ones are overwritten
+static const size_t TRACE_EVENTS = 16384;
+
+static const char *const STAGE_NAMES[] = {"received", "queued", "dispatched", "first delivery", "last delivery"};
+static_assert(sizeof(STAGE_NAMES) / sizeof(STAGE_NAMES[0]) == static_cast<size_t>(TraceStage::Count),
+              "a name per stage");
+
+struct TraceEvent
+{
+    uint64_t ns;
+    uint64_t id;
+    TraceStage stage;
+};
+
+// Written by its thread only; the lock is taken by the exporter, so the
+// owner never waits but for an export in progress
+struct TraceBuffer
+{
+    std::mutex mutex;
+    std::vector<TraceEvent> events; // ring, allocated on first use
+    size_t next = 0;
+    unsigned tid = 0;
+};
+
+static std::atomic<uint64_t> g_next_id{1};
+static std::mutex g_buffers_mutex;
+static std::vector<std::unique_ptr<TraceBuffer>> g_buffers; // every buffer ever made
+static std::vector<TraceBuffer *> g_free_buffers;           // left behind by exited threads
+
+// Returns the thread's buffer to the free list when the thread exits; like
+// the metric shards, a buffer outlives its thread so no event is lost
+struct BufferLease
+{
+    TraceBuffer *buffer = nullptr;
+
+    ~BufferLease()
+    {
+        if (!buffer)
+            return;
+        std::lock_guard<std::mutex> lk(g_buffers_mutex);
+        g_free_buffers.push_back(buffer);
+    }
+};
+
+static thread_local BufferLease t_lease;
+static thread_local unsigned t_unsampled = 0; // frames since this thread last sampled one
+static thread_local uint64_t t_current = 0;
+
+static TraceBuffer &local_buffer()
+{
+    if (!t_lease.buffer)
+    {
+        std::lock_guard<std::mutex> lk(g_buffers_mutex);
+        if (!g_free_buffers.empty())
+        {
+            t_lease.buffer = g_free_buffers.back();
+            g_free_buffers.pop_back();
+        }
+        else
+        {
+            g_buffers.emplace_back(new TraceBuffer());
+            t_lease.buffer = g_buffers.back().get();
+            t_lease.buffer->tid = static_cast<unsigned>(g_buffers.size());
+        }
+    }
+    return *t_lease.buffer;
+}
+
+uint64_t trace_begin()
+{
+    unsigned every = trace_sample.load(std::memory_order_relaxed);
+    if (every == 0 || ++t_unsampled < every)
+        return 0;
+    t_unsampled = 0;
+    uint64_t id = g_next_id.fetch_add(1, std::memory_order_relaxed);
+    trace_record(id, TraceStage::Received);
+    return id;
+}
+
+void trace_record(uint64_t id, TraceStage stage)
+{
+    if (id == 0)
+        return;
+    uint64_t now = monotonic_ns();
+    TraceBuffer &b = local_buffer();
+    std::lock_guard<std::mutex> lk(b.mutex);
+    if (b.events.empty())
+        b.events.resize(TRACE_EVENTS);
+    b.events[b.next % TRACE_EVENTS] = TraceEvent{now, id, stage};
+    ++b.next;
+}
+
+uint64_t trace_current()
+{
+    return t_current;
+}
+
+TraceScope::TraceScope(uint64_t id) : saved_(t_current)
+{
+    t_current = id;
+}
+
+TraceScope::~TraceScope()
+{
+    t_current = saved_;
+}
+
+void trace_clear()
+{
+    std::lock_guard<std::mutex> lk(g_buffers_mutex);
+    for (auto &b : g_buffers)
+    {
+        std::lock_guard<std::mutex> blk(b->mutex);
+        b->next = 0;
+    }
+}
+
+// ---- export ----
+
+struct Stamped
+{
+    TraceEvent event;
+    unsigned tid;
+};
+
+// Microseconds since `base`, the unit of the trace event format
+static std::string micros(uint64_t ns, uint64_t base)
+{
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.3f", static_cast<double>(ns - base) / 1000.0);
+    return buf;
+}
+
+static void write_async(std::ostringstream &os, const char *ph, const std::string &name, uint64_t id,
+                        const Stamped &at, uint64_t base)
+{
+    os << ",\n{\"name\":\"" << name << "\",\"cat\":\"message\",\"ph\":\"" << ph << "\",\"id\":\"0x" << std::hex << id
+       << std::dec << "\",\"ts\":" << micros(at.event.ns, base) << ",\"pid\":1,\"tid\":" << at.tid << "}";
+}
+
+std::string trace_export_json()
+{
+    std::vector<Stamped> all;
+    {
+        std::lock_guard<std::mutex> lk(g_buffers_mutex);
+        for (auto &b : g_buffers)
+        {
+            std::lock_guard<std::mutex> blk(b->mutex);
+            size_t n = std::min(b->next, TRACE_EVENTS);
+            for (size_t i = b->next - n; i < b->next; ++i)
+                all.push_back(Stamped{b->events[i % TRACE_EVENTS], b->tid});
+        }
+    }
+    std::sort(all.begin(), all.end(), [](const Stamped &a, const Stamped &b) { return a.event.ns < b.event.ns; });
+    uint64_t base = all.empty() ? 0 : all.front().event.ns;
+
+    std::ostringstream os;
+    os << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n"
+       << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"chat_server\"}}";
+    std::map<uint64_t, std::vector<const Stamped *>> messages;
+    for (const Stamped &s : all)
+    {
+        os << ",\n{\"name\":\"" << STAGE_NAMES[static_cast<size_t>(s.event.stage)]
+           << "\",\"cat\":\"stage\",\"ph\":\"i\",\"s\":\"t\",\"ts\":" << micros(s.event.ns, base)
+           << ",\"pid\":1,\"tid\":" << s.tid << ",\"args\":{\"message\":" << s.event.id << "}}";
+        messages[s.event.id].push_back(&s);
+    }
+    // a message whose early stages were overwritten still shows what is left
+    for (auto &kv : messages)
+    {
+        const std::vector<const Stamped *> &stages = kv.second;
+        if (stages.size() < 2)
+            continue;
+        write_async(os, "b", "message", kv.first, *stages.front(), base);
+        for (size_t i = 1; i < stages.size(); ++i)
+        {
+            std::string step = std::string(STAGE_NAMES[static_cast<size_t>(stages[i - 1]->event.stage)]) + " -> " +
+                               STAGE_NAMES[static_cast<size_t>(stages[i]->event.stage)];
+            write_async(os, "b", step, kv.first, *stages[i - 1], base);
+            write_async(os, "e", step, kv.first, *stages[i], base);
+        }
+        write_async(os, "e", "message", kv.first, *stages.back(), base);
+    }
+    os << "\n]}\n";
+    return os.str();
+}
@@ -0,0 +1,52 @@
+// Sampled tracing of the message pipeline, exported as Chrome trace JSON
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Points a message passes on its way through the server
+enum class TraceStage : uint8_t
+{
+    Received,      // frame decoded by its I/O thread
+    Queued,        // in the client's inbox, waiting for a worker (--workers only)
+    Dispatched,    // chat logic starts on it
+    FirstDelivery, // handed to the first recipient of a fan-out
+    LastDelivery,  // handed to the last one
+    Count
+};
+
+// One frame in `trace_sample` is traced, 0 = off. Set at startup
+// (--trace-sample) and changed at runtime on the admin port (metrics.h).
+extern std::atomic<unsigned> trace_sample;
+
+// Called as a frame is decoded: a trace id for it when it is sampled, else
+// 0; records TraceStage::Received. Costs one relaxed load when tracing is off.
+uint64_t trace_begin();
+// Stamps `stage` of trace `id` with the steady clock into the calling
+// thread's buffer; nothing for id 0. Buffers are fixed rings, so a thread
+// only ever keeps its latest events.
+void trace_record(uint64_t id, TraceStage stage);
+
+// The trace id of the message the calling thread is handling, for code
+// that does not see the inbox item (fan-out)
+uint64_t trace_current();
+class TraceScope
+{
+public:
+    explicit TraceScope(uint64_t id);
+    ~TraceScope();
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+private:
+    uint64_t saved_;
+};
+
+// Every buffered event in the Chrome trace event format (loads in
+// chrome://tracing and ui.perfetto.dev): an instant event per stage on
+// the thread that recorded it and, per message, an async span from the
+// first stage to the last with one nested span per step between them
+std::string trace_export_json();
+// Drops every buffered event
+void trace_clear();
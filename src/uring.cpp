@@ -0,0 +1,232 @@
+#include "uring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+static int sys_setup(unsigned entries, io_uring_params *p)
+{
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, const void *arg, size_t argsz)
+{
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, argsz));
+}
+
+static int sys_register(int fd, unsigned opcode, const void *arg, unsigned nr_args)
+{
+    return static_cast<int>(syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+static void *map(size_t size, int fd, off_t offset)
+{
+    void *p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                   fd < 0 ? MAP_PRIVATE | MAP_ANONYMOUS : MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? nullptr : p;
+}
+
+static size_t page_round(size_t n)
+{
+    size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return (n + page - 1) / page * page;
+}
+
+bool uring_supported(std::string &why)
+{
+    // multishot recv, the newest feature used, arrived in 6.0
+    utsname u{};
+    unsigned major = 0, minor = 0;
+    if (uname(&u) != 0 || std::sscanf(u.release, "%u.%u", &major, &minor) != 2 || major < 6)
+    {
+        why = std::string("kernel ") + u.release + " is older than 6.0";
+        return false;
+    }
+    Uring probe(8);
+    if (!probe.ok())
+    {
+        why = std::string("io_uring unavailable: ") + std::strerror(errno);
+        return false;
+    }
+    if (!probe.setup_buffers(0, 2, 4096))
+    {
+        why = std::string("provided buffer rings unavailable: ") + std::strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+Uring::Uring(unsigned entries)
+{
+    io_uring_params p{};
+    p.flags = IORING_SETUP_CLAMP | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SUBMIT_ALL;
+    fd_ = sys_setup(entries, &p);
+    if (fd_ < 0)
+    {
+        p = io_uring_params{};
+        p.flags = IORING_SETUP_CLAMP;
+        fd_ = sys_setup(entries, &p);
+    }
+    if (fd_ < 0)
+        return;
+    // timed waits and lossless completions are not optional
+    if (!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP))
+    {
+        close(fd_);
+        fd_ = -1;
+        errno = ENOSYS;
+        return;
+    }
+
+    sq_map_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_map_size_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    bool single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+        sq_map_size_ = cq_map_size_ = std::max(sq_map_size_, cq_map_size_);
+    sq_map_ = map(sq_map_size_, fd_, IORING_OFF_SQ_RING);
+    cq_map_ = single ? sq_map_ : map(cq_map_size_, fd_, IORING_OFF_CQ_RING);
+    sqes_size_ = p.sq_entries * sizeof(io_uring_sqe);
+    sqes_ = static_cast<io_uring_sqe *>(map(sqes_size_, fd_, IORING_OFF_SQES));
+    if (!sq_map_ || !cq_map_ || !sqes_)
+    {
+        int err = errno;
+        release();
+        errno = err;
+        return;
+    }
+
+    char *sq = static_cast<char *>(sq_map_);
+    sq_head_ = reinterpret_cast<unsigned *>(sq + p.sq_off.head);
+    sq_tail_ = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    sq_array_ = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    sq_mask_ = *reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    sq_entries_ = p.sq_entries;
+    // SQE i always sits in slot i, so the index array is filled once
+    for (unsigned i = 0; i < sq_entries_; ++i)
+        sq_array_[i] = i;
+    sqe_tail_ = submitted_ = *sq_tail_;
+
+    char *cq = static_cast<char *>(cq_map_);
+    cq_head_ = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    cqes_ = reinterpret_cast<io_uring_cqe *>(cq + p.cq_off.cqes);
+    cq_mask_ = *reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+}
+
+Uring::~Uring()
+{
+    release();
+}
+
+void Uring::release()
+{
+    if (fd_ >= 0)
+        close(fd_);
+    fd_ = -1;
+    if (sqes_)
+        munmap(sqes_, sqes_size_);
+    if (cq_map_ && cq_map_ != sq_map_)
+        munmap(cq_map_, cq_map_size_);
+    if (sq_map_)
+        munmap(sq_map_, sq_map_size_);
+    if (buf_ring_)
+        munmap(buf_ring_, buf_ring_size_);
+    if (buffers_)
+        munmap(buffers_, buffers_size_);
+    sqes_ = nullptr;
+    sq_map_ = cq_map_ = nullptr;
+    buf_ring_ = nullptr;
+    buffers_ = nullptr;
+}
+
+io_uring_sqe *Uring::sqe()
+{
+    if (sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+    {
+        if (submit_and_wait(0) < 0 || sqe_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) >= sq_entries_)
+            return nullptr;
+    }
+    io_uring_sqe *e = &sqes_[sqe_tail_ & sq_mask_];
+    ++sqe_tail_;
+    std::memset(e, 0, sizeof(*e));
+    return e;
+}
+
+int Uring::submit_and_wait(int timeout_ms)
+{
+    unsigned pending = sqe_tail_ - submitted_;
+    __atomic_store_n(sq_tail_, sqe_tail_, __ATOMIC_RELEASE);
+    // nothing to wait for if completions are already there
+    if (timeout_ms != 0 && *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+        timeout_ms = 0;
+    if (pending == 0 && timeout_ms == 0)
+        return 0;
+
+    unsigned flags = 0;
+    __kernel_timespec ts{};
+    io_uring_getevents_arg arg{};
+    const void *argp = nullptr;
+    size_t argsz = 0;
+    if (timeout_ms != 0)
+        flags |= IORING_ENTER_GETEVENTS;
+    if (timeout_ms > 0)
+    {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        flags |= IORING_ENTER_EXT_ARG;
+        argp = &arg;
+        argsz = sizeof(arg);
+    }
+    int r = sys_enter(fd_, pending, timeout_ms != 0 ? 1 : 0, flags, argp, argsz);
+    // the kernel's head is what it actually took, whatever enter returned
+    submitted_ = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    if (r < 0 && errno != ETIME && errno != EINTR && errno != EBUSY && errno != EAGAIN)
+        return -1;
+    return 0;
+}
+
+bool Uring::setup_buffers(uint16_t group, unsigned count, unsigned size)
+{
+    if (count == 0 || (count & (count - 1)) || count > 32768)
+    {
+        errno = EINVAL;
+        return false;
+    }
+    buf_ring_size_ = page_round(count * sizeof(io_uring_buf));
+    buf_ring_ = static_cast<io_uring_buf *>(map(buf_ring_size_, -1, 0));
+    buffers_size_ = page_round(static_cast<size_t>(count) * size);
+    buffers_ = static_cast<char *>(map(buffers_size_, -1, 0));
+    if (!buf_ring_ || !buffers_)
+        return false;
+
+    io_uring_buf_reg reg{};
+    reg.ring_addr = reinterpret_cast<uint64_t>(buf_ring_);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (sys_register(fd_, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return false;
+    buffer_size_ = size;
+    buf_mask_ = static_cast<uint16_t>(count - 1);
+    buf_tail_ = 0;
+    for (unsigned bid = 0; bid < count; ++bid)
+        recycle(static_cast<uint16_t>(bid));
+    return true;
+}
+
+void Uring::recycle(uint16_t bid)
+{
+    // field by field: the first entry's resv is the ring's tail
+    io_uring_buf &b = buf_ring_[buf_tail_ & buf_mask_];
+    b.addr = reinterpret_cast<uint64_t>(buffer(bid));
+    b.len = buffer_size_;
+    b.bid = bid;
+    ++buf_tail_;
+    __atomic_store_n(&buf_ring_[0].resv, buf_tail_, __ATOMIC_RELEASE);
+}
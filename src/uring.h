@@ -0,0 +1,96 @@
+// Minimal io_uring binding for the event loop, straight over the kernel
+// interface (no liburing). Only built where CMake found <linux/io_uring.h>
+// and CHAT_WITH_IO_URING is on; CHAT_HAVE_IO_URING is then defined.
+#pragma once
+
+#if defined(CHAT_HAVE_IO_URING)
+
+#include <linux/io_uring.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// True when the running kernel has everything the io_uring mode of the event
+// loop relies on: multishot accept and recv, provided buffer rings and
+// waiting with a timeout (Linux 6.0). Otherwise `why` says what is missing.
+bool uring_supported(std::string &why);
+
+// One submission/completion ring pair, used by a single thread. SQEs are
+// only queued by sqe(); the kernel sees them on the next submit_and_wait(),
+// so everything prepared during one loop iteration goes in with one
+// io_uring_enter.
+class Uring
+{
+public:
+    explicit Uring(unsigned entries);
+    ~Uring();
+    Uring(const Uring &) = delete;
+    Uring &operator=(const Uring &) = delete;
+
+    bool ok() const { return fd_ >= 0; }
+
+    // Next free SQE, zeroed; submits what is queued first if the ring is
+    // full. Null only if even that fails.
+    io_uring_sqe *sqe();
+    // Submits the queued SQEs and waits until at least one completion is
+    // ready or timeout_ms passes (-1: no limit, 0: do not wait). Returns -1
+    // on a hard error.
+    int submit_and_wait(int timeout_ms);
+
+    // Calls f(const io_uring_cqe &) for every ready completion, then frees
+    // their slots
+    template <class F>
+    void for_each_cqe(F f)
+    {
+        unsigned head = *cq_head_;
+        unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+        for (; head != tail; ++head)
+            f(cqes_[head & cq_mask_]);
+        __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+
+    // Provided buffers: `count` (a power of two) buffers of `size` bytes in
+    // buffer group `group`, for receives with IOSQE_BUFFER_SELECT. The
+    // kernel picks one per completion and reports its id in the CQE flags;
+    // it is lent to the application until recycle().
+    bool setup_buffers(uint16_t group, unsigned count, unsigned size);
+    char *buffer(uint16_t bid) { return buffers_ + static_cast<size_t>(bid) * buffer_size_; }
+    void recycle(uint16_t bid);
+
+private:
+    void release();
+
+    int fd_ = -1;
+    void *sq_map_ = nullptr;
+    size_t sq_map_size_ = 0;
+    void *cq_map_ = nullptr;
+    size_t cq_map_size_ = 0;
+    io_uring_sqe *sqes_ = nullptr;
+    size_t sqes_size_ = 0;
+
+    unsigned *sq_head_ = nullptr;
+    unsigned *sq_tail_ = nullptr;
+    unsigned *sq_array_ = nullptr;
+    unsigned sq_mask_ = 0;
+    unsigned sq_entries_ = 0;
+    unsigned sqe_tail_ = 0;  // next SQE to hand out
+    unsigned submitted_ = 0; // SQEs already passed to the kernel
+
+    unsigned *cq_head_ = nullptr;
+    unsigned *cq_tail_ = nullptr;
+    io_uring_cqe *cqes_ = nullptr;
+    unsigned cq_mask_ = 0;
+
+    // an io_uring_buf_ring, indexed by hand: its flexible array member
+    // is laid out differently when the header is compiled as C++
+    io_uring_buf *buf_ring_ = nullptr;
+    size_t buf_ring_size_ = 0;
+    char *buffers_ = nullptr;
+    size_t buffers_size_ = 0;
+    unsigned buffer_size_ = 0;
+    uint16_t buf_mask_ = 0;
+    uint16_t buf_tail_ = 0;
+};
+
+#endif
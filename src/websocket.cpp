@@ -0,0 +1,772 @@
+#include "websocket.h"
+#include "compress.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+
+#if defined(CHAT_HAVE_ZLIB)
+#include <zlib.h>
+#endif
+
+enum : uint8_t
+{
+    OP_CONTINUATION = 0x0,
+    OP_TEXT = 0x1,
+    OP_BINARY = 0x2,
+    OP_CLOSE = 0x8,
+    OP_PING = 0x9,
+    OP_PONG = 0xa,
+};
+
+static const uint8_t WS_FIN = 0x80;
+static const uint8_t WS_RSV1 = 0x40; // compressed message (permessage-deflate)
+static const uint8_t WS_MASKED = 0x80;
+
+// Close codes (RFC 6455 section 7.4.1)
+static const uint16_t CLOSE_PROTOCOL_ERROR = 1002;
+static const uint16_t CLOSE_INVALID_DATA = 1007; // a text message that is not UTF-8
+static const uint16_t CLOSE_TOO_BIG = 1009;
+
+// Longest upgrade request accepted
+static const size_t MAX_REQUEST = 8 * 1024;
+
+// Appended to the key for Sec-WebSocket-Accept
+static const char WS_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// The tail an RFC 7692 sender strips from every compressed message
+static const char DEFLATE_TAIL[] = {'\x00', '\x00', '\xff', '\xff'};
+
+// ---- handshake ----
+
+static uint32_t rotl(uint32_t v, int bits)
+{
+    return (v << bits) | (v >> (32 - bits));
+}
+
+// Only for Sec-WebSocket-Accept, where SHA-1 is what the protocol asks for
+static void sha1(std::string_view in, unsigned char digest[20])
+{
+    uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+    std::string msg(in);
+    uint64_t bits = static_cast<uint64_t>(in.size()) * 8;
+    msg.push_back('\x80');
+    while (msg.size() % 64 != 56)
+        msg.push_back('\0');
+    for (int shift = 56; shift >= 0; shift -= 8)
+        msg.push_back(static_cast<char>((bits >> shift) & 0xff));
+
+    for (size_t block = 0; block < msg.size(); block += 64)
+    {
+        uint32_t w[80];
+        for (int i = 0; i < 16; ++i)
+        {
+            const unsigned char *p = reinterpret_cast<const unsigned char *>(msg.data() + block + i * 4);
+            w[i] = uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 | p[3];
+        }
+        for (int i = 16; i < 80; ++i)
+            w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; ++i)
+        {
+            uint32_t f, k;
+            if (i < 20)
+                f = (b & c) | (~b & d), k = 0x5a827999;
+            else if (i < 40)
+                f = b ^ c ^ d, k = 0x6ed9eba1;
+            else if (i < 60)
+                f = (b & c) | (b & d) | (c & d), k = 0x8f1bbcdc;
+            else
+                f = b ^ c ^ d, k = 0xca62c1d6;
+            uint32_t t = rotl(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotl(b, 30);
+            b = a;
+            a = t;
+        }
+        h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
+    }
+    for (int i = 0; i < 5; ++i)
+    {
+        for (int j = 0; j < 4; ++j)
+            digest[i * 4 + j] = static_cast<unsigned char>(h[i] >> (24 - j * 8));
+    }
+}
+
+static std::string base64(const unsigned char *data, size_t n)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    for (size_t i = 0; i < n; i += 3)
+    {
+        uint32_t v = uint32_t(data[i]) << 16;
+        if (i + 1 < n)
+            v |= uint32_t(data[i + 1]) << 8;
+        if (i + 2 < n)
+            v |= data[i + 2];
+        out.push_back(alphabet[v >> 18 & 63]);
+        out.push_back(alphabet[v >> 12 & 63]);
+        out.push_back(i + 1 < n ? alphabet[v >> 6 & 63] : '=');
+        out.push_back(i + 2 < n ? alphabet[v & 63] : '=');
+    }
+    return out;
+}
+
+static std::string_view trim(std::string_view s)
+{
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+        s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+        s.remove_suffix(1);
+    return s;
+}
+
+static bool iequals(std::string_view a, std::string_view b)
+{
+    return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+               return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+           });
+}
+
+// Whether the comma-separated header value lists `token`
+static bool has_token(std::string_view value, std::string_view token)
+{
+    while (!value.empty())
+    {
+        size_t comma = value.find(',');
+        if (iequals(trim(value.substr(0, comma)), token))
+            return true;
+        if (comma == std::string_view::npos)
+            break;
+        value.remove_prefix(comma + 1);
+    }
+    return false;
+}
+
+// A permessage-deflate offer this server can take: the server deflates
+// with the full window and every peer may use any window, so the only
+// parameters that would not fit are a smaller server window or ones we do
+// not know
+static bool deflate_offered(std::string_view extensions)
+{
+    while (!extensions.empty())
+    {
+        size_t comma = extensions.find(',');
+        std::string_view offer = extensions.substr(0, comma);
+        extensions.remove_prefix(comma == std::string_view::npos ? extensions.size() : comma + 1);
+
+        size_t semi = offer.find(';');
+        if (!iequals(trim(offer.substr(0, semi)), "permessage-deflate"))
+            continue;
+        bool fits = true;
+        while (semi != std::string_view::npos && fits)
+        {
+            offer.remove_prefix(semi + 1);
+            semi = offer.find(';');
+            std::string_view param = trim(offer.substr(0, semi));
+            std::string_view name = trim(param.substr(0, param.find('=')));
+            fits = iequals(name, "server_no_context_takeover") || iequals(name, "client_no_context_takeover") ||
+                   iequals(name, "client_max_window_bits") ||
+                   (iequals(name, "server_max_window_bits") && param.size() > name.size() &&
+                    trim(param.substr(param.find('=') + 1)) == "15");
+        }
+        if (fits)
+            return true;
+    }
+    return false;
+}
+
+// ---- session ----
+
+#if defined(CHAT_HAVE_ZLIB)
+struct WsSession::Inflater
+{
+    z_stream zs{};
+    bool ready = false;
+
+    ~Inflater()
+    {
+        if (ready)
+            inflateEnd(&zs);
+    }
+};
+#else
+struct WsSession::Inflater
+{
+};
+#endif
+
+// Header of a server frame (never masked) with `len` bytes of payload
+static size_t put_header(char *out, uint8_t first, uint64_t len)
+{
+    out[0] = static_cast<char>(first);
+    if (len < 126)
+    {
+        out[1] = static_cast<char>(len);
+        return 2;
+    }
+    size_t bytes = len <= 0xffff ? 2 : 8;
+    out[1] = static_cast<char>(bytes == 2 ? 126 : 127);
+    for (size_t i = 0; i < bytes; ++i)
+        out[2 + i] = static_cast<char>((len >> ((bytes - 1 - i) * 8)) & 0xff);
+    return 2 + bytes;
+}
+
+static void append_control(std::string &out, uint8_t opcode, std::string_view payload)
+{
+    char header[10];
+    out.append(header, put_header(header, WS_FIN | opcode, payload.size()));
+    out.append(payload.data(), payload.size());
+}
+
+// `at` is where src starts in the payload
+static void unmask(char *dst, const char *src, size_t n, const unsigned char mask[4], size_t at)
+{
+    for (size_t i = 0; i < n; ++i)
+        dst[i] = static_cast<char>(src[i] ^ mask[(at + i) & 3]);
+}
+
+bool Utf8Check::feed(const unsigned char *s, size_t n)
+{
+    for (size_t i = 0; i < n; ++i)
+    {
+        unsigned char c = s[i];
+        if (need > 0)
+        {
+            if (c < lo || c > hi)
+                return false;
+            lo = 0x80;
+            hi = 0xbf;
+            --need;
+        }
+        else if (c >= 0x80)
+        {
+            if (c < 0xc2 || c > 0xf4)
+                return false;
+            need = c < 0xe0 ? 1 : c < 0xf0 ? 2 : 3;
+            // overlong forms, surrogates and past U+10FFFF
+            if (c == 0xe0)
+                lo = 0xa0;
+            else if (c == 0xed)
+                hi = 0x9f;
+            else if (c == 0xf0)
+                lo = 0x90;
+            else if (c == 0xf4)
+                hi = 0x8f;
+        }
+    }
+    return true;
+}
+
+WsSession::WsSession() = default;
+WsSession::~WsSession() = default;
+
+void WsSession::feed(const char *data, size_t n)
+{
+    // the request is parsed as a whole, and parked input goes first
+    if (!open_ || !in_.empty())
+    {
+        in_.append(data, n);
+        parked_ = true;
+        cur_ = in_.data();
+        end_ = cur_ + in_.size();
+        return;
+    }
+    parked_ = false;
+    cur_ = data;
+    end_ = data + n;
+}
+
+void WsSession::park()
+{
+    if (!cur_)
+        return;
+    if (parked_)
+        in_.erase(0, static_cast<size_t>(cur_ - in_.data()));
+    else
+        in_.assign(cur_, static_cast<size_t>(end_ - cur_));
+    parked_ = true;
+    cur_ = in_.data();
+    end_ = cur_ + in_.size();
+}
+
+bool WsSession::next(Buffer &out)
+{
+    while (!closing_)
+    {
+        if (!open_)
+        {
+            if (!handshake())
+                return false;
+            continue;
+        }
+        if (!in_frame_)
+        {
+            if (header() <= 0)
+                return false;
+            continue;
+        }
+        size_t avail = static_cast<size_t>(end_ - cur_);
+        if (!compressed_ && frame_left_ > 0)
+        {
+            if (avail == 0)
+                return false;
+            if (piece_len_ == frame_limits.fragment)
+            {
+                emit(out, false); // more of the message follows
+                return true;
+            }
+            size_t room = frame_limits.fragment - piece_len_;
+            size_t n = static_cast<size_t>(std::min<uint64_t>(frame_left_, std::min(avail, room)));
+            reserve(static_cast<size_t>(std::min<uint64_t>(frame_left_, room)));
+            char *dst = piece_.data() + piece_len_;
+            unmask(dst, cur_, n, mask_, mask_at_);
+            if (text_ && !utf8_.feed(reinterpret_cast<const unsigned char *>(dst), n))
+            {
+                fail(CLOSE_INVALID_DATA);
+                return false;
+            }
+            piece_len_ += n;
+            message_size_ += n;
+            cur_ += n;
+            mask_at_ += n;
+            frame_left_ -= n;
+            continue;
+        }
+        if (compressed_ && (frame_left_ > 0 || inflate_full_ || (fin_ && tail_left_ > 0)))
+        {
+            static thread_local char plain[16 * 1024]; // unmasked input for zlib
+            const char *in = plain;
+            size_t n = 0;
+            if (frame_left_ > 0)
+            {
+                n = static_cast<size_t>(std::min<uint64_t>(frame_left_, std::min(avail, sizeof(plain))));
+                if (n == 0 && !inflate_full_)
+                    return false;
+                unmask(plain, cur_, n, mask_, mask_at_);
+            }
+            else if (fin_)
+            {
+                in = DEFLATE_TAIL + sizeof(DEFLATE_TAIL) - tail_left_;
+                n = tail_left_;
+            }
+            size_t used = 0;
+            bool emitted = false;
+            if (!inflate_some(in, n, used, out, emitted))
+                return false;
+            if (frame_left_ > 0)
+            {
+                cur_ += used;
+                mask_at_ += used;
+                frame_left_ -= used;
+            }
+            else
+                tail_left_ -= used;
+            if (emitted)
+                return true;
+            continue;
+        }
+        in_frame_ = false;
+        if (!fin_)
+            continue;
+        in_message_ = false;
+        if (text_ && !utf8_.complete())
+        {
+            fail(CLOSE_INVALID_DATA); // ends inside a character
+            return false;
+        }
+        emit(out, true);
+        return true;
+    }
+    cur_ = end_;
+    return false;
+}
+
+bool WsSession::handshake()
+{
+    size_t end = in_.find("\r\n\r\n");
+    if (end == std::string::npos)
+    {
+        if (in_.size() > MAX_REQUEST)
+        {
+            reply_ = "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+            closing_ = true;
+        }
+        return false;
+    }
+    std::string_view request(in_.data(), end);
+    std::string_view key, version, upgrade, connection, extensions;
+    size_t eol = request.find("\r\n");
+    bool get = request.compare(0, 4, "GET ") == 0;
+    while (eol != std::string_view::npos)
+    {
+        request.remove_prefix(eol + 2);
+        eol = request.find("\r\n");
+        std::string_view line = request.substr(0, eol);
+        size_t colon = line.find(':');
+        if (colon == std::string_view::npos)
+            continue;
+        std::string_view name = trim(line.substr(0, colon));
+        std::string_view value = trim(line.substr(colon + 1));
+        if (iequals(name, "Sec-WebSocket-Key"))
+            key = value;
+        else if (iequals(name, "Sec-WebSocket-Version"))
+            version = value;
+        else if (iequals(name, "Upgrade"))
+            upgrade = value;
+        else if (iequals(name, "Connection"))
+            connection = value;
+        else if (iequals(name, "Sec-WebSocket-Extensions"))
+            extensions = value; // browsers send a single header
+    }
+    if (!get || !has_token(upgrade, "websocket") || !has_token(connection, "upgrade") || key.empty())
+    {
+        reply_ = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        closing_ = true;
+        return false;
+    }
+    if (version != "13")
+    {
+        reply_ = "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\nContent-Length: 0\r\n"
+                 "Connection: close\r\n\r\n";
+        closing_ = true;
+        return false;
+    }
+
+    unsigned char digest[20];
+    sha1(std::string(key) + WS_GUID, digest);
+    reply_ = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+             "Sec-WebSocket-Accept: " +
+            base64(digest, sizeof(digest)) + "\r\n";
+#if defined(CHAT_HAVE_ZLIB)
+    // no context takeover either way: every message is compressed on its
+    // own, so one compressed frame serves every recipient (ws_frame), and
+    // a connection keeps no window between messages
+    if (compress_config.enabled && deflate_offered(extensions))
+    {
+        deflate_ = true;
+        reply_ += "Sec-WebSocket-Extensions: permessage-deflate; server_no_context_takeover; "
+                  "client_no_context_takeover\r\n";
+    }
+#endif
+    reply_ += "\r\n";
+    cur_ = in_.data() + end + 4; // frames may follow at once
+    open_ = true;
+    return true;
+}
+
+void WsSession::fail(uint16_t code)
+{
+    char payload[2] = {static_cast<char>(code >> 8), static_cast<char>(code & 0xff)};
+    append_control(reply_, OP_CLOSE, std::string_view(payload, 2));
+    closing_ = true;
+    cur_ = end_;
+}
+
+int WsSession::header()
+{
+    size_t avail = static_cast<size_t>(end_ - cur_);
+    if (avail < 2)
+        return 0;
+    uint8_t b0 = static_cast<uint8_t>(cur_[0]);
+    uint8_t b1 = static_cast<uint8_t>(cur_[1]);
+    bool fin = (b0 & WS_FIN) != 0;
+    bool rsv1 = (b0 & WS_RSV1) != 0;
+    uint8_t opcode = b0 & 0x0f;
+    bool control = (opcode & 0x8) != 0;
+
+    bool valid = (b0 & 0x30) == 0 && (b1 & WS_MASKED) != 0; // RSV2/3 unused; clients must mask
+    if (control)
+        valid = valid && fin && !rsv1 && (b1 & 0x7f) <= 125 &&
+                (opcode == OP_CLOSE || opcode == OP_PING || opcode == OP_PONG);
+    else if (opcode == OP_CONTINUATION)
+        valid = valid && in_message_ && !rsv1;
+    else
+        valid = valid && !in_message_ && (opcode == OP_TEXT || opcode == OP_BINARY) && (!rsv1 || deflate_);
+    if (!valid)
+    {
+        LOG_WARN("WebSocket: protocol error (first bytes " << int(b0) << ' ' << int(b1) << "); closing");
+        fail(CLOSE_PROTOCOL_ERROR);
+        return -1;
+    }
+
+    size_t header = 2;
+    uint64_t len = b1 & 0x7f;
+    if (len >= 126)
+    {
+        size_t bytes = len == 126 ? 2 : 8;
+        if (avail < header + bytes)
+            return 0;
+        len = 0;
+        for (size_t i = 0; i < bytes; ++i)
+            len = len << 8 | static_cast<unsigned char>(cur_[header + i]);
+        header += bytes;
+    }
+    if (avail < header + 4)
+        return 0;
+    const unsigned char *mask = reinterpret_cast<const unsigned char *>(cur_ + header);
+    header += 4;
+
+    if (control)
+    {
+        // at most 125 bytes, so kept whole
+        if (avail < header + len)
+            return 0;
+        char body[125];
+        size_t size = static_cast<size_t>(len);
+        unmask(body, cur_ + header, size, mask, 0);
+        cur_ += header + size;
+        if (opcode == OP_PING)
+            append_control(reply_, OP_PONG, std::string_view(body, size));
+        else if (opcode == OP_CLOSE)
+        {
+            // echo the status code, and stop reading
+            append_control(reply_, OP_CLOSE, std::string_view(body, size >= 2 ? 2 : 0));
+            closing_ = true;
+        }
+        return 1;
+    }
+
+    if (opcode != OP_CONTINUATION && !start_message(opcode == OP_TEXT, rsv1))
+        return -1;
+    // checked before any of the payload arrives, like FrameReader does
+    if (len > frame_limits.max_frame - message_size_)
+    {
+        fail(CLOSE_TOO_BIG);
+        return -1;
+    }
+    std::memcpy(mask_, mask, 4);
+    mask_at_ = 0;
+    frame_left_ = len;
+    fin_ = fin;
+    tail_left_ = compressed_ && fin ? sizeof(DEFLATE_TAIL) : 0;
+    in_frame_ = true;
+    cur_ += header;
+    return 1;
+}
+
+bool WsSession::start_message(bool text, bool compressed)
+{
+    in_message_ = true;
+    text_ = text;
+    compressed_ = compressed;
+    inflate_full_ = false;
+    message_size_ = 0;
+    pieces_ = 0;
+    utf8_ = Utf8Check();
+    if (!compressed)
+        return true;
+#if defined(CHAT_HAVE_ZLIB)
+    if (!inflater_)
+        inflater_.reset(new Inflater());
+    z_stream &zs = inflater_->zs;
+    if (inflater_->ready)
+    {
+        inflateReset(&zs); // client_no_context_takeover was agreed
+        return true;
+    }
+    if (inflateInit2(&zs, -15) == Z_OK)
+    {
+        inflater_->ready = true;
+        return true;
+    }
+#endif
+    fail(CLOSE_PROTOCOL_ERROR); // never negotiated without zlib
+    return false;
+}
+
+// Inflates what it can of n bytes into the piece. A full piece is handed
+// out only once more output turns up, so a message never ends with an empty
+// one; `emitted` tells that out holds it.
+bool WsSession::inflate_some(const char *in, size_t n, size_t &used, Buffer &out, bool &emitted)
+{
+#if defined(CHAT_HAVE_ZLIB)
+    static thread_local char spill[4096];
+    z_stream &zs = inflater_->zs;
+    bool full = piece_len_ == frame_limits.fragment;
+    if (!full)
+        reserve(std::max<size_t>(n * 4, 4096));
+    char *dst = full ? spill : piece_.data() + piece_len_;
+    size_t room = full ? sizeof(spill) : piece_cap_ - piece_len_;
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+    zs.avail_in = static_cast<uInt>(n);
+    zs.next_out = reinterpret_cast<Bytef *>(dst);
+    zs.avail_out = static_cast<uInt>(room);
+    int rc = inflate(&zs, Z_SYNC_FLUSH);
+    if (rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR)
+    {
+        LOG_WARN("WebSocket: undecodable compressed message; closing");
+        fail(CLOSE_PROTOCOL_ERROR);
+        return false;
+    }
+    size_t produced = room - zs.avail_out;
+    used = rc == Z_STREAM_END ? n : n - zs.avail_in; // nothing follows a final block
+    inflate_full_ = rc != Z_STREAM_END && zs.avail_out == 0;
+    if (produced > frame_limits.max_frame - message_size_)
+    {
+        fail(CLOSE_TOO_BIG); // a small message that inflates past the limit
+        return false;
+    }
+    if (text_ && !utf8_.feed(reinterpret_cast<const unsigned char *>(dst), produced))
+    {
+        fail(CLOSE_INVALID_DATA);
+        return false;
+    }
+    message_size_ += produced;
+    if (!full)
+    {
+        piece_len_ += produced;
+        return true;
+    }
+    if (produced > 0)
+    {
+        emit(out, false);
+        emitted = true;
+        reserve(produced);
+        std::memcpy(piece_.data(), spill, produced);
+        piece_len_ = produced;
+    }
+    return true;
+#else
+    (void)in;
+    (void)n;
+    (void)used;
+    (void)out;
+    (void)emitted;
+    fail(CLOSE_PROTOCOL_ERROR);
+    return false;
+#endif
+}
+
+// Room for `more` bytes after the piece so far, up to a whole piece
+void WsSession::reserve(size_t more)
+{
+    size_t want = std::min(piece_len_ + more, frame_limits.fragment);
+    if (want <= piece_cap_)
+        return;
+    size_t cap = std::min(std::max(want, piece_cap_ * 2), frame_limits.fragment);
+    Buffer grown;
+    grown.resize(cap);
+    if (piece_len_ > 0)
+        std::memcpy(grown.data(), piece_.data(), piece_len_);
+    piece_ = std::move(grown);
+    piece_cap_ = cap;
+}
+
+void WsSession::emit(Buffer &out, bool last)
+{
+    if (pieces_++ == 0)
+        part_ = last ? FramePart::Whole : FramePart::First;
+    else
+        part_ = last ? FramePart::Last : FramePart::Middle;
+    piece_.resize(piece_len_);
+    out = std::move(piece_);
+    piece_ = Buffer();
+    piece_len_ = piece_cap_ = 0;
+}
+
+// ---- outbound ----
+
+// Slot in Frame::variants: FRAME_WS_VARIANTS + binary + 2 * deflate
+static const size_t WS_BINARY = 1;
+static const size_t WS_DEFLATE = 2;
+static_assert(FRAME_WS_VARIANTS + (WS_BINARY | WS_DEFLATE) < FRAME_VARIANTS,
+              "every WebSocket encoding needs a Frame::variants slot");
+
+// A text message that is not UTF-8 would fail the connection in a browser
+static bool utf8_valid(const unsigned char *s, size_t n)
+{
+    Utf8Check check;
+    return check.feed(s, n) && check.complete();
+}
+
+#if defined(CHAT_HAVE_ZLIB)
+struct WsDeflateState
+{
+    z_stream zs{};
+    bool ready = false;
+
+    ~WsDeflateState()
+    {
+        if (ready)
+            deflateEnd(&zs);
+    }
+};
+
+// Raw deflate of src ending in a sync flush, without the tail RFC 7692
+// has removed; 0 if it does not fit in cap
+static size_t ws_deflate(const char *src, size_t n, char *dst, size_t cap)
+{
+    static thread_local WsDeflateState st;
+    if (!st.ready)
+    {
+        if (deflateInit2(&st.zs, deflate_level(), Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            return 0;
+        st.ready = true;
+    }
+    else
+        deflateReset(&st.zs);
+    st.zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src));
+    st.zs.avail_in = static_cast<uInt>(n);
+    st.zs.next_out = reinterpret_cast<Bytef *>(dst);
+    st.zs.avail_out = static_cast<uInt>(cap);
+    if (deflate(&st.zs, Z_SYNC_FLUSH) != Z_OK || st.zs.avail_in != 0 || st.zs.avail_out == 0)
+        return 0;
+    size_t out = cap - st.zs.avail_out;
+    return out >= sizeof(DEFLATE_TAIL) ? out - sizeof(DEFLATE_TAIL) : 0;
+}
+#endif
+
+static Frame *build_ws(const Frame &frame, size_t slot)
+{
+    size_t kind = slot - FRAME_WS_VARIANTS;
+    const char *payload = frame.data() + sizeof(uint32_t);
+    size_t n = frame.size() - sizeof(uint32_t);
+    bool binary = (kind & WS_BINARY) != 0 ||
+                  !utf8_valid(reinterpret_cast<const unsigned char *>(payload), n);
+    uint8_t first = WS_FIN | (binary ? OP_BINARY : OP_TEXT);
+
+    Frame *v = new_variant();
+#if defined(CHAT_HAVE_ZLIB)
+    if (kind & WS_DEFLATE)
+    {
+        // the header is written once the size is known; 10 bytes is the most it takes
+        size_t cap = compressBound(static_cast<uLong>(n)) + 16;
+        v->wire.resize(10 + cap);
+        size_t out = ws_deflate(payload, n, v->wire.data() + 10, cap);
+        if (out > 0 && out < n)
+        {
+            char header[10];
+            size_t h = put_header(header, first | WS_RSV1, out);
+            std::memmove(v->wire.data() + h, v->wire.data() + 10, out);
+            std::memcpy(v->wire.data(), header, h);
+            v->wire.resize(h + out);
+            return v;
+        }
+    }
+#endif
+    char header[10];
+    size_t h = put_header(header, first, n);
+    v->wire.resize(h + n);
+    std::memcpy(v->wire.data(), header, h);
+    std::memcpy(v->wire.data() + h, payload, n);
+    return v;
+}
+
+FramePtr ws_frame(const FramePtr &frame, bool deflate, bool binary)
+{
+    bool compress = deflate && frame->size() - sizeof(uint32_t) >= compress_config.min_size;
+    size_t slot = FRAME_WS_VARIANTS + (binary ? WS_BINARY : 0) + (compress ? WS_DEFLATE : 0);
+    return shared_variant(frame, slot, build_ws);
+}
+
+FramePtr raw_frame(std::string_view bytes)
+{
+    auto f = std::allocate_shared<Frame>(PoolAllocator<Frame>());
+    f->wire.resize(bytes.size());
+    if (!bytes.empty())
+        std::memcpy(f->wire.data(), bytes.data(), bytes.size());
+    return f;
+}
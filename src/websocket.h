@@ -0,0 +1,122 @@
+// WebSocket transport (RFC 6455, optionally RFC 7692 permessage-deflate)
+// for browsers, served by the reactor on its own port (--ws-port)
+#pragma once
+
+#include "protocol.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// UTF-8 validation that carries over between calls, for text that arrives
+// in pieces; a sequence may be split anywhere
+struct Utf8Check
+{
+    bool feed(const unsigned char *s, size_t n); // false at the first invalid byte
+    bool complete() const { return need == 0; }
+
+    uint8_t need = 0; // continuation bytes still expected
+    uint8_t lo = 0x80; // range of the next one
+    uint8_t hi = 0xbf;
+};
+
+// Which listener a connection came in on
+enum class Transport : uint8_t
+{
+    Stream,    // the 4-byte length-prefixed protocol
+    WebSocket,
+    Count
+};
+
+// Each WebSocket message carries exactly one payload of the chat protocol,
+// in both directions: the username first, then text or commands, or
+// protocol 1 messages after "__caps__ proto=1" (as binary messages). The
+// server's compression negotiation does not apply; permessage-deflate does
+// instead. Everything above the framing (rate limits, rooms, fan-out) is
+// shared with the other listener.
+//
+// Input is decoded the way FrameReader does it: feed() the bytes read, then
+// next() until it returns false. Payloads are unmasked (or inflated) as they
+// arrive, and a message over frame_limits.fragment comes out in pieces,
+// part() telling which, so a session holds at most one piece and the frame
+// header it is on. A text message that is not UTF-8 closes with 1007. The
+// bytes are parsed in place once the handshake is done, so they have to stay
+// valid until next() returns false or park() keeps the unparsed rest.
+// Answers the protocol itself calls for (the handshake response, pongs, the
+// closing handshake) collect in reply() as wire bytes; once closing() the
+// connection is to be closed after them.
+//
+// One WsSession per connection, used by the thread owning its input.
+class WsSession
+{
+public:
+    WsSession();
+    ~WsSession();
+    WsSession(const WsSession &) = delete;
+    WsSession &operator=(const WsSession &) = delete;
+
+    void feed(const char *data, size_t n);
+    bool next(Buffer &out);
+    FramePart part() const { return part_; } // of the last piece next() returned
+    void park();
+    std::string &reply() { return reply_; }
+    bool closing() const { return closing_; }
+
+    // Written before the first message is decoded, so safe to read from any
+    // thread that learned of the client through the registry or a room
+    bool deflate() const { return deflate_; }
+
+private:
+    struct Inflater;
+
+    bool handshake();
+    // Parses the header of the next frame, and all of a control frame; 0 if
+    // incomplete, -1 on a protocol error
+    int header();
+    bool start_message(bool text, bool compressed);
+    bool inflate_some(const char *in, size_t n, size_t &used, Buffer &out, bool &emitted);
+    void reserve(size_t more);
+    void emit(Buffer &out, bool last);
+    void fail(uint16_t code);
+
+    std::string in_;            // upgrade request, or input kept by park()
+    bool parked_ = false;       // cur_ points into in_
+    const char *cur_ = nullptr; // unparsed input
+    const char *end_ = nullptr;
+    std::string reply_;
+    bool open_ = false;     // handshake done
+    bool closing_ = false;  // close frame sent; the rest of the input is ignored
+    bool deflate_ = false;  // permessage-deflate negotiated
+
+    // the data frame being received
+    bool in_frame_ = false;
+    bool fin_ = false;
+    uint64_t frame_left_ = 0; // payload bytes not parsed yet
+    unsigned char mask_[4] = {};
+    size_t mask_at_ = 0;
+
+    // the message it belongs to
+    bool in_message_ = false;
+    bool text_ = false;
+    bool compressed_ = false;  // RSV1 on the message's first frame
+    size_t tail_left_ = 0;     // of DEFLATE_TAIL, still to inflate after the last frame
+    bool inflate_full_ = false; // the last inflate filled its output; more may be waiting
+    size_t message_size_ = 0;  // payload so far, inflated
+    Utf8Check utf8_;
+    Buffer piece_;              // unmasked or inflated payload not handed out yet
+    size_t piece_len_ = 0;
+    size_t piece_cap_ = 0;
+    size_t pieces_ = 0;         // of the message handed out so far
+    FramePart part_ = FramePart::Whole;
+    std::unique_ptr<Inflater> inflater_;
+};
+
+// The WebSocket form of `frame` for a client, shared by every client of
+// the same kind like the compressed variants (compress.h): a text message,
+// or binary for protocol 1, compressed when the session negotiated
+// permessage-deflate and compression gains something
+FramePtr ws_frame(const FramePtr &frame, bool deflate, bool binary);
+
+// A frame holding `bytes` as they are, for WsSession replies
+FramePtr raw_frame(std::string_view bytes);